@@ -0,0 +1,587 @@
+#include "src/dia.h"
+
+#include <string.h>
+
+// Headless decode-path benchmark. Each archive is walked stage by stage, the way the viewer
+// touches it, and the latency distribution and throughput of every stage are printed as JSON so
+// runs on different commits can be diffed. synth_archive.py makes reproducible inputs.
+
+#define BENCH_CACHE_MB 512  // the viewer's default canvas cache
+
+enum {
+    STAGE_READ,    // dia_archive_read_hinted() of every root, delta and alpha entry
+    STAGE_DECODE,  // load_pixbuf_from_bytes() of the PNG and JPEG entries among them
+    STAGE_ALPHA,   // every alpha map or alpha delta applied to a canvas of its size
+    STAGE_RENDER,  // render_composite_image() without a cache: the whole chain every time
+    STAGE_BROWSE,  // render_composite_image() in ID order through one canvas cache per round
+    N_STAGES
+};
+
+static const gchar *stage_names[N_STAGES] = { "read", "decode", "alpha", "render", "browse" };
+
+typedef struct {
+    GArray *samples;  // gint64 microseconds
+    guint64 pixels;
+    guint64 bytes;
+} Stage;
+
+typedef struct {
+    const gchar *path;
+    guint32 entry;
+} EntryRef;
+
+// stdout carries the JSON report, so all chatter goes to stderr
+static void print_to_stderr(const gchar *message) {
+    fputs(message, stderr);
+}
+
+// The warm-up pass runs with stages NULL and records nothing
+static void record(Stage *stages, guint stage, gint64 elapsed, guint64 pixels, guint64 bytes) {
+    if (!stages) return;
+    g_array_append_val(stages[stage].samples, elapsed);
+    stages[stage].pixels += pixels;
+    stages[stage].bytes += bytes;
+}
+
+static guint64 pixbuf_pixels(GdkPixbuf *pixbuf) {
+    return (guint64)gdk_pixbuf_get_width(pixbuf) * gdk_pixbuf_get_height(pixbuf);
+}
+
+// Every stored entry the renderer reads: roots and full-canvas deltas, delta tiles, alpha maps
+static GArray* collect_entries(DiaArchive *archive) {
+    GArray *refs = g_array_new(FALSE, FALSE, sizeof(EntryRef));
+    guint n_images = dia_archive_n_images(archive);
+    for (guint i = 0; i < n_images; i++) {
+        const gchar *id = dia_archive_image_id(archive, i);
+        gint n_tiles = dia_archive_n_tiles(archive, id);
+        EntryRef ref;
+        if (!dia_archive_parent(archive, id) || n_tiles < 0) {
+            ref.path = dia_archive_image_path(archive, id, &ref.entry);
+            if (ref.path) g_array_append_val(refs, ref);
+        }
+        for (gint t = 0; t < n_tiles; t++) {
+            DiaDeltaTile tile;
+            dia_archive_get_tile(archive, id, (guint)t, &tile);
+            ref.path = tile.path;
+            ref.entry = tile.entry;
+            g_array_append_val(refs, ref);
+        }
+        ref.path = dia_archive_alpha_path(archive, id, &ref.entry);
+        if (ref.path) g_array_append_val(refs, ref);
+    }
+    return refs;
+}
+
+static gboolean bench_entries(DiaArchive *archive, GArray *refs, Stage *stages, GError **error) {
+    for (guint i = 0; i < refs->len; i++) {
+        const EntryRef *ref = &g_array_index(refs, EntryRef, i);
+        gint64 start = g_get_monotonic_time();
+        g_autoptr(GBytes) bytes = dia_archive_read_hinted(archive, ref->entry, ref->path, error);
+        record(stages, STAGE_READ, g_get_monotonic_time() - start, 0, bytes ? g_bytes_get_size(bytes) : 0);
+        if (!bytes) return FALSE;
+
+        // zmask, JPEG and alpha deltas are decoded by the alpha and render stages only
+        if (dia_zmask_is_delta(bytes) || dia_jpeg_is_delta(bytes) || dia_alpha_is_delta(bytes)) continue;
+        start = g_get_monotonic_time();
+        g_autoptr(GdkPixbuf) pixbuf = load_pixbuf_from_bytes(bytes, error);
+        gint64 elapsed = g_get_monotonic_time() - start;
+        if (!pixbuf) {
+            g_prefix_error(error, "Could not decode '%s': ", ref->path);
+            return FALSE;
+        }
+        record(stages, STAGE_DECODE, elapsed, pixbuf_pixels(pixbuf), g_bytes_get_size(bytes));
+    }
+    return TRUE;
+}
+
+static gboolean bench_alpha(DiaArchive *archive, Stage *stages, GError **error) {
+    guint n_images = dia_archive_n_images(archive);
+    for (guint i = 0; i < n_images; i++) {
+        guint32 entry;
+        const gchar *path = dia_archive_alpha_path(archive, dia_archive_image_id(archive, i), &entry);
+        if (!path) continue;
+        g_autoptr(GBytes) bytes = dia_archive_read_hinted(archive, entry, path, error);
+        if (!bytes) return FALSE;
+
+        // Alpha deltas are timed from decode to apply, since their rects are decoded per link
+        DiaAlphaDelta *delta = NULL;
+        g_autoptr(GdkPixbuf) alpha = NULL;
+        gint64 start = g_get_monotonic_time();
+        gint width, height;
+        if (dia_alpha_is_delta(bytes)) {
+            delta = dia_alpha_delta_decode(bytes, path, error);
+            if (!delta) return FALSE;
+            dia_alpha_delta_get_size(delta, &width, &height);
+        } else {
+            alpha = load_pixbuf_from_bytes(bytes, error);
+            if (!alpha) return FALSE;
+            width = gdk_pixbuf_get_width(alpha);
+            height = gdk_pixbuf_get_height(alpha);
+        }
+        gint64 decoded = g_get_monotonic_time();
+
+        g_autoptr(GdkPixbuf) canvas = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, width, height);
+        if (!canvas) {
+            dia_alpha_delta_free(delta);
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_NO_SPACE, "Could not allocate a canvas for '%s'", path);
+            return FALSE;
+        }
+        gdk_pixbuf_fill(canvas, 0xffffffff);
+        gint64 apply_start = g_get_monotonic_time();
+        gboolean ok = delta ? dia_alpha_delta_apply(delta, canvas, error) : apply_alpha_map_to_pixbuf(canvas, alpha, FALSE, error);
+        gint64 elapsed = g_get_monotonic_time() - apply_start + (delta ? decoded - start : 0);
+        dia_alpha_delta_free(delta);
+        record(stages, STAGE_ALPHA, elapsed, pixbuf_pixels(canvas), 0);
+        if (!ok) return FALSE;
+    }
+    return TRUE;
+}
+
+static gboolean bench_render(DiaArchive *archive, DiaCanvasCache *cache, guint stage, Stage *stages, GError **error) {
+    guint n_images = dia_archive_n_images(archive);
+    for (guint i = 0; i < n_images; i++) {
+        const gchar *id = dia_archive_image_id(archive, i);
+        gint64 start = g_get_monotonic_time();
+        g_autoptr(GdkPixbuf) pixbuf = render_composite_image(archive, cache, id, NULL, error);
+        gint64 elapsed = g_get_monotonic_time() - start;
+        if (!pixbuf) {
+            g_prefix_error(error, "Could not render ID '%s': ", id);
+            return FALSE;
+        }
+        record(stages, stage, elapsed, pixbuf_pixels(pixbuf), 0);
+    }
+    return TRUE;
+}
+
+static gboolean bench_round(DiaArchive *archive, GArray *refs, gsize cache_bytes, Stage *stages, DiaCacheStats *cache_stats, GError **error) {
+    if (!bench_entries(archive, refs, stages, error)) return FALSE;
+    if (!bench_alpha(archive, stages, error)) return FALSE;
+    if (!bench_render(archive, NULL, STAGE_RENDER, stages, error)) return FALSE;
+
+    DiaCanvasCache *cache = dia_canvas_cache_new(cache_bytes);
+    gboolean ok = bench_render(archive, cache, STAGE_BROWSE, stages, error);
+    if (stages) {
+        DiaCacheStats round_stats;
+        dia_canvas_cache_get_stats(cache, &round_stats);
+        cache_stats->hits += round_stats.hits;
+        cache_stats->misses += round_stats.misses;
+    }
+    dia_canvas_cache_free(cache);
+    return ok;
+}
+
+static gint compare_int64(gconstpointer a, gconstpointer b) {
+    gint64 x = *(const gint64*)a;
+    gint64 y = *(const gint64*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_ms(GArray *sorted, double p) {
+    if (sorted->len == 0) return 0;
+    guint i = (guint)MIN(sorted->len - 1, (guint)(p * sorted->len));
+    return g_array_index(sorted, gint64, i) / 1000.0;
+}
+
+static void add_stage(JsonBuilder *builder, const gchar *name, Stage *stage) {
+    GArray *samples = stage->samples;
+    gint64 total = 0;
+    for (guint s = 0; s < samples->len; s++) total += g_array_index(samples, gint64, s);
+    g_array_sort(samples, compare_int64);
+    double seconds = total / (double)G_USEC_PER_SEC;
+
+    json_builder_set_member_name(builder, name);
+    json_builder_begin_object(builder);
+    json_builder_set_member_name(builder, "count");
+    json_builder_add_int_value(builder, samples->len);
+    json_builder_set_member_name(builder, "total_s");
+    json_builder_add_double_value(builder, seconds);
+    json_builder_set_member_name(builder, "mean_ms");
+    json_builder_add_double_value(builder, samples->len ? total / 1000.0 / samples->len : 0.0);
+    static const struct { const gchar *name; double p; } percentiles[] = {
+        { "p50_ms", 0.50 }, { "p90_ms", 0.90 }, { "p95_ms", 0.95 }, { "p99_ms", 0.99 }, { "max_ms", 1.0 },
+    };
+    for (guint p = 0; p < G_N_ELEMENTS(percentiles); p++) {
+        json_builder_set_member_name(builder, percentiles[p].name);
+        json_builder_add_double_value(builder, percentile_ms(samples, percentiles[p].p));
+    }
+    if (stage->pixels) {
+        json_builder_set_member_name(builder, "megapixels");
+        json_builder_add_double_value(builder, stage->pixels / 1e6);
+        json_builder_set_member_name(builder, "mp_per_s");
+        json_builder_add_double_value(builder, seconds > 0 ? stage->pixels / 1e6 / seconds : 0.0);
+    }
+    if (stage->bytes) {
+        json_builder_set_member_name(builder, "mib_per_s");
+        json_builder_add_double_value(builder, seconds > 0 ? stage->bytes / 1048576.0 / seconds : 0.0);
+    }
+    json_builder_end_object(builder);
+}
+
+// Blend check: every kernel against the two passes it replaced, gdk_pixbuf_composite() with
+// GDK_INTERP_NEAREST followed by apply_alpha_map_to_pixbuf(). Widths straddle the SSE2 and AVX2
+// spans and every rowstride is padded, so tails and stride handling are covered.
+#define BLEND_TIME_WIDTH 1921
+#define BLEND_TIME_HEIGHT 1081
+#define BLEND_TIME_REPEATS 5
+
+static const int blend_widths[] = { 1, 3, 15, 16, 17, 31, 32, 33, 47, 63, 64, 65, 127, 257 };
+static const DiaBlendImpl blend_impls[] = { DIA_BLEND_SCALAR, DIA_BLEND_SSE2, DIA_BLEND_AVX2 };
+
+enum {
+    PATTERN_BINARY,  // delta alpha 0 or 255 only, as encode.py writes it
+    PATTERN_MIXED,   // runs of arbitrary delta alpha too, which the vector kernels hand to scalar code
+    N_PATTERNS
+};
+
+static const gchar *pattern_names[N_PATTERNS] = { "binary", "mixed" };
+
+typedef struct {
+    GdkPixbuf *canvas;
+    GdkPixbuf *delta;
+    GdkPixbuf *alpha;  // NULL for tiles, which never carry an alpha map
+    gboolean tile;     // the canvas is larger than the delta
+    int x, y;          // where the delta lands on the canvas
+} BlendCase;
+
+static void free_pixels(guchar *pixels, gpointer data) {
+    (void)data;
+    g_free(pixels);
+}
+
+// Random pixels, padding included, so a kernel that writes past a row shows up in the comparison
+static GdkPixbuf* random_pixbuf(GRand *rand, gboolean has_alpha, int width, int height) {
+    int stride = width * (has_alpha ? 4 : 3) + g_rand_int_range(rand, 0, 14);
+    gsize size = (gsize)stride * height;
+    guchar *pixels = g_malloc(size);
+    for (gsize i = 0; i < size; i++) pixels[i] = (guchar)g_rand_int(rand);
+    return gdk_pixbuf_new_from_data(pixels, GDK_COLORSPACE_RGB, has_alpha, 8, width, height, stride, free_pixels, NULL);
+}
+
+// Writes runs of 1 to 64 equal kinds into channel `channel`: transparent and opaque runs, plus
+// runs of random values one time in `random_one_in` (never when it is 0)
+static void shape_runs(GRand *rand, GdkPixbuf *pixbuf, int channel, guint8 run_value, int random_one_in) {
+    int width = gdk_pixbuf_get_width(pixbuf);
+    int stride = gdk_pixbuf_get_rowstride(pixbuf);
+    int channels = gdk_pixbuf_get_n_channels(pixbuf);
+    guchar *pixels = gdk_pixbuf_get_pixels(pixbuf);
+    for (int y = 0; y < gdk_pixbuf_get_height(pixbuf); y++) {
+        for (int x = 0; x < width;) {
+            int run = g_rand_int_range(rand, 1, 65);
+            run = MIN(run, width - x);
+            gboolean random = random_one_in && g_rand_int_range(rand, 0, random_one_in) == 0;
+            guint8 value = g_rand_boolean(rand) ? run_value : 0xff;
+            for (int i = 0; i < run; i++, x++) {
+                pixels[(gsize)y * stride + (gsize)x * channels + channel] = random ? (guint8)g_rand_int(rand) : value;
+            }
+        }
+    }
+}
+
+static void blend_case_init(BlendCase *c, GRand *rand, guint pattern, int delta_channels, int alpha_channels,
+                            int width, int height, gboolean tile) {
+    int canvas_width = width, canvas_height = height;
+    c->tile = tile;
+    c->x = c->y = 0;
+    if (tile) {
+        canvas_width += g_rand_int_range(rand, 0, 40);
+        canvas_height += g_rand_int_range(rand, 0, 4);
+        c->x = g_rand_int_range(rand, 0, canvas_width - width + 1);
+        c->y = g_rand_int_range(rand, 0, canvas_height - height + 1);
+    }
+    c->canvas = random_pixbuf(rand, TRUE, canvas_width, canvas_height);
+    c->delta = random_pixbuf(rand, delta_channels == 4, width, height);
+    if (delta_channels == 4) shape_runs(rand, c->delta, 3, 0, pattern == PATTERN_MIXED ? 4 : 0);
+    c->alpha = NULL;
+    if (alpha_channels) {
+        // Alpha maps are mostly opaque, with stretches of partial transparency
+        c->alpha = random_pixbuf(rand, alpha_channels == 4, width, height);
+        shape_runs(rand, c->alpha, 0, 0xff, 3);
+    }
+}
+
+static void blend_case_clear(BlendCase *c) {
+    g_object_unref(c->canvas);
+    g_object_unref(c->delta);
+    g_clear_object(&c->alpha);
+}
+
+// impl DIA_BLEND_AUTO stands for the reference here
+static void blend_case_run(const BlendCase *c, DiaBlendImpl impl, GdkPixbuf *canvas) {
+    int width = gdk_pixbuf_get_width(c->delta);
+    int height = gdk_pixbuf_get_height(c->delta);
+    if (impl == DIA_BLEND_AUTO) {
+        gdk_pixbuf_composite(c->delta, canvas, c->x, c->y, width, height, c->x, c->y, 1.0, 1.0, GDK_INTERP_NEAREST, 255);
+        if (c->alpha) apply_alpha_map_to_pixbuf(canvas, c->alpha, TRUE, NULL);
+        return;
+    }
+    int stride = gdk_pixbuf_get_rowstride(canvas);
+    dia_blend_delta_with(impl, gdk_pixbuf_get_pixels(canvas) + (gsize)c->y * stride + (gsize)c->x * 4, stride,
+                         gdk_pixbuf_get_pixels(c->delta), gdk_pixbuf_get_rowstride(c->delta), gdk_pixbuf_get_n_channels(c->delta),
+                         c->alpha ? gdk_pixbuf_get_pixels(c->alpha) : NULL, c->alpha ? gdk_pixbuf_get_rowstride(c->alpha) : 0,
+                         c->alpha ? gdk_pixbuf_get_n_channels(c->alpha) : 0, width, height);
+}
+
+// Returns the number of kernel results that differ from the reference in any byte
+static guint blend_check_case(const BlendCase *c, guint pattern, guint *mismatches) {
+    g_autoptr(GdkPixbuf) expected = gdk_pixbuf_copy(c->canvas);
+    blend_case_run(c, DIA_BLEND_AUTO, expected);
+    guint failed = 0;
+    for (guint k = 0; k < G_N_ELEMENTS(blend_impls); k++) {
+        if (!dia_blend_impl_supported(blend_impls[k])) continue;
+        g_autoptr(GdkPixbuf) actual = gdk_pixbuf_copy(c->canvas);
+        blend_case_run(c, blend_impls[k], actual);
+        if (memcmp(gdk_pixbuf_read_pixels(expected), gdk_pixbuf_read_pixels(actual), gdk_pixbuf_get_byte_length(actual)) == 0) continue;
+        if (mismatches[k]++ == 0) {
+            g_printerr("ERROR: %s blend differs from the reference: %s %d-channel %s %dx%d at %d,%d, %d-channel alpha map\n",
+                       dia_blend_impl_name(blend_impls[k]), pattern_names[pattern], gdk_pixbuf_get_n_channels(c->delta),
+                       c->tile ? "tile" : "delta",
+                       gdk_pixbuf_get_width(c->delta), gdk_pixbuf_get_height(c->delta), c->x, c->y,
+                       c->alpha ? gdk_pixbuf_get_n_channels(c->alpha) : 0);
+        }
+        failed++;
+    }
+    return failed;
+}
+
+// Mean over a few repeats of a full-canvas delta with an alpha map, the canvas copy untimed
+static double blend_ms_per_mp(const BlendCase *c, DiaBlendImpl impl) {
+    gint64 total = 0;
+    for (int r = 0; r < BLEND_TIME_REPEATS; r++) {
+        g_autoptr(GdkPixbuf) canvas = gdk_pixbuf_copy(c->canvas);
+        gint64 start = g_get_monotonic_time();
+        blend_case_run(c, impl, canvas);
+        total += g_get_monotonic_time() - start;
+    }
+    double megapixels = (double)BLEND_TIME_WIDTH * BLEND_TIME_HEIGHT / 1e6;
+    return total / 1000.0 / BLEND_TIME_REPEATS / megapixels;
+}
+
+static void add_blend_timings(JsonBuilder *builder, const BlendCase *timed, DiaBlendImpl impl) {
+    for (guint p = 0; p < N_PATTERNS; p++) {
+        g_autofree gchar *name = g_strdup_printf("%s_ms_per_mp", pattern_names[p]);
+        json_builder_set_member_name(builder, name);
+        json_builder_add_double_value(builder, blend_ms_per_mp(&timed[p], impl));
+    }
+}
+
+static gboolean bench_blend(JsonBuilder *builder) {
+    GRand *rand = g_rand_new_with_seed(1);
+    guint mismatches[G_N_ELEMENTS(blend_impls)] = { 0 };
+    guint cases = 0, failed = 0;
+    gint64 start = g_get_monotonic_time();
+
+    for (guint p = 0; p < N_PATTERNS; p++) {
+        for (guint w = 0; w < G_N_ELEMENTS(blend_widths); w++) {
+            for (int delta_channels = 3; delta_channels <= 4; delta_channels++) {
+                // Full-canvas deltas without and with a 3- or 4-channel alpha map, then a tile
+                static const int alpha_variants[] = { 0, 3, 4, -1 };
+                for (guint a = 0; a < G_N_ELEMENTS(alpha_variants); a++) {
+                    BlendCase c;
+                    gboolean tile = alpha_variants[a] < 0;
+                    blend_case_init(&c, rand, p, delta_channels, MAX(alpha_variants[a], 0), blend_widths[w],
+                                    g_rand_int_range(rand, 1, 6), tile);
+                    failed += blend_check_case(&c, p, mismatches);
+                    cases++;
+                    blend_case_clear(&c);
+                }
+            }
+        }
+    }
+
+    BlendCase timed[N_PATTERNS];
+    for (guint p = 0; p < N_PATTERNS; p++) {
+        blend_case_init(&timed[p], rand, p, 4, 3, BLEND_TIME_WIDTH, BLEND_TIME_HEIGHT, FALSE);
+    }
+
+    json_builder_set_member_name(builder, "blend_check");
+    json_builder_begin_object(builder);
+    json_builder_set_member_name(builder, "cases");
+    json_builder_add_int_value(builder, cases);
+    json_builder_set_member_name(builder, "timed_size");
+    g_autofree gchar *timed_size = g_strdup_printf("%dx%d", BLEND_TIME_WIDTH, BLEND_TIME_HEIGHT);
+    json_builder_add_string_value(builder, timed_size);
+    json_builder_set_member_name(builder, "reference");
+    json_builder_begin_object(builder);
+    add_blend_timings(builder, timed, DIA_BLEND_AUTO);
+    json_builder_end_object(builder);
+    for (guint k = 0; k < G_N_ELEMENTS(blend_impls); k++) {
+        json_builder_set_member_name(builder, dia_blend_impl_name(blend_impls[k]));
+        json_builder_begin_object(builder);
+        gboolean supported = dia_blend_impl_supported(blend_impls[k]);
+        json_builder_set_member_name(builder, "supported");
+        json_builder_add_boolean_value(builder, supported);
+        if (supported) {
+            json_builder_set_member_name(builder, "mismatches");
+            json_builder_add_int_value(builder, mismatches[k]);
+            add_blend_timings(builder, timed, blend_impls[k]);
+        }
+        json_builder_end_object(builder);
+    }
+    json_builder_end_object(builder);
+
+    for (guint p = 0; p < N_PATTERNS; p++) blend_case_clear(&timed[p]);
+    g_rand_free(rand);
+    g_print("[bench] blend check: %u cases, %u kernel results differ from the reference, in %.2f s\n", cases, failed,
+            (g_get_monotonic_time() - start) / (double)G_USEC_PER_SEC);
+    return failed == 0;
+}
+
+static gboolean bench_archive(const gchar *path, gint rounds, gsize cache_bytes, JsonBuilder *builder, GError **error) {
+    DiaArchive *archive = dia_archive_open(path, error);
+    if (!archive || !dia_archive_load_map(archive, error)) {
+        dia_archive_free(archive);
+        return FALSE;
+    }
+
+    GArray *refs = collect_entries(archive);
+    Stage stages[N_STAGES];
+    for (guint s = 0; s < N_STAGES; s++) {
+        stages[s].samples = g_array_new(FALSE, FALSE, sizeof(gint64));
+        stages[s].pixels = stages[s].bytes = 0;
+    }
+
+    // One untimed pass faults the mapping in, so the first timed round is not an outlier
+    DiaCacheStats cache_stats = { 0 };
+    gint64 start = g_get_monotonic_time();
+    gboolean ok = bench_round(archive, refs, cache_bytes, NULL, &cache_stats, error);
+    for (gint r = 0; ok && r < rounds; r++) ok = bench_round(archive, refs, cache_bytes, stages, &cache_stats, error);
+
+    if (ok) {
+        guint n_images = dia_archive_n_images(archive);
+        guint max_depth = 0;
+        guint64 depth_sum = 0;
+        for (guint i = 0; i < n_images; i++) {
+            guint depth = dia_archive_chain_depth(archive, dia_archive_image_id(archive, i));
+            max_depth = MAX(max_depth, depth);
+            depth_sum += depth;
+        }
+        g_print("[bench] %s: %u images, %d rounds in %.2f s\n", path, n_images, rounds,
+                (g_get_monotonic_time() - start) / (double)G_USEC_PER_SEC);
+
+        g_autofree gchar *basename = g_path_get_basename(path);
+        json_builder_begin_object(builder);
+        json_builder_set_member_name(builder, "archive");
+        json_builder_add_string_value(builder, basename);
+        json_builder_set_member_name(builder, "bytes");
+        json_builder_add_int_value(builder, (gint64)archive->length);
+        json_builder_set_member_name(builder, "images");
+        json_builder_add_int_value(builder, n_images);
+        json_builder_set_member_name(builder, "roots");
+        json_builder_add_int_value(builder, dia_archive_n_roots(archive));
+        json_builder_set_member_name(builder, "entries");
+        json_builder_add_int_value(builder, refs->len);
+        json_builder_set_member_name(builder, "mean_depth");
+        json_builder_add_double_value(builder, n_images ? depth_sum / (double)n_images : 0.0);
+        json_builder_set_member_name(builder, "max_depth");
+        json_builder_add_int_value(builder, max_depth);
+        json_builder_set_member_name(builder, "browse_cache_hits");
+        json_builder_add_int_value(builder, (gint64)cache_stats.hits);
+        json_builder_set_member_name(builder, "browse_cache_misses");
+        json_builder_add_int_value(builder, (gint64)cache_stats.misses);
+        json_builder_set_member_name(builder, "stages");
+        json_builder_begin_object(builder);
+        for (guint s = 0; s < N_STAGES; s++) add_stage(builder, stage_names[s], &stages[s]);
+        json_builder_end_object(builder);
+        json_builder_end_object(builder);
+    }
+
+    for (guint s = 0; s < N_STAGES; s++) g_array_free(stages[s].samples, TRUE);
+    g_array_free(refs, TRUE);
+    dia_archive_free(archive);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    g_set_print_handler(print_to_stderr);
+
+    g_autoptr(GError) trace_error = NULL;
+    if (!dia_trace_init(NULL, &trace_error)) {
+        g_printerr("ERROR: %s\n", trace_error->message);
+        return 1;
+    }
+
+    gint rounds = 3;
+    gint cache_mb = BENCH_CACHE_MB;
+    gint threads = 0;
+    gchar *label = NULL;
+    gchar *output = NULL;
+    gboolean blend_check = FALSE;
+    GOptionEntry entries[] = {
+        { "rounds", 'n', 0, G_OPTION_ARG_INT, &rounds, "Timed passes over each archive (default 3)", "ROUNDS" },
+        { "cache-mb", 0, 0, G_OPTION_ARG_INT, &cache_mb, "Canvas cache of the browse stage in MiB (default 512)", "MB" },
+        { "threads", 't', 0, G_OPTION_ARG_INT, &threads, "Chain links decoded ahead of compositing (default: one per core, at most 8)", "N" },
+        { "label", 0, 0, G_OPTION_ARG_STRING, &label, "Free-form tag stored in the report, e.g. a commit", "TEXT" },
+        { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output, "Write the report to FILE instead of stdout", "FILE" },
+        { "blend-check", 0, 0, G_OPTION_ARG_NONE, &blend_check, "Compare every blend kernel with gdk_pixbuf_composite() and time it; archives are optional", NULL },
+        { NULL }
+    };
+
+    g_autoptr(GError) error = NULL;
+    GOptionContext *context = g_option_context_new("<archive.dia>...");
+    g_option_context_add_main_entries(context, entries, NULL);
+    gboolean parsed = g_option_context_parse(context, &argc, &argv, &error);
+    g_option_context_free(context);
+    if (!parsed || (argc < 2 && !blend_check) || rounds <= 0 || cache_mb < 0 || threads < 0) {
+        if (error) g_printerr("%s\n", error->message);
+        g_printerr("Usage: dia-bench [-n ROUNDS] [--cache-mb MB] [-t THREADS] [--label TEXT] [-o FILE] [--blend-check] <archive.dia>...\n");
+        g_free(label);
+        g_free(output);
+        return 1;
+    }
+
+    dia_render_set_decode_threads((guint)threads);
+
+    JsonBuilder *builder = json_builder_new();
+    json_builder_begin_object(builder);
+    json_builder_set_member_name(builder, "label");
+    if (label) json_builder_add_string_value(builder, label);
+    else json_builder_add_null_value(builder);
+    json_builder_set_member_name(builder, "rounds");
+    json_builder_add_int_value(builder, rounds);
+    json_builder_set_member_name(builder, "cache_mb");
+    json_builder_add_int_value(builder, cache_mb);
+    json_builder_set_member_name(builder, "blend");
+    json_builder_add_string_value(builder, dia_blend_impl_name(dia_blend_default_impl()));
+    json_builder_set_member_name(builder, "cpus");
+    json_builder_add_int_value(builder, g_get_num_processors());
+    json_builder_set_member_name(builder, "decode_threads");
+    json_builder_add_int_value(builder, dia_render_get_decode_threads());
+
+    int status = 0;
+    if (blend_check && !bench_blend(builder)) status = 1;
+
+    json_builder_set_member_name(builder, "archives");
+    json_builder_begin_array(builder);
+    for (int i = 1; i < argc; i++) {
+        if (!bench_archive(argv[i], rounds, (gsize)cache_mb << 20, builder, &error)) {
+            g_printerr("ERROR: %s: %s\n", argv[i], error ? error->message : "Unknown error");
+            g_clear_error(&error);
+            status = 1;
+        }
+    }
+    json_builder_end_array(builder);
+    json_builder_end_object(builder);
+
+    JsonGenerator *generator = json_generator_new();
+    JsonNode *root = json_builder_get_root(builder);
+    json_generator_set_root(generator, root);
+    json_generator_set_pretty(generator, TRUE);
+    gsize length;
+    g_autofree gchar *report = json_generator_to_data(generator, &length);
+    json_node_unref(root);
+    g_object_unref(generator);
+    g_object_unref(builder);
+
+    if (output) {
+        if (!g_file_set_contents(output, report, (gssize)length, &error)) {
+            g_printerr("ERROR: %s\n", error->message);
+            status = 1;
+        }
+    } else if (printf("%s\n", report) < 0 || fflush(stdout) != 0) {
+        g_printerr("ERROR: Could not write the report: %s\n", g_strerror(errno));
+        status = 1;
+    }
+    g_free(label);
+    g_free(output);
+    return status;
+}
@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+"""Encodes one image collection with each delta codec and compares archive size, Phase 2 encode
+throughput and, when the native dia tool is available, per-overlay decode latency."""
+
+import argparse
+import re
+import subprocess
+import sys
+import tempfile
+import time
+from pathlib import Path
+
+from PIL import Image
+
+import encode
+
+CODECS = (
+    ("png", []),
+    ("zmask", ["--delta-codec", "zmask"]),
+    ("zmask+dict", ["--delta-codec", "zmask", "--zmask-dict"]),
+)
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("input_dir", help="Directory of source images, as for encode.py.")
+    parser.add_argument("-w", "--workers", type=int, default=4, help="Passed to encode.py.")
+    parser.add_argument("--dia", help="Path to the native dia tool (default: next to this script, then PATH).")
+    parser.add_argument("--rounds", type=int, default=3, help="Walks over each archive when timing overlays.")
+    parser.add_argument("--keep", metavar="DIR", help="Keep the archives in DIR instead of a temporary directory.")
+    args = parser.parse_args()
+
+    input_dir = Path(args.input_dir).resolve()
+    megapixels = 0.0
+    for path in input_dir.rglob('*'):
+        if path.is_file() and path.suffix.lower() in encode.IMAGE_EXTENSIONS:
+            with Image.open(path) as img:
+                megapixels += img.width * img.height / 1e6
+
+    dia_tool = encode.find_dia_tool(args.dia)
+    with tempfile.TemporaryDirectory() as temp_dir:
+        out_dir = Path(args.keep or temp_dir)
+        out_dir.mkdir(parents=True, exist_ok=True)
+        rows, archives = [], []
+        for name, flags in CODECS:
+            archive = out_dir / f"{input_dir.name}.{name.replace('+', '-')}.dia"
+            command = [sys.executable, str(Path(encode.__file__).resolve()), str(input_dir), "-o", str(archive),
+                       "-w", str(args.workers), "--no-previews"] + flags
+            start = time.monotonic()
+            result = subprocess.run(command, capture_output=True, text=True)
+            elapsed = time.monotonic() - start
+            if result.returncode != 0 or not archive.exists():
+                print(f"{name}: encode.py failed\n{result.stdout}{result.stderr}")
+                return 1
+            phase2 = re.search(r"Phase 2 took ([0-9.]+)s", result.stdout)
+            phase2_seconds = float(phase2.group(1)) if phase2 else float('nan')
+            rows.append((name, archive.stat().st_size / 2**20, elapsed, phase2_seconds, megapixels / phase2_seconds))
+            archives.append(str(archive))
+
+        print(f"{megapixels:.1f} MP in {input_dir}")
+        print(f"{'codec':<12} {'archive MiB':>12} {'encode s':>9} {'phase 2 s':>10} {'phase 2 MP/s':>13}")
+        for name, size, elapsed, phase2_seconds, throughput in rows:
+            print(f"{name:<12} {size:>12.2f} {elapsed:>9.2f} {phase2_seconds:>10.2f} {throughput:>13.1f}")
+
+        if not dia_tool:
+            print("\nSkipping overlay latency: build the dia tool with `make dia` or pass --dia.")
+            return 0
+        print()
+        sys.stdout.flush()
+        return subprocess.run([dia_tool, "bench-overlays", "-n", str(args.rounds)] + archives).returncode
+
+if __name__ == "__main__":
+    sys.exit(main())
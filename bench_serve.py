@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+"""Load-tests a running `dia serve`: keeps a number of requests in flight against every archive it
+serves, then reports client-side throughput and latency percentiles next to the server's /stats."""
+
+import argparse
+import http.client
+import json
+import random
+import socket
+import sys
+import threading
+import time
+from collections import Counter
+from urllib.parse import quote, urlsplit
+
+class UnixHTTPConnection(http.client.HTTPConnection):
+    def __init__(self, path, timeout):
+        super().__init__("localhost", timeout=timeout)
+        self.socket_path = path
+
+    def connect(self):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.settimeout(self.timeout)
+        self.sock.connect(self.socket_path)
+
+def connection_factory(args):
+    if args.socket:
+        return lambda: UnixHTTPConnection(args.socket, args.timeout)
+    url = urlsplit(args.url)
+    return lambda: http.client.HTTPConnection(url.hostname, url.port or 80, timeout=args.timeout)
+
+def fetch(connect, path):
+    """Returns (status, body); the server closes every connection after one response."""
+    conn = connect()
+    try:
+        conn.request("GET", path)
+        response = conn.getresponse()
+        return response.status, response.read()
+    finally:
+        conn.close()
+
+def fetch_json(connect, path):
+    status, body = fetch(connect, path)
+    if status != 200:
+        raise RuntimeError(f"GET {path} returned {status}: {body.decode(errors='replace').strip()}")
+    return json.loads(body)
+
+def make_targets(archives, pattern, hot, seed):
+    """Returns a function from request number to (archive, image ID). Image i has ID "i"."""
+    images = [(a["name"], str(i)) for a in archives for i in range(a["images"])]
+    if not images:
+        raise RuntimeError("the server has no images")
+    rng = random.Random(seed)
+    lock = threading.Lock()
+    if pattern == "sequential":
+        return lambda n: images[n % len(images)]
+    if pattern == "hot":
+        hot_set = rng.sample(images, min(hot, len(images)))
+        def pick(_):
+            with lock:
+                return rng.choice(hot_set) if rng.random() < 0.9 else rng.choice(images)
+        return pick
+    def pick(_):
+        with lock:
+            return rng.choice(images)
+    return pick
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0.0
+    return sorted_values[min(len(sorted_values) - 1, max(0, int(round(p / 100 * len(sorted_values))) - 1))]
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    target = parser.add_mutually_exclusive_group()
+    target.add_argument("--socket", metavar="PATH", help="UNIX socket of the server.")
+    target.add_argument("--url", default="http://127.0.0.1:8080", help="Base URL of the server (default: %(default)s).")
+    parser.add_argument("-c", "--concurrency", type=int, default=8, help="Requests kept in flight (default: %(default)s).")
+    parser.add_argument("-n", "--requests", type=int, default=1000, help="Requests to send (default: %(default)s).")
+    parser.add_argument("-d", "--duration", type=float, help="Run for this many seconds instead of a fixed count.")
+    parser.add_argument("--format", choices=("png", "rgba"), default="png", help="Response format (default: %(default)s).")
+    parser.add_argument("--pattern", choices=("random", "sequential", "hot"), default="random",
+                        help="Image order: uniform random, every image in turn, or 90%% of requests on --hot images.")
+    parser.add_argument("--hot", type=int, default=10, help="Size of the hot set (default: %(default)s).")
+    parser.add_argument("--seed", type=int, default=0, help="Seed of the random patterns.")
+    parser.add_argument("--timeout", type=float, default=60.0, help="Per-request timeout in seconds.")
+    parser.add_argument("--json", action="store_true", help="Print the report as JSON.")
+    args = parser.parse_args()
+    if args.concurrency < 1 or (args.duration is None and args.requests < 1):
+        parser.error("--concurrency and --requests must be positive")
+
+    connect = connection_factory(args)
+    try:
+        archives = fetch_json(connect, "/")["archives"]
+        pick = make_targets(archives, args.pattern, args.hot, args.seed)
+    except (OSError, RuntimeError, ValueError) as e:
+        print(f"ERROR: {e}", file=sys.stderr)
+        return 1
+
+    lock = threading.Lock()
+    counter = iter(range(sys.maxsize))
+    latencies, statuses, failures = [], Counter(), Counter()
+    received = 0
+    deadline = time.monotonic() + args.duration if args.duration is not None else None
+
+    def next_request():
+        with lock:
+            n = next(counter)
+        if deadline is None:
+            return n if n < args.requests else None
+        return n if time.monotonic() < deadline else None
+
+    def worker():
+        nonlocal received
+        while (n := next_request()) is not None:
+            name, image_id = pick(n)
+            path = f"/{quote(name, safe='')}/{quote(image_id, safe='/')}?format={args.format}"
+            start = time.monotonic()
+            try:
+                status, body = fetch(connect, path)
+            except OSError as e:
+                with lock:
+                    failures[type(e).__name__] += 1
+                continue
+            elapsed = time.monotonic() - start
+            with lock:
+                statuses[status] += 1
+                if status == 200:
+                    latencies.append(elapsed)
+                    received += len(body)
+
+    start = time.monotonic()
+    threads = [threading.Thread(target=worker, daemon=True) for _ in range(args.concurrency)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    wall = time.monotonic() - start
+
+    latencies.sort()
+    sent = sum(statuses.values()) + sum(failures.values())
+    client = {
+        "requests": sent,
+        "seconds": wall,
+        "requests_per_second": sent / wall if wall > 0 else 0.0,
+        "mib_per_second": received / 2**20 / wall if wall > 0 else 0.0,
+        "statuses": {str(k): v for k, v in sorted(statuses.items())},
+        "failures": dict(failures),
+        "latency_ms": {f"p{p}": percentile(latencies, p) * 1000 for p in (50, 90, 95, 99)},
+    }
+    client["latency_ms"]["max"] = latencies[-1] * 1000 if latencies else 0.0
+    try:
+        server = fetch_json(connect, "/stats")
+    except (OSError, RuntimeError, ValueError) as e:
+        print(f"WARNING: could not read /stats: {e}", file=sys.stderr)
+        server = None
+
+    if args.json:
+        print(json.dumps({"concurrency": args.concurrency, "pattern": args.pattern, "format": args.format,
+                          "client": client, "server": server}, indent=2))
+        return 0 if not failures else 1
+
+    lat = client["latency_ms"]
+    print(f"{sent} requests in {wall:.2f} s with {args.concurrency} in flight ({args.pattern}, {args.format})")
+    print(f"  throughput: {client['requests_per_second']:.1f} req/s, {client['mib_per_second']:.1f} MiB/s")
+    print(f"  latency ms: p50 {lat['p50']:.1f}  p90 {lat['p90']:.1f}  p95 {lat['p95']:.1f}  p99 {lat['p99']:.1f}  max {lat['max']:.1f}")
+    print(f"  statuses:   {', '.join(f'{k}: {v}' for k, v in client['statuses'].items()) or 'none'}")
+    if failures:
+        print(f"  failures:   {', '.join(f'{k}: {v}' for k, v in failures.items())}")
+    if server:
+        cache = server["cache"]
+        print(f"server: {server['requests']} requests, {server['coalesced']} coalesced, {server['rejected']} rejected, "
+              f"p50 {server['latency_ms']['p50']:.0f} ms, p99 {server['latency_ms']['p99']:.0f} ms (bucket bounds)")
+        print(f"  canvas cache: {cache['hit_rate'] * 100:.1f}% hits, {cache['canvases']} canvases, "
+              f"{cache['resident_bytes'] / 2**20:.0f} of {cache['budget_bytes'] / 2**20:.0f} MiB")
+    return 0 if not failures else 1
+
+if __name__ == "__main__":
+    sys.exit(main())
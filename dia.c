@@ -0,0 +1,499 @@
+#include "src/dia.h"
+
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+// stdout may carry a tar stream, so all chatter goes to stderr
+static void print_to_stderr(const gchar *message) {
+    fputs(message, stderr);
+}
+
+static int usage(void) {
+    g_printerr("Usage: dia <command> [options]\n"
+               "\n"
+               "Commands:\n"
+               "  extract [-o DIR|-] [-j N] <archive.dia>   Reconstruct every image into DIR, or as a tar stream on stdout\n"
+               "  score [-j N] [--memory-mb=MB] [--pairs=FILE] [--metric=pixels|bytes] [LIST]\n"
+               "                                            Score image pairs; paths are read one per line (stdin without LIST)\n"
+               "  bench-overlays [-n ROUNDS] <archive.dia>...\n"
+               "                                            Time every delta overlay and report its latency distribution\n"
+               "  jpeg-delta <base.jpg> <image.jpg> [OUT]   Write the coefficient delta from base to image (stdout without OUT)\n"
+               "  serve [--socket=PATH] [--port=N] [-j N] <archive.dia>...\n"
+               "                                            Serve reconstructed images over HTTP on a UNIX socket or localhost\n");
+    return 1;
+}
+
+static int cmd_extract(int argc, char **argv) {
+    gchar *output = NULL;
+    gint jobs = 0;
+    GOptionEntry entries[] = {
+        { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output, "Output directory, or - for a tar stream on stdout", "DIR" },
+        { "jobs", 'j', 0, G_OPTION_ARG_INT, &jobs, "Trees reconstructed in parallel (default: one per core)", "N" },
+        { NULL }
+    };
+
+    g_autoptr(GError) error = NULL;
+    GOptionContext *context = g_option_context_new("<archive.dia>");
+    g_option_context_add_main_entries(context, entries, NULL);
+    gboolean parsed = g_option_context_parse(context, &argc, &argv, &error);
+    g_option_context_free(context);
+    if (!parsed || argc != 2 || !output || jobs < 0) {
+        if (error) g_printerr("%s\n", error->message);
+        g_printerr("Usage: dia extract -o <DIR|-> [-j N] <archive.dia>\n");
+        g_free(output);
+        return 1;
+    }
+
+    gboolean to_tar = strcmp(output, "-") == 0;
+    if (to_tar && isatty(STDOUT_FILENO)) {
+        g_printerr("Refusing to write a tar stream to a terminal\n");
+        g_free(output);
+        return 1;
+    }
+
+    gint64 start = g_get_monotonic_time();
+    DiaArchive *archive = dia_archive_open(argv[1], &error);
+    if (!archive || !dia_archive_load_map(archive, &error)) {
+        g_printerr("ERROR: %s\n", error ? error->message : "Unknown error");
+        dia_archive_free(archive);
+        g_free(output);
+        return 1;
+    }
+
+    DiaExtractOptions options = {
+        .output_dir = to_tar ? NULL : output,
+        .tar_stream = to_tar ? stdout : NULL,
+        .jobs = (guint)jobs,
+    };
+    DiaExtractStats stats;
+    gboolean ok = dia_extract_archive(archive, &options, &stats, &error);
+    double seconds = (g_get_monotonic_time() - start) / (double)G_USEC_PER_SEC;
+
+    g_autofree gchar *written = g_format_size(stats.bytes);
+    g_print("[dia] extracted %u images from %u trees (%s) in %.2f s\n", stats.images, stats.trees, written, seconds);
+    if (stats.unreachable) {
+        g_printerr("WARNING: %u images are not reachable from root_images and were skipped\n", stats.unreachable);
+    }
+    if (!ok) {
+        g_printerr("ERROR: %s\n", error ? error->message : "Unknown error");
+    }
+
+    dia_archive_free(archive);
+    g_free(output);
+    return ok ? 0 : 1;
+}
+
+static gchar* peak_rss(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return g_strdup("unknown");
+    return g_format_size((guint64)usage.ru_maxrss * 1024);
+}
+
+static void print_edge(guint64 score, guint id1, guint id2, gpointer user_data) {
+    fprintf((FILE*)user_data, "%" G_GUINT64_FORMAT "\t%u\t%u\n", score, id1, id2);
+}
+
+// Candidate pairs are whitespace-separated "id1 id2" lines
+static GArray* read_pair_list(const gchar *path, GError **error) {
+    g_autofree gchar *contents = NULL;
+    if (!g_file_get_contents(path, &contents, NULL, error)) return NULL;
+
+    GArray *pairs = g_array_new(FALSE, FALSE, sizeof(guint));
+    const gchar *p = contents;
+    for (;;) {
+        while (g_ascii_isspace(*p)) p++;
+        if (!*p) break;
+        gchar *end = NULL;
+        guint64 id = g_ascii_strtoull(p, &end, 10);
+        if (end == p || id > G_MAXUINT) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "'%s' is not a list of image ID pairs", path);
+            g_array_free(pairs, TRUE);
+            return NULL;
+        }
+        guint value = (guint)id;
+        g_array_append_val(pairs, value);
+        p = end;
+    }
+
+    if (pairs->len % 2 != 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "'%s' has an odd number of image IDs", path);
+        g_array_free(pairs, TRUE);
+        return NULL;
+    }
+    return pairs;
+}
+
+// Output is one "score<TAB>id1<TAB>id2" line per pair, where IDs are line numbers of the input.
+// With --metric=bytes the score is the estimated delta size in bytes, which is better when lower.
+static int cmd_score(int argc, char **argv) {
+    gint jobs = 0;
+    gint memory_mb = DIA_DEFAULT_SCORE_MB;
+    gchar *pairs_path = NULL;
+    g_autofree gchar *metric = NULL;
+    GOptionEntry entries[] = {
+        { "jobs", 'j', 0, G_OPTION_ARG_INT, &jobs, "Scoring threads (default: one per core)", "N" },
+        { "memory-mb", 0, 0, G_OPTION_ARG_INT, &memory_mb, "Budget for decoded images in MiB (default 4096)", "MB" },
+        { "pairs", 0, 0, G_OPTION_ARG_FILENAME, &pairs_path, "Score only the \"id1 id2\" pairs listed in FILE", "FILE" },
+        { "metric", 0, 0, G_OPTION_ARG_STRING, &metric, "'pixels' counts identical pixels (default), 'bytes' estimates the delta size", "METRIC" },
+        { NULL }
+    };
+
+    g_autoptr(GError) error = NULL;
+    GOptionContext *context = g_option_context_new("[LIST]");
+    g_option_context_add_main_entries(context, entries, NULL);
+    gboolean parsed = g_option_context_parse(context, &argc, &argv, &error);
+    g_option_context_free(context);
+    gboolean bytes = metric && strcmp(metric, "bytes") == 0;
+    if (!parsed || argc > 2 || jobs < 0 || memory_mb <= 0 || (metric && !bytes && strcmp(metric, "pixels") != 0)) {
+        if (error) g_printerr("%s\n", error->message);
+        g_printerr("Usage: dia score [-j N] [--memory-mb=MB] [--pairs=FILE] [--metric=pixels|bytes] [LIST]\n");
+        g_free(pairs_path);
+        return 1;
+    }
+
+    GArray *pairs = NULL;
+    if (pairs_path) {
+        pairs = read_pair_list(pairs_path, &error);
+        g_free(pairs_path);
+        if (!pairs) {
+            g_printerr("ERROR: %s\n", error->message);
+            return 1;
+        }
+    }
+
+    gchar *contents = NULL;
+    gsize length = 0;
+    if (argc == 2 && strcmp(argv[1], "-") != 0) {
+        if (!g_file_get_contents(argv[1], &contents, &length, &error)) {
+            g_printerr("ERROR: %s\n", error->message);
+            if (pairs) g_array_free(pairs, TRUE);
+            return 1;
+        }
+    } else {
+        GString *buffer = g_string_new(NULL);
+        gchar chunk[65536];
+        gsize got;
+        while ((got = fread(chunk, 1, sizeof(chunk), stdin)) > 0) g_string_append_len(buffer, chunk, (gssize)got);
+        length = buffer->len;
+        contents = g_string_free(buffer, FALSE);
+    }
+
+    // Blank lines still take an ID so numbering always matches the caller's list
+    if (length > 0 && contents[length - 1] == '\n') contents[length - 1] = '\0';
+    gchar **paths = g_strsplit(contents, "\n", -1);
+    g_free(contents);
+    guint n_paths = length > 0 ? g_strv_length(paths) : 0;
+
+    gint64 start = g_get_monotonic_time();
+    DiaScoreOptions options = {
+        .jobs = (guint)jobs,
+        .memory_budget = (gsize)memory_mb << 20,
+        .metric = bytes ? DIA_SCORE_BYTES : DIA_SCORE_PIXELS,
+        .pairs = pairs ? (const guint*)pairs->data : NULL,
+        .n_pairs = pairs ? pairs->len / 2 : 0,
+    };
+    DiaScoreStats stats;
+    dia_score_images((const gchar *const *)paths, n_paths, &options, print_edge, stdout, &stats);
+    gboolean ok = fflush(stdout) == 0 && !ferror(stdout);
+    double seconds = (g_get_monotonic_time() - start) / (double)G_USEC_PER_SEC;
+
+    g_autofree gchar *rss = peak_rss();
+    g_print("[dia] scored %" G_GUINT64_FORMAT " pairs of %u images in %u buckets with %" G_GUINT64_FORMAT " decodes in %.2f s, peak RSS %s\n",
+            stats.pairs, stats.images, stats.buckets, stats.decodes, seconds, rss);
+    if (stats.skipped) g_printerr("WARNING: %u images could not be read and were skipped\n", stats.skipped);
+    if (!ok) g_printerr("ERROR: Could not write scores: %s\n", g_strerror(errno));
+
+    g_strfreev(paths);
+    if (pairs) g_array_free(pairs, TRUE);
+    return ok ? 0 : 1;
+}
+
+typedef struct {
+    guint64 bytes;
+    guint png;
+    guint zmask;
+    guint jpeg;
+} DeltaCensus;
+
+static void census_entry(DiaArchive *archive, const gchar *path, DeltaCensus *census) {
+    gint64 index = dia_archive_lookup(archive, path);
+    if (index < 0) return;
+    census->bytes += g_array_index(archive->entries, DiaEntry, index).compressed_size;
+    g_autoptr(GBytes) bytes = dia_archive_read_index(archive, (guint64)index, NULL);
+    if (bytes && dia_zmask_is_delta(bytes)) census->zmask++;
+    else if (bytes && dia_jpeg_is_delta(bytes)) census->jpeg++;
+    else census->png++;
+}
+
+// Sizes and formats of the stored delta tiles; full-canvas deltas count as PNG
+static void census_deltas(DiaArchive *archive, DeltaCensus *census) {
+    memset(census, 0, sizeof(*census));
+    guint n_images = dia_archive_n_images(archive);
+    for (guint i = 0; i < n_images; i++) {
+        const gchar *id = dia_archive_image_id(archive, i);
+        if (!dia_archive_parent(archive, id)) continue;
+        gint n_tiles = dia_archive_n_tiles(archive, id);
+        if (n_tiles < 0) {
+            const gchar *path = dia_archive_image_path(archive, id, NULL);
+            if (path) census_entry(archive, path, census);
+        }
+        for (gint t = 0; t < n_tiles; t++) {
+            DiaDeltaTile tile;
+            dia_archive_get_tile(archive, id, (guint)t, &tile);
+            census_entry(archive, tile.path, census);
+        }
+    }
+}
+
+static gint compare_int64(gconstpointer a, gconstpointer b) {
+    gint64 x = *(const gint64*)a;
+    gint64 y = *(const gint64*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_ms(GArray *sorted, double p) {
+    if (sorted->len == 0) return 0;
+    guint i = (guint)MIN(sorted->len - 1, (guint)(p * sorted->len));
+    return g_array_index(sorted, gint64, i) / 1000.0;
+}
+
+// Walks every tree depth-first like extract, timing each dia_render_overlay() call: the tile
+// reads, decodes and blends, but not the copy of the parent canvas. JPEG trees have no
+// per-overlay canvas and are left out.
+static gboolean time_overlays(DiaArchive *archive, GArray *samples, GError **error) {
+    guint n_roots = dia_archive_n_roots(archive);
+    for (guint r = 0; r < n_roots; r++) {
+        const gchar *root_id = dia_archive_root(archive, r);
+        if (dia_archive_is_jpeg(archive, root_id)) continue;
+        GdkPixbuf *canvas = dia_render_base(archive, root_id, NULL, error);
+        if (!canvas) return FALSE;
+
+        GPtrArray *pending_ids = g_ptr_array_new();
+        GPtrArray *pending_parents = g_ptr_array_new_with_free_func(g_object_unref);
+        for (guint c = 0; c < dia_archive_n_children(archive, root_id); c++) {
+            g_ptr_array_add(pending_ids, (gpointer)dia_archive_child(archive, root_id, c));
+            g_ptr_array_add(pending_parents, g_object_ref(canvas));
+        }
+        g_object_unref(canvas);
+
+        gboolean ok = TRUE;
+        while (ok && pending_ids->len > 0) {
+            const gchar *id = g_ptr_array_steal_index(pending_ids, pending_ids->len - 1);
+            GdkPixbuf *parent = g_ptr_array_steal_index(pending_parents, pending_parents->len - 1);
+            GdkPixbuf *child = gdk_pixbuf_copy(parent);
+            g_object_unref(parent);
+
+            gint64 start = g_get_monotonic_time();
+            ok = dia_render_overlay(archive, child, id, NULL, error);
+            gint64 elapsed = g_get_monotonic_time() - start;
+            g_array_append_val(samples, elapsed);
+
+            for (guint c = 0; ok && c < dia_archive_n_children(archive, id); c++) {
+                g_ptr_array_add(pending_ids, (gpointer)dia_archive_child(archive, id, c));
+                g_ptr_array_add(pending_parents, g_object_ref(child));
+            }
+            g_object_unref(child);
+        }
+        g_ptr_array_unref(pending_ids);
+        g_ptr_array_unref(pending_parents);
+        if (!ok) return FALSE;
+    }
+    return TRUE;
+}
+
+static int cmd_bench_overlays(int argc, char **argv) {
+    gint rounds = 3;
+    GOptionEntry entries[] = {
+        { "rounds", 'n', 0, G_OPTION_ARG_INT, &rounds, "Walks over each archive (default 3)", "ROUNDS" },
+        { NULL }
+    };
+
+    g_autoptr(GError) error = NULL;
+    GOptionContext *context = g_option_context_new("<archive.dia>...");
+    g_option_context_add_main_entries(context, entries, NULL);
+    gboolean parsed = g_option_context_parse(context, &argc, &argv, &error);
+    g_option_context_free(context);
+    if (!parsed || argc < 2 || rounds <= 0) {
+        if (error) g_printerr("%s\n", error->message);
+        g_printerr("Usage: dia bench-overlays [-n ROUNDS] <archive.dia>...\n");
+        return 1;
+    }
+
+    // One line per archive on stdout, so runs over several codecs line up
+    printf("%-32s %10s %10s %6s %6s %6s %9s %9s %9s %9s\n", "archive", "size", "deltas", "png", "zmask", "jpeg", "mean ms", "p50 ms", "p95 ms", "p99 ms");
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        DiaArchive *archive = dia_archive_open(argv[i], &error);
+        if (!archive || !dia_archive_load_map(archive, &error)) {
+            g_printerr("ERROR: %s: %s\n", argv[i], error ? error->message : "Unknown error");
+            g_clear_error(&error);
+            dia_archive_free(archive);
+            status = 1;
+            continue;
+        }
+
+        DeltaCensus census;
+        census_deltas(archive, &census);
+        GArray *samples = g_array_new(FALSE, FALSE, sizeof(gint64));
+        gboolean ok = TRUE;
+        for (gint r = 0; ok && r < rounds; r++) ok = time_overlays(archive, samples, &error);
+        if (!ok) {
+            g_printerr("ERROR: %s: %s\n", argv[i], error->message);
+            g_clear_error(&error);
+            status = 1;
+        } else {
+            gint64 total = 0;
+            for (guint s = 0; s < samples->len; s++) total += g_array_index(samples, gint64, s);
+            g_array_sort(samples, compare_int64);
+            g_autofree gchar *basename = g_path_get_basename(argv[i]);
+            g_autofree gchar *size = g_format_size(archive->length);
+            g_autofree gchar *deltas = g_format_size(census.bytes);
+            printf("%-32s %10s %10s %6u %6u %6u %9.3f %9.3f %9.3f %9.3f\n", basename, size, deltas, census.png, census.zmask, census.jpeg,
+                   samples->len ? total / 1000.0 / samples->len : 0.0,
+                   percentile_ms(samples, 0.50), percentile_ms(samples, 0.95), percentile_ms(samples, 0.99));
+        }
+        g_array_free(samples, TRUE);
+        dia_archive_free(archive);
+    }
+    return status;
+}
+
+static DiaJpegCoefs* read_jpeg_coefs(const gchar *path, GError **error) {
+    gchar *contents = NULL;
+    gsize length = 0;
+    if (!g_file_get_contents(path, &contents, &length, error)) return NULL;
+    g_autoptr(GBytes) bytes = g_bytes_new_take(contents, length);
+    return dia_jpeg_coefs_new(bytes, path, error);
+}
+
+// encode.py stores the output as the image's only delta tile
+static int cmd_jpeg_delta(int argc, char **argv) {
+    if (argc != 3 && argc != 4) {
+        g_printerr("Usage: dia jpeg-delta <base.jpg> <image.jpg> [OUT]\n");
+        return 1;
+    }
+
+    g_autoptr(GError) error = NULL;
+    DiaJpegCoefs *base = read_jpeg_coefs(argv[1], &error);
+    DiaJpegCoefs *image = base ? read_jpeg_coefs(argv[2], &error) : NULL;
+    g_autoptr(GBytes) delta = image ? dia_jpeg_delta_encode(base, image, &error) : NULL;
+    dia_jpeg_coefs_free(base);
+    dia_jpeg_coefs_free(image);
+    if (!delta) {
+        g_printerr("ERROR: %s\n", error->message);
+        return 1;
+    }
+
+    gsize size;
+    const gchar *data = g_bytes_get_data(delta, &size);
+    if (argc == 4) {
+        if (!g_file_set_contents(argv[3], data, (gssize)size, &error)) {
+            g_printerr("ERROR: %s\n", error->message);
+            return 1;
+        }
+    } else if (fwrite(data, 1, size, stdout) != size || fflush(stdout) != 0) {
+        g_printerr("ERROR: Could not write delta: %s\n", g_strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+// Archives are addressed by file name without ".dia"
+static int cmd_serve(int argc, char **argv) {
+    gchar *socket_path = NULL;
+    gint port = -1;
+    gint workers = 0;
+    gint queue = DIA_DEFAULT_SERVE_QUEUE;
+    gint cache_mb = DIA_DEFAULT_SERVE_CACHE_MB;
+    gint threads = 0;
+    gint png_compression = 1;
+    GOptionEntry entries[] = {
+        { "socket", 0, 0, G_OPTION_ARG_FILENAME, &socket_path, "Listen on a UNIX socket at PATH", "PATH" },
+        { "port", 0, 0, G_OPTION_ARG_INT, &port, "Listen on 127.0.0.1:N (default 8080 without --socket)", "N" },
+        { "workers", 'j', 0, G_OPTION_ARG_INT, &workers, "Requests handled at once (default: one per core)", "N" },
+        { "queue", 0, 0, G_OPTION_ARG_INT, &queue, "Connections waiting for a worker before new ones get 503 (default 256)", "N" },
+        { "cache-mb", 0, 0, G_OPTION_ARG_INT, &cache_mb, "Canvas cache shared by all archives in MiB (default 1024)", "MB" },
+        { "decode-threads", 't', 0, G_OPTION_ARG_INT, &threads, "Chain links decoded ahead of compositing (default: one per core, at most 8)", "N" },
+        { "png-compression", 0, 0, G_OPTION_ARG_INT, &png_compression, "zlib level of PNG responses, 0 to 9 (default 1)", "N" },
+        { NULL }
+    };
+
+    g_autoptr(GError) error = NULL;
+    GOptionContext *context = g_option_context_new("<archive.dia>...");
+    g_option_context_add_main_entries(context, entries, NULL);
+    gboolean parsed = g_option_context_parse(context, &argc, &argv, &error);
+    g_option_context_free(context);
+    if (port < 0) port = socket_path ? 0 : DIA_DEFAULT_SERVE_PORT;
+    if (!parsed || argc < 2 || port > G_MAXUINT16 || workers < 0 || queue < 1 || cache_mb < 0 || threads < 0 ||
+        png_compression < 0 || png_compression > 9 || (!socket_path && !port)) {
+        if (error) g_printerr("%s\n", error->message);
+        g_printerr("Usage: dia serve [--socket=PATH] [--port=N] [-j N] [--queue=N] [--cache-mb=MB] [-t N] [--png-compression=N] <archive.dia>...\n");
+        g_free(socket_path);
+        return 1;
+    }
+    dia_render_set_decode_threads((guint)threads);
+
+    guint n_archives = (guint)argc - 1;
+    DiaArchive **archives = g_new0(DiaArchive*, n_archives);
+    gchar **names = g_new0(gchar*, n_archives + 1);
+    gboolean ok = TRUE;
+    for (guint i = 0; ok && i < n_archives; i++) {
+        const gchar *path = argv[i + 1];
+        gchar *base = g_path_get_basename(path);
+        if (g_str_has_suffix(base, ".dia")) base[strlen(base) - strlen(".dia")] = '\0';
+        names[i] = base;
+        for (guint j = 0; ok && j < i; j++) {
+            if (strcmp(names[j], base) == 0) {
+                g_set_error(&error, G_IO_ERROR, G_IO_ERROR_EXISTS, "'%s' and '%s' would both be served as '%s'", argv[j + 1], path, base);
+                ok = FALSE;
+            }
+        }
+        if (!ok) break;
+        archives[i] = dia_archive_open(path, &error);
+        ok = archives[i] && dia_archive_load_map(archives[i], &error);
+        if (!ok) g_prefix_error(&error, "%s: ", path);
+    }
+
+    if (ok) {
+        DiaServeOptions options = {
+            .archives = archives,
+            .names = (const gchar *const *)names,
+            .n_archives = n_archives,
+            .socket_path = socket_path,
+            .port = (guint)port,
+            .workers = (guint)workers,
+            .queue = (guint)queue,
+            .cache_budget = (gsize)cache_mb << 20,
+            .png_compression = png_compression,
+        };
+        ok = dia_serve(&options, &error);
+    }
+    if (!ok) g_printerr("ERROR: %s\n", error ? error->message : "Unknown error");
+
+    for (guint i = 0; i < n_archives; i++) dia_archive_free(archives[i]);
+    g_free(archives);
+    g_strfreev(names);
+    g_free(socket_path);
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    g_set_print_handler(print_to_stderr);
+
+    g_autoptr(GError) trace_error = NULL;
+    if (!dia_trace_init(NULL, &trace_error)) {
+        g_printerr("ERROR: %s\n", trace_error->message);
+        return 1;
+    }
+
+    if (argc < 2) return usage();
+    if (strcmp(argv[1], "extract") == 0) return cmd_extract(argc - 1, argv + 1);
+    if (strcmp(argv[1], "score") == 0) return cmd_score(argc - 1, argv + 1);
+    if (strcmp(argv[1], "bench-overlays") == 0) return cmd_bench_overlays(argc - 1, argv + 1);
+    if (strcmp(argv[1], "jpeg-delta") == 0) return cmd_jpeg_delta(argc - 1, argv + 1);
+    if (strcmp(argv[1], "serve") == 0) return cmd_serve(argc - 1, argv + 1);
+
+    g_printerr("Unknown command '%s'\n", argv[1]);
+    return usage();
+}
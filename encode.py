@@ -1,23 +1,60 @@
 #!/usr/bin/env python3
 
-import gc
 import os
 import shutil
 import argparse
 import json
 from pathlib import Path
-from concurrent.futures import ThreadPoolExecutor, as_completed
+from concurrent.futures import ProcessPoolExecutor, ThreadPoolExecutor, as_completed
 from itertools import combinations
 import collections
+import hashlib
+import io
 import oxipng
+import struct
+import subprocess
 import sys
 import tempfile
+import threading
+import time
 import zipfile
 
+try:
+    import resource
+except ImportError:
+    resource = None
+
+try:
+    import zstandard
+except ImportError:
+    zstandard = None
+
 from PIL import Image, ImageChops
 import numpy as np
 
-IMAGE_EXTENSIONS = {'.png'}
+JPEG_EXTENSIONS = {'.jpg', '.jpeg'}
+IMAGE_EXTENSIONS = {'.png'} | JPEG_EXTENSIONS
+JPEG_DELTA_SUFFIX = ".jdelta"
+OXIPNG_LEVEL = 6  # default effort for every PNG the encoder writes; --oxipng-level trades it for speed
+
+def jpeg_layout(img_path):
+    """Everything two JPEGs must share for one to be stored as the coefficient blocks it changes
+    over the other: size, colour space, sampling and quantization. None for JPEGs the viewer
+    cannot patch (CMYK, 12-bit)."""
+    try:
+        with Image.open(img_path) as img:
+            if img.format != "JPEG" or img.mode not in {"L", "RGB"} or img.bits != 8:
+                return None
+            return (img.size, img.mode, img.info.get("adobe_transform"), tuple(img.layer),
+                    tuple(sorted((k, tuple(v)) for k, v in img.quantization.items())))
+    except Exception:
+        return None
+
+def chainable_pairs(all_scores, jpeg_layouts, jpeg_deltas):
+    """Keeps the pairs that can be delta-coded: two non-JPEGs, or, when jpeg_deltas, two JPEGs
+    that share a layout. Pixel deltas between JPEGs would not be bit-exact with the files."""
+    return [(score, id1, id2) for score, id1, id2 in all_scores
+            if jpeg_layouts.get(id1) == jpeg_layouts.get(id2) and (jpeg_deltas or id1 not in jpeg_layouts)]
 
 def image_has_alpha(image_path):
     try:
@@ -30,23 +67,50 @@ def image_has_alpha(image_path):
     except Exception:
         return False
 
-def extract_and_save_alpha(img_path, alpha_save_path):
+def alpha_channel(img):
+    """The alpha channel of an open image as an array, or None when it has no transparency at all."""
+    if img.mode not in {"RGBA", "LA", "PA"} and "transparency" not in img.info:
+        return None
+    return np.array(img.convert("RGBA").getchannel("A"), dtype=np.uint8)
+
+def encode_alpha_png(alpha, level=OXIPNG_LEVEL):
+    """An alpha array as an optimized grayscale PNG."""
+    height, width = alpha.shape
+    raw = oxipng.RawImage(np.ascontiguousarray(alpha).tobytes(), width, height, color_type=oxipng.ColorType.grayscale())
+    return raw.create_optimized_png(level=level, optimize_alpha=False)
+
+def extract_alpha_png(img_path, level=OXIPNG_LEVEL):
+    """Returns the alpha channel of an image as an optimized grayscale PNG, or None on failure. Only
+    archives without "alpha_encoding": "delta" store these."""
     try:
-        alpha_save_path.parent.mkdir(parents=True, exist_ok=True)
         with Image.open(img_path) as img:
-            alpha_channel = img.convert('RGBA').getchannel('A')
-            alpha_array = np.array(alpha_channel, dtype=np.uint8)
-            width, height = alpha_channel.size
-            data = alpha_array.tobytes()
-            color_type = oxipng.ColorType.grayscale()
-            raw = oxipng.RawImage(data, width, height, color_type=color_type)
-            optimized = raw.create_optimized_png(level=6, optimize_alpha=False)
-            with open(alpha_save_path, "wb") as f:
-                f.write(optimized)
-        return True
+            return encode_alpha_png(np.array(img.convert('RGBA').getchannel('A'), dtype=np.uint8), level)
     except Exception as e:
         print(f"Error saving alpha for {img_path}: {e}")
-        return False
+        return None
+
+ALPHA_DELTA_MAGIC = b"DIAA"
+ALPHA_DELTA_VERSION = 1
+ALPHA_DELTA_SUFFIX = ".alpha"
+
+def encode_alpha_delta(alpha, parent_alpha, changed, level=OXIPNG_LEVEL):
+    """Encodes where an image's alpha differs from what compositing its delta tiles leaves on the
+    parent's canvas: the parent's alpha, made opaque wherever a pixel changed. The layout is
+    documented in src/alpha.c. None (no alpha entry) when nothing differs; a None alpha is opaque."""
+    if alpha is None and parent_alpha is None:
+        return None
+    predicted = np.where(changed, np.uint8(255), np.uint8(255) if parent_alpha is None else parent_alpha)
+    differs = predicted != (np.uint8(255) if alpha is None else alpha)
+    if not differs.any():
+        return None
+    if alpha is None:
+        alpha = np.full(changed.shape, 255, dtype=np.uint8)
+    height, width = changed.shape
+    records, pngs = [], []
+    for x0, y0, x1, y1 in find_delta_tiles(differs):
+        pngs.append(encode_alpha_png(alpha[y0:y1, x0:x1], level))
+        records.append(struct.pack('<3I', x0, y0, len(pngs[-1])))
+    return ALPHA_DELTA_MAGIC + struct.pack('<4I', ALPHA_DELTA_VERSION, width, height, len(records)) + b''.join(records + pngs)
 
 class DisjointSetUnion:
     """A simple Disjoint Set Union (DSU) or Union-Find data structure."""
@@ -81,7 +145,11 @@ def calculate_similarity_score(img_path1, img_path2):
         with Image.open(img_path1) as img1, Image.open(img_path2) as img2:
             if img1.size != img2.size or img1.mode != img2.mode:
                 return -1
-            
+            if img1.mode == "P":
+                # Palette indices are not colours: compare what they map to, as `dia score` does. RGBA
+                # either way, so one side's transparency cannot split the pair; convert('L') drops it.
+                img1, img2 = img1.convert("RGBA"), img2.convert("RGBA")
+
             diff = ImageChops.difference(img1, img2)
             diff_arr = np.array(diff.convert('L'))
             non_zero_pixels = np.count_nonzero(diff_arr)
@@ -90,46 +158,1094 @@ def calculate_similarity_score(img_path1, img_path2):
     except Exception:
         return -1
 
-def process_image(current_img_path, base_img_path, output_path, alpha_save_path=None):
+COST_CELL = 64  # DELTA_TILE_CELL; the estimate counts the cells a delta's tiles are cut from
+COST_CELL_BYTES = 24  # per changed cell: tile headers, row filters and the zip entry, spread over its cells
+
+def estimate_delta_bytes(rgb1, rgb2):
+    """Estimated compressed size of the delta between two RGB arrays, in either direction: a fixed
+    cost per changed COST_CELL cell, the binary entropy of the change mask inside those cells, and
+    the order-0 entropy of the changed pixels' left-neighbour residuals, averaged over both images.
+    Scattered noise costs mask bits in many cells, where pixel counts would rate it as a near match.
+    Mirrors estimate_delta_bytes() in src/score.c."""
+    changed = np.any(rgb1 != rgb2, axis=2)
+    n_changed = int(np.count_nonzero(changed))
+    if not n_changed:
+        return 0
+    height, width = changed.shape
+    grid_h, grid_w = -(-height // COST_CELL), -(-width // COST_CELL)
+    padded = np.zeros((grid_h * COST_CELL, grid_w * COST_CELL), dtype=np.int64)
+    padded[:height, :width] = changed
+    counts = padded.reshape(grid_h, COST_CELL, grid_w, COST_CELL).sum(axis=(1, 3))
+    cell_rows = np.minimum(COST_CELL, height - COST_CELL * np.arange(grid_h))
+    cell_cols = np.minimum(COST_CELL, width - COST_CELL * np.arange(grid_w))
+    areas = np.outer(cell_rows, cell_cols)
+    used = counts > 0
+    c, a = counts[used].astype(np.float64), areas[used].astype(np.float64)
+    rest = a - c
+    with np.errstate(divide='ignore', invalid='ignore'):
+        mask_bits = -np.sum(c * np.log2(c / a)) - np.sum(np.where(rest > 0, rest * np.log2(rest / a), 0.0))
+
+    histogram = np.zeros(256, dtype=np.int64)
+    for rgb in (rgb1, rgb2):
+        left = np.zeros_like(rgb)
+        left[:, 1:] = rgb[:, :-1]
+        histogram += np.bincount((rgb - left)[changed].ravel(), minlength=256)
+    nonzero = histogram[histogram > 0].astype(np.float64)
+    total = float(nonzero.sum())
+    value_bits = total * np.log2(total) - float(np.sum(nonzero * np.log2(nonzero)))
+    return int(int(np.count_nonzero(used)) * COST_CELL_BYTES + (mask_bits + value_bits / 2) / 8 + 0.5)
+
+def calculate_delta_cost(img_path1, img_path2):
+    """estimate_delta_bytes() of two image files; -1 when they cannot be compared, as for scores."""
     try:
-        output_path.parent.mkdir(parents=True, exist_ok=True)
-        with Image.open(current_img_path) as img_current, Image.open(base_img_path) as img_base:
-            img_current_rgb = img_current.convert('RGB')
-            del img_current
-            img_base_rgb = img_base.convert('RGB')
-            del img_base
-            if alpha_save_path is not None:
-                extract_and_save_alpha(current_img_path, alpha_save_path)
-            diff = ImageChops.difference(img_current_rgb, img_base_rgb)
-            del img_base_rgb
-            mask = diff.convert('L').point(lambda p: 255 if p > 0 else 0)
-            del diff
-            sanitized_image = img_current_rgb.convert('RGBA')
-            del img_current_rgb
-            sanitized_image.putalpha(mask)
-            del mask
-            rgba_array = np.array(sanitized_image, dtype=np.uint8)
-            height, width, channels = rgba_array.shape
-            del sanitized_image
-            data = rgba_array.tobytes()
-            del rgba_array
-            color_type = oxipng.ColorType.rgba()  
-            raw = oxipng.RawImage(data, width, height, color_type=color_type)
-            del data, color_type
-            optimized = raw.create_optimized_png(level=6, optimize_alpha=True)
-            del raw
-            with open(output_path, "wb") as f:
-              f.write(optimized)
-            del optimized
-        gc.collect()
-        return True
+        with Image.open(img_path1) as img1, Image.open(img_path2) as img2:
+            if img1.size != img2.size or img1.mode != img2.mode:
+                return -1
+            return estimate_delta_bytes(np.asarray(img1.convert('RGB')), np.asarray(img2.convert('RGB')))
+    except Exception:
+        return -1
+
+def find_dia_tool(explicit=None):
+    """Locates the native `dia` tool: an explicit path, next to this script, or on PATH."""
+    if explicit:
+        return explicit if os.access(explicit, os.X_OK) else None
+    local = Path(__file__).resolve().parent / "dia"
+    if local.is_file() and os.access(local, os.X_OK):
+        return str(local)
+    return shutil.which("dia")
+
+def peak_rss_mib(children=False):
+    if resource is None:
+        return float('nan')
+    who = resource.RUSAGE_CHILDREN if children else resource.RUSAGE_SELF
+    return resource.getrusage(who).ru_maxrss / 1024
+
+def io_counters():
+    """Bytes read and written by this process so far, where the platform reports them."""
+    try:
+        with open("/proc/self/io") as f:
+            fields = dict(line.split(":", 1) for line in f if ":" in line)
+        return int(fields["rchar"]), int(fields["wchar"])
+    except (OSError, KeyError, ValueError):
+        return None
+
+SIGNATURE_GRID = 16
+SIGNATURE_BANDS = 16
+
+def compute_signature(img_path):
+    """Cheap tokens for candidate pruning: exact tile hashes plus LSH bands of a coarse thumbnail.
+
+    Only images with the same size and mode can be scored, so tokens are keyed by both.
+    """
+    try:
+        with Image.open(img_path) as img:
+            key = (img.size, img.mode)
+            rgb = np.asarray(img.convert('RGB'))
+            thumb = np.asarray(img.convert('L').resize((8, 8), Image.BOX)) // 32
+    except Exception:
+        return None
+    height, width = rgb.shape[:2]
+    tokens = set()
+    for ty in range(SIGNATURE_GRID):
+        y0, y1 = ty * height // SIGNATURE_GRID, (ty + 1) * height // SIGNATURE_GRID
+        for tx in range(SIGNATURE_GRID):
+            x0, x1 = tx * width // SIGNATURE_GRID, (tx + 1) * width // SIGNATURE_GRID
+            if y0 == y1 or x0 == x1:
+                continue
+            digest = hashlib.blake2b(np.ascontiguousarray(rgb[y0:y1, x0:x1]).tobytes(), digest_size=8).digest()
+            tokens.add((key, 't', ty * SIGNATURE_GRID + tx, digest))
+    cells = thumb.reshape(-1)
+    band_width = cells.size // SIGNATURE_BANDS
+    for band in range(SIGNATURE_BANDS):
+        tokens.add((key, 'b', band, cells[band * band_width:(band + 1) * band_width].tobytes()))
+    return key, tokens
+
+SIGNATURES_DIR = "signatures"  # one entry per encode or append, named after its first new image ID
+SIGNATURES_BACKFILL = "backfill-"  # prefix of the entry holding an append's signatures of older images
+SIGNATURES_MAGIC = b"DIAS"
+SIGNATURES_VERSION = 1
+
+def pack_signatures(signatures_by_id):
+    """Serializes {image ID: signature} so appends can pick candidates without decoding the archive.
+    Little-endian: magic, version, count, then per image its ID, width, height, mode and tokens."""
+    records = [(image_id, signature) for image_id, signature in signatures_by_id.items() if signature]
+    out = bytearray(SIGNATURES_MAGIC + struct.pack('<2I', SIGNATURES_VERSION, len(records)))
+    for image_id, ((size, mode), tokens) in sorted(records, key=lambda r: int(r[0])):
+        out += struct.pack('<3IB', int(image_id), size[0], size[1], len(mode)) + mode.encode('ascii')
+        out += struct.pack('<I', len(tokens))
+        for _, kind, position, data in sorted(tokens):
+            out += struct.pack('<cHB', kind.encode('ascii'), position, len(data)) + data
+    return bytes(out)
+
+def unpack_signatures(data):
+    """Inverse of pack_signatures; raises ValueError on anything it did not write."""
+    try:
+        magic, (version, count) = data[:4], struct.unpack_from('<2I', data, 4)
+        if magic != SIGNATURES_MAGIC or version != SIGNATURES_VERSION:
+            raise ValueError("not a version 1 signature table")
+        signatures, offset = {}, 12
+        for _ in range(count):
+            image_id, width, height, mode_len = struct.unpack_from('<3IB', data, offset)
+            offset += 13
+            key = ((width, height), data[offset:offset + mode_len].decode('ascii'))
+            n_tokens, = struct.unpack_from('<I', data, offset + mode_len)
+            offset += mode_len + 4
+            tokens = set()
+            for _ in range(n_tokens):
+                kind, position, length = struct.unpack_from('<cHB', data, offset)
+                tokens.add((key, kind.decode('ascii'), position, data[offset + 4:offset + 4 + length]))
+                offset += 4 + length
+            signatures[str(image_id)] = (key, tokens)
+        return signatures
+    except (struct.error, UnicodeDecodeError) as e:
+        raise ValueError(f"truncated signature table: {e}") from None
+
+def compute_signatures(img_paths, workers):
+    with ThreadPoolExecutor(max_workers=workers) as executor:
+        return list(executor.map(compute_signature, img_paths))
+
+def select_candidate_pairs(input_dir, image_paths_rel, k, workers):
+    """Picks up to k likely partners per image by shared signature tokens. Returns sorted (i, j) index
+    pairs, i < j, and the signatures so they can be stored for later appends."""
+    signatures = compute_signatures((input_dir / p for p in image_paths_rel), workers)
+    return signature_pairs(signatures, k), signatures
+
+def signature_pairs(signatures, k, queries=None):
+    """Pairs each image in queries (default: all) with up to k others by shared signature tokens."""
+    queries = set(range(len(signatures))) if queries is None else set(queries)
+    index = collections.defaultdict(list)
+    for i, signature in enumerate(signatures):
+        if signature:
+            for token in signature[1]:
+                index[token].append(i)
+    # Tokens shared by a large share of the collection (flat backgrounds) say nothing and cost quadratic time
+    max_posting = max(256, 8 * k)
+
+    pairs = set()
+    previous_by_key = {}
+    for i, signature in enumerate(signatures):
+        if not signature:
+            continue
+        previous = previous_by_key.get(signature[0])
+        previous_by_key[signature[0]] = i
+        if i not in queries:
+            continue
+        shared = collections.Counter()
+        for token in signature[1]:
+            posting = index[token]
+            if len(posting) <= max_posting:
+                shared.update(posting)
+        del shared[i]
+        for j, _ in shared.most_common(k):
+            pairs.add((min(i, j), max(i, j)))
+        # Sequence neighbours are the usual best match, so they are always candidates
+        if previous is not None:
+            pairs.add((previous, i))
+    return sorted(pairs)
+
+def score_pairs_python(input_dir, image_paths_rel, path_to_id, workers, pairs=None, edge_weight="pixels"):
+    score_pair = calculate_delta_cost if edge_weight == "bytes" else calculate_similarity_score
+    if pairs is None:
+        all_pairs = list(combinations(image_paths_rel, 2))
+    else:
+        all_pairs = [(image_paths_rel[i], image_paths_rel[j]) for i, j in pairs]
+    all_scores = []
+    with ThreadPoolExecutor(max_workers=workers) as executor:
+        future_to_pair = {executor.submit(score_pair, input_dir / p[0], input_dir / p[1]): p for p in all_pairs}
+        for i, future in enumerate(as_completed(future_to_pair), 1):
+            pair = future_to_pair[future]
+            try:
+                score = future.result()
+                if score != -1:
+                    id1, id2 = path_to_id[pair[0]], path_to_id[pair[1]]
+                    all_scores.append((score, id1, id2))
+            except Exception as e:
+                print(f"\nError scoring pair {pair}: {e}")
+            print_progress_bar(i, len(all_pairs), prefix='Phase 1/2:', suffix='Scoring Pairs')
+    return all_scores
+
+def score_pairs_native(dia_tool, input_dir, image_paths_rel, workers, pairs=None, edge_weight="pixels"):
+    """Runs `dia score`, which decodes each image once; IDs are positions in image_paths_rel."""
+    command = [dia_tool, "score", "-j", str(workers)] + (["--metric=bytes"] if edge_weight == "bytes" else [])
+    if pairs is None:
+        return run_native_scorer(command, input_dir, image_paths_rel)
+    with tempfile.NamedTemporaryFile('w', suffix=".pairs") as pairs_file:
+        pairs_file.writelines(f"{i} {j}\n" for i, j in pairs)
+        pairs_file.flush()
+        return run_native_scorer(command + [f"--pairs={pairs_file.name}"], input_dir, image_paths_rel)
+
+def run_native_scorer(command, input_dir, image_paths_rel):
+    paths = "".join(f"{input_dir / p}\n" for p in image_paths_rel)
+    proc = subprocess.Popen(command, stdin=subprocess.PIPE, stdout=subprocess.PIPE, text=True)
+    # Feed the list from a thread so a large edge list cannot deadlock against a full stdin pipe
+    with ThreadPoolExecutor(max_workers=1) as feeder:
+        def feed():
+            proc.stdin.write(paths)
+            proc.stdin.close()
+        feeding = feeder.submit(feed)
+        all_scores = []
+        for line in proc.stdout:
+            score, id1, id2 = line.split("\t")
+            all_scores.append((int(score), id1, id2.strip()))
+        feeding.result()
+    if proc.wait() != 0:
+        raise RuntimeError(f"'{' '.join(command[:2])}' exited with status {proc.returncode}")
+    return all_scores
+
+def choose_centroid_root(component_node_ids, adjacency_list, file_size):
+    """Node with the smallest total chain length to every other node, i.e. the lowest mean decode cost."""
+    start = component_node_ids[0]
+    order, parent = [start], {start: None}
+    for node_id in order:
+        for neighbor_id in adjacency_list[node_id]:
+            if neighbor_id not in parent:
+                parent[neighbor_id] = node_id
+                order.append(neighbor_id)
+    subtree = {node_id: 1 for node_id in order}
+    depth = {start: 0}
+    for node_id in order[1:]:
+        depth[node_id] = depth[parent[node_id]] + 1
+    for node_id in reversed(order[1:]):
+        subtree[parent[node_id]] += subtree[node_id]
+    # Moving the root across an edge brings that subtree one step closer and everything else one step further
+    total = {start: sum(depth.values())}
+    for node_id in order[1:]:
+        total[node_id] = total[parent[node_id]] + len(order) - 2 * subtree[node_id]
+    return min(order, key=lambda nid: (total[nid], file_size(nid)))
+
+STANDALONE = "standalone"  # virtual node of the "bytes" forests; an edge to it stores an image whole
+
+def forest_edges(all_scores, edge_weight, node_ids, file_size):
+    """Scored pairs in the order Kruskal takes them. Identical pixel counts go highest first. With
+    "bytes" edge weights, estimated delta sizes go lowest first, mixed with an edge from every
+    image in node_ids to STANDALONE weighted by its file size. The forest walks never follow those,
+    so an image only joins a tree through a delta estimated to be smaller than its file."""
+    if edge_weight != "bytes":
+        return sorted(all_scores, key=lambda x: x[0], reverse=True)
+    return sorted([(file_size(nid), nid, STANDALONE) for nid in node_ids] + list(all_scores), key=lambda x: x[0])
+
+def build_spanning_forest(all_scores, id_to_path, input_dir, root_strategy="size", max_depth=0, edge_weight="pixels"):
+    """Maximum spanning forest over the scored pairs, or with "bytes" edge weights the minimum one
+    over estimated delta sizes, where images are stored whole when that is cheaper.
+
+    Each tree is rooted at its smallest source file ("size") or at the node with the lowest mean
+    chain length ("centroid"). With max_depth, the fewest nodes needed to keep every chain within
+    the cap are promoted to stored full images.
+    """
+    file_size = lambda nid: (input_dir / id_to_path[nid]).stat().st_size
+    dsu = DisjointSetUnion(list(id_to_path.keys()) + [STANDALONE])
+    adjacency_list = collections.defaultdict(list)
+    for score, u_id, v_id in forest_edges(all_scores, edge_weight, id_to_path.keys(), file_size):
+        if dsu.union(u_id, v_id) and v_id != STANDALONE:
+            adjacency_list[u_id].append(v_id)
+            adjacency_list[v_id].append(u_id)
+
+    root_image_ids, dependencies_by_id, visited_ids = [], {}, set()
+    for image_id in id_to_path.keys():
+        if image_id not in visited_ids:
+            component_node_ids, q = [], collections.deque([image_id])
+            component_visited_ids = {image_id}
+            while q:
+                node_id = q.popleft()
+                component_node_ids.append(node_id)
+                for neighbor_id in adjacency_list[node_id]:
+                    if neighbor_id not in component_visited_ids:
+                        component_visited_ids.add(neighbor_id)
+                        q.append(neighbor_id)
+            if root_strategy == "centroid":
+                optimal_root_id = choose_centroid_root(component_node_ids, adjacency_list, file_size)
+            else:
+                optimal_root_id = min(component_node_ids, key=file_size)
+            root_image_ids.append(optimal_root_id)
+            q = collections.deque([optimal_root_id])
+            visited_ids.add(optimal_root_id)
+            tree_order = [optimal_root_id]
+            while q:
+                parent_id = q.popleft()
+                for child_id in adjacency_list[parent_id]:
+                    if child_id not in visited_ids:
+                        visited_ids.add(child_id)
+                        dependencies_by_id[child_id] = parent_id
+                        tree_order.append(child_id)
+                        q.append(child_id)
+            if max_depth > 0:
+                # Bottom-up: a node whose kept subtree is already max_depth deep is cut loose as a new root
+                height = collections.defaultdict(int)
+                for node_id in reversed(tree_order[1:]):
+                    if height[node_id] >= max_depth:
+                        del dependencies_by_id[node_id]
+                        root_image_ids.append(node_id)
+                    else:
+                        parent_id = dependencies_by_id[node_id]
+                        height[parent_id] = max(height[parent_id], height[node_id] + 1)
+    return root_image_ids, dependencies_by_id
+
+def attach_new_images(all_scores, new_ids, existing_depths, file_size, max_depth=0, edge_weight="pixels"):
+    """Maximum spanning forest over the scored pairs with every existing image contracted into one
+    node, so existing chains stay as they are. A new image joins the tree through its best edge
+    to an existing image or another new one; new images that reach neither become roots at their
+    smallest file. Chains longer than max_depth are cut into new roots. With "bytes" edge weights,
+    storing a new image whole is one more edge into the contracted node, as in build_spanning_forest()."""
+    existing = "existing"
+    dsu = DisjointSetUnion(list(new_ids) + [existing])
+    adjacency_list = collections.defaultdict(list)
+    contract = lambda nid: existing if nid in existing_depths or nid == STANDALONE else nid
+    for score, u_id, v_id in forest_edges(all_scores, edge_weight, new_ids, file_size):
+        if dsu.union(contract(u_id), contract(v_id)) and v_id != STANDALONE:
+            adjacency_list[u_id].append(v_id)
+            adjacency_list[v_id].append(u_id)
+
+    # Existing endpoints seed the walk, so each new image hangs below the side it was joined from
+    seeds = [(u_id, existing_depths[u_id]) for u_id in list(adjacency_list) if u_id in existing_depths]
+    root_image_ids, dependencies_by_id, depth = [], {}, {}
+    def walk(start_id, start_depth):
+        q = collections.deque([start_id])
+        depth[start_id] = start_depth
+        while q:
+            parent_id = q.popleft()
+            for child_id in adjacency_list[parent_id]:
+                if child_id in depth or child_id in existing_depths:
+                    continue
+                if max_depth > 0 and depth[parent_id] >= max_depth:
+                    root_image_ids.append(child_id)
+                    depth[child_id] = 0
+                else:
+                    dependencies_by_id[child_id] = parent_id
+                    depth[child_id] = depth[parent_id] + 1
+                q.append(child_id)
+    for existing_id, existing_depth in seeds:
+        walk(existing_id, existing_depth)
+    for new_id in sorted(new_ids, key=int):
+        if new_id in depth:
+            continue
+        component, q = [new_id], collections.deque([new_id])
+        seen = {new_id}
+        while q:
+            for neighbor_id in adjacency_list[q.popleft()]:
+                if neighbor_id not in seen:
+                    seen.add(neighbor_id)
+                    component.append(neighbor_id)
+                    q.append(neighbor_id)
+        root_id = min(component, key=file_size)
+        root_image_ids.append(root_id)
+        walk(root_id, 0)
+    return root_image_ids, dependencies_by_id
+
+def chain_depths(root_image_ids, dependencies_by_id):
+    """Number of deltas applied on top of the root to reconstruct each image."""
+    depth = {root_id: 0 for root_id in root_image_ids}
+    def resolve(image_id):
+        chain = []
+        while image_id not in depth:
+            chain.append(image_id)
+            image_id = dependencies_by_id[image_id]
+        for node_id in reversed(chain):
+            depth[node_id] = depth[dependencies_by_id[node_id]] + 1
+    for image_id in dependencies_by_id:
+        resolve(image_id)
+    return depth
+
+def report_tree_shaping(all_scores, root_image_ids, dependencies_by_id, id_to_path, input_dir, root_strategy, max_depth,
+                        edge_weight="pixels"):
+    """Prints what bounding chain depth cost in stored full images against the default size-rooted forest."""
+    baseline_roots, baseline_deps = build_spanning_forest(list(all_scores), id_to_path, input_dir, edge_weight=edge_weight)
+    root_bytes = lambda roots: sum((input_dir / id_to_path[r]).stat().st_size for r in roots)
+    before = chain_depths(baseline_roots, baseline_deps).values()
+    after = chain_depths(root_image_ids, dependencies_by_id).values()
+    cap = f"max depth {max_depth}" if max_depth else "no depth cap"
+    print(f"Tree shaping ({root_strategy} roots, {cap}): worst-case chain {max(before)} -> {max(after)}, "
+          f"mean {sum(before) / len(before):.2f} -> {sum(after) / len(after):.2f}; "
+          f"roots {len(baseline_roots)} -> {len(root_image_ids)}, "
+          f"full images {root_bytes(baseline_roots) / 2**20:.2f} -> {root_bytes(root_image_ids) / 2**20:.2f} MiB")
+
+def report_pruning_loss(pruned_scores, exhaustive_scores, root_image_ids, dependencies_by_id, id_to_path, input_dir,
+                        root_strategy="size", max_depth=0, edge_weight="pixels"):
+    """Compares the pruned forest with the exhaustive one by pixels that must be stored (roots whole, children as
+    deltas), or with "bytes" edge weights by estimated bytes (root files plus estimated deltas)."""
+    score_by_pair = {(min(u, v), max(u, v)): score for score, u, v in exhaustive_scores}
+    size = {}
+    for img_id, rel_path in id_to_path.items():
+        if edge_weight == "bytes":
+            size[img_id] = (input_dir / rel_path).stat().st_size
+        else:
+            with Image.open(input_dir / rel_path) as img:
+                size[img_id] = img.size[0] * img.size[1]
+
+    def stored_cost(roots, dependencies):
+        total = sum(size[r] for r in roots)
+        for child_id, parent_id in dependencies.items():
+            score = score_by_pair[(min(child_id, parent_id), max(child_id, parent_id))]
+            total += score if edge_weight == "bytes" else size[child_id] - score
+        return total
+
+    exhaustive_roots, exhaustive_deps = build_spanning_forest(list(exhaustive_scores), id_to_path, input_dir,
+                                                              root_strategy, max_depth, edge_weight)
+    exhaustive_cost = stored_cost(exhaustive_roots, exhaustive_deps)
+    pruned_cost = stored_cost(root_image_ids, dependencies_by_id)
+    loss = 100 * (pruned_cost - exhaustive_cost) / exhaustive_cost if exhaustive_cost else 0.0
+    print(f"Candidate pruning scored {len(pruned_scores)} of {len(exhaustive_scores)} comparable pairs "
+          f"({100 * len(pruned_scores) / max(1, len(exhaustive_scores)):.1f}%)")
+    unit = "Estimated bytes" if edge_weight == "bytes" else "Changed pixels"
+    print(f"{unit} to store: exhaustive {exhaustive_cost} ({len(exhaustive_roots)} roots), "
+          f"pruned {pruned_cost} ({len(root_image_ids)} roots), {loss:+.2f}%")
+
+DELTA_TILE_CELL = 64
+MAX_DELTA_TILES = 64
+
+def find_delta_tiles(changed):
+    """Tight (x0, y0, x1, y1) boxes around the changed pixels, one per 8-connected group of DELTA_TILE_CELL cells."""
+    height, width = changed.shape
+    grid_h, grid_w = -(-height // DELTA_TILE_CELL), -(-width // DELTA_TILE_CELL)
+    padded = np.zeros((grid_h * DELTA_TILE_CELL, grid_w * DELTA_TILE_CELL), dtype=bool)
+    padded[:height, :width] = changed
+    grid = padded.reshape(grid_h, DELTA_TILE_CELL, grid_w, DELTA_TILE_CELL).any(axis=(1, 3))
+    del padded
+
+    boxes, seen = [], np.zeros_like(grid)
+    for start in zip(*np.nonzero(grid)):
+        if seen[start]:
+            continue
+        seen[start] = True
+        q, cells = collections.deque([start]), []
+        while q:
+            gy, gx = q.popleft()
+            cells.append((gy, gx))
+            for ny in range(max(0, gy - 1), min(grid_h, gy + 2)):
+                for nx in range(max(0, gx - 1), min(grid_w, gx + 2)):
+                    if grid[ny, nx] and not seen[ny, nx]:
+                        seen[ny, nx] = True
+                        q.append((ny, nx))
+        y0 = min(c[0] for c in cells) * DELTA_TILE_CELL
+        y1 = min(height, (max(c[0] for c in cells) + 1) * DELTA_TILE_CELL)
+        x0 = min(c[1] for c in cells) * DELTA_TILE_CELL
+        x1 = min(width, (max(c[1] for c in cells) + 1) * DELTA_TILE_CELL)
+        region = changed[y0:y1, x0:x1]
+        rows, cols = np.flatnonzero(region.any(axis=1)), np.flatnonzero(region.any(axis=0))
+        boxes.append((x0 + cols[0], y0 + rows[0], x0 + cols[-1] + 1, y0 + rows[-1] + 1))
+
+    # Many scattered groups cost more in per-file overhead than one box around all of them
+    if len(boxes) > 1:
+        union = (min(b[0] for b in boxes), min(b[1] for b in boxes), max(b[2] for b in boxes), max(b[3] for b in boxes))
+        union_area = (union[2] - union[0]) * (union[3] - union[1])
+        if len(boxes) > MAX_DELTA_TILES or sum((b[2] - b[0]) * (b[3] - b[1]) for b in boxes) >= 0.9 * union_area:
+            boxes = [union]
+    return [tuple(int(v) for v in b) for b in boxes]
+
+def process_root(img_path, rel_path, alpha_rel=None, level=OXIPNG_LEVEL):
+    """Returns the archive entries of a root image: the source file unchanged, plus its alpha map."""
+    try:
+        entries = [(rel_path, img_path.read_bytes())]
+    except OSError as e:
+        print(f"\nError reading {img_path}: {e}")
+        return None
+    if alpha_rel is not None:
+        alpha = extract_alpha_png(img_path, level)
+        if alpha is not None:
+            entries.append((alpha_rel, alpha))
+    return entries
+
+def process_jpeg_image(dia_tool, current_img_path, base_img_path, rel_path):
+    """Encodes a JPEG as the coefficient blocks that differ from its parent's, with `dia jpeg-delta`;
+    the layout is documented in src/jpegcoef.c. Returns the single tile and its archive entry."""
+    result = subprocess.run([dia_tool, "jpeg-delta", str(base_img_path), str(current_img_path)], capture_output=True)
+    if result.returncode != 0:
+        print(f"\nError processing {os.path.basename(str(current_img_path))}: "
+              f"{result.stderr.decode(errors='replace').strip()}")
+        return None
+    tile_rel = (Path("tiles") / Path(rel_path).with_suffix(JPEG_DELTA_SUFFIX)).as_posix()
+    return [{"path": tile_rel, "x": 0, "y": 0}], [(tile_rel, result.stdout)]
+
+class PngDeltaCodec:
+    """Delta tiles as RGBA PNGs whose alpha marks the changed pixels."""
+    name, suffix = "png", ".png"
+
+    def __init__(self, level=OXIPNG_LEVEL):
+        self.level = level
+
+    def encode(self, tile):
+        height, width = tile.shape[:2]
+        raw = oxipng.RawImage(np.ascontiguousarray(tile).tobytes(), width, height, color_type=oxipng.ColorType.rgba())
+        return raw.create_optimized_png(level=self.level, optimize_alpha=True)
+
+ZMASK_MAGIC = b"DIAZ"
+ZMASK_VERSION = 1
+ZMASK_ZSTD_LEVEL = 12
+ZMASK_DICT_NAME = "zmask.dict"
+ZMASK_DICT_SIZE = 112640
+ZMASK_DICT_SAMPLE_IMAGES = 64
+
+class ZmaskDeltaCodec:
+    """Delta tiles as a change bitmap plus the RGB of the changed pixels, in one zstd frame; the
+    layout is documented in src/zmask.c. The viewer decodes them straight into the canvas."""
+    name, suffix = "zmask", ".zmask"
+
+    def __init__(self, dictionary=None, level=ZMASK_ZSTD_LEVEL):
+        self.dictionary, self.level = dictionary, level
+        self.local = threading.local()  # compressors are not thread-safe
+
+    # Phase 2 workers get a copy of the codec; compressors are rebuilt on their side
+    def __getstate__(self):
+        return self.dictionary.as_bytes() if self.dictionary else None, self.level
+
+    def __setstate__(self, state):
+        dictionary, level = state
+        self.__init__(zstandard.ZstdCompressionDict(dictionary) if dictionary else None, level)
+
+    @staticmethod
+    def payload(tile):
+        changed = tile[:, :, 3] != 0
+        mask = np.packbits(changed, axis=1, bitorder='little')
+        return mask.tobytes() + tile[changed][:, :3].tobytes(), int(np.count_nonzero(changed))
+
+    def encode(self, tile):
+        compressor = getattr(self.local, "compressor", None)
+        if compressor is None:
+            compressor = self.local.compressor = zstandard.ZstdCompressor(level=self.level, dict_data=self.dictionary)
+        payload, n_changed = self.payload(tile)
+        height, width = tile.shape[:2]
+        return ZMASK_MAGIC + struct.pack('<4I', ZMASK_VERSION, width, height, n_changed) + compressor.compress(payload)
+
+class ZmaskSampleCodec(ZmaskDeltaCodec):
+    """Returns uncompressed payloads, used as dictionary training samples."""
+    def encode(self, tile):
+        return self.payload(tile)[0]
+
+def train_zmask_dictionary(input_dir, id_to_path, dependencies_by_id, workers):
+    """Trains a zstd dictionary on the deltas of evenly spaced images; None if there is too little data."""
+    dependents = sorted(dependencies_by_id, key=int)
+    step = max(1, len(dependents) // ZMASK_DICT_SAMPLE_IMAGES)
+    sampler = ZmaskSampleCodec()
+    samples = []
+    with ThreadPoolExecutor(max_workers=workers) as executor:
+        futures = [executor.submit(process_family, input_dir / id_to_path[dependencies_by_id[cid]],
+                                   [(cid, input_dir / id_to_path[cid], id_to_path[cid], None, False)], sampler)
+                   for cid in dependents[::step]]
+        for future in futures:
+            for _, result in future.result():
+                if result is not None:
+                    samples.extend(data for _, data in result[1])
+    try:
+        return zstandard.train_dictionary(ZMASK_DICT_SIZE, samples, level=ZMASK_ZSTD_LEVEL)
+    except zstandard.ZstdError as e:
+        print(f"Warning: not using a zmask dictionary ({len(samples)} samples): {e}")
+        return None
+
+def decode_pixels(img_path, with_alpha=False):
+    """Decodes an image once for every delta that uses it: an RGB array, plus with with_alpha its
+    alpha array (None for images without transparency)."""
+    with Image.open(img_path) as img:
+        alpha = alpha_channel(img) if with_alpha else None
+        return np.asarray(img.convert('RGB')), alpha
+
+def process_image(current_img_path, base_pixels, rel_path, alpha_rel=None, codec=PngDeltaCodec(), alpha_delta=False,
+                  level=OXIPNG_LEVEL):
+    """Encodes the delta against base_pixels, from decode_pixels(), as cropped tiles; returns their
+    map entries and the archive entries to store, or None on failure. alpha_rel receives the full
+    alpha map, or with alpha_delta the alpha delta against base, which is left out when the tiles
+    already predict the alpha."""
+    try:
+        base_rgb, base_alpha = base_pixels
+        current_rgb, alpha = decode_pixels(current_img_path, alpha_rel is not None)
+        if current_rgb.shape != base_rgb.shape:
+            raise ValueError(f"{current_rgb.shape[1]}x{current_rgb.shape[0]} does not match its parent's "
+                             f"{base_rgb.shape[1]}x{base_rgb.shape[0]}")
+        entries = []
+        if alpha_rel is not None and not alpha_delta:
+            entries.append((alpha_rel, encode_alpha_png(np.full(current_rgb.shape[:2], 255, np.uint8) if alpha is None else alpha, level)))
+        # Compared per channel, so a change of one level in any channel is kept
+        changed = np.any(current_rgb != base_rgb, axis=2)
+        tiles = []
+        for n, (x0, y0, x1, y1) in enumerate(find_delta_tiles(changed)):
+            tile = np.dstack([current_rgb[y0:y1, x0:x1], np.where(changed[y0:y1, x0:x1], np.uint8(255), np.uint8(0))])
+            tile_rel = (Path("tiles") / Path(rel_path).with_suffix(f".{n}{codec.suffix}")).as_posix()
+            entries.append((tile_rel, codec.encode(tile)))
+            tiles.append({"path": tile_rel, "x": x0, "y": y0})
+        delta = encode_alpha_delta(alpha, base_alpha, changed, level) if alpha_delta and alpha_rel is not None else None
+        if delta is not None:
+            entries.append((alpha_rel, delta))
+        return tiles, entries
     except Exception as e:
-        gc.collect()
         exc_type, exc_obj, exc_tb = sys.exc_info()
         fname = os.path.split(exc_tb.tb_frame.f_code.co_filename)[1]
         print(f"\nException: {exc_type} in {fname} at line {exc_tb.tb_lineno}")
         print(f"Error processing {os.path.basename(str(current_img_path))}: {e}")
-        return False
+        return None
+
+FAMILY_BATCH = 8  # children per Phase 2 task; wider families decode their parent once per batch to spread over workers
+
+def process_family(parent_img_path, children, codec=PngDeltaCodec(), alpha_delta=False, level=OXIPNG_LEVEL, dia_tool=None):
+    """Encodes some children of one parent, which is decoded once for all of them. children are
+    (image_id, img_path, rel_path, alpha_rel, is_jpeg); returns (image_id, result) pairs with the
+    result of process_image() or process_jpeg_image()."""
+    base_pixels, results = None, []
+    for image_id, img_path, rel_path, alpha_rel, is_jpeg in children:
+        if is_jpeg:
+            results.append((image_id, process_jpeg_image(dia_tool, img_path, parent_img_path, rel_path)))
+            continue
+        if base_pixels is None:
+            try:
+                base_pixels = decode_pixels(parent_img_path, alpha_delta)
+            except Exception as e:
+                print(f"\nError decoding {os.path.basename(str(parent_img_path))}: {e}")
+                return [(child[0], None) for child in children]
+        results.append((image_id, process_image(img_path, base_pixels, rel_path, alpha_rel, codec, alpha_delta, level)))
+    return results
+
+PREVIEW_SIZES = (256, 1280)  # longest side of each stored rendition; images only get the ones they exceed
+PREVIEW_JPEG_QUALITY = 85
+
+def make_previews(img_path, rel_path):
+    """Encodes independently decodable downscales of one image; returns their map entries, smallest
+    first, and the archive entries to store."""
+    try:
+        previews, entries = [], []
+        with Image.open(img_path) as img:
+            has_alpha = image_has_alpha(img_path)
+            img = img.convert('RGBA' if has_alpha else 'RGB')
+            # Each level is reduced from the one above it, so the full image is resampled once
+            for size in sorted(PREVIEW_SIZES, reverse=True):
+                if max(img.size) <= size:
+                    continue
+                img.thumbnail((size, size), Image.LANCZOS)
+                suffix = ".png" if has_alpha else ".jpg"
+                preview_rel = (Path("previews") / str(size) / Path(rel_path).with_suffix(suffix)).as_posix()
+                buffer = io.BytesIO()
+                if has_alpha:
+                    img.save(buffer, "PNG", optimize=True)
+                else:
+                    img.save(buffer, "JPEG", quality=PREVIEW_JPEG_QUALITY, optimize=True)
+                previews.append({"path": preview_rel, "size": max(img.size)})
+                entries.append((preview_rel, buffer.getvalue()))
+        return previews[::-1], entries[::-1]
+    except Exception as e:
+        print(f"\nError saving previews for {os.path.basename(str(img_path))}: {e}")
+        return [], []
+
+MAP_NAME = "optimization_map.json"
+BINARY_INDEX_NAME = "optimization_map.bin"
+BINARY_INDEX_MAGIC = 0x58414944  # "DIAX"
+BINARY_INDEX_VERSION = 3  # 2 is written for archives that keep full alpha maps; the layout is the same
+BINARY_INDEX_NONE = 0xFFFFFFFF
+ZIP_ALIGN_EXTRA_ID = 0xD935  # same padding field zipalign uses
+ZIP_DATE_TIME = (1980, 1, 1, 0, 0, 0)  # fixed, so the same input always yields the same archive
+
+def map_in_order(executor, jobs, window, budget=None):
+    """Runs (fn, args, key) jobs on executor and yields (key, result) in submission order, keeping at
+    most window jobs submitted but not yet consumed. A job may carry its memory estimate as a fourth
+    element; with a budget, it is only submitted once the estimates of the unconsumed jobs before it
+    leave room, though one job always runs."""
+    pending, held = collections.deque(), 0
+    for fn, fn_args, key, *cost in jobs:
+        cost = cost[0] if cost else 0
+        while pending and (len(pending) >= window or (budget is not None and held + cost > budget)):
+            done_key, future, done_cost = pending.popleft()
+            held -= done_cost
+            yield done_key, future.result()
+        pending.append((key, executor.submit(fn, *fn_args), cost))
+        held += cost
+    while pending:
+        key, future, _ = pending.popleft()
+        yield key, future.result()
+
+def build_binary_index(id_to_path, root_image_ids, dependencies_by_id, alpha_map, delta_tiles, previews, entry_of,
+                       version=BINARY_INDEX_VERSION):
+    """Serializes the map into the little-endian layout documented in src/dia.h; image i must have ID "i"."""
+    pool, pool_offsets = bytearray(), {}
+    def intern(text):
+        if text not in pool_offsets:
+            pool_offsets[text] = len(pool)
+            pool.extend(text.encode('utf-8') + b'\0')
+        return pool_offsets[text]
+
+    n_images = len(id_to_path)
+    depths = chain_depths(root_image_ids, dependencies_by_id)
+    children = collections.defaultdict(list)
+    for child_id, parent_id in dependencies_by_id.items():
+        children[int(parent_id)].append(int(child_id))
+
+    images, child_list, tiles, preview_records = bytearray(), [], bytearray(), bytearray()
+    n_tiles = n_previews = 0
+    for i in range(n_images):
+        image_id, rel_path = str(i), id_to_path[str(i)]
+        alpha_path = alpha_map.get(image_id)
+        parent_id = dependencies_by_id.get(image_id)
+        kids = sorted(children[i])
+        tile_list = delta_tiles.get(image_id)
+        preview_list = previews.get(image_id)
+        images += struct.pack('<12I', intern(image_id), intern(rel_path), entry_of.get(rel_path, BINARY_INDEX_NONE),
+                              int(parent_id) if parent_id is not None else BINARY_INDEX_NONE,
+                              intern(alpha_path) if alpha_path else BINARY_INDEX_NONE,
+                              entry_of.get(alpha_path, BINARY_INDEX_NONE) if alpha_path else BINARY_INDEX_NONE,
+                              depths.get(image_id, 0), len(child_list), len(kids),
+                              n_tiles, len(tile_list) if tile_list is not None else BINARY_INDEX_NONE,
+                              n_previews if preview_list else BINARY_INDEX_NONE)
+        child_list.extend(kids)
+        for tile in tile_list or ():
+            tiles += struct.pack('<IIii', intern(tile["path"]), entry_of.get(tile["path"], BINARY_INDEX_NONE), tile["x"], tile["y"])
+            n_tiles += 1
+        for preview in preview_list or ():
+            preview_records += struct.pack('<4I', i, preview["size"], intern(preview["path"]),
+                                           entry_of.get(preview["path"], BINARY_INDEX_NONE))
+            n_previews += 1
+
+    roots = sorted(int(r) for r in root_image_ids)
+    header = struct.pack('<8I', BINARY_INDEX_MAGIC, version, n_images, len(roots), len(child_list),
+                         n_tiles, len(pool), n_previews)
+    return b''.join([header, bytes(images), struct.pack(f'<{len(roots)}I', *roots),
+                     struct.pack(f'<{len(child_list)}I', *child_list), bytes(tiles), bytes(preview_records), bytes(pool)])
+
+def write_stored_aligned(zipf, arcname, data, alignment=8):
+    """Stores data uncompressed with its first byte aligned in the file, so readers can use it in place."""
+    info = zipfile.ZipInfo(arcname, date_time=ZIP_DATE_TIME)
+    info.compress_type = zipfile.ZIP_STORED
+    data_offset = zipf.fp.tell() + 30 + len(arcname.encode('utf-8')) + 4
+    padding = -data_offset % alignment
+    info.extra = struct.pack('<HH', ZIP_ALIGN_EXTRA_ID, padding) + b'\0' * padding
+    zipf.writestr(info, data)
+
+def write_central_directory(f, infos, comment=b''):
+    """Writes the central directory of infos and its end record at the position of f, the way
+    zipfile closes an archive, so zipfile can open what precedes it again. Zip64 records are added
+    when the entry count, an offset or a size does not fit the classic fields."""
+    start = f.tell()
+    for info in infos:
+        overflow = [v for v in (info.file_size, info.compress_size, info.header_offset) if v >= 0xFFFFFFFF]
+        extra = info.extra
+        while len(extra) >= 4:  # drop a zip64 field read from the old directory; it is rebuilt below
+            field_id, size = struct.unpack_from('<HH', extra)
+            if field_id != 1:
+                break
+            extra = extra[4 + size:]
+        extract_version = info.extract_version
+        if overflow:
+            extra = struct.pack(f'<HH{len(overflow)}Q', 1, 8 * len(overflow), *overflow) + extra
+            extract_version = max(extract_version, 45)
+        filename = info.filename.encode('utf-8' if info.flag_bits & 0x800 else 'cp437')
+        year, month, day, hour, minute, second = info.date_time
+        f.write(struct.pack('<4s4B4HL2L5H2L', b'PK\x01\x02', info.create_version, info.create_system,
+                            extract_version, info.reserved, info.flag_bits, info.compress_type,
+                            hour << 11 | minute << 5 | second // 2, (year - 1980) << 9 | month << 5 | day,
+                            info.CRC, min(info.compress_size, 0xFFFFFFFF), min(info.file_size, 0xFFFFFFFF),
+                            len(filename), len(extra), len(info.comment), 0, info.internal_attr,
+                            info.external_attr, min(info.header_offset, 0xFFFFFFFF)))
+        f.write(filename + extra + info.comment)
+    end = f.tell()
+    count, size = len(infos), end - start
+    if count >= 0xFFFF or start >= 0xFFFFFFFF or size >= 0xFFFFFFFF:
+        f.write(struct.pack('<4sQ2H2L4Q', b'PK\x06\x06', 44, 45, 45, 0, 0, count, count, size, start))
+        f.write(struct.pack('<4sLQL', b'PK\x06\x07', 0, end, 1))
+    f.write(struct.pack('<4s4H2LH', b'PK\x05\x06', 0, 0, min(count, 0xFFFF), min(count, 0xFFFF),
+                        min(size, 0xFFFFFFFF), min(start, 0xFFFFFFFF), len(comment)))
+    f.write(comment)
+
+def scan_images(input_dir, skip=()):
+    """Relative paths of the images under input_dir, minus skip, in ID order, and the layouts of
+    the JPEGs among them."""
+    print("Scanning for images recursively...")
+    all_image_paths_abs = [p for p in input_dir.rglob('**/*') if p.is_file() and p.suffix.lower() in IMAGE_EXTENSIONS]
+    image_paths_rel = [str(p.relative_to(input_dir)) for p in all_image_paths_abs]
+    image_paths_rel = [p for p in image_paths_rel if p not in skip]
+    jpeg_layout_by_path = {}
+    for rel_path in image_paths_rel:
+        if Path(rel_path).suffix.lower() in JPEG_EXTENSIONS:
+            jpeg_layout_by_path[rel_path] = jpeg_layout(input_dir / rel_path)
+            if jpeg_layout_by_path[rel_path] is None:
+                print(f"Warning: skipping {rel_path}: not an 8-bit grayscale or colour JPEG")
+    image_paths_rel = [p for p in image_paths_rel if p not in jpeg_layout_by_path or jpeg_layout_by_path[p]]
+    try:
+        image_paths_rel.sort(key=lambda f: int(Path(f).stem))
+    except (ValueError, IndexError):
+        image_paths_rel.sort()
+    return image_paths_rel, {p: layout for p, layout in jpeg_layout_by_path.items() if layout}
+
+def write_index_and_map(zipf, map_data, entry_of):
+    """The index and map describe every entry before them, so they close the archive."""
+    version = BINARY_INDEX_VERSION if map_data.get("alpha_encoding") == "delta" else 2
+    binary_index = build_binary_index(map_data["image_map"], map_data["root_images"], map_data["dependencies"],
+                                      map_data["alpha_map"], map_data["delta_tiles"], map_data["previews"], entry_of, version)
+    write_stored_aligned(zipf, BINARY_INDEX_NAME, binary_index)
+    map_info = zipfile.ZipInfo(MAP_NAME, date_time=ZIP_DATE_TIME)
+    map_info.compress_type = zipfile.ZIP_DEFLATED
+    zipf.writestr(map_info, json.dumps(map_data, indent=2, sort_keys=True, ensure_ascii=False))
+
+# Peak worker memory per pixel of the image, measured at 12 MP with every pixel changed
+PHASE2_BYTES_PER_PIXEL = 34  # a family task: parent and child arrays, masks, tiles and the codec's working copies
+PHASE2_BYTES_PER_CHILD_PIXEL = 4  # plus each child's encoded tiles, held until the task returns
+PHASE2_ROOT_BYTES_PER_PIXEL = 14  # a root task: the source file, and its decode when it has an alpha map
+
+def image_pixels(img_path):
+    try:
+        with Image.open(img_path) as img:
+            return img.width * img.height
+    except Exception:
+        return 0
+
+def encode_images(image_ids, id_to_path, source_of, dependencies_by_id, alpha_map, jpeg_layouts, codec, dia_tool, store,
+                  workers=1, memory_budget=None, level=OXIPNG_LEVEL, demote=True):
+    """Phase 2: stores each image as a root or as delta tiles against its parent. Trees are walked
+    top-down, and each task covers one parent and up to FAMILY_BATCH of its children, so the parent
+    is decoded once for all of them. Tasks run in worker processes, started only while their
+    estimated memory fits memory_budget; entries are stored in task order, which is fixed.
+    alpha_map lists the full alpha maps to store; None delta-codes alpha along the tree instead,
+    so roots carry their own and only children whose alpha the tiles do not predict get an entry.
+    With demote, a child whose delta comes out larger than its source file is stored whole instead;
+    its own children are unaffected, since they were cut against its pixels either way.
+    Returns the delta tiles and the alpha entries by image ID, and the children stored whole,
+    which the caller turns into roots."""
+    processed_count = 0
+    print_progress_bar(processed_count, len(image_ids), prefix='Phase 2/2:', suffix='Processing')
+    alpha_delta = alpha_map is None
+    delta_tiles, alpha_entries, demoted = {}, {}, []
+    wanted = set(image_ids)
+    children = collections.defaultdict(list)
+    for image_id in sorted(wanted, key=int):
+        if image_id in dependencies_by_id:
+            children[dependencies_by_id[image_id]].append(image_id)
+    def alpha_rel_of(image_id):
+        if not alpha_delta:
+            return alpha_map.get(image_id)
+        if image_id not in dependencies_by_id or image_id in jpeg_layouts:
+            return None
+        return (Path("alpha") / Path(id_to_path[image_id]).with_suffix(ALPHA_DELTA_SUFFIX)).as_posix()
+    def jobs():
+        # When appending, existing parents of new images start walks of their own
+        pending = collections.deque(sorted({i for i in wanted if i not in dependencies_by_id} | (children.keys() - wanted), key=int))
+        while pending:
+            image_id = pending.popleft()
+            if image_id in wanted and image_id not in dependencies_by_id:
+                yield (process_root, (source_of[image_id], id_to_path[image_id], alpha_rel_of(image_id), level), image_id,
+                       image_pixels(source_of[image_id]) * PHASE2_ROOT_BYTES_PER_PIXEL)
+            kids = children[image_id]
+            pixels = image_pixels(source_of[image_id]) if kids else 0
+            for start in range(0, len(kids), FAMILY_BATCH):
+                batch = [(cid, source_of[cid], id_to_path[cid], alpha_rel_of(cid), cid in jpeg_layouts)
+                         for cid in kids[start:start + FAMILY_BATCH]]
+                cost = pixels * (PHASE2_BYTES_PER_PIXEL + PHASE2_BYTES_PER_CHILD_PIXEL * len(batch))
+                yield process_family, (source_of[image_id], batch, codec, alpha_delta, level, dia_tool), None, cost
+            pending.extend(kids)
+    with ProcessPoolExecutor(max_workers=workers) as executor:
+        for key, result in map_in_order(executor, jobs(), 2 * workers, memory_budget):
+            # Root jobs are keyed by their image; family jobs report each child with its result
+            for image_id, entries in ([(key, result)] if key is not None else result):
+                processed_count += 1
+                print_progress_bar(processed_count, len(image_ids), prefix='Phase 2/2:', suffix='Processing')
+                if entries is None:
+                    continue
+                alpha_rel = alpha_rel_of(image_id)
+                if image_id in dependencies_by_id:
+                    tiles, entries = entries
+                    # Full alpha maps are stored for roots too, so only alpha deltas count against the file
+                    delta_bytes = sum(len(data) for name, data in entries if alpha_delta or name != alpha_rel)
+                    whole = None
+                    if demote and delta_bytes > source_of[image_id].stat().st_size:
+                        whole = process_root(source_of[image_id], id_to_path[image_id],
+                                             None if alpha_delta else alpha_rel, level)
+                    if whole is not None:
+                        demoted.append(image_id)
+                        entries = whole
+                    else:
+                        delta_tiles[image_id] = tiles
+                if alpha_rel is not None and any(name == alpha_rel for name, _ in entries):
+                    alpha_entries[image_id] = alpha_rel
+                store(entries)
+    if demoted:
+        print(f"\n{len(demoted)} images stored whole: their deltas came out larger than their files")
+    return delta_tiles, alpha_entries, demoted
+
+def write_previews(image_ids, id_to_path, source_of, workers, store):
+    """Previews are cut from the sources rather than the chain, so one decode shows any image."""
+    print("\nWriting previews...")
+    print_progress_bar(0, len(image_ids), prefix='Previews:', suffix='Processing')
+    previews = {}
+    jobs = ((make_previews, (source_of[i], id_to_path[i]), i) for i in image_ids)
+    with ThreadPoolExecutor(max_workers=workers) as executor:
+        for done, (image_id, (preview_list, entries)) in enumerate(map_in_order(executor, jobs, 2 * workers), 1):
+            if preview_list:
+                previews[image_id] = preview_list
+            store(entries)
+            print_progress_bar(done, len(image_ids), prefix='Previews:', suffix='Processing')
+    return previews
+
+def phase2_budget(args):
+    return args.memory_mb << 20 if args.memory_mb else None
+
+APPEND_CANDIDATES = 16  # existing partners scored per new image when --candidates is not given
+
+def append_to_archive(args, input_dir, archive_path):
+    """Adds the images under input_dir that the archive does not hold yet. Only the new images are
+    scored, against existing ones picked by the stored signatures, and only their entries plus a
+    new index and map are written, over the old index and map that close the archive."""
+    start_time = time.monotonic()
+    try:
+        with zipfile.ZipFile(archive_path) as archive:
+            names = archive.namelist()
+            if names[-2:] != [BINARY_INDEX_NAME, MAP_NAME]:
+                print(f"Error: '{archive_path}' does not end with its index and map; encode it again to append.")
+                return
+            map_data = json.loads(archive.read(MAP_NAME))
+            stored_signatures = {}
+            for name in names:
+                if name.startswith(SIGNATURES_DIR + "/"):
+                    stored_signatures.update(unpack_signatures(archive.read(name)))
+            dictionary = archive.read(ZMASK_DICT_NAME) if ZMASK_DICT_NAME in names else None
+    except (OSError, KeyError, ValueError, zipfile.BadZipFile) as e:
+        print(f"Error: cannot append to '{archive_path}': {e}")
+        return
+
+    id_to_path = dict(map_data["image_map"])
+    n_existing = len(id_to_path)
+    new_paths, jpeg_layout_by_path = scan_images(input_dir, skip=set(id_to_path.values()))
+    if not new_paths:
+        print(f"Nothing to append: every image under {input_dir} is already in {archive_path}.")
+        return
+    new_ids = [str(n_existing + i) for i in range(len(new_paths))]
+    id_to_path.update(zip(new_ids, new_paths))
+    root_image_ids = list(map_data["root_images"])
+    dependencies_by_id = dict(map_data["dependencies"])
+    existing_depths = chain_depths(root_image_ids, dependencies_by_id)
+    image_kinds = dict(map_data.get("image_kinds", {}))
+    jpeg_layouts = {image_id: jpeg_layout_by_path[p] for image_id, p in zip(new_ids, new_paths) if p in jpeg_layout_by_path}
+
+    if map_data.get("delta_codec", "png") == "zmask" and zstandard is None:
+        print("Error: this archive uses zmask deltas, which need the zstandard module (pip install zstandard).")
+        return
+    dia_tool = find_dia_tool(args.dia) if args.scorer != "python" or jpeg_layouts else None
+    if args.scorer == "native" and not dia_tool:
+        print("Error: --scorer native needs the dia tool; build it with `make dia` or pass --dia.")
+        return
+    scorer = "native" if dia_tool and args.scorer != "python" else "python"
+    if jpeg_layouts and not dia_tool:
+        print(f"Note: storing {len(jpeg_layouts)} JPEGs as roots; build the dia tool with `make dia` to delta-code them.")
+    workers = max(1, args.workers)
+
+    with tempfile.TemporaryDirectory() as temp_dir:
+        source_of = {image_id: input_dir / id_to_path[image_id] for image_id in new_ids}
+        roots = set(root_image_ids)
+        # Existing images are read from their sources when those are still there; roots are stored
+        # verbatim, so the archive stands in for theirs. Other images cannot be parents.
+        with zipfile.ZipFile(archive_path) as archive:
+            def pixel_source(image_id):
+                if image_id not in source_of and image_id not in existing_depths:
+                    return None
+                if image_id not in source_of:
+                    path = input_dir / id_to_path[image_id]
+                    if not path.is_file() and image_id in roots:
+                        path = Path(temp_dir) / id_to_path[image_id]
+                        path.parent.mkdir(parents=True, exist_ok=True)
+                        path.write_bytes(archive.read(id_to_path[image_id]))
+                    source_of[image_id] = path if path.is_file() else None
+                return source_of[image_id]
+
+            print(f"Appending {len(new_ids)} images to {n_existing}. Computing signatures...")
+            missing = [str(i) for i in range(n_existing) if str(i) not in stored_signatures and pixel_source(str(i))]
+            if missing:
+                print(f"Computing {len(missing)} signatures the archive does not store yet...")
+            batch_signatures = dict(zip(missing + new_ids, compute_signatures((source_of[i] for i in missing + new_ids), workers)))
+            signatures = [stored_signatures.get(str(i)) or batch_signatures.get(str(i)) for i in range(len(id_to_path))]
+
+            pairs = signature_pairs(signatures, args.candidates or APPEND_CANDIDATES, range(n_existing, len(id_to_path)))
+            pairs = [(i, j) for i, j in pairs if pixel_source(str(i)) and pixel_source(str(j))]
+        involved = sorted({i for pair in pairs for i in pair})
+        position = {image_id: n for n, image_id in enumerate(involved)}
+        paths = [str(source_of[str(i)]) for i in involved]
+        for image_id in (str(i) for i in involved):
+            if image_kinds.get(image_id) == "jpeg" and image_id not in jpeg_layouts:
+                # A JPEG that cannot be read as one must not pair with PNGs either
+                jpeg_layouts[image_id] = jpeg_layout(source_of[image_id]) or ("unreadable", image_id)
+
+        print(f"Starting Phase 1: Scoring {len(pairs)} candidate pairs ({scorer} scorer)...")
+        phase1_start = time.monotonic()
+        local_pairs = [(position[i], position[j]) for i, j in pairs]
+        if scorer == "native":
+            scores = score_pairs_native(dia_tool, Path(), paths, workers, local_pairs, args.edge_weight)
+        else:
+            scores = score_pairs_python(Path(), paths, {p: str(n) for n, p in enumerate(paths)}, workers, local_pairs,
+                                        args.edge_weight)
+        scores = [(score, str(involved[int(a)]), str(involved[int(b)])) for score, a, b in scores]
+        scores = chainable_pairs(scores, jpeg_layouts, bool(dia_tool))
+        print(f"Phase 1 took {time.monotonic() - phase1_start:.2f}s ({len(scores)} scored pairs, {scorer} scorer)")
+
+        new_roots, new_dependencies = attach_new_images(scores, new_ids, existing_depths,
+                                                        lambda nid: source_of[nid].stat().st_size, args.max_depth,
+                                                        args.edge_weight)
+        attached = sum(1 for parent_id in new_dependencies.values() if parent_id in existing_depths)
+        print(f"{attached} new images attach to existing trees, {len(new_dependencies) - attached} to other new images, "
+              f"{len(new_roots)} become roots")
+        root_image_ids += new_roots
+        dependencies_by_id.update(new_dependencies)
+        # Archives written before alpha deltas keep full alpha maps, which new images then follow
+        alpha_map = dict(map_data["alpha_map"])
+        new_alpha_maps = None
+        if map_data.get("alpha_encoding") != "delta":
+            new_alpha_maps = {i: (Path("alpha") / id_to_path[i]).as_posix() for i in new_ids if image_has_alpha(source_of[i])}
+
+        codec = PngDeltaCodec(args.oxipng_level)
+        if map_data.get("delta_codec", "png") == "zmask":
+            codec = ZmaskDeltaCodec(zstandard.ZstdCompressionDict(dictionary) if dictionary else None)
+
+        print(f"Starting Phase 2: Processing images ({codec.name} deltas, {workers} workers)...")
+        phase2_start = time.monotonic()
+        with zipfile.ZipFile(archive_path) as archive:
+            kept, comment = archive.infolist()[:-2], archive.comment
+            append_offset = archive.infolist()[-2].header_offset
+        # New entries go over the old index and map; the bytes they replace are kept to undo a failure.
+        # Closing the kept entries with their own directory there lets zipfile append after them.
+        with open(archive_path, 'rb') as f:
+            f.seek(append_offset)
+            replaced_tail = f.read()
+        zipf = None
+        entry_of = {info.filename: n for n, info in enumerate(kept)}
+        def store(entries):
+            for arcname, data in entries:
+                entry_of[arcname] = len(entry_of)
+                write_stored_aligned(zipf, arcname, data)
+        try:
+            with open(archive_path, 'r+b') as f:
+                f.seek(append_offset)
+                write_central_directory(f, kept, comment)
+                f.truncate()
+            zipf = zipfile.ZipFile(archive_path, 'a')
+            delta_tiles = dict(map_data["delta_tiles"])
+            new_tiles, new_alpha, demoted = encode_images(new_ids, id_to_path, source_of, dependencies_by_id,
+                                                          new_alpha_maps, jpeg_layouts, codec, dia_tool, store, workers,
+                                                          phase2_budget(args), args.oxipng_level)
+            for image_id in demoted:
+                del dependencies_by_id[image_id]
+            root_image_ids += demoted
+            delta_tiles.update(new_tiles)
+            alpha_map.update(new_alpha)
+            previews = dict(map_data["previews"])
+            if not args.no_previews:
+                previews.update(write_previews(new_ids, id_to_path, source_of, workers, store))
+            store([(f"{SIGNATURES_DIR}/{n_existing}.bin", pack_signatures({i: batch_signatures[i] for i in new_ids}))])
+            if missing:
+                store([(f"{SIGNATURES_DIR}/{SIGNATURES_BACKFILL}{n_existing}.bin",
+                        pack_signatures({i: batch_signatures[i] for i in missing}))])
+            image_kinds.update({image_id: "jpeg" for image_id in new_ids if image_id in jpeg_layouts})
+            map_data.update({
+                "image_map": id_to_path,
+                "root_images": sorted(root_image_ids, key=int),
+                "dependencies": dependencies_by_id,
+                "alpha_map": alpha_map,
+                "delta_tiles": delta_tiles,
+                "previews": previews,
+                "image_kinds": dict(sorted(image_kinds.items(), key=lambda kv: int(kv[0]))),
+            })
+            write_index_and_map(zipf, map_data, entry_of)
+            zipf.close()
+        except BaseException:
+            if zipf:
+                zipf.close()
+            with open(archive_path, 'r+b') as f:
+                f.seek(append_offset)
+                f.write(replaced_tail)
+                f.truncate()
+            raise
+
+    size = archive_path.stat().st_size
+    print(f"\nPhase 2 took {time.monotonic() - phase2_start:.2f}s (wrote {(size - append_offset) / 2**20:.1f} MiB, "
+          f"{size / 2**20:.1f} MiB archive)")
+    print(f"Appended {len(new_ids)} images in {time.monotonic() - start_time:.2f}s. Output saved to {archive_path}")
 
 def main():
     parser = argparse.ArgumentParser(
@@ -137,126 +1253,181 @@ def main():
         formatter_class=argparse.RawTextHelpFormatter
     )
     parser.add_argument("input_dir", help="Directory containing source images and subdirectories.")
-    parser.add_argument("-w", "--workers", type=int, default=os.cpu_count() // 2, help="Number of concurrent threads.")
+    parser.add_argument("-w", "--workers", type=int, default=os.cpu_count() or 1,
+                        help="Number of concurrent workers: processes for Phase 2, threads elsewhere (default: one per core).")
+    parser.add_argument("--scorer", choices=("auto", "native", "python"), default="auto",
+                        help="Phase 1 pair scorer. 'native' runs `dia score`; 'auto' uses it when it can be found.")
+    parser.add_argument("--dia", help="Path to the native dia tool (default: next to this script, then PATH).")
+    parser.add_argument("--candidates", type=int, default=0, metavar="K",
+                        help="Score only the K most similar images per image by tile/thumbnail signatures\n"
+                             "instead of every pair (0 = exhaustive). For very large collections.")
+    parser.add_argument("--max-depth", type=int, default=0, metavar="N",
+                        help="Cap delta chains at N steps by promoting the fewest images to full roots (0 = no cap).")
+    parser.add_argument("--root-strategy", choices=("size", "centroid"), default="size",
+                        help="Root each tree at its smallest file ('size') or at the image with the lowest\n"
+                             "mean chain length ('centroid'), trading root size for decode latency.")
+    parser.add_argument("--edge-weight", choices=("pixels", "bytes"), default="pixels",
+                        help="Spanning forest edge weight. 'pixels' links the pairs with the most identical pixels;\n"
+                             "'bytes' links those with the smallest estimated compressed delta, and stores an image\n"
+                             "whole when no delta is estimated to be smaller than its file.")
+    parser.add_argument("--compare-exhaustive", action="store_true",
+                        help="With --candidates, also score every pair and report how much the pruned forest loses.")
+    parser.add_argument("--no-previews", action="store_true",
+                        help="Do not store the downscaled renditions the viewer shows while browsing.")
+    parser.add_argument("--delta-codec", choices=("png", "zmask"), default="png",
+                        help="Delta tile format. 'zmask' stores a change bitmap and the changed pixels with zstd;\n"
+                             "it encodes and decodes faster than PNG (needs the zstandard module).")
+    parser.add_argument("--oxipng-level", type=int, choices=range(7), default=OXIPNG_LEVEL, metavar="{0..6}",
+                        help="oxipng effort for PNG deltas and alpha: lower encodes faster, higher is smaller (default 6).")
+    parser.add_argument("--memory-mb", type=int, default=4096, metavar="MB",
+                        help="Phase 2 memory budget; fewer images are encoded at once when large ones would exceed it\n"
+                             "(default 4096, 0 = no limit).")
+    parser.add_argument("--zmask-dict", action="store_true",
+                        help="With --delta-codec zmask, train a zstd dictionary on a sample of the deltas.")
+    parser.add_argument("--append", action="store_true",
+                        help="Add the images under input_dir that the archive does not hold yet, updating it in place.\n"
+                             "Only the new images are scored and encoded; existing chains are kept.")
+    parser.add_argument("-o", "--output", help="Archive to write (default: <input_dir>.dia).")
     args = parser.parse_args()
+    if args.max_depth < 0:
+        parser.error("--max-depth must be 0 or more")
+    if args.memory_mb < 0:
+        parser.error("--memory-mb must be 0 or more")
 
     input_dir = Path(args.input_dir).resolve()
-    output_zip_path = Path(f"{input_dir}.dia")
+    output_zip_path = Path(args.output) if args.output else Path(f"{input_dir}.dia")
+    if args.delta_codec == "zmask" and zstandard is None:
+        print("Error: --delta-codec zmask needs the zstandard module (pip install zstandard).")
+        return
 
     if not input_dir.is_dir():
         print(f"Error: Input directory not found at '{input_dir}'")
         return
 
-    with tempfile.TemporaryDirectory() as temp_dir:
-        output_dir = Path(temp_dir)
+    if args.append:
+        append_to_archive(args, input_dir, output_zip_path)
+        return
 
-        print("Scanning for images recursively...")
-        all_image_paths_abs = [p for p in input_dir.rglob('**/*') if p.is_file() and p.suffix.lower() in IMAGE_EXTENSIONS]
-        image_paths_rel = [str(p.relative_to(input_dir)) for p in all_image_paths_abs]
-        try:
-            image_paths_rel.sort(key=lambda f: int(Path(f).stem))
-        except (ValueError, IndexError):
-            image_paths_rel.sort()
-        
-        if len(image_paths_rel) < 2:
-            print("At least two images are required for optimization.")
-            return
-
-        path_to_id = {path: str(i) for i, path in enumerate(image_paths_rel)}
-        id_to_path = {str(i): path for i, path in enumerate(image_paths_rel)}
-        alpha_image_ids = [img_id for img_id, rel_path in id_to_path.items() if image_has_alpha(input_dir / rel_path)]
-
-        print(f"Found {len(image_paths_rel)} images. Starting Phase 1: Scoring all pairs...")
-        all_pairs = list(combinations(image_paths_rel, 2))
-        all_scores = []
-        with ThreadPoolExecutor(max_workers=args.workers) as executor:
-            future_to_pair = {executor.submit(calculate_similarity_score, input_dir / p[0], input_dir / p[1]): p for p in all_pairs}
-            for i, future in enumerate(as_completed(future_to_pair), 1):
-                pair = future_to_pair[future]
-                try:
-                    score = future.result()
-                    if score != -1:
-                        id1, id2 = path_to_id[pair[0]], path_to_id[pair[1]]
-                        all_scores.append((score, id1, id2))
-                except Exception as e:
-                    print(f"\nError scoring pair {pair}: {e}")
-                print_progress_bar(i, len(all_pairs), prefix='Phase 1/2:', suffix='Scoring Pairs')
-
-        all_scores.sort(key=lambda x: x[0], reverse=True)
-        dsu = DisjointSetUnion(id_to_path.keys())
-        adjacency_list = collections.defaultdict(list)
-        for score, u_id, v_id in all_scores:
-            if dsu.union(u_id, v_id):
-                adjacency_list[u_id].append(v_id)
-                adjacency_list[v_id].append(u_id)
-
-        root_image_ids, dependencies_by_id, visited_ids = [], {}, set()
-        for image_id in id_to_path.keys():
-            if image_id not in visited_ids:
-                component_node_ids, q = [], collections.deque([image_id])
-                component_visited_ids = {image_id}
-                while q:
-                    node_id = q.popleft()
-                    component_node_ids.append(node_id)
-                    for neighbor_id in adjacency_list[node_id]:
-                        if neighbor_id not in component_visited_ids:
-                            component_visited_ids.add(neighbor_id)
-                            q.append(neighbor_id)
-                optimal_root_id = min(component_node_ids, key=lambda nid: (input_dir / id_to_path[nid]).stat().st_size)
-                root_image_ids.append(optimal_root_id)
-                q = collections.deque([optimal_root_id])
-                visited_ids.add(optimal_root_id)
-                while q:
-                    parent_id = q.popleft()
-                    for child_id in adjacency_list[parent_id]:
-                        if child_id not in visited_ids:
-                            visited_ids.add(child_id)
-                            dependencies_by_id[child_id] = parent_id
-                            q.append(child_id)
-
-        alpha_dir = output_dir / "alpha"
-        alpha_map = {img_id: str(Path("alpha") / id_to_path[img_id]) for img_id in alpha_image_ids}
+    image_paths_rel, jpeg_layout_by_path = scan_images(input_dir)
+    if len(image_paths_rel) < 2:
+        print("At least two images are required for optimization.")
+        return
+
+    path_to_id = {path: str(i) for i, path in enumerate(image_paths_rel)}
+    id_to_path = {str(i): path for i, path in enumerate(image_paths_rel)}
+    jpeg_layouts = {path_to_id[p]: layout for p, layout in jpeg_layout_by_path.items()}
+
+    # JPEG deltas are always cut by the native tool, whichever scorer runs
+    dia_tool = find_dia_tool(args.dia) if args.scorer != "python" or jpeg_layouts else None
+    if args.scorer == "native" and not dia_tool:
+        print("Error: --scorer native needs the dia tool; build it with `make dia` or pass --dia.")
+        return
+    scorer = "native" if dia_tool and args.scorer != "python" else "python"
+    if jpeg_layouts and not dia_tool:
+        print(f"Note: storing {len(jpeg_layouts)} JPEGs as roots; build the dia tool with `make dia` to delta-code them.")
+
+    def score_pairs(pairs=None):
+        if scorer == "native":
+            scores = score_pairs_native(dia_tool, input_dir, image_paths_rel, max(1, args.workers), pairs, args.edge_weight)
+        else:
+            scores = score_pairs_python(input_dir, image_paths_rel, path_to_id, args.workers, pairs, args.edge_weight)
+        return chainable_pairs(scores, jpeg_layouts, bool(dia_tool))
+
+    candidate_pairs, signatures = None, None
+    phase1_start = time.monotonic()
+    if args.candidates > 0:
+        print(f"Found {len(image_paths_rel)} images. Selecting up to {args.candidates} candidates per image...")
+        candidate_pairs, signatures = select_candidate_pairs(input_dir, image_paths_rel, args.candidates, max(1, args.workers))
+        print(f"Starting Phase 1: Scoring {len(candidate_pairs)} candidate pairs ({scorer} scorer)...")
+    else:
+        print(f"Found {len(image_paths_rel)} images. Starting Phase 1: Scoring all pairs ({scorer} scorer)...")
+    all_scores = score_pairs(candidate_pairs)
+    print(f"Phase 1 took {time.monotonic() - phase1_start:.2f}s, peak RSS {peak_rss_mib(children=scorer == 'native'):.0f} MiB "
+          f"({len(all_scores)} scored pairs, {scorer} scorer)")
+
+    exhaustive_scores = None
+    if candidate_pairs is not None and args.compare_exhaustive:
+        print("Scoring all pairs for comparison...")
+        exhaustive_scores = score_pairs()
+
+    root_image_ids, dependencies_by_id = build_spanning_forest(all_scores, id_to_path, input_dir,
+                                                              args.root_strategy, args.max_depth, args.edge_weight)
+    if args.edge_weight == "bytes":
+        cost_by_pair = {(u, v): cost for cost, u, v in all_scores}
+        estimate = sum((input_dir / id_to_path[r]).stat().st_size for r in root_image_ids)
+        estimate += sum(cost_by_pair.get((c, p), cost_by_pair.get((p, c), 0)) for c, p in dependencies_by_id.items())
+        print(f"Estimated archive size {estimate / 2**20:.1f} MiB before previews, {len(root_image_ids)} images stored whole")
+    if args.max_depth or args.root_strategy != "size":
+        report_tree_shaping(all_scores, root_image_ids, dependencies_by_id, id_to_path, input_dir,
+                            args.root_strategy, args.max_depth, args.edge_weight)
+    if exhaustive_scores is not None:
+        report_pruning_loss(all_scores, exhaustive_scores, root_image_ids, dependencies_by_id, id_to_path, input_dir,
+                            args.root_strategy, args.max_depth, args.edge_weight)
+
+    codec = PngDeltaCodec(args.oxipng_level)
+    dictionary = None
+    if args.delta_codec == "zmask":
+        if args.zmask_dict:
+            print("Training zmask dictionary...")
+            pixel_dependencies = {cid: pid for cid, pid in dependencies_by_id.items() if cid not in jpeg_layouts}
+            dictionary = train_zmask_dictionary(input_dir, id_to_path, pixel_dependencies, max(1, args.workers))
+        codec = ZmaskDeltaCodec(dictionary)
+
+    workers = max(1, args.workers)
+    print(f"Starting Phase 2: Processing images ({codec.name} deltas, {workers} workers)...")
+    phase2_start = time.monotonic()
+    io_start = io_counters()
+    partial_zip_path = output_zip_path.with_name(output_zip_path.name + ".partial")
+    # Entries are written tree by tree as soon as they are encoded, so nothing is staged on disk
+    # and only a window of finished images is held in memory
+    with zipfile.ZipFile(partial_zip_path, 'w', zipfile.ZIP_STORED) as zipf:
+        entry_of = {}
+        def store(entries):
+            for arcname, data in entries:
+                entry_of[arcname] = len(entry_of)
+                write_stored_aligned(zipf, arcname, data)
+
+        if dictionary is not None:
+            store([(ZMASK_DICT_NAME, dictionary.as_bytes())])
+
+        source_of = {image_id: input_dir / rel_path for image_id, rel_path in id_to_path.items()}
+        all_ids = sorted(id_to_path, key=int)
+        delta_tiles, alpha_map, demoted = encode_images(all_ids, id_to_path, source_of, dependencies_by_id, None,
+                                                        jpeg_layouts, codec, dia_tool, store, workers,
+                                                        phase2_budget(args), args.oxipng_level)
+        for image_id in demoted:
+            del dependencies_by_id[image_id]
+        root_image_ids += demoted
+        previews = {}
+        if not args.no_previews:
+            previews = write_previews(all_ids, id_to_path, source_of, max(1, args.workers), store)
+        if signatures is None:
+            print("\nWriting signatures...")
+            signatures = compute_signatures((source_of[i] for i in all_ids), max(1, args.workers))
+        store([(f"{SIGNATURES_DIR}/0.bin", pack_signatures(dict(zip(all_ids, signatures))))])
 
         map_data = {
             "image_map": id_to_path,
             "root_images": sorted(root_image_ids, key=int),
             "dependencies": dependencies_by_id,
             "alpha_map": alpha_map,
+            "alpha_encoding": "delta",
+            "delta_tiles": delta_tiles,
+            "delta_codec": codec.name,
+            "image_kinds": {image_id: "jpeg" for image_id in sorted(jpeg_layouts, key=int)},
+            "previews": previews,
         }
-        map_file_path = output_dir / "optimization_map.json"
-        with open(map_file_path, 'w', encoding='utf-8') as f:
-            json.dump(map_data, f, indent=2, sort_keys=True, ensure_ascii=False)
-        print(f"\nOptimization map created in temporary directory.")
-
-        print("Starting Phase 2: Processing images...")
-        for root_id in root_image_ids:
-            root_path_rel = id_to_path[root_id]
-            dest_path = output_dir / root_path_rel
-            dest_path.parent.mkdir(parents=True, exist_ok=True)
-            shutil.copy2(input_dir / root_path_rel, dest_path)
-            if root_id in alpha_image_ids:
-                extract_and_save_alpha(input_dir / root_path_rel, alpha_dir / root_path_rel)
-        
-        total_to_process = len(dependencies_by_id) + len(root_image_ids)
-        processed_count = len(root_image_ids)
-        print_progress_bar(processed_count, total_to_process, prefix='Phase 2/2:', suffix='Processing')
-        with ThreadPoolExecutor(max_workers=4) as executor:
-            futures = {}
-            for cid, pid in dependencies_by_id.items():
-                alpha_save_path = alpha_dir / id_to_path[cid] if cid in alpha_image_ids else None
-                futures[executor.submit(process_image, input_dir / id_to_path[cid], input_dir / id_to_path[pid], output_dir / id_to_path[cid], alpha_save_path)] = cid
-            for future in as_completed(futures):
-                if future.result():
-                    processed_count += 1
-                    print_progress_bar(processed_count, total_to_process, prefix='Phase 2/2:', suffix='Processing')
-        
-        print("\nZipping output files...")
-        with zipfile.ZipFile(output_zip_path, 'w', zipfile.ZIP_DEFLATED) as zipf:
-            for file_path in output_dir.rglob('*'):
-                if file_path.is_file():
-                    arcname = file_path.relative_to(output_dir)
-                    zipf.write(file_path, arcname)
-    
+        write_index_and_map(zipf, map_data, entry_of)
+        n_entries = len(zipf.infolist())
+    os.replace(partial_zip_path, output_zip_path)
+
+    io_end = io_counters()
+    io_report = ""
+    if io_start and io_end:
+        io_report = (f", read {(io_end[0] - io_start[0]) / 2**20:.1f} MiB, "
+                     f"wrote {(io_end[1] - io_start[1]) / 2**20:.1f} MiB")
+    print(f"\nPhase 2 took {time.monotonic() - phase2_start:.2f}s{io_report} "
+          f"({n_entries} entries, {output_zip_path.stat().st_size / 2**20:.1f} MiB archive)")
     print(f"Optimization complete. Output saved to {output_zip_path}")
 
 if __name__ == "__main__":
@@ -9,11 +9,15 @@ int main(int argc, char **argv) {
     int status = g_application_run(G_APPLICATION(app), argc, argv);
     
     g_object_unref(app);
+    dia_prefetcher_free(data->prefetcher);
+    dia_thumb_grid_free(data->grid);
+    dia_scaler_free(data->scaler);
     g_free(data->zip_path);
-    if (data->image_map) g_hash_table_destroy(data->image_map);
-    if (data->dependencies) g_hash_table_destroy(data->dependencies);
-    if (data->alpha_map) g_hash_table_destroy(data->alpha_map);
+    dia_archive_free(data->archive);
+    dia_canvas_cache_free(data->selection_cache);
+    dia_canvas_cache_free(data->canvas_cache);
     if (data->original_pixbuf) g_object_unref(data->original_pixbuf);
+    if (data->render_cancellable) g_object_unref(data->render_cancellable);
     g_free(data);
     return status;
 }
@@ -0,0 +1,143 @@
+#include "dia.h"
+
+#include <string.h>
+
+// Alpha delta, written by encode.py for archives whose map says "alpha_encoding": "delta".
+// Little-endian header:
+//   "DIAA", version, canvas width, canvas height, n_rects (u32 each after the magic)
+// then n_rects records of x, y, png_size (u32 each), then the grayscale PNG of every rect in
+// record order. Compositing a delta's tiles leaves the parent's alpha in place and makes
+// changed pixels opaque; each rect then replaces the canvas alpha it covers. Images whose
+// alpha matches that prediction have no alpha entry at all, and roots carry their own.
+#define ALPHA_HEADER_SIZE 20
+#define ALPHA_RECT_SIZE 12
+#define ALPHA_VERSION 1
+
+typedef struct {
+    guint32 x;
+    guint32 y;
+    GdkPixbuf *pixbuf;
+} AlphaRect;
+
+struct _DiaAlphaDelta {
+    guint32 width;
+    guint32 height;
+    GArray *rects;  // AlphaRect
+};
+
+static guint32 rd32(const guint8 *p) {
+    return (guint32)p[0] | ((guint32)p[1] << 8) | ((guint32)p[2] << 16) | ((guint32)p[3] << 24);
+}
+
+gboolean dia_alpha_is_delta(GBytes *bytes) {
+    gsize size;
+    const guint8 *data = g_bytes_get_data(bytes, &size);
+    return size >= ALPHA_HEADER_SIZE && memcmp(data, DIA_ALPHA_MAGIC, 4) == 0;
+}
+
+static void clear_rect(gpointer data) {
+    AlphaRect *rect = data;
+    g_clear_object(&rect->pixbuf);
+}
+
+void dia_alpha_delta_free(DiaAlphaDelta *delta) {
+    if (!delta) return;
+    g_array_unref(delta->rects);
+    g_free(delta);
+}
+
+// Reads and decodes every rect; nothing here depends on the canvas, so it runs ahead of
+// compositing with the rest of a chain link
+DiaAlphaDelta* dia_alpha_delta_decode(GBytes *bytes, const gchar *name, GError **error) {
+    gsize size;
+    const guint8 *data = g_bytes_get_data(bytes, &size);
+    guint32 version = rd32(data + 4);
+    if (version != ALPHA_VERSION) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Alpha delta '%s' has unknown version %u", name, version);
+        return NULL;
+    }
+
+    guint32 n_rects = rd32(data + 16);
+    gsize offset = ALPHA_HEADER_SIZE + (gsize)n_rects * ALPHA_RECT_SIZE;
+    if (n_rects > (size - ALPHA_HEADER_SIZE) / ALPHA_RECT_SIZE) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Alpha delta '%s' is truncated", name);
+        return NULL;
+    }
+
+    DiaAlphaDelta *delta = g_new0(DiaAlphaDelta, 1);
+    delta->width = rd32(data + 8);
+    delta->height = rd32(data + 12);
+    delta->rects = g_array_sized_new(FALSE, TRUE, sizeof(AlphaRect), n_rects);
+    g_array_set_clear_func(delta->rects, clear_rect);
+
+    for (guint32 i = 0; i < n_rects; i++) {
+        const guint8 *record = data + ALPHA_HEADER_SIZE + (gsize)i * ALPHA_RECT_SIZE;
+        guint32 png_size = rd32(record + 8);
+        if (png_size > size - offset) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Alpha delta '%s' is truncated", name);
+            dia_alpha_delta_free(delta);
+            return NULL;
+        }
+
+        AlphaRect rect = { rd32(record), rd32(record + 4), NULL };
+        rect.pixbuf = load_pixbuf_from_memory((const gchar*)data + offset, png_size, error);
+        if (!rect.pixbuf) {
+            g_prefix_error(error, "Alpha delta '%s', rect %u: ", name, i);
+            dia_alpha_delta_free(delta);
+            return NULL;
+        }
+        guint32 rect_width = (guint32)gdk_pixbuf_get_width(rect.pixbuf);
+        guint32 rect_height = (guint32)gdk_pixbuf_get_height(rect.pixbuf);
+        g_array_append_val(delta->rects, rect);
+        if (rect_width > delta->width || rect_height > delta->height ||
+            rect.x > delta->width - rect_width || rect.y > delta->height - rect_height) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Alpha delta '%s' rect %u (%ux%u at %u,%u) lies outside the %ux%u canvas",
+                        name, i, rect_width, rect_height, rect.x, rect.y, delta->width, delta->height);
+            dia_alpha_delta_free(delta);
+            return NULL;
+        }
+        offset += png_size;
+    }
+    return delta;
+}
+
+void dia_alpha_delta_get_size(const DiaAlphaDelta *delta, gint *width, gint *height) {
+    *width = (gint)delta->width;
+    *height = (gint)delta->height;
+}
+
+// Replaces the canvas alpha inside every rect; pixels outside them are not touched
+gboolean dia_alpha_delta_apply(const DiaAlphaDelta *delta, GdkPixbuf *canvas_pixbuf, GError **error) {
+    int canvas_width = gdk_pixbuf_get_width(canvas_pixbuf);
+    int canvas_height = gdk_pixbuf_get_height(canvas_pixbuf);
+    if ((guint32)canvas_width != delta->width || (guint32)canvas_height != delta->height) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Alpha delta size mismatch (%ux%u vs %dx%d)",
+                    delta->width, delta->height, canvas_width, canvas_height);
+        return FALSE;
+    }
+    if (!gdk_pixbuf_get_has_alpha(canvas_pixbuf)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Target pixbuf missing alpha channel");
+        return FALSE;
+    }
+
+    DIA_TRACE_SCOPE(span, "render.alpha_apply");
+    int canvas_stride = gdk_pixbuf_get_rowstride(canvas_pixbuf);
+    guint8 *canvas = gdk_pixbuf_get_pixels(canvas_pixbuf);
+    for (guint i = 0; i < delta->rects->len; i++) {
+        const AlphaRect *rect = &g_array_index(delta->rects, AlphaRect, i);
+        int width = gdk_pixbuf_get_width(rect->pixbuf);
+        int height = gdk_pixbuf_get_height(rect->pixbuf);
+        int stride = gdk_pixbuf_get_rowstride(rect->pixbuf);
+        int channels = gdk_pixbuf_get_n_channels(rect->pixbuf);
+        const guint8 *src = gdk_pixbuf_read_pixels(rect->pixbuf);
+        for (int y = 0; y < height; y++) {
+            const guint8 *s = src + (gsize)y * stride;
+            guint8 *d = canvas + (gsize)(rect->y + y) * canvas_stride + (gsize)rect->x * 4 + 3;
+            for (int x = 0; x < width; x++) {
+                d[x * 4] = s[x * channels];
+            }
+        }
+        DIA_TRACE_BYTES(span, (guint64)width * height);
+    }
+    return TRUE;
+}
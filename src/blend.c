@@ -0,0 +1,287 @@
+#include "dia.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DIA_BLEND_X86 1
+#include <immintrin.h>
+#endif
+
+// One row of a delta overlay: composite `src` onto the RGBA `dst`, then multiply in the alpha map
+typedef void (*BlendRowFunc)(guint8 *dst, const guint8 *src, int src_channels,
+                             const guint8 *alpha, int alpha_channels, int width);
+
+// Mirrors gdk_pixbuf_composite() with GDK_INTERP_NEAREST, scale 1.0 and overall alpha 255 onto
+// a destination with alpha, followed by the combine step of apply_alpha_map_to_pixbuf().
+static void blend_row_scalar(guint8 *dst, const guint8 *src, int src_channels,
+                             const guint8 *alpha, int alpha_channels, int width) {
+    for (int x = 0; x < width; x++) {
+        guint8 *d = dst + x * 4;
+        const guint8 *s = src + x * src_channels;
+        unsigned int a0 = src_channels == 4 ? s[3] : 0xff;
+
+        if (a0 == 0xff) {
+            d[0] = s[0];
+            d[1] = s[1];
+            d[2] = s[2];
+            d[3] = 0xff;
+        } else if (a0 != 0) {
+            unsigned int w0 = 0xff * a0;
+            unsigned int w1 = (0xff - a0) * d[3];
+            unsigned int w = w0 + w1;
+            d[0] = (guint8)((w0 * s[0] + w1 * d[0]) / w);
+            d[1] = (guint8)((w0 * s[1] + w1 * d[1]) / w);
+            d[2] = (guint8)((w0 * s[2] + w1 * d[2]) / w);
+            d[3] = (guint8)(w / 0xff);
+        }
+
+        if (alpha) {
+            d[3] = (guint8)((d[3] * alpha[x * alpha_channels]) / 255);
+        }
+    }
+}
+
+#ifdef DIA_BLEND_X86
+
+// Delta PNGs from encode.py only ever use alpha 0 or 255. Spans of that shape take the vector
+// path; anything else in a span falls back to the scalar blend for exactness.
+#define SSE2_SPAN 16
+#define AVX2_SPAN 32
+
+static inline void gather_alpha(guint32 *out, const guint8 *alpha, int alpha_channels, int n) {
+    for (int i = 0; i < n; i++) {
+        out[i] = alpha[i * alpha_channels];
+    }
+}
+
+// Most of an alpha map is fully opaque, and multiplying by 255 is a no-op
+__attribute__((target("sse2")))
+static inline gboolean alpha_span_opaque_sse2(const guint8 *alpha, int bytes) {
+    const __m128i ones = _mm_set1_epi8((char)0xFF);
+    __m128i all = ones;
+    for (int i = 0; i < bytes; i += 16) {
+        all = _mm_and_si128(all, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(alpha + i)), ones));
+    }
+    return _mm_movemask_epi8(all) == 0xFFFF;
+}
+
+__attribute__((target("sse2")))
+static void multiply_alpha_sse2(guint8 *dst, const guint8 *alpha, int alpha_channels) {
+    if (alpha_span_opaque_sse2(alpha, SSE2_SPAN * alpha_channels)) return;
+
+    guint32 map[SSE2_SPAN];
+    gather_alpha(map, alpha, alpha_channels, SSE2_SPAN);
+
+    const __m128i rgb_mask = _mm_set1_epi32(0x00FFFFFF);
+    const __m128i one = _mm_set1_epi32(1);
+    for (int i = 0; i < SSE2_SPAN; i += 4) {
+        __m128i m = _mm_loadu_si128((const __m128i*)(map + i));
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i * 4));
+        // a * m fits in the low 16 bits of each lane; x / 255 == (x + 1 + (x >> 8)) >> 8 for x <= 65025
+        __m128i p = _mm_mullo_epi16(_mm_srli_epi32(d, 24), m);
+        __m128i q = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(p, one), _mm_srli_epi32(p, 8)), 8);
+        d = _mm_or_si128(_mm_and_si128(d, rgb_mask), _mm_slli_epi32(q, 24));
+        _mm_storeu_si128((__m128i*)(dst + i * 4), d);
+    }
+}
+
+__attribute__((target("sse2")))
+static void blend_row_sse2(guint8 *dst, const guint8 *src, int src_channels,
+                           const guint8 *alpha, int alpha_channels, int width) {
+    if (src_channels != 4) {
+        blend_row_scalar(dst, src, src_channels, alpha, alpha_channels, width);
+        return;
+    }
+
+    const __m128i alpha_mask = _mm_set1_epi32((int)0xFF000000);
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+
+    for (; x + SSE2_SPAN <= width; x += SSE2_SPAN) {
+        __m128i s[4], opaque[4];
+        __m128i binary = _mm_set1_epi32(-1);
+        __m128i any_opaque = zero;
+
+        for (int i = 0; i < 4; i++) {
+            s[i] = _mm_loadu_si128((const __m128i*)(src + (x + i * 4) * 4));
+            __m128i a = _mm_and_si128(s[i], alpha_mask);
+            opaque[i] = _mm_cmpeq_epi32(a, alpha_mask);
+            binary = _mm_and_si128(binary, _mm_or_si128(opaque[i], _mm_cmpeq_epi32(a, zero)));
+            any_opaque = _mm_or_si128(any_opaque, opaque[i]);
+        }
+
+        const guint8 *span_alpha = alpha ? alpha + x * alpha_channels : NULL;
+        if (_mm_movemask_epi8(binary) != 0xFFFF) {
+            blend_row_scalar(dst + x * 4, src + x * 4, 4, span_alpha, alpha_channels, SSE2_SPAN);
+            continue;
+        }
+
+        // Fully transparent spans leave the canvas untouched
+        if (_mm_movemask_epi8(any_opaque) != 0) {
+            for (int i = 0; i < 4; i++) {
+                __m128i *dp = (__m128i*)(dst + (x + i * 4) * 4);
+                __m128i d = _mm_loadu_si128(dp);
+                d = _mm_or_si128(_mm_and_si128(opaque[i], s[i]), _mm_andnot_si128(opaque[i], d));
+                _mm_storeu_si128(dp, d);
+            }
+        }
+
+        if (span_alpha) {
+            multiply_alpha_sse2(dst + x * 4, span_alpha, alpha_channels);
+        }
+    }
+
+    if (x < width) {
+        blend_row_scalar(dst + x * 4, src + x * 4, 4, alpha ? alpha + x * alpha_channels : NULL, alpha_channels, width - x);
+    }
+}
+
+__attribute__((target("avx2")))
+static void multiply_alpha_avx2(guint8 *dst, const guint8 *alpha, int alpha_channels) {
+    if (alpha_span_opaque_sse2(alpha, AVX2_SPAN * alpha_channels)) return;
+
+    guint32 map[AVX2_SPAN];
+    gather_alpha(map, alpha, alpha_channels, AVX2_SPAN);
+
+    const __m256i rgb_mask = _mm256_set1_epi32(0x00FFFFFF);
+    const __m256i one = _mm256_set1_epi32(1);
+    for (int i = 0; i < AVX2_SPAN; i += 8) {
+        __m256i m = _mm256_loadu_si256((const __m256i*)(map + i));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i * 4));
+        __m256i p = _mm256_mullo_epi16(_mm256_srli_epi32(d, 24), m);
+        __m256i q = _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(p, one), _mm256_srli_epi32(p, 8)), 8);
+        d = _mm256_or_si256(_mm256_and_si256(d, rgb_mask), _mm256_slli_epi32(q, 24));
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), d);
+    }
+}
+
+__attribute__((target("avx2")))
+static void blend_row_avx2(guint8 *dst, const guint8 *src, int src_channels,
+                           const guint8 *alpha, int alpha_channels, int width) {
+    if (src_channels != 4) {
+        blend_row_scalar(dst, src, src_channels, alpha, alpha_channels, width);
+        return;
+    }
+
+    const __m256i alpha_mask = _mm256_set1_epi32((int)0xFF000000);
+    const __m256i zero = _mm256_setzero_si256();
+    int x = 0;
+
+    for (; x + AVX2_SPAN <= width; x += AVX2_SPAN) {
+        __m256i s[4], opaque[4];
+        __m256i binary = _mm256_set1_epi32(-1);
+        __m256i any_opaque = zero;
+
+        for (int i = 0; i < 4; i++) {
+            s[i] = _mm256_loadu_si256((const __m256i*)(src + (x + i * 8) * 4));
+            __m256i a = _mm256_and_si256(s[i], alpha_mask);
+            opaque[i] = _mm256_cmpeq_epi32(a, alpha_mask);
+            binary = _mm256_and_si256(binary, _mm256_or_si256(opaque[i], _mm256_cmpeq_epi32(a, zero)));
+            any_opaque = _mm256_or_si256(any_opaque, opaque[i]);
+        }
+
+        const guint8 *span_alpha = alpha ? alpha + x * alpha_channels : NULL;
+        if (_mm256_movemask_epi8(binary) != -1) {
+            blend_row_scalar(dst + x * 4, src + x * 4, 4, span_alpha, alpha_channels, AVX2_SPAN);
+            continue;
+        }
+
+        if (_mm256_movemask_epi8(any_opaque) != 0) {
+            for (int i = 0; i < 4; i++) {
+                __m256i *dp = (__m256i*)(dst + (x + i * 8) * 4);
+                __m256i d = _mm256_loadu_si256(dp);
+                d = _mm256_blendv_epi8(d, s[i], opaque[i]);
+                _mm256_storeu_si256(dp, d);
+            }
+        }
+
+        if (span_alpha) {
+            multiply_alpha_avx2(dst + x * 4, span_alpha, alpha_channels);
+        }
+    }
+
+    if (x < width) {
+        blend_row_sse2(dst + x * 4, src + x * 4, 4, alpha ? alpha + x * alpha_channels : NULL, alpha_channels, width - x);
+    }
+}
+
+#endif
+
+static BlendRowFunc blend_row_for(DiaBlendImpl impl) {
+    switch (impl) {
+#ifdef DIA_BLEND_X86
+    case DIA_BLEND_SSE2:
+        return blend_row_sse2;
+    case DIA_BLEND_AVX2:
+        return blend_row_avx2;
+#endif
+    default:
+        return blend_row_scalar;
+    }
+}
+
+gboolean dia_blend_impl_supported(DiaBlendImpl impl) {
+    switch (impl) {
+    case DIA_BLEND_SCALAR:
+        return TRUE;
+#ifdef DIA_BLEND_X86
+    case DIA_BLEND_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case DIA_BLEND_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return FALSE;
+    }
+}
+
+const gchar* dia_blend_impl_name(DiaBlendImpl impl) {
+    switch (impl) {
+    case DIA_BLEND_SCALAR: return "scalar";
+    case DIA_BLEND_SSE2: return "sse2";
+    case DIA_BLEND_AVX2: return "avx2";
+    default: return "auto";
+    }
+}
+
+// Picks the widest kernel the CPU supports; DIA_BLEND=scalar|sse2|avx2 forces one for comparisons
+DiaBlendImpl dia_blend_default_impl(void) {
+    static gsize resolved = 0;
+
+    if (g_once_init_enter(&resolved)) {
+        DiaBlendImpl impl = DIA_BLEND_SCALAR;
+        const gchar *forced = g_getenv("DIA_BLEND");
+        if (forced && g_strcmp0(forced, "sse2") == 0 && dia_blend_impl_supported(DIA_BLEND_SSE2)) {
+            impl = DIA_BLEND_SSE2;
+        } else if (forced && g_strcmp0(forced, "avx2") == 0 && dia_blend_impl_supported(DIA_BLEND_AVX2)) {
+            impl = DIA_BLEND_AVX2;
+        } else if (!forced || g_strcmp0(forced, "scalar") != 0) {
+            if (dia_blend_impl_supported(DIA_BLEND_AVX2)) impl = DIA_BLEND_AVX2;
+            else if (dia_blend_impl_supported(DIA_BLEND_SSE2)) impl = DIA_BLEND_SSE2;
+        }
+        g_once_init_leave(&resolved, (gsize)impl + 1);
+    }
+
+    return (DiaBlendImpl)(resolved - 1);
+}
+
+void dia_blend_delta_with(DiaBlendImpl impl, guint8 *canvas, int canvas_stride,
+                          const guint8 *delta, int delta_stride, int delta_channels,
+                          const guint8 *alpha_map, int alpha_stride, int alpha_channels,
+                          int width, int height) {
+    if (impl == DIA_BLEND_AUTO) impl = dia_blend_default_impl();
+    BlendRowFunc blend_row = blend_row_for(impl);
+
+    for (int y = 0; y < height; y++) {
+        blend_row(canvas + (gsize)y * canvas_stride,
+                  delta + (gsize)y * delta_stride, delta_channels,
+                  alpha_map ? alpha_map + (gsize)y * alpha_stride : NULL, alpha_channels,
+                  width);
+    }
+}
+
+void dia_blend_delta(guint8 *canvas, int canvas_stride,
+                     const guint8 *delta, int delta_stride, int delta_channels,
+                     const guint8 *alpha_map, int alpha_stride, int alpha_channels,
+                     int width, int height) {
+    dia_blend_delta_with(DIA_BLEND_AUTO, canvas, canvas_stride, delta, delta_stride, delta_channels,
+                         alpha_map, alpha_stride, alpha_channels, width, height);
+}
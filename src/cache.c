@@ -0,0 +1,161 @@
+#include "dia.h"
+
+#include <string.h>
+
+typedef struct {
+    gchar *id;
+    GdkPixbuf *pixbuf;
+    gsize bytes;
+} CacheEntry;
+
+static void cache_entry_free(CacheEntry *entry) {
+    g_free(entry->id);
+    g_object_unref(entry->pixbuf);
+    g_free(entry);
+}
+
+DiaCanvasCache* dia_canvas_cache_new(gsize budget_bytes) {
+    DiaCanvasCache *cache = g_new0(DiaCanvasCache, 1);
+    g_mutex_init(&cache->lock);
+    g_queue_init(&cache->lru);
+    cache->entries = g_hash_table_new(g_str_hash, g_str_equal);
+    cache->budget = budget_bytes;
+    return cache;
+}
+
+// The store must outlive its views
+DiaCanvasCache* dia_canvas_cache_new_view(DiaCanvasCache *store, const gchar *scope) {
+    DiaCanvasCache *cache = g_new0(DiaCanvasCache, 1);
+    cache->store = store;
+    cache->scope = g_strdup(scope);
+    return cache;
+}
+
+void dia_canvas_cache_free(DiaCanvasCache *cache) {
+    if (!cache) return;
+    if (cache->store) {
+        g_free(cache->scope);
+        g_free(cache);
+        return;
+    }
+    g_hash_table_destroy(cache->entries);
+    g_queue_clear_full(&cache->lru, (GDestroyNotify)cache_entry_free);
+    g_mutex_clear(&cache->lock);
+    g_free(cache);
+}
+
+static DiaCanvasCache* store_of(DiaCanvasCache *cache) {
+    return cache->store ? cache->store : cache;
+}
+
+// Key of image_id in the store; NULL when the ID is used as it is
+static gchar* scoped_key(const DiaCanvasCache *cache, const gchar *image_id) {
+    return cache->scope ? g_strconcat(cache->scope, "/", image_id, NULL) : NULL;
+}
+
+// Drops least recently used canvases until the resident size fits the budget. Caller holds the lock.
+static void evict_to_budget(DiaCanvasCache *cache) {
+    while (cache->resident > cache->budget && !g_queue_is_empty(&cache->lru)) {
+        CacheEntry *victim = g_queue_pop_tail(&cache->lru);
+        g_hash_table_remove(cache->entries, victim->id);
+        cache->resident -= victim->bytes;
+        cache->evictions++;
+        cache_entry_free(victim);
+    }
+}
+
+GdkPixbuf* dia_canvas_cache_find_nearest(DiaCanvasCache *cache, GQueue *chain, guint *position) {
+    if (!cache) return NULL;
+
+    GdkPixbuf *found = NULL;
+    DiaCanvasCache *store = store_of(cache);
+    g_mutex_lock(&store->lock);
+
+    // chain runs root first, so walk from the requested image back towards the root
+    guint pos = g_queue_get_length(chain);
+    for (GList *l = g_queue_peek_tail_link(chain); l; l = l->prev) {
+        pos--;
+        g_autofree gchar *key = scoped_key(cache, l->data);
+        GList *link = g_hash_table_lookup(store->entries, key ? key : l->data);
+        if (link) {
+            CacheEntry *entry = link->data;
+            g_queue_unlink(&store->lru, link);
+            g_queue_push_head_link(&store->lru, link);
+            found = g_object_ref(entry->pixbuf);
+            *position = pos;
+            break;
+        }
+    }
+
+    // A view's lookups count towards its store too
+    if (found) cache->hits++;
+    else cache->misses++;
+    if (cache != store) {
+        if (found) store->hits++;
+        else store->misses++;
+    }
+
+    g_mutex_unlock(&store->lock);
+    return found;
+}
+
+gboolean dia_canvas_cache_contains(DiaCanvasCache *cache, const gchar *image_id) {
+    if (!cache || !image_id) return FALSE;
+
+    DiaCanvasCache *store = store_of(cache);
+    g_autofree gchar *key = scoped_key(cache, image_id);
+    g_mutex_lock(&store->lock);
+    gboolean found = g_hash_table_contains(store->entries, key ? key : image_id);
+    g_mutex_unlock(&store->lock);
+    return found;
+}
+
+void dia_canvas_cache_insert(DiaCanvasCache *cache, const gchar *image_id, GdkPixbuf *pixbuf) {
+    if (!cache || !image_id || !pixbuf) return;
+
+    DiaCanvasCache *store = store_of(cache);
+    gsize bytes = gdk_pixbuf_get_byte_length(pixbuf);
+    if (bytes > store->budget) return;
+
+    gchar *key = scoped_key(cache, image_id);
+    if (!key) key = g_strdup(image_id);
+    g_mutex_lock(&store->lock);
+
+    GList *existing = g_hash_table_lookup(store->entries, key);
+    if (existing) {
+        // Canvases for an ID never change, so just refresh its position
+        g_queue_unlink(&store->lru, existing);
+        g_queue_push_head_link(&store->lru, existing);
+        g_mutex_unlock(&store->lock);
+        g_free(key);
+        return;
+    }
+
+    CacheEntry *entry = g_new0(CacheEntry, 1);
+    entry->id = key;
+    entry->pixbuf = g_object_ref(pixbuf);
+    entry->bytes = bytes;
+
+    g_queue_push_head(&store->lru, entry);
+    g_hash_table_insert(store->entries, entry->id, g_queue_peek_head_link(&store->lru));
+    store->resident += bytes;
+    evict_to_budget(store);
+
+    g_mutex_unlock(&store->lock);
+}
+
+// A view reports its own hits and misses against the occupancy of the whole store
+void dia_canvas_cache_get_stats(DiaCanvasCache *cache, DiaCacheStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (!cache) return;
+
+    DiaCanvasCache *store = store_of(cache);
+    g_mutex_lock(&store->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = store->evictions;
+    stats->resident = store->resident;
+    stats->budget = store->budget;
+    stats->count = g_queue_get_length(&store->lru);
+    g_mutex_unlock(&store->lock);
+}
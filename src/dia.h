@@ -0,0 +1,367 @@
+#pragma once
+
+// GTK-free core shared by the browser and the command-line tools
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <zip.h>
+#include <json-glib/json-glib.h>
+#include <errno.h>
+#include <stdio.h>
+
+// One central directory record of the archive
+typedef struct {
+    gchar *name;
+    guint64 header_offset;
+    guint64 compressed_size;
+    guint64 size;
+    guint16 method;
+    guint16 flags;
+} DiaEntry;
+
+// Cropped piece of a delta, composited at (x, y) on its parent's canvas
+typedef struct {
+    const gchar *path;
+    guint32 entry;  // zip entry index hint, DIA_INDEX_NONE when unknown
+    gint x;
+    gint y;
+} DiaDeltaTile;
+
+// Downscaled rendition of a whole image, stored in its own file and decoded without the chain
+typedef struct {
+    const gchar *path;
+    guint32 entry;  // zip entry index hint, DIA_INDEX_NONE when unknown
+    guint size;     // longest side in pixels
+} DiaPreview;
+
+// optimization_map.bin: little-endian, stored uncompressed so it is used in place from the
+// mapping. Image i has ID "i". Layout: header, images[n_images], roots[n_roots],
+// children[n_children], tiles[n_tiles], previews[n_previews], then n_pool bytes of
+// NUL-terminated strings. String fields are pool offsets; parent/child/root fields are image
+// indices. Version 1 predates previews and is still read. Version 3 has the same layout; its
+// alpha entries are alpha deltas along the tree (src/alpha.c) rather than full alpha maps.
+#define DIA_INDEX_NAME "optimization_map.bin"
+#define DIA_INDEX_MAGIC 0x58414944u  // "DIAX"
+#define DIA_INDEX_VERSION 3
+#define DIA_INDEX_NONE 0xFFFFFFFFu
+
+typedef struct {
+    guint32 magic;
+    guint32 version;
+    guint32 n_images;
+    guint32 n_roots;
+    guint32 n_children;
+    guint32 n_tiles;
+    guint32 n_pool;
+    guint32 n_previews;   // always 0 in version 1
+} DiaIndexHeader;
+
+typedef struct {
+    guint32 id;
+    guint32 path;
+    guint32 entry;        // zip entry of path, or NONE (tiled deltas have no file of their own)
+    guint32 parent;       // NONE for roots
+    guint32 alpha;        // NONE without an alpha map
+    guint32 alpha_entry;
+    guint32 depth;
+    guint32 first_child;
+    guint32 n_children;
+    guint32 first_tile;
+    guint32 n_tiles;      // NONE for a full-canvas delta
+    guint32 first_preview; // NONE without previews; unused in version 1
+} DiaIndexImage;
+
+typedef struct {
+    guint32 path;
+    guint32 entry;
+    gint32 x;
+    gint32 y;
+} DiaIndexTile;
+
+// An image's previews are consecutive records, smallest first
+typedef struct {
+    guint32 image;
+    guint32 size;
+    guint32 path;
+    guint32 entry;
+} DiaIndexPreview;
+
+// Long-lived archive reader: the file is mapped and indexed once, reads are thread-safe
+typedef struct {
+    gchar *path;
+    GMappedFile *mapped;
+    const guint8 *base;
+    gsize length;
+    GArray *entries;
+    GHashTable *entry_index;
+    zip_t *zip;
+    GMutex zip_lock;
+    GMutex codec_lock;
+    struct ZSTD_DDict_s *zmask_dict;  // loaded on first use, see src/zmask.c
+
+    // Reconstruction map, filled in by dia_archive_load_map() and read through the dia_archive_*
+    // map queries. Either the binary index is used in place, or the JSON map is copied into tables.
+    GBytes *index_bytes;
+    const DiaIndexHeader *index;
+    const DiaIndexImage *index_images;
+    const guint32 *index_roots;
+    const guint32 *index_children;
+    const DiaIndexTile *index_tiles;
+    const DiaIndexPreview *index_previews;
+    const gchar *index_pool;
+
+    GHashTable *image_map;
+    GHashTable *dependencies;
+    GHashTable *alpha_map;
+    gboolean alpha_deltas;    // "alpha_encoding": "delta", see src/alpha.c
+    GHashTable *delta_tiles;  // id -> GArray of DiaDeltaTile; ids without an entry use a full-canvas delta
+    GHashTable *previews;     // id -> GArray of DiaPreview, smallest first
+    GHashTable *children;
+    GPtrArray *root_images;
+    GPtrArray *image_ids;     // borrowed image_map keys, for indexed iteration
+} DiaArchive;
+
+// LRU cache of fully reconstructed canvases, keyed by image ID and bounded by a byte budget.
+// A view keys its entries by "scope/ID" in the store it was made from, so several archives can
+// share one budget; lookups and inserts go to the store, and the view keeps its own hit counts.
+// A view without a scope uses the store's own keys, which only separates the counts.
+typedef struct _DiaCanvasCache DiaCanvasCache;
+
+struct _DiaCanvasCache {
+    GMutex lock;
+    GHashTable *entries;
+    GQueue lru;
+    gsize budget;
+    gsize resident;
+    guint64 hits;
+    guint64 misses;
+    guint64 evictions;
+    DiaCanvasCache *store;  // NULL unless this is a view
+    gchar *scope;           // NULL for a view that shares the store's keys
+};
+
+typedef struct {
+    guint64 hits;
+    guint64 misses;
+    guint64 evictions;
+    gsize resident;
+    gsize budget;
+    guint count;
+} DiaCacheStats;
+
+// Delta-apply kernels, selected at runtime by CPU support
+typedef enum {
+    DIA_BLEND_AUTO,
+    DIA_BLEND_SCALAR,
+    DIA_BLEND_SSE2,
+    DIA_BLEND_AVX2
+} DiaBlendImpl;
+
+// Whole-archive restore
+typedef struct {
+    const gchar *output_dir;
+    FILE *tar_stream;
+    guint jobs;
+} DiaExtractOptions;
+
+typedef struct {
+    guint images;
+    guint trees;
+    guint unreachable;
+    guint64 bytes;
+} DiaExtractStats;
+
+// Reconstruction server, see src/serve.c
+#define DIA_DEFAULT_SERVE_PORT 8080
+#define DIA_DEFAULT_SERVE_CACHE_MB 1024
+#define DIA_DEFAULT_SERVE_QUEUE 256
+
+typedef struct {
+    DiaArchive **archives;
+    const gchar *const *names;  // archive name in request paths
+    guint n_archives;
+    const gchar *socket_path;   // UNIX socket to listen on, or NULL
+    guint port;                 // localhost TCP port, or 0
+    guint workers;              // requests handled at once; 0 means one per core
+    guint queue;                // connections waiting for a worker before new ones get 503
+    gsize cache_budget;
+    gint png_compression;
+} DiaServeOptions;
+
+// All-pairs similarity scoring for the encoder
+#define DIA_DEFAULT_SCORE_MB 4096
+
+typedef enum {
+    DIA_SCORE_PIXELS,  // identical pixels, higher is better
+    DIA_SCORE_BYTES,   // estimated compressed delta size, lower is better
+} DiaScoreMetric;
+
+typedef struct {
+    guint jobs;
+    gsize memory_budget;
+    DiaScoreMetric metric;
+    // Optional flattened (id1, id2) candidate list; NULL scores every pair within each bucket
+    const guint *pairs;
+    gsize n_pairs;
+} DiaScoreOptions;
+
+typedef struct {
+    guint images;
+    guint skipped;
+    guint buckets;
+    guint64 pairs;
+    guint64 decodes;
+} DiaScoreStats;
+
+typedef void (*DiaScoreEdgeFunc)(guint64 score, guint id1, guint id2, gpointer user_data);
+
+// zmask delta codec; tiles are told apart from PNG ones by their magic
+#define DIA_ZMASK_MAGIC "DIAZ"
+#define DIA_ZMASK_DICT_NAME "zmask.dict"
+
+gboolean dia_zmask_is_delta(GBytes *bytes);
+gboolean dia_zmask_apply(DiaArchive *archive, GBytes *bytes, GdkPixbuf *canvas_pixbuf, gint x, gint y,
+                         const gchar *name, GError **error);
+void dia_zmask_clear(DiaArchive *archive);
+struct ZSTD_DCtx_s* dia_zstd_thread_dctx(void);
+
+// Alpha deltas along the tree, replacing full alpha maps; see src/alpha.c
+#define DIA_ALPHA_MAGIC "DIAA"
+
+typedef struct _DiaAlphaDelta DiaAlphaDelta;
+
+gboolean dia_alpha_is_delta(GBytes *bytes);
+DiaAlphaDelta* dia_alpha_delta_decode(GBytes *bytes, const gchar *name, GError **error);
+void dia_alpha_delta_get_size(const DiaAlphaDelta *delta, gint *width, gint *height);
+gboolean dia_alpha_delta_apply(const DiaAlphaDelta *delta, GdkPixbuf *canvas_pixbuf, GError **error);
+void dia_alpha_delta_free(DiaAlphaDelta *delta);
+
+// JPEG families, patched in the DCT coefficient domain and decoded once; see src/jpegcoef.c
+#define DIA_JPEG_DELTA_MAGIC "DIAJ"
+
+typedef struct _DiaJpegCoefs DiaJpegCoefs;
+
+gboolean dia_jpeg_is_image(GBytes *bytes);
+gboolean dia_jpeg_is_delta(GBytes *bytes);
+DiaJpegCoefs* dia_jpeg_coefs_new(GBytes *jpeg, const gchar *name, GError **error);
+DiaJpegCoefs* dia_jpeg_coefs_copy(const DiaJpegCoefs *coefs);
+void dia_jpeg_coefs_free(DiaJpegCoefs *coefs);
+gboolean dia_jpeg_coefs_apply(DiaJpegCoefs *coefs, GBytes *delta, const gchar *name, GError **error);
+GdkPixbuf* dia_jpeg_coefs_render(const DiaJpegCoefs *coefs, GError **error);
+GBytes* dia_jpeg_coefs_save(const DiaJpegCoefs *coefs, GError **error);
+GBytes* dia_jpeg_delta_encode(const DiaJpegCoefs *base, const DiaJpegCoefs *image, GError **error);
+
+// Stage tracing, see src/trace.c. Built in unless compiled with -DDIA_TRACE=0 (make TRACE=0),
+// and off until dia_trace_init() is given a spec. A disabled scope costs one predictable branch.
+//   DIA_TRACE_SCOPE(span, "render.tile");   // recorded when span goes out of scope
+//   DIA_TRACE_BYTES(span, size);            // optional payload, summed per stage
+#ifndef DIA_TRACE
+#define DIA_TRACE 1
+#endif
+
+typedef struct {
+    const gchar *name;  // string literal
+    gint64 start;       // ns, 0 when tracing was off at the start of the scope
+    guint64 bytes;
+} DiaTraceSpan;
+
+gboolean dia_trace_init(const gchar *spec, GError **error);
+
+#if DIA_TRACE
+extern gboolean dia_trace_on;
+gint64 dia_trace_now(void);
+void dia_trace_record(const DiaTraceSpan *span);
+
+static inline DiaTraceSpan dia_trace_begin(const gchar *name) {
+    DiaTraceSpan span = { name, G_UNLIKELY(dia_trace_on) ? dia_trace_now() : 0, 0 };
+    return span;
+}
+
+static inline void dia_trace_end(DiaTraceSpan *span) {
+    if (G_UNLIKELY(span->start)) dia_trace_record(span);
+}
+
+#define DIA_TRACE_SCOPE(var, name) \
+    DiaTraceSpan var __attribute__((cleanup(dia_trace_end))) = dia_trace_begin(name)
+#define DIA_TRACE_BYTES(var, n) ((var).bytes += (guint64)(n))
+#else
+#define DIA_TRACE_SCOPE(var, name) G_GNUC_UNUSED DiaTraceSpan var = { name, 0, 0 }
+#define DIA_TRACE_BYTES(var, n) ((void)(var))
+#endif
+
+// Rendering. Chain links are decoded ahead of compositing on a shared pool; every decoded link
+// in flight holds up to a canvas worth of pixels, hence the modest default.
+#define DIA_DEFAULT_DECODE_THREADS 8
+
+GdkPixbuf* render_composite_image(DiaArchive *archive, DiaCanvasCache *cache, const gchar *image_id, GCancellable *cancellable, GError **error);
+GdkPixbuf* dia_render_base(DiaArchive *archive, const gchar *base_id, GdkPixbuf **alpha_out, GError **error);
+gboolean dia_render_overlay(DiaArchive *archive, GdkPixbuf *canvas_pixbuf, const gchar *overlay_id, GdkPixbuf **alpha_out, GError **error);
+DiaJpegCoefs* dia_render_jpeg_base(DiaArchive *archive, const gchar *base_id, GError **error);
+gboolean dia_render_jpeg_overlay(DiaArchive *archive, DiaJpegCoefs *coefs, const gchar *overlay_id, GError **error);
+GdkPixbuf* dia_render_output(DiaArchive *archive, const gchar *image_id, GdkPixbuf *canvas, GdkPixbuf *alpha, GError **error);
+GdkPixbuf* dia_render_preview(DiaArchive *archive, const gchar *image_id, guint min_size, guint *size_out, GError **error);
+gboolean apply_alpha_map_to_pixbuf(GdkPixbuf *pixbuf, GdkPixbuf *alpha_map_pixbuf, gboolean combine_with_existing, GError **error);
+void dia_render_set_decode_threads(guint n_threads);
+guint dia_render_get_decode_threads(void);
+
+// Blending
+void dia_blend_delta(guint8 *canvas, int canvas_stride,
+                     const guint8 *delta, int delta_stride, int delta_channels,
+                     const guint8 *alpha_map, int alpha_stride, int alpha_channels,
+                     int width, int height);
+void dia_blend_delta_with(DiaBlendImpl impl, guint8 *canvas, int canvas_stride,
+                          const guint8 *delta, int delta_stride, int delta_channels,
+                          const guint8 *alpha_map, int alpha_stride, int alpha_channels,
+                          int width, int height);
+DiaBlendImpl dia_blend_default_impl(void);
+gboolean dia_blend_impl_supported(DiaBlendImpl impl);
+const gchar* dia_blend_impl_name(DiaBlendImpl impl);
+
+// Canvas cache
+DiaCanvasCache* dia_canvas_cache_new(gsize budget_bytes);
+DiaCanvasCache* dia_canvas_cache_new_view(DiaCanvasCache *store, const gchar *scope);
+void dia_canvas_cache_free(DiaCanvasCache *cache);
+GdkPixbuf* dia_canvas_cache_find_nearest(DiaCanvasCache *cache, GQueue *chain, guint *position);
+gboolean dia_canvas_cache_contains(DiaCanvasCache *cache, const gchar *image_id);
+void dia_canvas_cache_insert(DiaCanvasCache *cache, const gchar *image_id, GdkPixbuf *pixbuf);
+void dia_canvas_cache_get_stats(DiaCanvasCache *cache, DiaCacheStats *stats);
+
+// Extraction
+gboolean dia_extract_archive(DiaArchive *archive, const DiaExtractOptions *options, DiaExtractStats *stats, GError **error);
+
+// Serving; runs until SIGINT or SIGTERM
+gboolean dia_serve(const DiaServeOptions *options, GError **error);
+
+// Scoring
+void dia_score_images(const gchar *const *paths, guint n_paths, const DiaScoreOptions *options,
+                      DiaScoreEdgeFunc emit, gpointer user_data, DiaScoreStats *stats);
+
+// IO helpers
+DiaArchive* dia_archive_open(const char *path, GError **error);
+void dia_archive_free(DiaArchive *archive);
+gint64 dia_archive_lookup(DiaArchive *archive, const char *name);
+GBytes* dia_archive_read_index(DiaArchive *archive, guint64 index, GError **error);
+GBytes* dia_archive_read(DiaArchive *archive, const char *inner_filename, GError **error);
+GBytes* dia_archive_read_hinted(DiaArchive *archive, guint32 entry_hint, const char *inner_filename, GError **error);
+GdkPixbuf* load_pixbuf_from_memory(const gchar *buffer, gsize size, GError **error);
+GdkPixbuf* load_pixbuf_from_bytes(GBytes *bytes, GError **error);
+
+// Map queries. Returned strings are owned by the archive; unknown IDs give NULL, 0 or -1.
+gboolean dia_archive_load_map(DiaArchive *archive, GError **error);
+guint dia_archive_n_images(DiaArchive *archive);
+const gchar* dia_archive_image_id(DiaArchive *archive, guint index);
+const gchar* dia_archive_image_path(DiaArchive *archive, const gchar *image_id, guint32 *entry_hint);
+const gchar* dia_archive_parent(DiaArchive *archive, const gchar *image_id);
+gboolean dia_archive_is_jpeg(DiaArchive *archive, const gchar *image_id);
+const gchar* dia_archive_alpha_path(DiaArchive *archive, const gchar *image_id, guint32 *entry_hint);
+gboolean dia_archive_alpha_deltas(DiaArchive *archive);
+gint dia_archive_n_tiles(DiaArchive *archive, const gchar *image_id);
+void dia_archive_get_tile(DiaArchive *archive, const gchar *image_id, guint index, DiaDeltaTile *tile);
+guint dia_archive_n_previews(DiaArchive *archive, const gchar *image_id);
+void dia_archive_get_preview(DiaArchive *archive, const gchar *image_id, guint index, DiaPreview *preview);
+guint dia_archive_n_children(DiaArchive *archive, const gchar *image_id);
+const gchar* dia_archive_child(DiaArchive *archive, const gchar *image_id, guint index);
+guint dia_archive_n_roots(DiaArchive *archive);
+const gchar* dia_archive_root(DiaArchive *archive, guint index);
+guint dia_archive_chain_depth(DiaArchive *archive, const gchar *image_id);
@@ -0,0 +1,390 @@
+#include "dia.h"
+
+#include <glib/gstdio.h>
+#include <string.h>
+
+#define TAR_BLOCK 512
+
+typedef struct {
+    DiaArchive *archive;
+    const DiaExtractOptions *options;
+    GMutex lock;
+    GError *error;
+    gint failed;
+    guint64 mtime;
+    guint images;
+    guint64 bytes;
+} ExtractContext;
+
+// One node of the depth-first walk whose children are still being visited. JPEG trees carry
+// coefficient blocks instead of a canvas.
+typedef struct {
+    const gchar *id;
+    GdkPixbuf *canvas;
+    DiaJpegCoefs *coefs;
+    guint next_child;
+} ExtractFrame;
+
+typedef struct {
+    const gchar *root_id;
+    guint size;
+} ExtractTree;
+
+static void record_error(ExtractContext *ctx, GError *error) {
+    g_mutex_lock(&ctx->lock);
+    if (!ctx->error) ctx->error = error;
+    else g_error_free(error);
+    g_mutex_unlock(&ctx->lock);
+    g_atomic_int_set(&ctx->failed, 1);
+}
+
+// ustar numeric fields are zero-padded octal terminated by NUL
+static void tar_octal(guint8 *field, gsize width, guint64 value) {
+    g_snprintf((gchar*)field, width, "%0*" G_GINT64_MODIFIER "o", (int)(width - 1), value);
+}
+
+static gboolean tar_write(FILE *out, const void *buffer, gsize size, GError **error) {
+    if (size && fwrite(buffer, 1, size, out) != size) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), "Could not write tar stream: %s", g_strerror(errno));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static gboolean tar_write_padding(FILE *out, guint64 size, GError **error) {
+    static const guint8 zeros[TAR_BLOCK];
+    gsize pad = (gsize)((TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+    return tar_write(out, zeros, pad, error);
+}
+
+static gboolean tar_write_header(FILE *out, const gchar *name, const gchar *prefix, gchar type,
+                                 guint64 size, guint64 mtime, GError **error) {
+    guint8 block[TAR_BLOCK];
+    memset(block, 0, sizeof(block));
+
+    memcpy(block, name, MIN(strlen(name), 100));
+    tar_octal(block + 100, 8, 0644);
+    tar_octal(block + 108, 8, 0);
+    tar_octal(block + 116, 8, 0);
+    tar_octal(block + 124, 12, size);
+    tar_octal(block + 136, 12, mtime);
+    block[156] = (guint8)type;
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+    if (prefix) memcpy(block + 345, prefix, MIN(strlen(prefix), 155));
+
+    // The checksum is computed with its own field read as spaces
+    memset(block + 148, ' ', 8);
+    guint checksum = 0;
+    for (gsize i = 0; i < sizeof(block); i++) checksum += block[i];
+    g_snprintf((gchar*)block + 148, 8, "%06o", checksum);
+    block[155] = ' ';
+
+    return tar_write(out, block, sizeof(block), error);
+}
+
+// End-of-archive marker: two zero blocks
+static gboolean tar_write_end(FILE *out, GError **error) {
+    static const guint8 zeros[2 * TAR_BLOCK];
+    if (!tar_write(out, zeros, sizeof(zeros), error)) return FALSE;
+    if (fflush(out) != 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), "Could not write tar stream: %s", g_strerror(errno));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static gsize decimal_digits(gsize value) {
+    gsize digits = 1;
+    while (value >= 10) {
+        value /= 10;
+        digits++;
+    }
+    return digits;
+}
+
+// Names that fit neither the 100-byte name field nor a prefix/name split get a PAX path record
+static gboolean tar_write_entry(FILE *out, const gchar *path, const gchar *contents, gsize size,
+                                guint64 mtime, GError **error) {
+    gsize len = strlen(path);
+    g_autofree gchar *prefix = NULL;
+    const gchar *name = path;
+
+    if (len > 100) {
+        const gchar *split = NULL;
+        for (const gchar *p = strchr(path, '/'); p; p = strchr(p + 1, '/')) {
+            if ((gsize)(p - path) <= 155 && len - (gsize)(p - path) - 1 <= 100) {
+                split = p;
+                break;
+            }
+        }
+
+        if (split) {
+            prefix = g_strndup(path, (gsize)(split - path));
+            name = split + 1;
+        } else {
+            // The record length counts its own digits
+            gsize body = strlen(" path=") + len + 1;
+            gsize record_len = body;
+            while (body + decimal_digits(record_len) != record_len) {
+                record_len = body + decimal_digits(record_len);
+            }
+            g_autofree gchar *record = g_strdup_printf("%" G_GSIZE_FORMAT " path=%s\n", record_len, path);
+            if (!tar_write_header(out, "PaxHeader", NULL, 'x', record_len, mtime, error) ||
+                !tar_write(out, record, record_len, error) ||
+                !tar_write_padding(out, record_len, error)) {
+                return FALSE;
+            }
+        }
+    }
+
+    return tar_write_header(out, name, prefix, '0', size, mtime, error) &&
+           tar_write(out, contents, size, error) &&
+           tar_write_padding(out, size, error);
+}
+
+// Archive paths come from the map, so keep them from escaping the output directory
+static gboolean is_safe_relative_path(const gchar *path) {
+    if (!path || !*path || g_path_is_absolute(path)) return FALSE;
+
+    gchar **parts = g_strsplit(path, "/", -1);
+    gboolean safe = TRUE;
+    for (gint i = 0; parts[i]; i++) {
+        if (strcmp(parts[i], "..") == 0) safe = FALSE;
+    }
+    g_strfreev(parts);
+    return safe;
+}
+
+static gboolean emit_file(ExtractContext *ctx, const gchar *image_id, const gchar *contents, gsize size, GError **error) {
+    const gchar *rel_path = dia_archive_image_path(ctx->archive, image_id, NULL);
+    if (!is_safe_relative_path(rel_path)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_FILENAME, "Refusing to extract ID '%s' to '%s'", image_id, rel_path ? rel_path : "");
+        return FALSE;
+    }
+
+    gboolean ok;
+    if (ctx->options->tar_stream) {
+        g_mutex_lock(&ctx->lock);
+        ok = tar_write_entry(ctx->options->tar_stream, rel_path, contents, size, ctx->mtime, error);
+        g_mutex_unlock(&ctx->lock);
+    } else {
+        g_autofree gchar *path = g_build_filename(ctx->options->output_dir, rel_path, NULL);
+        g_autofree gchar *dir = g_path_get_dirname(path);
+        if (g_mkdir_with_parents(dir, 0755) != 0) {
+            int saved_errno = errno;
+            g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved_errno), "Could not create '%s': %s", dir, g_strerror(saved_errno));
+            return FALSE;
+        }
+        ok = g_file_set_contents(path, contents, (gssize)size, error);
+    }
+    if (!ok) return FALSE;
+
+    g_mutex_lock(&ctx->lock);
+    ctx->images++;
+    ctx->bytes += size;
+    g_mutex_unlock(&ctx->lock);
+    return TRUE;
+}
+
+static gboolean emit_image(ExtractContext *ctx, const gchar *image_id, GdkPixbuf *canvas, GdkPixbuf *alpha, GError **error) {
+    g_autoptr(GdkPixbuf) out = dia_render_output(ctx->archive, image_id, canvas, alpha, error);
+    if (!out) return FALSE;
+
+    g_autofree gchar *png = NULL;
+    gsize png_size = 0;
+    if (!gdk_pixbuf_save_to_buffer(out, &png, &png_size, "png", error, NULL)) {
+        g_prefix_error(error, "Could not encode ID '%s': ", image_id);
+        return FALSE;
+    }
+    return emit_file(ctx, image_id, png, png_size, error);
+}
+
+// A JPEG root is written out exactly as stored. Its coefficients are only needed if it has
+// descendants.
+static gboolean extract_root(ExtractContext *ctx, ExtractFrame *frame, GError **error) {
+    if (!dia_archive_is_jpeg(ctx->archive, frame->id)) {
+        GdkPixbuf *alpha = NULL;
+        frame->canvas = dia_render_base(ctx->archive, frame->id, &alpha, error);
+        gboolean ok = frame->canvas && emit_image(ctx, frame->id, frame->canvas, alpha, error);
+        g_clear_object(&alpha);
+        return ok;
+    }
+
+    guint32 entry;
+    const gchar *path = dia_archive_image_path(ctx->archive, frame->id, &entry);
+    if (!path) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Could not find filename for ID '%s'", frame->id);
+        return FALSE;
+    }
+    g_autoptr(GBytes) source = dia_archive_read_hinted(ctx->archive, entry, path, error);
+    if (!source) return FALSE;
+    gsize size;
+    const gchar *data = g_bytes_get_data(source, &size);
+    if (!emit_file(ctx, frame->id, data, size, error)) return FALSE;
+    if (dia_archive_n_children(ctx->archive, frame->id) == 0) return TRUE;
+
+    frame->coefs = dia_render_jpeg_base(ctx->archive, frame->id, error);
+    return frame->coefs != NULL;
+}
+
+// JPEG descendants are written as a lossless re-encoding of their patched coefficients, which
+// decodes to exactly the pixels of the source file
+static gboolean extract_child(ExtractContext *ctx, ExtractFrame *frame, GError **error) {
+    if (frame->coefs) {
+        if (!dia_render_jpeg_overlay(ctx->archive, frame->coefs, frame->id, error)) return FALSE;
+        g_autoptr(GBytes) jpeg = dia_jpeg_coefs_save(frame->coefs, error);
+        if (!jpeg) return FALSE;
+        gsize size;
+        const gchar *data = g_bytes_get_data(jpeg, &size);
+        return emit_file(ctx, frame->id, data, size, error);
+    }
+
+    GdkPixbuf *alpha = NULL;
+    gboolean ok = dia_render_overlay(ctx->archive, frame->canvas, frame->id, &alpha, error) &&
+                  emit_image(ctx, frame->id, frame->canvas, alpha, error);
+    g_clear_object(&alpha);
+    return ok;
+}
+
+static void clear_frame(ExtractFrame *frame) {
+    g_clear_object(&frame->canvas);
+    g_clear_pointer(&frame->coefs, dia_jpeg_coefs_free);
+}
+
+// Depth-first over one dependency tree. Every delta is decoded once: each child starts from a
+// copy of its parent's canvas, and the last child takes the parent's canvas over outright, so
+// a plain chain never copies at all.
+static void extract_tree(gpointer root_data, gpointer user_data) {
+    ExtractContext *ctx = (ExtractContext*)user_data;
+    const gchar *root_id = (const gchar*)root_data;
+    if (g_atomic_int_get(&ctx->failed)) return;
+
+    GError *error = NULL;
+    GArray *stack = g_array_new(FALSE, FALSE, sizeof(ExtractFrame));
+
+    ExtractFrame root = { root_id, NULL, NULL, 0 };
+    gboolean ok = extract_root(ctx, &root, &error);
+    if (ok && dia_archive_n_children(ctx->archive, root_id) > 0) {
+        g_array_append_val(stack, root);
+    } else {
+        clear_frame(&root);
+    }
+
+    while (ok && stack->len > 0) {
+        if (g_atomic_int_get(&ctx->failed)) break;
+
+        ExtractFrame *top = &g_array_index(stack, ExtractFrame, stack->len - 1);
+        guint n_siblings = dia_archive_n_children(ctx->archive, top->id);
+        ExtractFrame child = { dia_archive_child(ctx->archive, top->id, top->next_child++), NULL, NULL, 0 };
+
+        if (top->next_child == n_siblings) {
+            child.canvas = top->canvas;
+            child.coefs = top->coefs;
+            g_array_set_size(stack, stack->len - 1);
+        } else if (top->coefs) {
+            child.coefs = dia_jpeg_coefs_copy(top->coefs);
+        } else {
+            child.canvas = gdk_pixbuf_copy(top->canvas);
+            if (!child.canvas) {
+                g_set_error(&error, G_IO_ERROR, G_IO_ERROR_NO_SPACE, "Could not allocate canvas for ID '%s'", child.id);
+                break;
+            }
+        }
+
+        ok = extract_child(ctx, &child, &error);
+        if (ok && dia_archive_n_children(ctx->archive, child.id) > 0) {
+            g_array_append_val(stack, child);
+        } else {
+            clear_frame(&child);
+        }
+    }
+
+    for (guint i = 0; i < stack->len; i++) {
+        clear_frame(&g_array_index(stack, ExtractFrame, i));
+    }
+    g_array_free(stack, TRUE);
+
+    if (error) record_error(ctx, error);
+}
+
+static guint count_tree(DiaArchive *archive, const gchar *root_id) {
+    guint count = 0;
+    GPtrArray *pending = g_ptr_array_new();
+    g_ptr_array_add(pending, (gpointer)root_id);
+    while (pending->len > 0) {
+        const gchar *id = g_ptr_array_steal_index_fast(pending, pending->len - 1);
+        count++;
+        guint n_children = dia_archive_n_children(archive, id);
+        for (guint i = 0; i < n_children; i++) {
+            g_ptr_array_add(pending, (gpointer)dia_archive_child(archive, id, i));
+        }
+    }
+    g_ptr_array_unref(pending);
+    return count;
+}
+
+static gint compare_tree_size_desc(gconstpointer a, gconstpointer b) {
+    const ExtractTree *ta = a;
+    const ExtractTree *tb = b;
+    return (ta->size < tb->size) - (ta->size > tb->size);
+}
+
+gboolean dia_extract_archive(DiaArchive *archive, const DiaExtractOptions *options, DiaExtractStats *stats, GError **error) {
+    memset(stats, 0, sizeof(*stats));
+    if (!archive->index && !archive->image_ids) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Archive map has not been loaded");
+        return FALSE;
+    }
+
+    ExtractContext ctx = { 0 };
+    ctx.archive = archive;
+    ctx.options = options;
+    g_mutex_init(&ctx.lock);
+
+    GStatBuf st;
+    if (g_stat(archive->path, &st) == 0) ctx.mtime = (guint64)st.st_mtime;
+
+    // Largest trees first so one long tree does not start last and leave the other cores idle
+    guint n_roots = dia_archive_n_roots(archive);
+    GArray *trees = g_array_sized_new(FALSE, FALSE, sizeof(ExtractTree), n_roots);
+    guint reachable = 0;
+    for (guint i = 0; i < n_roots; i++) {
+        ExtractTree tree = { dia_archive_root(archive, i), 0 };
+        tree.size = count_tree(archive, tree.root_id);
+        reachable += tree.size;
+        g_array_append_val(trees, tree);
+    }
+    g_array_sort(trees, compare_tree_size_desc);
+
+    guint jobs = options->jobs ? options->jobs : g_get_num_processors();
+    GThreadPool *pool = g_thread_pool_new(extract_tree, &ctx, (gint)MAX(1u, MIN(jobs, trees->len)), TRUE, error);
+    if (!pool) {
+        g_array_free(trees, TRUE);
+        g_mutex_clear(&ctx.lock);
+        return FALSE;
+    }
+    for (guint i = 0; i < trees->len; i++) {
+        g_thread_pool_push(pool, (gpointer)g_array_index(trees, ExtractTree, i).root_id, NULL);
+    }
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    if (!ctx.error && options->tar_stream) {
+        tar_write_end(options->tar_stream, &ctx.error);
+    }
+
+    stats->images = ctx.images;
+    stats->trees = trees->len;
+    stats->bytes = ctx.bytes;
+    guint n_images = dia_archive_n_images(archive);
+    stats->unreachable = n_images - MIN(reachable, n_images);
+
+    g_array_free(trees, TRUE);
+    g_mutex_clear(&ctx.lock);
+
+    if (ctx.error) {
+        g_propagate_error(error, ctx.error);
+        return FALSE;
+    }
+    return TRUE;
+}
@@ -0,0 +1,263 @@
+#include "viewer.h"
+
+// Thumbnail grid over the images in tree order. Layout is pure arithmetic on the scroll offset, so
+// a frame only paints the visible cells from ready-made surfaces; missing thumbnails are decoded
+// from the stored previews by a small pool and painted when they land.
+
+#define DIA_THUMB_SIZE 160
+#define DIA_THUMB_CELL (DIA_THUMB_SIZE + 16)
+#define DIA_THUMB_CACHE_ENTRIES 1024
+
+typedef struct {
+    DiaThumbGrid *grid;
+    guint position;
+    gchar *image_id;
+    GdkPixbuf *pixbuf;
+    gboolean failed;
+    guint source_id;  // idle source that delivers the job
+} ThumbJob;
+
+static void thumb_job_free(ThumbJob *job) {
+    g_free(job->image_id);
+    if (job->pixbuf) g_object_unref(job->pixbuf);
+    g_free(job);
+}
+
+static GdkPixbuf* fit_thumbnail(GdkPixbuf *pixbuf) {
+    int width = gdk_pixbuf_get_width(pixbuf);
+    int height = gdk_pixbuf_get_height(pixbuf);
+    if (width <= DIA_THUMB_SIZE && height <= DIA_THUMB_SIZE) return g_object_ref(pixbuf);
+
+    double scale = MIN((double)DIA_THUMB_SIZE / width, (double)DIA_THUMB_SIZE / height);
+    return gdk_pixbuf_scale_simple(pixbuf, MAX(1, (int)(width * scale)), MAX(1, (int)(height * scale)), GDK_INTERP_BILINEAR);
+}
+
+// Back on the main thread
+static gboolean deliver_thumbnail(gpointer user_data) {
+    ThumbJob *job = (ThumbJob*)user_data;
+    DiaThumbGrid *grid = job->grid;
+    gpointer key = GUINT_TO_POINTER(job->position);
+
+    g_mutex_lock(&grid->delivery_lock);
+    g_queue_remove(&grid->deliveries, job);
+    g_mutex_unlock(&grid->delivery_lock);
+
+    g_hash_table_remove(grid->requested, key);
+    if (job->pixbuf || job->failed) {
+        // Failures are remembered as a NULL surface so they are not retried on every frame
+        cairo_surface_t *surface = job->pixbuf ? gdk_cairo_surface_create_from_pixbuf(job->pixbuf, 1, NULL) : NULL;
+        g_hash_table_insert(grid->thumbs, key, surface);
+        g_queue_push_tail(&grid->order, key);
+        while (g_queue_get_length(&grid->order) > DIA_THUMB_CACHE_ENTRIES) {
+            g_hash_table_remove(grid->thumbs, g_queue_pop_head(&grid->order));
+        }
+        gtk_widget_queue_draw(grid->area);
+    }
+
+    thumb_job_free(job);
+    return G_SOURCE_REMOVE;
+}
+
+// Runs on the thumbnail pool. Positions scrolled far out of view are dropped undecoded.
+static void thumbnail_worker(gpointer job_data, gpointer user_data) {
+    ThumbJob *job = (ThumbJob*)job_data;
+    DiaThumbGrid *grid = job->grid;
+    (void)user_data;
+
+    if (g_atomic_int_get(&grid->closing)) {
+        // The grid is being freed and nothing will take the result
+        thumb_job_free(job);
+        return;
+    }
+
+    gint first = g_atomic_int_get(&grid->visible_first);
+    gint last = g_atomic_int_get(&grid->visible_last);
+    gint margin = last - first + 1;
+    if ((gint)job->position >= first - margin && (gint)job->position <= last + margin) {
+        g_autoptr(GError) error = NULL;
+        g_autoptr(GdkPixbuf) source = dia_render_preview(grid->data->archive, job->image_id, DIA_THUMB_SIZE, NULL, &error);
+        if (!source && g_error_matches(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
+            // Small images and older archives have no previews
+            g_clear_error(&error);
+            source = render_composite_image(grid->data->archive, grid->data->canvas_cache, job->image_id, NULL, &error);
+        }
+        if (source) {
+            job->pixbuf = fit_thumbnail(source);
+        } else {
+            g_printerr("[dia] thumbnail of '%s' failed: %s\n", job->image_id, error ? error->message : "Unknown error");
+            job->failed = TRUE;
+        }
+    }
+
+    // Listed under the lock, so the grid can drop the delivery if it is freed first
+    g_mutex_lock(&grid->delivery_lock);
+    job->source_id = g_idle_add(deliver_thumbnail, job);
+    g_queue_push_tail(&grid->deliveries, job);
+    g_mutex_unlock(&grid->delivery_lock);
+}
+
+static void request_thumbnail(DiaThumbGrid *grid, guint position) {
+    gpointer key = GUINT_TO_POINTER(position);
+    if (g_hash_table_contains(grid->requested, key)) return;
+    g_hash_table_add(grid->requested, key);
+
+    ThumbJob *job = g_new0(ThumbJob, 1);
+    job->grid = grid;
+    job->position = position;
+    job->image_id = g_strdup(dia_tree_model_image_id(grid->model, position));
+    g_thread_pool_push(grid->pool, job, NULL);
+}
+
+static gint grid_margin(DiaThumbGrid *grid) {
+    return (gtk_widget_get_allocated_width(grid->area) - grid->columns * DIA_THUMB_CELL) / 2;
+}
+
+static gboolean on_grid_draw(GtkWidget *area, cairo_t *cr, gpointer user_data) {
+    DiaThumbGrid *grid = (DiaThumbGrid*)user_data;
+    gint width = gtk_widget_get_allocated_width(area);
+    gint height = gtk_widget_get_allocated_height(area);
+    gtk_render_background(gtk_widget_get_style_context(area), cr, 0, 0, width, height);
+
+    guint n_images = dia_tree_model_n_images(grid->model);
+    gdouble value = gtk_adjustment_get_value(grid->adjustment);
+    guint first_row = (guint)(value / DIA_THUMB_CELL);
+    gint margin = grid_margin(grid);
+    guint first = first_row * (guint)grid->columns;
+    guint last = first;
+
+    for (guint row = first_row; row * DIA_THUMB_CELL - value < height; row++) {
+        gdouble y = row * DIA_THUMB_CELL - value;
+        for (gint column = 0; column < grid->columns; column++) {
+            guint position = row * (guint)grid->columns + (guint)column;
+            if (position >= n_images) break;
+            last = position;
+
+            gdouble x = margin + column * DIA_THUMB_CELL;
+            gpointer key = GUINT_TO_POINTER(position);
+            cairo_surface_t *surface = NULL;
+            if (!g_hash_table_lookup_extended(grid->thumbs, key, NULL, (gpointer*)&surface)) {
+                request_thumbnail(grid, position);
+            }
+            if (surface) {
+                gint thumb_width = cairo_image_surface_get_width(surface);
+                gint thumb_height = cairo_image_surface_get_height(surface);
+                cairo_set_source_surface(cr, surface, x + (DIA_THUMB_CELL - thumb_width) / 2, y + (DIA_THUMB_CELL - thumb_height) / 2);
+                cairo_paint(cr);
+            } else {
+                cairo_set_source_rgba(cr, 0.5, 0.5, 0.5, 0.2);
+                cairo_rectangle(cr, x + (DIA_THUMB_CELL - DIA_THUMB_SIZE) / 2, y + (DIA_THUMB_CELL - DIA_THUMB_SIZE) / 2, DIA_THUMB_SIZE, DIA_THUMB_SIZE);
+                cairo_fill(cr);
+            }
+        }
+    }
+
+    g_atomic_int_set(&grid->visible_first, (gint)first);
+    g_atomic_int_set(&grid->visible_last, (gint)last);
+    return TRUE;
+}
+
+static void on_grid_size_allocate(GtkWidget *area, GdkRectangle *allocation, gpointer user_data) {
+    DiaThumbGrid *grid = (DiaThumbGrid*)user_data;
+    (void)area;
+
+    // Keep the first visible image in view when the column count changes
+    guint first = (guint)(gtk_adjustment_get_value(grid->adjustment) / DIA_THUMB_CELL) * (guint)grid->columns;
+    grid->columns = MAX(1, allocation->width / DIA_THUMB_CELL);
+    guint n_images = dia_tree_model_n_images(grid->model);
+    guint rows = (n_images + (guint)grid->columns - 1) / (guint)grid->columns;
+    gtk_adjustment_configure(grid->adjustment, (gdouble)(first / (guint)grid->columns) * DIA_THUMB_CELL, 0,
+                             (gdouble)rows * DIA_THUMB_CELL, DIA_THUMB_CELL / 2.0, allocation->height * 0.9, allocation->height);
+}
+
+static gboolean on_grid_scroll(GtkWidget *area, GdkEventScroll *event, gpointer user_data) {
+    DiaThumbGrid *grid = (DiaThumbGrid*)user_data;
+    (void)area;
+
+    gdouble delta = 0;
+    if (event->direction == GDK_SCROLL_SMOOTH) delta = event->delta_y;
+    else if (event->direction == GDK_SCROLL_UP) delta = -1;
+    else if (event->direction == GDK_SCROLL_DOWN) delta = 1;
+    else return FALSE;
+
+    gdouble value = gtk_adjustment_get_value(grid->adjustment) + delta * gtk_adjustment_get_step_increment(grid->adjustment);
+    gdouble max = gtk_adjustment_get_upper(grid->adjustment) - gtk_adjustment_get_page_size(grid->adjustment);
+    gtk_adjustment_set_value(grid->adjustment, CLAMP(value, 0, MAX(max, 0)));
+    return TRUE;
+}
+
+// A click selects the image in the tree and returns to the single-image view
+static gboolean on_grid_button_press(GtkWidget *area, GdkEventButton *event, gpointer user_data) {
+    DiaThumbGrid *grid = (DiaThumbGrid*)user_data;
+    (void)area;
+    if (event->type != GDK_BUTTON_PRESS || event->button != GDK_BUTTON_PRIMARY) return FALSE;
+
+    gint column = (gint)(event->x - grid_margin(grid)) / DIA_THUMB_CELL;
+    if (event->x < grid_margin(grid) || column >= grid->columns) return FALSE;
+    guint row = (guint)((gtk_adjustment_get_value(grid->adjustment) + event->y) / DIA_THUMB_CELL);
+    GtkTreePath *path = dia_tree_model_image_path(grid->model, row * (guint)grid->columns + (guint)column);
+    if (!path) return FALSE;
+
+    GtkTreeView *tree_view = GTK_TREE_VIEW(grid->data->tree_view);
+    gtk_tree_view_expand_to_path(tree_view, path);
+    gtk_tree_selection_select_path(gtk_tree_view_get_selection(tree_view), path);
+    gtk_tree_view_scroll_to_cell(tree_view, path, NULL, FALSE, 0, 0);
+    gtk_tree_path_free(path);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(grid->data->grid_toggle), FALSE);
+    return TRUE;
+}
+
+static void on_grid_scrolled(GtkAdjustment *adjustment, gpointer user_data) {
+    DiaThumbGrid *grid = (DiaThumbGrid*)user_data;
+    (void)adjustment;
+    gtk_widget_queue_draw(grid->area);
+}
+
+DiaThumbGrid* dia_thumb_grid_new(AppData *data, DiaTreeModel *model) {
+    DiaThumbGrid *grid = g_new0(DiaThumbGrid, 1);
+    grid->data = data;
+    grid->model = g_object_ref(model);
+    grid->columns = 1;
+    grid->thumbs = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)cairo_surface_destroy);
+    grid->requested = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_queue_init(&grid->order);
+    g_mutex_init(&grid->delivery_lock);
+    g_queue_init(&grid->deliveries);
+    grid->pool = g_thread_pool_new(thumbnail_worker, NULL, CLAMP((gint)g_get_num_processors() / 2, 1, 4), FALSE, NULL);
+
+    grid->adjustment = g_object_ref_sink(gtk_adjustment_new(0, 0, 0, 0, 0, 0));
+    g_signal_connect(grid->adjustment, "value-changed", G_CALLBACK(on_grid_scrolled), grid);
+
+    grid->area = gtk_drawing_area_new();
+    gtk_widget_add_events(grid->area, GDK_SCROLL_MASK | GDK_SMOOTH_SCROLL_MASK | GDK_BUTTON_PRESS_MASK);
+    g_signal_connect(grid->area, "draw", G_CALLBACK(on_grid_draw), grid);
+    g_signal_connect(grid->area, "size-allocate", G_CALLBACK(on_grid_size_allocate), grid);
+    g_signal_connect(grid->area, "scroll-event", G_CALLBACK(on_grid_scroll), grid);
+    g_signal_connect(grid->area, "button-press-event", G_CALLBACK(on_grid_button_press), grid);
+
+    grid->widget = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
+    gtk_box_pack_start(GTK_BOX(grid->widget), grid->area, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(grid->widget), gtk_scrollbar_new(GTK_ORIENTATION_VERTICAL, grid->adjustment), FALSE, FALSE, 0);
+    return grid;
+}
+
+// Call from the main thread once its loop has stopped. Deliveries still pending there would
+// reach a freed grid, so their sources are removed with the jobs.
+void dia_thumb_grid_free(DiaThumbGrid *grid) {
+    if (!grid) return;
+    // Queued jobs still pass through the worker, which frees them unrun
+    g_atomic_int_set(&grid->closing, TRUE);
+    g_thread_pool_free(grid->pool, FALSE, TRUE);
+    for (GList *l = grid->deliveries.head; l; l = l->next) {
+        ThumbJob *job = (ThumbJob*)l->data;
+        g_source_remove(job->source_id);
+        thumb_job_free(job);
+    }
+    g_queue_clear(&grid->deliveries);
+    g_mutex_clear(&grid->delivery_lock);
+    g_hash_table_destroy(grid->thumbs);
+    g_hash_table_destroy(grid->requested);
+    g_queue_clear(&grid->order);
+    g_object_unref(grid->adjustment);
+    g_object_unref(grid->model);
+    g_free(grid);
+}
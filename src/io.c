@@ -1,68 +1,305 @@
-#include "viewer.h"
+#include "dia.h"
 
-gchar* read_file_from_zip(const char *zip_path, const char *inner_filename, gsize *size, GError **error) {
-    if (!inner_filename) {
-        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Inner filename cannot be NULL");
-        return NULL;
+#include <string.h>
+
+#define ZIP_LOCAL_HEADER_SIG   0x04034b50u
+#define ZIP_CENTRAL_HEADER_SIG 0x02014b50u
+#define ZIP_EOCD_SIG           0x06054b50u
+#define ZIP_EOCD64_LOC_SIG     0x07064b50u
+#define ZIP_EOCD64_SIG         0x06064b50u
+#define ZIP_METHOD_STORED      0
+
+static guint16 rd16(const guint8 *p) {
+    return (guint16)(p[0] | (p[1] << 8));
+}
+
+static guint32 rd32(const guint8 *p) {
+    return (guint32)p[0] | ((guint32)p[1] << 8) | ((guint32)p[2] << 16) | ((guint32)p[3] << 24);
+}
+
+static guint64 rd64(const guint8 *p) {
+    return (guint64)rd32(p) | ((guint64)rd32(p + 4) << 32);
+}
+
+// Applies the zip64 extended information extra field to values that overflowed 32 bits
+static void apply_zip64_extra(const guint8 *extra, gsize extra_len, DiaEntry *entry, gboolean need_size, gboolean need_csize, gboolean need_offset) {
+    gsize pos = 0;
+    while (pos + 4 <= extra_len) {
+        guint16 id = rd16(extra + pos);
+        guint16 len = rd16(extra + pos + 2);
+        const guint8 *field = extra + pos + 4;
+        if (pos + 4 + len > extra_len) return;
+        if (id == 0x0001) {
+            gsize off = 0;
+            if (need_size && off + 8 <= len) { entry->size = rd64(field + off); off += 8; }
+            if (need_csize && off + 8 <= len) { entry->compressed_size = rd64(field + off); off += 8; }
+            if (need_offset && off + 8 <= len) { entry->header_offset = rd64(field + off); }
+            return;
+        }
+        pos += 4 + len;
     }
-    
-    int err = 0;
-    zip_t *archive = zip_open(zip_path, 0, &err);
-    if (!archive) {
-        zip_error_t zip_err;
-        zip_error_init_with_code(&zip_err, err);
-        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to open zip archive '%s': %s", 
-                   zip_path, zip_error_strerror(&zip_err));
-        zip_error_fini(&zip_err);
-        return NULL;
+}
+
+static gboolean parse_central_directory(DiaArchive *archive, GError **error) {
+    const guint8 *base = archive->base;
+    gsize length = archive->length;
+
+    if (length < 22) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "'%s' is too small to be a zip archive", archive->path);
+        return FALSE;
     }
-    
-    struct zip_stat stat;
-    zip_stat_init(&stat);
-    if (zip_stat(archive, inner_filename, 0, &stat) < 0) {
-        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "File not found in zip archive: %s", inner_filename);
-        zip_close(archive);
+
+    // The end of central directory record sits within the last 64 KiB (+ record size)
+    gsize eocd = 0;
+    gboolean found = FALSE;
+    gsize lower = length > 22 + 0xFFFF ? length - 22 - 0xFFFF : 0;
+    for (gsize pos = length - 22; ; pos--) {
+        if (rd32(base + pos) == ZIP_EOCD_SIG) {
+            eocd = pos;
+            found = TRUE;
+            break;
+        }
+        if (pos == lower) break;
+    }
+    if (!found) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "'%s' has no end of central directory record", archive->path);
+        return FALSE;
+    }
+
+    guint64 n_entries = rd16(base + eocd + 10);
+    guint64 cd_size = rd32(base + eocd + 12);
+    guint64 cd_offset = rd32(base + eocd + 16);
+
+    if (eocd >= 20 && rd32(base + eocd - 20) == ZIP_EOCD64_LOC_SIG) {
+        guint64 eocd64 = rd64(base + eocd - 20 + 8);
+        if (eocd64 + 56 > length || rd32(base + eocd64) != ZIP_EOCD64_SIG) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "'%s' has a corrupt zip64 end of central directory", archive->path);
+            return FALSE;
+        }
+        n_entries = rd64(base + eocd64 + 32);
+        cd_size = rd64(base + eocd64 + 40);
+        cd_offset = rd64(base + eocd64 + 48);
+    }
+
+    if (cd_offset > length || cd_size > length - cd_offset) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "'%s' has a central directory outside the file", archive->path);
+        return FALSE;
+    }
+
+    archive->entries = g_array_sized_new(FALSE, TRUE, sizeof(DiaEntry), (guint)MIN(n_entries, cd_size / 46));
+    archive->entry_index = g_hash_table_new(g_str_hash, g_str_equal);
+
+    const guint8 *p = base + cd_offset;
+    const guint8 *end = p + cd_size;
+    for (guint64 i = 0; i < n_entries; i++) {
+        if (p + 46 > end || rd32(p) != ZIP_CENTRAL_HEADER_SIG) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "'%s' has a corrupt central directory entry #%" G_GUINT64_FORMAT, archive->path, i);
+            return FALSE;
+        }
+        guint16 name_len = rd16(p + 28);
+        guint16 extra_len = rd16(p + 30);
+        guint16 comment_len = rd16(p + 32);
+        if (p + 46 + name_len + extra_len + comment_len > end) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "'%s' has a truncated central directory entry #%" G_GUINT64_FORMAT, archive->path, i);
+            return FALSE;
+        }
+
+        DiaEntry entry = {0};
+        entry.flags = rd16(p + 8);
+        entry.method = rd16(p + 10);
+        entry.compressed_size = rd32(p + 20);
+        entry.size = rd32(p + 24);
+        entry.header_offset = rd32(p + 42);
+        apply_zip64_extra(p + 46 + name_len, extra_len, &entry,
+                          entry.size == 0xFFFFFFFFu, entry.compressed_size == 0xFFFFFFFFu, entry.header_offset == 0xFFFFFFFFu);
+        entry.name = g_strndup((const gchar*)p + 46, name_len);
+        g_array_append_val(archive->entries, entry);
+
+        // Later duplicates win, matching how appended entries shadow older ones
+        DiaEntry *stored = &g_array_index(archive->entries, DiaEntry, archive->entries->len - 1);
+        g_hash_table_insert(archive->entry_index, stored->name, GUINT_TO_POINTER(archive->entries->len));
+
+        p += 46 + name_len + extra_len + comment_len;
+    }
+
+    return TRUE;
+}
+
+DiaArchive* dia_archive_open(const char *path, GError **error) {
+    DIA_TRACE_SCOPE(span, "archive.open");
+    GMappedFile *mapped = g_mapped_file_new(path, FALSE, error);
+    if (!mapped) return NULL;
+
+    DiaArchive *archive = g_new0(DiaArchive, 1);
+    archive->path = g_strdup(path);
+    archive->mapped = mapped;
+    archive->base = (const guint8*)g_mapped_file_get_contents(mapped);
+    archive->length = g_mapped_file_get_length(mapped);
+    g_mutex_init(&archive->zip_lock);
+    g_mutex_init(&archive->codec_lock);
+    DIA_TRACE_BYTES(span, archive->length);
+
+    if (!parse_central_directory(archive, error)) {
+        dia_archive_free(archive);
         return NULL;
     }
-    
-    zip_file_t* file_in_zip = zip_fopen(archive, inner_filename, 0);
+
+    g_print("[dia] indexed %u entries in '%s'\n", archive->entries->len, path);
+    return archive;
+}
+
+void dia_archive_free(DiaArchive *archive) {
+    if (!archive) return;
+    if (archive->index_bytes) g_bytes_unref(archive->index_bytes);
+    if (archive->image_ids) g_ptr_array_unref(archive->image_ids);
+    if (archive->root_images) g_ptr_array_unref(archive->root_images);
+    if (archive->children) g_hash_table_destroy(archive->children);
+    if (archive->image_map) g_hash_table_destroy(archive->image_map);
+    if (archive->dependencies) g_hash_table_destroy(archive->dependencies);
+    if (archive->alpha_map) g_hash_table_destroy(archive->alpha_map);
+    if (archive->delta_tiles) g_hash_table_destroy(archive->delta_tiles);
+    if (archive->previews) g_hash_table_destroy(archive->previews);
+    if (archive->zip) zip_close(archive->zip);
+    g_mutex_clear(&archive->zip_lock);
+    dia_zmask_clear(archive);
+    g_mutex_clear(&archive->codec_lock);
+    if (archive->entry_index) g_hash_table_destroy(archive->entry_index);
+    if (archive->entries) {
+        for (guint i = 0; i < archive->entries->len; i++) {
+            g_free(g_array_index(archive->entries, DiaEntry, i).name);
+        }
+        g_array_free(archive->entries, TRUE);
+    }
+    if (archive->mapped) g_mapped_file_unref(archive->mapped);
+    g_free(archive->path);
+    g_free(archive);
+}
+
+gint64 dia_archive_lookup(DiaArchive *archive, const char *name) {
+    if (!archive || !name) return -1;
+    gpointer value = g_hash_table_lookup(archive->entry_index, name);
+    return value ? (gint64)GPOINTER_TO_UINT(value) - 1 : -1;
+}
+
+// Compressed entries go through libzip, whose handles are not thread-safe, so they are serialized
+static GBytes* read_compressed_entry(DiaArchive *archive, guint64 index, const DiaEntry *entry, GError **error) {
+    DIA_TRACE_SCOPE(span, "zip.inflate");
+    g_mutex_lock(&archive->zip_lock);
+
+    if (!archive->zip) {
+        int err = 0;
+        archive->zip = zip_open(archive->path, ZIP_RDONLY, &err);
+        if (!archive->zip) {
+            zip_error_t zip_err;
+            zip_error_init_with_code(&zip_err, err);
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to open zip archive '%s': %s",
+                       archive->path, zip_error_strerror(&zip_err));
+            zip_error_fini(&zip_err);
+            g_mutex_unlock(&archive->zip_lock);
+            return NULL;
+        }
+    }
+
+    zip_file_t *file_in_zip = zip_fopen_index(archive->zip, index, 0);
     if (!file_in_zip) {
-        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to open file '%s' inside zip archive: %s", 
-                   inner_filename, zip_strerror(archive));
-        zip_close(archive);
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to open file '%s' inside zip archive: %s",
+                   entry->name, zip_strerror(archive->zip));
+        g_mutex_unlock(&archive->zip_lock);
         return NULL;
     }
-    
-    guint8 *buffer = g_malloc(stat.size);
-    zip_int64_t bytes_read = zip_fread(file_in_zip, buffer, stat.size);
+
+    guint8 *buffer = g_malloc(entry->size);
+    zip_int64_t bytes_read = zip_fread(file_in_zip, buffer, entry->size);
     zip_fclose(file_in_zip);
-    zip_close(archive);
-    
-    if (bytes_read < 0 || (guint64)bytes_read != stat.size) {
-        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, 
-                   "Failed to read all bytes from '%s' in zip archive.", inner_filename);
+    g_mutex_unlock(&archive->zip_lock);
+
+    if (bytes_read < 0 || (guint64)bytes_read != entry->size) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Failed to read all bytes from '%s' in zip archive.", entry->name);
         g_free(buffer);
         return NULL;
     }
-    
-    *size = (gsize)bytes_read;
-    return (gchar*)buffer;
+
+    DIA_TRACE_BYTES(span, entry->size);
+    return g_bytes_new_take(buffer, entry->size);
+}
+
+GBytes* dia_archive_read_index(DiaArchive *archive, guint64 index, GError **error) {
+    if (!archive || index >= archive->entries->len) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Entry index %" G_GUINT64_FORMAT " out of range", index);
+        return NULL;
+    }
+
+    const DiaEntry *entry = &g_array_index(archive->entries, DiaEntry, index);
+
+    // Encrypted entries and anything but STORED need libzip to decode them
+    if (entry->method != ZIP_METHOD_STORED || (entry->flags & 0x1)) {
+        return read_compressed_entry(archive, index, entry, error);
+    }
+
+    if (entry->header_offset + 30 > archive->length || rd32(archive->base + entry->header_offset) != ZIP_LOCAL_HEADER_SIG) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Corrupt local header for '%s'", entry->name);
+        return NULL;
+    }
+
+    const guint8 *header = archive->base + entry->header_offset;
+    guint64 data_offset = entry->header_offset + 30 + rd16(header + 26) + rd16(header + 28);
+    if (data_offset > archive->length || entry->size > archive->length - data_offset) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Entry '%s' extends past the end of the archive", entry->name);
+        return NULL;
+    }
+
+    // Zero-copy: the bytes keep the mapping alive for as long as they are referenced
+    return g_bytes_new_with_free_func(archive->base + data_offset, entry->size,
+                                      (GDestroyNotify)g_mapped_file_unref, g_mapped_file_ref(archive->mapped));
+}
+
+GBytes* dia_archive_read(DiaArchive *archive, const char *inner_filename, GError **error) {
+    if (!inner_filename) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Inner filename cannot be NULL");
+        return NULL;
+    }
+
+    gint64 index = dia_archive_lookup(archive, inner_filename);
+    if (index < 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "File not found in zip archive: %s", inner_filename);
+        return NULL;
+    }
+
+    return dia_archive_read_index(archive, (guint64)index, error);
+}
+
+// Reads by entry index when the hint still names the same file, skipping the name lookup
+GBytes* dia_archive_read_hinted(DiaArchive *archive, guint32 entry_hint, const char *inner_filename, GError **error) {
+    if (archive && inner_filename && entry_hint < archive->entries->len &&
+        strcmp(g_array_index(archive->entries, DiaEntry, entry_hint).name, inner_filename) == 0) {
+        return dia_archive_read_index(archive, entry_hint, error);
+    }
+    return dia_archive_read(archive, inner_filename, error);
 }
 
 GdkPixbuf* load_pixbuf_from_memory(const gchar *buffer, gsize size, GError **error) {
+    DIA_TRACE_SCOPE(span, "image.decode");
+    DIA_TRACE_BYTES(span, size);
     g_autoptr(GdkPixbufLoader) loader = gdk_pixbuf_loader_new();
-    
+
     if (!gdk_pixbuf_loader_write(loader, (const guint8*)buffer, size, error)) {
         return NULL;
     }
-    
+
     if (!gdk_pixbuf_loader_close(loader, error)) {
         return NULL;
     }
-    
+
     GdkPixbuf *pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
     if (pixbuf) {
         g_object_ref(pixbuf);
     }
     return pixbuf;
 }
+
+GdkPixbuf* load_pixbuf_from_bytes(GBytes *bytes, GError **error) {
+    gsize size = 0;
+    const gchar *buffer = g_bytes_get_data(bytes, &size);
+    return load_pixbuf_from_memory(buffer, size, error);
+}
@@ -0,0 +1,498 @@
+#include "dia.h"
+
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jpeglib.h>
+#include <zstd.h>
+
+// JPEG families are chained in the DCT domain: the root is the source JPEG stored unchanged, and
+// each descendant stores only the 8x8 coefficient blocks that differ from its parent. A chain is
+// patched block by block and decoded once, so every image comes out with exactly the
+// coefficients, and therefore the pixels, of its source file.
+//
+// Delta file, written by `dia jpeg-delta`. Little-endian header:
+//   "DIAJ", version, n_components, mask_frame_size, then width_in_blocks, height_in_blocks and
+//   n_changed per component (u32 each after the magic)
+// followed by a zstd frame of mask_frame_size bytes holding, per component, a change bitmap of
+// ceil(width_in_blocks / 8) bytes per block row, least significant bit first. The rest of the
+// file is a JPEG with the family's tables whose changed blocks carry the new coefficients and
+// whose unchanged blocks are zero. The bitmap is what marks a block as changed, so a block
+// that changes to all zeros is still copied; Huffman coding of the blocks beats zstd on raw
+// coefficients by about a quarter.
+#define JPEG_DELTA_VERSION 1
+#define JPEG_DELTA_ZSTD_LEVEL 12
+#define JPEG_MAX_COMPONENTS 3
+#define JPEG_BLOCK_BYTES (DCTSIZE2 * sizeof(JCOEF))
+
+typedef struct {
+    guint width_in_blocks;
+    guint height_in_blocks;
+    guint h_samp_factor;
+    guint v_samp_factor;
+    guint16 quant[DCTSIZE2];
+    JCOEF *blocks;  // DCTSIZE2 coefficients per block, blocks in raster order
+} JpegPlane;
+
+struct _DiaJpegCoefs {
+    GBytes *source;  // root JPEG; its headers describe every image of the family
+    guint width;
+    guint height;
+    J_COLOR_SPACE color_space;
+    guint n_components;
+    JpegPlane planes[JPEG_MAX_COMPONENTS];
+};
+
+// libjpeg reports fatal errors through error_exit, which must not return
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+    char message[JMSG_LENGTH_MAX];
+} JpegError;
+
+static void jpeg_error_exit(j_common_ptr cinfo) {
+    JpegError *err = (JpegError*)cinfo->err;
+    err->pub.format_message(cinfo, err->message);
+    longjmp(err->jump, 1);
+}
+
+// Warnings are kept quiet; the first one is remembered in case the caller treats it as fatal
+static void jpeg_output_message(j_common_ptr cinfo) {
+    JpegError *err = (JpegError*)cinfo->err;
+    if (!err->message[0]) err->pub.format_message(cinfo, err->message);
+}
+
+static struct jpeg_error_mgr* jpeg_error_init(JpegError *err) {
+    jpeg_std_error(&err->pub);
+    err->pub.error_exit = jpeg_error_exit;
+    err->pub.output_message = jpeg_output_message;
+    err->message[0] = '\0';
+    return &err->pub;
+}
+
+static guint32 rd32(const guint8 *p) {
+    return (guint32)p[0] | ((guint32)p[1] << 8) | ((guint32)p[2] << 16) | ((guint32)p[3] << 24);
+}
+
+static void wr32(guint8 *p, guint32 value) {
+    p[0] = (guint8)value;
+    p[1] = (guint8)(value >> 8);
+    p[2] = (guint8)(value >> 16);
+    p[3] = (guint8)(value >> 24);
+}
+
+gboolean dia_jpeg_is_image(GBytes *bytes) {
+    gsize size;
+    const guint8 *data = g_bytes_get_data(bytes, &size);
+    return size >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF;
+}
+
+gboolean dia_jpeg_is_delta(GBytes *bytes) {
+    gsize size;
+    const guint8 *data = g_bytes_get_data(bytes, &size);
+    return size >= 16 && memcmp(data, DIA_JPEG_DELTA_MAGIC, 4) == 0;
+}
+
+void dia_jpeg_coefs_free(DiaJpegCoefs *coefs) {
+    if (!coefs) return;
+    for (guint c = 0; c < JPEG_MAX_COMPONENTS; c++) g_free(coefs->planes[c].blocks);
+    if (coefs->source) g_bytes_unref(coefs->source);
+    g_free(coefs);
+}
+
+static gsize plane_blocks(const JpegPlane *plane) {
+    return (gsize)plane->width_in_blocks * plane->height_in_blocks;
+}
+
+// Decodes the entropy-coded data of a JPEG into coefficient blocks, without any IDCT. Source
+// files with recoverable damage read the way any decoder shows them; the JPEGs inside deltas
+// are written by us, so for them (strict) a warning means a corrupt archive.
+static DiaJpegCoefs* read_coefficients(GBytes *jpeg, const gchar *name, gboolean strict, GError **error) {
+    gsize size;
+    const guint8 *data = g_bytes_get_data(jpeg, &size);
+    DiaJpegCoefs *coefs = g_new0(DiaJpegCoefs, 1);
+    coefs->source = g_bytes_ref(jpeg);
+
+    struct jpeg_decompress_struct cinfo;
+    memset(&cinfo, 0, sizeof(cinfo));
+    JpegError jerr;
+    cinfo.err = jpeg_error_init(&jerr);
+    if (setjmp(jerr.jump)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Could not read JPEG '%s': %s", name, jerr.message);
+        jpeg_destroy_decompress(&cinfo);
+        dia_jpeg_coefs_free(coefs);
+        return NULL;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char*)data, (unsigned long)size);
+    jpeg_read_header(&cinfo, TRUE);
+
+    // Anything the viewer cannot turn into RGB; encode.py skips such files
+    if (cinfo.data_precision != 8 || cinfo.num_components > JPEG_MAX_COMPONENTS ||
+        (cinfo.jpeg_color_space != JCS_GRAYSCALE && cinfo.jpeg_color_space != JCS_YCbCr && cinfo.jpeg_color_space != JCS_RGB) ||
+        (cinfo.num_components == 1) != (cinfo.jpeg_color_space == JCS_GRAYSCALE)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "JPEG '%s' has an unsupported layout (%d components, %d-bit)",
+                    name, cinfo.num_components, cinfo.data_precision);
+        jpeg_destroy_decompress(&cinfo);
+        dia_jpeg_coefs_free(coefs);
+        return NULL;
+    }
+
+    jvirt_barray_ptr *arrays = jpeg_read_coefficients(&cinfo);
+    coefs->width = cinfo.image_width;
+    coefs->height = cinfo.image_height;
+    coefs->color_space = cinfo.jpeg_color_space;
+    coefs->n_components = (guint)cinfo.num_components;
+    for (guint c = 0; c < coefs->n_components; c++) {
+        const jpeg_component_info *comp = &cinfo.comp_info[c];
+        JpegPlane *plane = &coefs->planes[c];
+        plane->width_in_blocks = comp->width_in_blocks;
+        plane->height_in_blocks = comp->height_in_blocks;
+        plane->h_samp_factor = (guint)comp->h_samp_factor;
+        plane->v_samp_factor = (guint)comp->v_samp_factor;
+        if (comp->quant_table) {
+            for (int k = 0; k < DCTSIZE2; k++) plane->quant[k] = comp->quant_table->quantval[k];
+        }
+        plane->blocks = g_malloc_n(plane_blocks(plane), JPEG_BLOCK_BYTES);
+        for (guint row = 0; row < plane->height_in_blocks; row++) {
+            JBLOCKARRAY rows = cinfo.mem->access_virt_barray((j_common_ptr)&cinfo, arrays[c], row, 1, FALSE);
+            memcpy(plane->blocks + (gsize)row * plane->width_in_blocks * DCTSIZE2, rows[0],
+                   plane->width_in_blocks * JPEG_BLOCK_BYTES);
+        }
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    if (strict && jerr.pub.num_warnings > 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "JPEG '%s' is damaged: %s", name, jerr.message);
+        dia_jpeg_coefs_free(coefs);
+        return NULL;
+    }
+    return coefs;
+}
+
+DiaJpegCoefs* dia_jpeg_coefs_new(GBytes *jpeg, const gchar *name, GError **error) {
+    return read_coefficients(jpeg, name, FALSE, error);
+}
+
+DiaJpegCoefs* dia_jpeg_coefs_copy(const DiaJpegCoefs *coefs) {
+    DiaJpegCoefs *copy = g_new(DiaJpegCoefs, 1);
+    *copy = *coefs;
+    g_bytes_ref(copy->source);
+    for (guint c = 0; c < coefs->n_components; c++) {
+        const JpegPlane *plane = &coefs->planes[c];
+        copy->planes[c].blocks = g_malloc_n(plane_blocks(plane), JPEG_BLOCK_BYTES);
+        memcpy(copy->planes[c].blocks, plane->blocks, plane_blocks(plane) * JPEG_BLOCK_BYTES);
+    }
+    return copy;
+}
+
+// Blocks only line up between images with the same geometry, sampling and quantization
+static gboolean same_layout(const DiaJpegCoefs *a, const DiaJpegCoefs *b) {
+    if (a->width != b->width || a->height != b->height || a->color_space != b->color_space ||
+        a->n_components != b->n_components) {
+        return FALSE;
+    }
+    for (guint c = 0; c < a->n_components; c++) {
+        const JpegPlane *pa = &a->planes[c];
+        const JpegPlane *pb = &b->planes[c];
+        if (pa->width_in_blocks != pb->width_in_blocks || pa->height_in_blocks != pb->height_in_blocks ||
+            pa->h_samp_factor != pb->h_samp_factor || pa->v_samp_factor != pb->v_samp_factor ||
+            memcmp(pa->quant, pb->quant, sizeof(pa->quant)) != 0) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static gsize mask_stride(const JpegPlane *plane) {
+    return (plane->width_in_blocks + 7) / 8;
+}
+
+// Entropy-codes the blocks as a sequential JPEG with the root's tables. This is lossless: the
+// file holds exactly these coefficients.
+static GBytes* write_jpeg(const DiaJpegCoefs *coefs, gboolean optimize_coding, GError **error) {
+    gsize source_size;
+    const guint8 *source = g_bytes_get_data(coefs->source, &source_size);
+    unsigned char *buffer = NULL;
+    unsigned long size = 0;
+
+    // Zeroed so the error path can destroy whichever of the two was never created
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    memset(&src, 0, sizeof(src));
+    memset(&dst, 0, sizeof(dst));
+    JpegError jerr;
+    src.err = jpeg_error_init(&jerr);
+    dst.err = &jerr.pub;
+    if (setjmp(jerr.jump)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Could not encode JPEG coefficients: %s", jerr.message);
+        jpeg_destroy_compress(&dst);
+        jpeg_destroy_decompress(&src);
+        free(buffer);
+        return NULL;
+    }
+    jpeg_create_decompress(&src);
+    jpeg_create_compress(&dst);
+
+    // Only the root's headers are parsed; its quantization tables and sampling carry over
+    jpeg_mem_src(&src, (unsigned char*)source, (unsigned long)source_size);
+    jpeg_read_header(&src, TRUE);
+    jpeg_copy_critical_parameters(&src, &dst);
+    dst.optimize_coding = optimize_coding;
+
+    jvirt_barray_ptr arrays[JPEG_MAX_COMPONENTS];
+    for (guint c = 0; c < coefs->n_components; c++) {
+        const JpegPlane *plane = &coefs->planes[c];
+        arrays[c] = dst.mem->request_virt_barray((j_common_ptr)&dst, JPOOL_IMAGE, FALSE, plane->width_in_blocks,
+                                                 plane->height_in_blocks, dst.comp_info[c].v_samp_factor);
+    }
+    dst.mem->realize_virt_arrays((j_common_ptr)&dst);
+    for (guint c = 0; c < coefs->n_components; c++) {
+        const JpegPlane *plane = &coefs->planes[c];
+        for (guint row = 0; row < plane->height_in_blocks; row++) {
+            JBLOCKARRAY rows = dst.mem->access_virt_barray((j_common_ptr)&dst, arrays[c], row, 1, TRUE);
+            memcpy(rows[0], plane->blocks + (gsize)row * plane->width_in_blocks * DCTSIZE2,
+                   plane->width_in_blocks * JPEG_BLOCK_BYTES);
+        }
+    }
+
+    jpeg_mem_dest(&dst, &buffer, &size);
+    jpeg_write_coefficients(&dst, arrays);
+    jpeg_finish_compress(&dst);
+    jpeg_destroy_compress(&dst);
+    jpeg_destroy_decompress(&src);
+    return g_bytes_new_with_free_func(buffer, size, free, buffer);
+}
+
+static gboolean block_changed(const guint8 *mask, gsize stride, guint row, guint col) {
+    return (mask[row * stride + col / 8] >> (col % 8)) & 1;
+}
+
+// Encodes the blocks of image that differ from base; used by encode.py through `dia jpeg-delta`
+GBytes* dia_jpeg_delta_encode(const DiaJpegCoefs *base, const DiaJpegCoefs *image, GError **error) {
+    if (!same_layout(base, image)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    "JPEGs differ in size, sampling or quantization and cannot share coefficient blocks");
+        return NULL;
+    }
+
+    gsize header_size = 16 + 12 * (gsize)image->n_components;
+    g_autofree guint8 *header = g_malloc0(header_size);
+    memcpy(header, DIA_JPEG_DELTA_MAGIC, 4);
+    wr32(header + 4, JPEG_DELTA_VERSION);
+    wr32(header + 8, image->n_components);
+
+    // Unchanged blocks are zeroed so they cost next to nothing once entropy-coded
+    DiaJpegCoefs *changed = dia_jpeg_coefs_copy(image);
+    GByteArray *masks = g_byte_array_new();
+    for (guint c = 0; c < image->n_components; c++) {
+        JpegPlane *plane = &changed->planes[c];
+        const JCOEF *base_blocks = base->planes[c].blocks;
+        gsize stride = mask_stride(plane);
+        gsize mask_offset = masks->len;
+        g_byte_array_set_size(masks, masks->len + stride * plane->height_in_blocks);
+        memset(masks->data + mask_offset, 0, stride * plane->height_in_blocks);
+
+        guint32 n_changed = 0;
+        for (guint row = 0; row < plane->height_in_blocks; row++) {
+            for (guint col = 0; col < plane->width_in_blocks; col++) {
+                JCOEF *block = plane->blocks + ((gsize)row * plane->width_in_blocks + col) * DCTSIZE2;
+                const JCOEF *base_block = base_blocks + ((gsize)row * plane->width_in_blocks + col) * DCTSIZE2;
+                if (memcmp(block, base_block, JPEG_BLOCK_BYTES) == 0) {
+                    memset(block, 0, JPEG_BLOCK_BYTES);
+                    continue;
+                }
+                masks->data[mask_offset + row * stride + col / 8] |= (guint8)(1u << (col % 8));
+                n_changed++;
+            }
+        }
+        guint8 *fields = header + 16 + 12 * c;
+        wr32(fields, plane->width_in_blocks);
+        wr32(fields + 4, plane->height_in_blocks);
+        wr32(fields + 8, n_changed);
+    }
+
+    GBytes *jpeg = write_jpeg(changed, TRUE, error);
+    dia_jpeg_coefs_free(changed);
+    if (!jpeg) {
+        g_byte_array_unref(masks);
+        return NULL;
+    }
+
+    gsize jpeg_size;
+    const guint8 *jpeg_data = g_bytes_get_data(jpeg, &jpeg_size);
+    gsize bound = ZSTD_compressBound(masks->len);
+    guint8 *out = g_malloc(header_size + bound + jpeg_size);
+    size_t written = ZSTD_compress(out + header_size, bound, masks->data, masks->len, JPEG_DELTA_ZSTD_LEVEL);
+    g_byte_array_unref(masks);
+    if (ZSTD_isError(written)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Could not compress JPEG delta: %s", ZSTD_getErrorName(written));
+        g_bytes_unref(jpeg);
+        g_free(out);
+        return NULL;
+    }
+    wr32(header + 12, (guint32)written);
+    memcpy(out, header, header_size);
+    memcpy(out + header_size + written, jpeg_data, jpeg_size);
+    g_bytes_unref(jpeg);
+    return g_bytes_new_take(out, header_size + written + jpeg_size);
+}
+
+static guint64 count_set_bits(const guint8 *mask, gsize size) {
+    guint64 count = 0;
+    for (gsize i = 0; i < size; i++) count += (guint64)__builtin_popcount(mask[i]);
+    return count;
+}
+
+// Overwrites the changed blocks of coefs with those of the delta, in place
+gboolean dia_jpeg_coefs_apply(DiaJpegCoefs *coefs, GBytes *delta, const gchar *name, GError **error) {
+    gsize size;
+    const guint8 *data = g_bytes_get_data(delta, &size);
+    guint32 version = rd32(data + 4);
+    guint32 n_components = rd32(data + 8);
+    if (version != JPEG_DELTA_VERSION) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "JPEG delta '%s' has unknown version %u", name, version);
+        return FALSE;
+    }
+    gsize header_size = 16 + 12 * (gsize)coefs->n_components;
+    if (n_components != coefs->n_components || size < header_size) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "JPEG delta '%s' has %u components, its parent %u",
+                    name, n_components, coefs->n_components);
+        return FALSE;
+    }
+    gsize frame_size = rd32(data + 12);
+    if (frame_size > size - header_size) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "JPEG delta '%s' is truncated", name);
+        return FALSE;
+    }
+
+    gsize masks_size = 0;
+    for (guint c = 0; c < coefs->n_components; c++) {
+        const JpegPlane *plane = &coefs->planes[c];
+        const guint8 *fields = data + 16 + 12 * c;
+        if (rd32(fields) != plane->width_in_blocks || rd32(fields + 4) != plane->height_in_blocks) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "JPEG delta '%s' does not match the %ux%u blocks of component %u",
+                        name, plane->width_in_blocks, plane->height_in_blocks, c);
+            return FALSE;
+        }
+        masks_size += mask_stride(plane) * plane->height_in_blocks;
+    }
+
+    ZSTD_DCtx *dctx = dia_zstd_thread_dctx();
+    g_autofree guint8 *masks = g_try_malloc(MAX(masks_size, 1));
+    if (!dctx || !masks) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NO_SPACE, "Could not allocate %" G_GSIZE_FORMAT " bytes for '%s'", masks_size, name);
+        return FALSE;
+    }
+    size_t got = ZSTD_decompressDCtx(dctx, masks, masks_size, data + header_size, frame_size);
+    if (ZSTD_isError(got) || got != masks_size) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Could not decompress JPEG delta '%s': %s", name,
+                    ZSTD_isError(got) ? ZSTD_getErrorName(got) : "unexpected size");
+        return FALSE;
+    }
+    const guint8 *mask = masks;
+    for (guint c = 0; c < coefs->n_components; c++) {
+        const JpegPlane *plane = &coefs->planes[c];
+        gsize mask_size = mask_stride(plane) * plane->height_in_blocks;
+        guint32 n_changed = rd32(data + 16 + 12 * c + 8);
+        if (count_set_bits(mask, mask_size) != n_changed) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "JPEG delta '%s' has a change mask that does not match its %u blocks",
+                        name, n_changed);
+            return FALSE;
+        }
+        mask += mask_size;
+    }
+
+    // The changed blocks travel as a JPEG with the family's tables, which also proves they line up
+    g_autoptr(GBytes) jpeg = g_bytes_new_from_bytes(delta, header_size + frame_size, size - header_size - frame_size);
+    DiaJpegCoefs *changed = read_coefficients(jpeg, name, TRUE, error);
+    if (!changed) return FALSE;
+    if (!same_layout(coefs, changed)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "JPEG delta '%s' does not share its parent's tables", name);
+        dia_jpeg_coefs_free(changed);
+        return FALSE;
+    }
+
+    mask = masks;
+    for (guint c = 0; c < coefs->n_components; c++) {
+        JpegPlane *plane = &coefs->planes[c];
+        const JCOEF *src = changed->planes[c].blocks;
+        gsize stride = mask_stride(plane);
+        for (guint row = 0; row < plane->height_in_blocks; row++) {
+            gsize offset = (gsize)row * plane->width_in_blocks * DCTSIZE2;
+            for (guint col = 0; col < plane->width_in_blocks; col++) {
+                if (!block_changed(mask, stride, row, col)) continue;
+                memcpy(plane->blocks + offset + (gsize)col * DCTSIZE2, src + offset + (gsize)col * DCTSIZE2, JPEG_BLOCK_BYTES);
+            }
+        }
+        mask += stride * plane->height_in_blocks;
+    }
+    dia_jpeg_coefs_free(changed);
+    return TRUE;
+}
+
+// A standalone JPEG with the patched coefficients, for extraction
+GBytes* dia_jpeg_coefs_save(const DiaJpegCoefs *coefs, GError **error) {
+    return write_jpeg(coefs, TRUE, error);
+}
+
+// The single IDCT of the chain, with libjpeg's default decoder settings, into an RGBA canvas
+GdkPixbuf* dia_jpeg_coefs_render(const DiaJpegCoefs *coefs, GError **error) {
+    g_autoptr(GBytes) jpeg = write_jpeg(coefs, FALSE, error);
+    if (!jpeg) return NULL;
+    gsize size;
+    const guint8 *data = g_bytes_get_data(jpeg, &size);
+
+    GdkPixbuf *pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, (int)coefs->width, (int)coefs->height);
+    if (!pixbuf) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NO_SPACE, "Could not allocate a %ux%u canvas", coefs->width, coefs->height);
+        return NULL;
+    }
+    guint8 *pixels = gdk_pixbuf_get_pixels(pixbuf);
+    int stride = gdk_pixbuf_get_rowstride(pixbuf);
+    guint8 *row_buffer = g_malloc((gsize)coefs->width * 3);
+
+    struct jpeg_decompress_struct cinfo;
+    memset(&cinfo, 0, sizeof(cinfo));
+    JpegError jerr;
+    cinfo.err = jpeg_error_init(&jerr);
+    if (setjmp(jerr.jump)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Could not decode JPEG coefficients: %s", jerr.message);
+        jpeg_destroy_decompress(&cinfo);
+        g_free(row_buffer);
+        g_object_unref(pixbuf);
+        return NULL;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char*)data, (unsigned long)size);
+    jpeg_read_header(&cinfo, TRUE);
+    gboolean gray = cinfo.num_components == 1;
+#ifdef JCS_ALPHA_EXTENSIONS
+    cinfo.out_color_space = gray ? JCS_GRAYSCALE : JCS_EXT_RGBA;
+#else
+    cinfo.out_color_space = gray ? JCS_GRAYSCALE : JCS_RGB;
+#endif
+    jpeg_start_decompress(&cinfo);
+
+    while (cinfo.output_scanline < cinfo.output_height) {
+        guint8 *dst = pixels + (gsize)cinfo.output_scanline * stride;
+#ifdef JCS_ALPHA_EXTENSIONS
+        JSAMPROW row = gray ? row_buffer : dst;
+#else
+        JSAMPROW row = row_buffer;
+#endif
+        jpeg_read_scanlines(&cinfo, &row, 1);
+        if (row == dst) continue;
+        for (guint x = 0; x < coefs->width; x++) {
+            const guint8 *s = gray ? row_buffer + x : row_buffer + 3 * x;
+            dst[4 * x] = s[0];
+            dst[4 * x + 1] = gray ? s[0] : s[1];
+            dst[4 * x + 2] = gray ? s[0] : s[2];
+            dst[4 * x + 3] = 0xff;
+        }
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    g_free(row_buffer);
+    return pixbuf;
+}
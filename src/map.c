@@ -0,0 +1,574 @@
+#include "dia.h"
+
+#include <string.h>
+
+static void copy_to_hashtable_cb(JsonObject *object, const gchar *member_name, JsonNode *member_node, gpointer user_data) {
+    GHashTable *hash_table = (GHashTable*)user_data;
+    (void)object;
+
+    if (!JSON_NODE_HOLDS_VALUE(member_node) || json_node_get_value_type(member_node) != G_TYPE_STRING) {
+        g_warning("Skipping non-string value for key '%s'", member_name);
+        return;
+    }
+
+    const gchar *value_str = json_node_get_string(member_node);
+    if (value_str) {
+        g_hash_table_insert(hash_table, g_strdup(member_name), g_strdup(value_str));
+    }
+}
+
+static void copy_object_member(JsonObject *root_obj, const gchar *member_name, GHashTable *hash_table) {
+    if (!json_object_has_member(root_obj, member_name)) return;
+
+    JsonNode *node = json_object_get_member(root_obj, member_name);
+    if (!JSON_NODE_HOLDS_OBJECT(node)) {
+        g_warning("Skipping '%s': not an object", member_name);
+        return;
+    }
+    json_object_foreach_member(json_node_get_object(node), copy_to_hashtable_cb, hash_table);
+}
+
+static void clear_delta_tile(gpointer data) {
+    g_free((gchar*)((DiaDeltaTile*)data)->path);
+}
+
+static const gchar* read_path_member(JsonObject *object) {
+    JsonNode *node = json_object_has_member(object, "path") ? json_object_get_member(object, "path") : NULL;
+    if (!node || !JSON_NODE_HOLDS_VALUE(node) || json_node_get_value_type(node) != G_TYPE_STRING) return NULL;
+    return json_node_get_string(node);
+}
+
+static gboolean read_int_member(JsonObject *object, const gchar *name, gint *out) {
+    JsonNode *node = json_object_has_member(object, name) ? json_object_get_member(object, name) : NULL;
+    if (!node || !JSON_NODE_HOLDS_VALUE(node) || json_node_get_value_type(node) != G_TYPE_INT64) return FALSE;
+    gint64 value = json_node_get_int(node);
+    if (value < 0 || value > G_MAXINT) return FALSE;
+    *out = (gint)value;
+    return TRUE;
+}
+
+// "delta_tiles": {"id": [{"path": "tiles/...", "x": 10, "y": 20}, ...]}. An empty list means
+// the image is identical to its parent.
+static gboolean collect_delta_tiles(DiaArchive *archive, JsonObject *root_obj, GError **error) {
+    archive->delta_tiles = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_array_unref);
+    if (!json_object_has_member(root_obj, "delta_tiles")) return TRUE;
+
+    JsonNode *node = json_object_get_member(root_obj, "delta_tiles");
+    if (!JSON_NODE_HOLDS_OBJECT(node)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "delta_tiles is not an object");
+        return FALSE;
+    }
+
+    JsonObject *tiles_obj = json_node_get_object(node);
+    g_autoptr(GList) members = json_object_get_members(tiles_obj);
+    for (GList *l = members; l; l = l->next) {
+        const gchar *image_id = l->data;
+        JsonNode *list_node = json_object_get_member(tiles_obj, image_id);
+        if (!JSON_NODE_HOLDS_ARRAY(list_node)) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "delta_tiles for '%s' is not a list", image_id);
+            return FALSE;
+        }
+
+        JsonArray *list = json_node_get_array(list_node);
+        GArray *tiles = g_array_sized_new(FALSE, FALSE, sizeof(DiaDeltaTile), json_array_get_length(list));
+        g_array_set_clear_func(tiles, clear_delta_tile);
+        g_hash_table_insert(archive->delta_tiles, g_strdup(image_id), tiles);
+
+        for (guint i = 0; i < json_array_get_length(list); i++) {
+            JsonNode *tile_node = json_array_get_element(list, i);
+            JsonObject *tile_obj = JSON_NODE_HOLDS_OBJECT(tile_node) ? json_node_get_object(tile_node) : NULL;
+            const gchar *path = tile_obj ? read_path_member(tile_obj) : NULL;
+            DiaDeltaTile tile = { NULL, DIA_INDEX_NONE, 0, 0 };
+            if (!path || !read_int_member(tile_obj, "x", &tile.x) || !read_int_member(tile_obj, "y", &tile.y)) {
+                g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "delta_tiles entry %u for '%s' is malformed", i, image_id);
+                return FALSE;
+            }
+            tile.path = g_strdup(path);
+            g_array_append_val(tiles, tile);
+        }
+    }
+    return TRUE;
+}
+
+static void clear_preview(gpointer data) {
+    g_free((gchar*)((DiaPreview*)data)->path);
+}
+
+static gint compare_previews(gconstpointer a, gconstpointer b) {
+    guint size_a = ((const DiaPreview*)a)->size;
+    guint size_b = ((const DiaPreview*)b)->size;
+    return size_a < size_b ? -1 : size_a > size_b;
+}
+
+// "previews": {"id": [{"path": "previews/256/...", "size": 256}, ...]}. Optional per image.
+static gboolean collect_previews(DiaArchive *archive, JsonObject *root_obj, GError **error) {
+    archive->previews = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_array_unref);
+    if (!json_object_has_member(root_obj, "previews")) return TRUE;
+
+    JsonNode *node = json_object_get_member(root_obj, "previews");
+    if (!JSON_NODE_HOLDS_OBJECT(node)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "previews is not an object");
+        return FALSE;
+    }
+
+    JsonObject *previews_obj = json_node_get_object(node);
+    g_autoptr(GList) members = json_object_get_members(previews_obj);
+    for (GList *l = members; l; l = l->next) {
+        const gchar *image_id = l->data;
+        JsonNode *list_node = json_object_get_member(previews_obj, image_id);
+        if (!JSON_NODE_HOLDS_ARRAY(list_node)) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "previews for '%s' is not a list", image_id);
+            return FALSE;
+        }
+
+        JsonArray *list = json_node_get_array(list_node);
+        GArray *previews = g_array_sized_new(FALSE, FALSE, sizeof(DiaPreview), json_array_get_length(list));
+        g_array_set_clear_func(previews, clear_preview);
+        g_hash_table_insert(archive->previews, g_strdup(image_id), previews);
+
+        for (guint i = 0; i < json_array_get_length(list); i++) {
+            JsonNode *preview_node = json_array_get_element(list, i);
+            JsonObject *preview_obj = JSON_NODE_HOLDS_OBJECT(preview_node) ? json_node_get_object(preview_node) : NULL;
+            const gchar *path = preview_obj ? read_path_member(preview_obj) : NULL;
+            gint size = 0;
+            if (!path || !read_int_member(preview_obj, "size", &size) || size == 0) {
+                g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "previews entry %u for '%s' is malformed", i, image_id);
+                return FALSE;
+            }
+            DiaPreview preview = { g_strdup(path), DIA_INDEX_NONE, (guint)size };
+            g_array_append_val(previews, preview);
+        }
+        g_array_sort(previews, compare_previews);
+    }
+    return TRUE;
+}
+
+// Roots come from the map when present; older maps only imply them through missing dependencies
+static void collect_root_images(DiaArchive *archive, JsonObject *root_obj) {
+    archive->root_images = g_ptr_array_new();
+
+    JsonNode *node = json_object_has_member(root_obj, "root_images") ? json_object_get_member(root_obj, "root_images") : NULL;
+    if (node && JSON_NODE_HOLDS_ARRAY(node)) {
+        JsonArray *roots = json_node_get_array(node);
+        for (guint i = 0; i < json_array_get_length(roots); i++) {
+            const gchar *root_id = json_array_get_string_element(roots, i);
+            gpointer key = NULL;
+            if (root_id && g_hash_table_lookup_extended(archive->image_map, root_id, &key, NULL) &&
+                !g_hash_table_contains(archive->dependencies, root_id)) {
+                g_ptr_array_add(archive->root_images, key);
+            }
+        }
+        return;
+    }
+
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init(&iter, archive->image_map);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        if (!g_hash_table_contains(archive->dependencies, key)) {
+            g_ptr_array_add(archive->root_images, key);
+        }
+    }
+}
+
+// Reverse of the dependencies map; keys and values borrow the strings in dependencies
+static void collect_children(DiaArchive *archive) {
+    archive->children = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)g_ptr_array_unref);
+
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, archive->dependencies);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        GPtrArray *children = g_hash_table_lookup(archive->children, value);
+        if (!children) {
+            children = g_ptr_array_new();
+            g_hash_table_insert(archive->children, value, children);
+        }
+        g_ptr_array_add(children, key);
+    }
+}
+
+static gboolean load_json_map(DiaArchive *archive, GError **error) {
+    g_autoptr(GBytes) map_bytes = dia_archive_read(archive, "optimization_map.json", error);
+    if (!map_bytes) {
+        g_prefix_error(error, "Could not read optimization_map.json: ");
+        return FALSE;
+    }
+
+    g_autoptr(JsonParser) parser = json_parser_new();
+    gsize map_size = 0;
+    const gchar *map_contents = g_bytes_get_data(map_bytes, &map_size);
+    if (!json_parser_load_from_data(parser, map_contents, map_size, error)) {
+        g_prefix_error(error, "Could not parse JSON: ");
+        return FALSE;
+    }
+
+    JsonNode *root = json_parser_get_root(parser);
+    if (!root || !JSON_NODE_HOLDS_OBJECT(root)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "optimization_map.json root is not an object");
+        return FALSE;
+    }
+
+    JsonObject *root_obj = json_node_get_object(root);
+
+    archive->image_map = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    archive->dependencies = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    archive->alpha_map = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+    g_print("EXTRACTING data from temporary JSON object into permanent hash tables...\n");
+
+    copy_object_member(root_obj, "image_map", archive->image_map);
+    copy_object_member(root_obj, "dependencies", archive->dependencies);
+    copy_object_member(root_obj, "alpha_map", archive->alpha_map);
+    archive->alpha_deltas = g_strcmp0(json_object_get_string_member_with_default(root_obj, "alpha_encoding", NULL), "delta") == 0;
+    if (!collect_delta_tiles(archive, root_obj, error) || !collect_previews(archive, root_obj, error)) {
+        g_prefix_error(error, "Invalid optimization_map.json: ");
+        return FALSE;
+    }
+    collect_root_images(archive, root_obj);
+    collect_children(archive);
+
+    archive->image_ids = g_ptr_array_sized_new(g_hash_table_size(archive->image_map));
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init(&iter, archive->image_map);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        g_ptr_array_add(archive->image_ids, key);
+    }
+
+    g_print("EXTRACTION complete.\n");
+    return TRUE;
+}
+
+static gboolean pool_offset_valid(const DiaIndexHeader *header, guint32 offset, gboolean optional) {
+    return offset < header->n_pool || (optional && offset == DIA_INDEX_NONE);
+}
+
+// Checks every offset and index once so the queries below can trust the index without bounds checks
+static gboolean validate_index(DiaArchive *archive, GError **error) {
+    const DiaIndexHeader *header = archive->index;
+    if (header->n_pool == 0 || archive->index_pool[header->n_pool - 1] != '\0') {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "string pool is not terminated");
+        return FALSE;
+    }
+
+    for (guint32 i = 0; i < header->n_images; i++) {
+        const DiaIndexImage *image = &archive->index_images[i];
+        gboolean valid = pool_offset_valid(header, image->id, FALSE) &&
+                         pool_offset_valid(header, image->path, FALSE) &&
+                         pool_offset_valid(header, image->alpha, TRUE) &&
+                         (image->parent == DIA_INDEX_NONE || image->parent < header->n_images) &&
+                         (guint64)image->first_child + image->n_children <= header->n_children &&
+                         (image->n_tiles == DIA_INDEX_NONE || (guint64)image->first_tile + image->n_tiles <= header->n_tiles);
+        if (!valid) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "image record %u is out of range", i);
+            return FALSE;
+        }
+    }
+    for (guint32 i = 0; i < header->n_roots; i++) {
+        if (archive->index_roots[i] >= header->n_images) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "root %u is out of range", i);
+            return FALSE;
+        }
+    }
+    for (guint32 i = 0; i < header->n_children; i++) {
+        if (archive->index_children[i] >= header->n_images) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "child %u is out of range", i);
+            return FALSE;
+        }
+    }
+    for (guint32 i = 0; i < header->n_tiles; i++) {
+        const DiaIndexTile *tile = &archive->index_tiles[i];
+        if (!pool_offset_valid(header, tile->path, FALSE) || tile->x < 0 || tile->y < 0) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "tile %u is out of range", i);
+            return FALSE;
+        }
+    }
+
+    // Previews are grouped by image, and each image points at the first of its group
+    for (guint32 i = 0; i < header->n_previews; i++) {
+        const DiaIndexPreview *preview = &archive->index_previews[i];
+        const DiaIndexPreview *prev = i ? preview - 1 : NULL;
+        gboolean valid = preview->image < header->n_images && preview->size > 0 &&
+                         pool_offset_valid(header, preview->path, FALSE) &&
+                         (!prev || prev->image < preview->image || (prev->image == preview->image && prev->size <= preview->size));
+        if (valid && (!prev || prev->image != preview->image)) {
+            valid = archive->index_images[preview->image].first_preview == i;
+        }
+        if (!valid) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "preview %u is out of range", i);
+            return FALSE;
+        }
+    }
+    for (guint32 i = 0; header->n_previews && i < header->n_images; i++) {
+        guint32 first = archive->index_images[i].first_preview;
+        if (first != DIA_INDEX_NONE && (first >= header->n_previews || archive->index_previews[first].image != i)) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "image record %u has a bad preview", i);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static void clear_index(DiaArchive *archive) {
+    g_clear_pointer(&archive->index_bytes, g_bytes_unref);
+    archive->index = NULL;
+    archive->index_images = NULL;
+    archive->index_roots = NULL;
+    archive->index_children = NULL;
+    archive->index_tiles = NULL;
+    archive->index_previews = NULL;
+    archive->index_pool = NULL;
+}
+
+static gboolean load_index(DiaArchive *archive, GError **error) {
+#if G_BYTE_ORDER != G_LITTLE_ENDIAN
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "only little-endian hosts read the index in place");
+    return FALSE;
+#endif
+    GBytes *bytes = dia_archive_read(archive, DIA_INDEX_NAME, error);
+    if (!bytes) return FALSE;
+
+    // Stored entries come straight from the mapping; copy only if the writer did not align them
+    gsize size = 0;
+    const guint8 *data = g_bytes_get_data(bytes, &size);
+    if (((guintptr)data & (sizeof(guint32) - 1)) != 0) {
+        GBytes *aligned = g_bytes_new(data, size);
+        g_bytes_unref(bytes);
+        bytes = aligned;
+        data = g_bytes_get_data(bytes, &size);
+    }
+    archive->index_bytes = bytes;
+
+    if (size < sizeof(DiaIndexHeader)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "truncated header");
+        clear_index(archive);
+        return FALSE;
+    }
+    const DiaIndexHeader *header = (const DiaIndexHeader*)data;
+    if (header->magic != DIA_INDEX_MAGIC || header->version < 1 || header->version > DIA_INDEX_VERSION ||
+        (header->version == 1 && header->n_previews != 0)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "unknown format (magic %08x, version %u)", header->magic, header->version);
+        clear_index(archive);
+        return FALSE;
+    }
+
+    guint64 expected = sizeof(DiaIndexHeader) + (guint64)header->n_images * sizeof(DiaIndexImage) +
+                       ((guint64)header->n_roots + header->n_children) * sizeof(guint32) +
+                       (guint64)header->n_tiles * sizeof(DiaIndexTile) +
+                       (guint64)header->n_previews * sizeof(DiaIndexPreview) + header->n_pool;
+    if (expected != size) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "section sizes do not add up to %" G_GSIZE_FORMAT " bytes", size);
+        clear_index(archive);
+        return FALSE;
+    }
+
+    archive->index = header;
+    archive->index_images = (const DiaIndexImage*)(header + 1);
+    archive->index_roots = (const guint32*)(archive->index_images + header->n_images);
+    archive->index_children = archive->index_roots + header->n_roots;
+    archive->index_tiles = (const DiaIndexTile*)(archive->index_children + header->n_children);
+    archive->index_previews = (const DiaIndexPreview*)(archive->index_tiles + header->n_tiles);
+    archive->index_pool = (const gchar*)(archive->index_previews + header->n_previews);
+    if (!validate_index(archive, error)) {
+        clear_index(archive);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// Prefers the binary index, which is used in place; archives without one, or with one this
+// build cannot read, fall back to the JSON map.
+gboolean dia_archive_load_map(DiaArchive *archive, GError **error) {
+    DIA_TRACE_SCOPE(span, "map.load");
+    gint64 start = g_get_monotonic_time();
+    const gchar *source = DIA_INDEX_NAME;
+
+    if (dia_archive_lookup(archive, DIA_INDEX_NAME) < 0) {
+        source = "optimization_map.json";
+    } else {
+        g_autoptr(GError) index_error = NULL;
+        if (!load_index(archive, &index_error)) {
+            g_printerr("WARNING: Ignoring %s: %s\n", DIA_INDEX_NAME, index_error->message);
+            source = "optimization_map.json";
+        }
+    }
+    if (!archive->index && !load_json_map(archive, error)) {
+        return FALSE;
+    }
+
+    g_print("[dia] loaded map of %u images from %s in %.1f ms\n", dia_archive_n_images(archive), source,
+            (g_get_monotonic_time() - start) / 1000.0);
+    return TRUE;
+}
+
+static const gchar* pool_string(DiaArchive *archive, guint32 offset) {
+    return offset == DIA_INDEX_NONE ? NULL : archive->index_pool + offset;
+}
+
+// Image i has ID "i"; the pool comparison rejects spellings like "007"
+static const DiaIndexImage* index_lookup(DiaArchive *archive, const gchar *image_id) {
+    guint64 i = 0;
+    if (!image_id || archive->index->n_images == 0 ||
+        !g_ascii_string_to_unsigned(image_id, 10, 0, archive->index->n_images - 1, &i, NULL)) {
+        return NULL;
+    }
+    const DiaIndexImage *image = &archive->index_images[i];
+    return strcmp(archive->index_pool + image->id, image_id) == 0 ? image : NULL;
+}
+
+guint dia_archive_n_images(DiaArchive *archive) {
+    if (archive->index) return archive->index->n_images;
+    return archive->image_ids ? archive->image_ids->len : 0;
+}
+
+const gchar* dia_archive_image_id(DiaArchive *archive, guint index) {
+    if (index >= dia_archive_n_images(archive)) return NULL;
+    if (archive->index) return archive->index_pool + archive->index_images[index].id;
+    return g_ptr_array_index(archive->image_ids, index);
+}
+
+const gchar* dia_archive_image_path(DiaArchive *archive, const gchar *image_id, guint32 *entry_hint) {
+    if (entry_hint) *entry_hint = DIA_INDEX_NONE;
+    if (!archive->index) return archive->image_map ? g_hash_table_lookup(archive->image_map, image_id) : NULL;
+
+    const DiaIndexImage *image = index_lookup(archive, image_id);
+    if (!image) return NULL;
+    if (entry_hint) *entry_hint = image->entry;
+    return archive->index_pool + image->path;
+}
+
+// encode.py codes every JPEG source in the coefficient domain and keeps its name, so the path
+// tells the kind without touching the entry
+gboolean dia_archive_is_jpeg(DiaArchive *archive, const gchar *image_id) {
+    const gchar *path = dia_archive_image_path(archive, image_id, NULL);
+    if (!path) return FALSE;
+    g_autofree gchar *lower = g_ascii_strdown(path, -1);
+    return g_str_has_suffix(lower, ".jpg") || g_str_has_suffix(lower, ".jpeg");
+}
+
+const gchar* dia_archive_parent(DiaArchive *archive, const gchar *image_id) {
+    if (!archive->index) return archive->dependencies ? g_hash_table_lookup(archive->dependencies, image_id) : NULL;
+
+    const DiaIndexImage *image = index_lookup(archive, image_id);
+    if (!image || image->parent == DIA_INDEX_NONE) return NULL;
+    return archive->index_pool + archive->index_images[image->parent].id;
+}
+
+const gchar* dia_archive_alpha_path(DiaArchive *archive, const gchar *image_id, guint32 *entry_hint) {
+    if (entry_hint) *entry_hint = DIA_INDEX_NONE;
+    if (!archive->index) return archive->alpha_map ? g_hash_table_lookup(archive->alpha_map, image_id) : NULL;
+
+    const DiaIndexImage *image = index_lookup(archive, image_id);
+    if (!image) return NULL;
+    if (entry_hint) *entry_hint = image->alpha_entry;
+    return pool_string(archive, image->alpha);
+}
+
+// Whether alpha entries are deltas against the parent (src/alpha.c) instead of full alpha maps
+gboolean dia_archive_alpha_deltas(DiaArchive *archive) {
+    return archive->index ? archive->index->version >= 3 : archive->alpha_deltas;
+}
+
+// -1 when the image has no tile list and uses a full-canvas delta
+gint dia_archive_n_tiles(DiaArchive *archive, const gchar *image_id) {
+    if (!archive->index) {
+        GArray *tiles = archive->delta_tiles ? g_hash_table_lookup(archive->delta_tiles, image_id) : NULL;
+        return tiles ? (gint)tiles->len : -1;
+    }
+
+    const DiaIndexImage *image = index_lookup(archive, image_id);
+    return image && image->n_tiles != DIA_INDEX_NONE ? (gint)image->n_tiles : -1;
+}
+
+// The tile's path is borrowed from the archive
+void dia_archive_get_tile(DiaArchive *archive, const gchar *image_id, guint index, DiaDeltaTile *tile) {
+    if (!archive->index) {
+        GArray *tiles = g_hash_table_lookup(archive->delta_tiles, image_id);
+        *tile = g_array_index(tiles, DiaDeltaTile, index);
+        return;
+    }
+
+    const DiaIndexImage *image = index_lookup(archive, image_id);
+    const DiaIndexTile *stored = &archive->index_tiles[image->first_tile + index];
+    tile->path = archive->index_pool + stored->path;
+    tile->entry = stored->entry;
+    tile->x = stored->x;
+    tile->y = stored->y;
+}
+
+guint dia_archive_n_previews(DiaArchive *archive, const gchar *image_id) {
+    if (!archive->index) {
+        GArray *previews = archive->previews ? g_hash_table_lookup(archive->previews, image_id) : NULL;
+        return previews ? previews->len : 0;
+    }
+
+    const DiaIndexImage *image = index_lookup(archive, image_id);
+    if (!image || archive->index->n_previews == 0 || image->first_preview == DIA_INDEX_NONE) return 0;
+    guint32 i = image->first_preview;
+    guint32 image_index = archive->index_previews[i].image;
+    while (i < archive->index->n_previews && archive->index_previews[i].image == image_index) i++;
+    return i - image->first_preview;
+}
+
+// Previews are ordered smallest first; the path is borrowed from the archive
+void dia_archive_get_preview(DiaArchive *archive, const gchar *image_id, guint index, DiaPreview *preview) {
+    if (!archive->index) {
+        GArray *previews = g_hash_table_lookup(archive->previews, image_id);
+        *preview = g_array_index(previews, DiaPreview, index);
+        return;
+    }
+
+    const DiaIndexImage *image = index_lookup(archive, image_id);
+    const DiaIndexPreview *stored = &archive->index_previews[image->first_preview + index];
+    preview->path = archive->index_pool + stored->path;
+    preview->entry = stored->entry;
+    preview->size = stored->size;
+}
+
+guint dia_archive_n_children(DiaArchive *archive, const gchar *image_id) {
+    if (!archive->index) {
+        GPtrArray *children = archive->children ? g_hash_table_lookup(archive->children, image_id) : NULL;
+        return children ? children->len : 0;
+    }
+
+    const DiaIndexImage *image = index_lookup(archive, image_id);
+    return image ? image->n_children : 0;
+}
+
+const gchar* dia_archive_child(DiaArchive *archive, const gchar *image_id, guint index) {
+    if (!archive->index) {
+        GPtrArray *children = g_hash_table_lookup(archive->children, image_id);
+        return g_ptr_array_index(children, index);
+    }
+
+    const DiaIndexImage *image = index_lookup(archive, image_id);
+    return archive->index_pool + archive->index_images[archive->index_children[image->first_child + index]].id;
+}
+
+guint dia_archive_n_roots(DiaArchive *archive) {
+    if (archive->index) return archive->index->n_roots;
+    return archive->root_images ? archive->root_images->len : 0;
+}
+
+const gchar* dia_archive_root(DiaArchive *archive, guint index) {
+    if (archive->index) return archive->index_pool + archive->index_images[archive->index_roots[index]].id;
+    return g_ptr_array_index(archive->root_images, index);
+}
+
+// Number of deltas between the image and its root; cycles stop after visiting every entry once
+guint dia_archive_chain_depth(DiaArchive *archive, const gchar *image_id) {
+    if (archive->index) {
+        const DiaIndexImage *image = index_lookup(archive, image_id);
+        return image ? image->depth : 0;
+    }
+
+    guint depth = 0;
+    guint limit = dia_archive_n_images(archive);
+    const gchar *parent_id;
+    while (depth <= limit && (parent_id = dia_archive_parent(archive, image_id))) {
+        image_id = parent_id;
+        depth++;
+    }
+    return depth;
+}
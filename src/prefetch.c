@@ -0,0 +1,168 @@
+#include "viewer.h"
+
+// Size the prefetched set may reach before it is first pruned
+#define DIA_PREFETCH_PRUNE_MIN 64
+
+typedef struct {
+    DiaPrefetcher *prefetcher;
+    gchar *image_id;
+    GCancellable *cancellable;
+} PrefetchJob;
+
+static void prefetch_job_free(PrefetchJob *job) {
+    g_free(job->image_id);
+    g_object_unref(job->cancellable);
+    g_free(job);
+}
+
+// Canvases the cache has evicted since can never be served, so they are dropped whenever the set
+// has doubled; it stays within twice the number of cached canvases. Caller holds the lock.
+static void prune_prefetched(DiaPrefetcher *prefetcher) {
+    GHashTableIter iter;
+    gpointer image_id;
+    g_hash_table_iter_init(&iter, prefetcher->prefetched);
+    while (g_hash_table_iter_next(&iter, &image_id, NULL)) {
+        if (!dia_canvas_cache_contains(prefetcher->data->canvas_cache, image_id)) g_hash_table_iter_remove(&iter);
+    }
+    prefetcher->prune_at = MAX(DIA_PREFETCH_PRUNE_MIN, 2 * g_hash_table_size(prefetcher->prefetched));
+}
+
+// Runs on the single prefetch thread; the render lands in the shared canvas cache
+static void prefetch_worker(gpointer job_data, gpointer user_data) {
+    PrefetchJob *job = (PrefetchJob*)job_data;
+    DiaPrefetcher *prefetcher = job->prefetcher;
+    (void)user_data;
+
+    if (g_cancellable_is_cancelled(job->cancellable) ||
+        dia_canvas_cache_contains(prefetcher->data->canvas_cache, job->image_id)) {
+        prefetch_job_free(job);
+        return;
+    }
+
+    g_autoptr(GError) error = NULL;
+    GdkPixbuf *pixbuf = render_composite_image(prefetcher->data->archive, prefetcher->data->canvas_cache, job->image_id, job->cancellable, &error);
+    if (pixbuf) {
+        g_mutex_lock(&prefetcher->lock);
+        g_hash_table_add(prefetcher->prefetched, g_strdup(job->image_id));
+        if (g_hash_table_size(prefetcher->prefetched) >= prefetcher->prune_at) prune_prefetched(prefetcher);
+        prefetcher->completed++;
+        g_mutex_unlock(&prefetcher->lock);
+        g_object_unref(pixbuf);
+    } else if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        g_printerr("[dia] prefetch of '%s' failed: %s\n", job->image_id, error ? error->message : "Unknown error");
+    }
+
+    prefetch_job_free(job);
+}
+
+DiaPrefetcher* dia_prefetcher_new(AppData *data, guint depth) {
+    DiaPrefetcher *prefetcher = g_new0(DiaPrefetcher, 1);
+    prefetcher->data = data;
+    prefetcher->depth = depth;
+    prefetcher->cancellable = g_cancellable_new();
+    prefetcher->prefetched = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    prefetcher->prune_at = DIA_PREFETCH_PRUNE_MIN;
+    g_mutex_init(&prefetcher->lock);
+
+    // One non-exclusive thread keeps speculative work from competing with foreground renders
+    prefetcher->pool = g_thread_pool_new(prefetch_worker, NULL, 1, FALSE, NULL);
+    return prefetcher;
+}
+
+void dia_prefetcher_free(DiaPrefetcher *prefetcher) {
+    if (!prefetcher) return;
+    g_cancellable_cancel(prefetcher->cancellable);
+    g_thread_pool_free(prefetcher->pool, TRUE, TRUE);
+    g_object_unref(prefetcher->cancellable);
+    g_hash_table_destroy(prefetcher->prefetched);
+    g_mutex_clear(&prefetcher->lock);
+    g_free(prefetcher);
+}
+
+void dia_prefetcher_pause(DiaPrefetcher *prefetcher) {
+    if (!prefetcher) return;
+
+    // The in-flight prefetch stops at its next overlay step and queued jobs are skipped
+    g_mutex_lock(&prefetcher->lock);
+    g_cancellable_cancel(prefetcher->cancellable);
+    g_object_unref(prefetcher->cancellable);
+    prefetcher->cancellable = g_cancellable_new();
+    g_mutex_unlock(&prefetcher->lock);
+}
+
+static void add_candidate(GPtrArray *candidates, GHashTable *seen, const gchar *image_id) {
+    if (!image_id || g_hash_table_contains(seen, image_id)) return;
+    g_hash_table_add(seen, (gpointer)image_id);
+    g_ptr_array_add(candidates, g_strdup(image_id));
+}
+
+GPtrArray* dia_prefetcher_rank(DiaPrefetcher *prefetcher, const gchar *image_id, const gchar *next_row_id, const gchar *prev_row_id) {
+    GPtrArray *candidates = g_ptr_array_new_with_free_func(g_free);
+    if (!prefetcher || prefetcher->depth == 0) return candidates;
+
+    GHashTable *seen = g_hash_table_new(g_str_hash, g_str_equal);
+    g_hash_table_add(seen, (gpointer)image_id);
+
+    // Users mostly move down the list, then into the variants of what they are looking at
+    add_candidate(candidates, seen, next_row_id);
+
+    DiaArchive *archive = prefetcher->data->archive;
+    guint n_children = dia_archive_n_children(archive, image_id);
+    for (guint i = 0; i < n_children; i++) {
+        add_candidate(candidates, seen, dia_archive_child(archive, image_id, i));
+    }
+
+    add_candidate(candidates, seen, prev_row_id);
+
+    const gchar *parent_id = dia_archive_parent(archive, image_id);
+    guint n_siblings = parent_id ? dia_archive_n_children(archive, parent_id) : 0;
+    for (guint i = 0; i < n_siblings; i++) {
+        add_candidate(candidates, seen, dia_archive_child(archive, parent_id, i));
+    }
+
+    g_hash_table_destroy(seen);
+
+    if (candidates->len > prefetcher->depth) {
+        g_ptr_array_set_size(candidates, (gint)prefetcher->depth);
+    }
+    return candidates;
+}
+
+void dia_prefetcher_schedule(DiaPrefetcher *prefetcher, GPtrArray *candidates) {
+    if (!prefetcher || !candidates) return;
+
+    g_mutex_lock(&prefetcher->lock);
+    for (guint i = 0; i < candidates->len; i++) {
+        PrefetchJob *job = g_new0(PrefetchJob, 1);
+        job->prefetcher = prefetcher;
+        job->image_id = g_strdup(g_ptr_array_index(candidates, i));
+        job->cancellable = g_object_ref(prefetcher->cancellable);
+        g_thread_pool_push(prefetcher->pool, job, NULL);
+    }
+    g_mutex_unlock(&prefetcher->lock);
+}
+
+gboolean dia_prefetcher_note_selection(DiaPrefetcher *prefetcher, const gchar *image_id) {
+    if (!prefetcher) return FALSE;
+
+    gboolean served = dia_canvas_cache_contains(prefetcher->data->canvas_cache, image_id);
+
+    g_mutex_lock(&prefetcher->lock);
+    served = served && g_hash_table_remove(prefetcher->prefetched, image_id);
+    prefetcher->selections++;
+    if (served) prefetcher->served++;
+    g_mutex_unlock(&prefetcher->lock);
+
+    return served;
+}
+
+void dia_prefetcher_get_stats(DiaPrefetcher *prefetcher, guint64 *selections, guint64 *served, guint64 *completed) {
+    *selections = *served = *completed = 0;
+    if (!prefetcher) return;
+
+    g_mutex_lock(&prefetcher->lock);
+    *selections = prefetcher->selections;
+    *served = prefetcher->served;
+    *completed = prefetcher->completed;
+    g_mutex_unlock(&prefetcher->lock);
+}
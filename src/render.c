@@ -1,9 +1,49 @@
-#include "viewer.h"
+#include "dia.h"
 
-static GdkPixbuf* load_alpha_for_id(AppData *data, const gchar *image_id, GError **error);
-static gboolean apply_alpha_map_to_pixbuf(GdkPixbuf *pixbuf, GdkPixbuf *alpha_map_pixbuf, gboolean combine_with_existing, GError **error);
+// One delta read and decoded ahead of compositing. PNG tiles are decoded to pixbufs; zmask
+// tiles decode straight into the canvas, so only their bytes are kept.
+typedef struct {
+    DiaDeltaTile tile;
+    GBytes *bytes;
+    GdkPixbuf *pixbuf;
+} DecodedTile;
 
-GdkPixbuf* render_composite_image(AppData *data, const gchar *image_id, GError **error) {
+typedef struct {
+    GdkPixbuf *alpha;          // full alpha map of a legacy archive
+    DiaAlphaDelta *alpha_delta;
+    GArray *tiles;         // DecodedTile; NULL for a full-canvas delta
+    GdkPixbuf *full_delta;
+} DecodedOverlay;
+
+typedef struct _ChainDecode ChainDecode;
+
+// Link 0 of a chain is its canvas, decoded as a base; the others are deltas
+typedef struct {
+    ChainDecode *decode;
+    const gchar *image_id;
+    GdkPixbuf *canvas;
+    DecodedOverlay overlay;
+    GError *error;
+    gboolean done;  // guarded by decode->lock
+} ChainLink;
+
+struct _ChainDecode {
+    DiaArchive *archive;
+    GCancellable *cancellable;
+    ChainLink *links;
+    GMutex lock;
+    GCond ready;
+    gint abandoned;
+};
+
+static gboolean load_alpha_for_id(DiaArchive *archive, const gchar *image_id, GdkPixbuf **alpha_pixbuf,
+                                  DiaAlphaDelta **alpha_delta, GError **error);
+static GdkPixbuf* render_jpeg_chain(DiaArchive *archive, DiaCanvasCache *cache, GQueue *chain, GCancellable *cancellable, GError **error);
+static GdkPixbuf* render_chain(DiaArchive *archive, DiaCanvasCache *cache, GQueue *chain, GdkPixbuf *cached_pixbuf,
+                               GCancellable *cancellable, GError **error);
+
+GdkPixbuf* render_composite_image(DiaArchive *archive, DiaCanvasCache *cache, const gchar *image_id, GCancellable *cancellable, GError **error) {
+    DIA_TRACE_SCOPE(span, "render");
     GQueue *chain = g_queue_new();
     GHashTable *visited = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
     gchar *current_id = g_strdup(image_id);
@@ -22,147 +62,591 @@ GdkPixbuf* render_composite_image(AppData *data, const gchar *image_id, GError *
         g_hash_table_insert(visited, g_strdup(current_id), GINT_TO_POINTER(1));
         g_queue_push_head(chain, current_id);
         
-        if (g_hash_table_contains(data->dependencies, current_id)) {
-            const gchar *dependency = g_hash_table_lookup(data->dependencies, current_id);
-            current_id = g_strdup(dependency);
-        } else {
-            current_id = NULL;
-        }
+        const gchar *dependency = dia_archive_parent(archive, current_id);
+        current_id = dependency ? g_strdup(dependency) : NULL;
     }
     
     g_hash_table_destroy(visited);
-    
-    // Start with the base image
-    gchar *base_id = g_queue_pop_head(chain);
-    const gchar *base_filename = g_hash_table_lookup(data->image_map, base_id);
+
+    if (dia_archive_is_jpeg(archive, g_queue_peek_head(chain))) {
+        GdkPixbuf *canvas_pixbuf = render_jpeg_chain(archive, cache, chain, cancellable, error);
+        g_queue_free_full(chain, g_free);
+        return canvas_pixbuf;
+    }
+
+    // Resume from the deepest ancestor (or the image itself) that is already reconstructed
+    guint cached_pos = 0;
+    g_autoptr(GdkPixbuf) cached_pixbuf = dia_canvas_cache_find_nearest(cache, chain, &cached_pos);
+    if (cached_pixbuf) {
+        for (guint i = 0; i < cached_pos; i++) {
+            g_free(g_queue_pop_head(chain));
+        }
+        if (g_queue_get_length(chain) == 1) {
+            // Cached canvases are shared and must be treated as read-only by the caller
+            g_queue_free_full(chain, g_free);
+            return g_steal_pointer(&cached_pixbuf);
+        }
+    }
+
+    GdkPixbuf *canvas_pixbuf = render_chain(archive, cache, chain, cached_pixbuf, cancellable, error);
+    g_queue_free_full(chain, g_free);
+    return canvas_pixbuf;
+}
+
+// JPEG chains are patched in the coefficient domain and decoded once at the end. No ancestor
+// ever exists as pixels, so only the requested image itself is looked up and cached.
+static GdkPixbuf* render_jpeg_chain(DiaArchive *archive, DiaCanvasCache *cache, GQueue *chain, GCancellable *cancellable, GError **error) {
+    DIA_TRACE_SCOPE(span, "render.jpeg");
+    const gchar *image_id = g_queue_peek_tail(chain);
+    GQueue self = G_QUEUE_INIT;
+    g_queue_push_tail(&self, (gpointer)image_id);
+    guint position;
+    GdkPixbuf *canvas_pixbuf = dia_canvas_cache_find_nearest(cache, &self, &position);
+    g_queue_clear(&self);
+    if (canvas_pixbuf) return canvas_pixbuf;
+
+    DiaJpegCoefs *coefs = NULL;
+    for (GList *l = chain->head; l; l = l->next) {
+        gboolean ok = !g_cancellable_set_error_if_cancelled(cancellable, error);
+        if (ok && !coefs) {
+            coefs = dia_render_jpeg_base(archive, l->data, error);
+            ok = coefs != NULL;
+        } else if (ok) {
+            ok = dia_render_jpeg_overlay(archive, coefs, l->data, error);
+        }
+        if (!ok) {
+            dia_jpeg_coefs_free(coefs);
+            return NULL;
+        }
+    }
+
+    {
+        DIA_TRACE_SCOPE(decode_span, "render.jpeg_decode");
+        canvas_pixbuf = dia_jpeg_coefs_render(coefs, error);
+    }
+    dia_jpeg_coefs_free(coefs);
+    if (canvas_pixbuf) dia_canvas_cache_insert(cache, image_id, canvas_pixbuf);
+    return canvas_pixbuf;
+}
+
+// Decodes a root image into an RGBA canvas with its alpha map applied. A full alpha map is
+// handed back through alpha_out when requested; alpha deltas are only applied.
+GdkPixbuf* dia_render_base(DiaArchive *archive, const gchar *base_id, GdkPixbuf **alpha_out, GError **error) {
+    DIA_TRACE_SCOPE(span, "render.base");
+    guint32 base_entry;
+    const gchar *base_filename = dia_archive_image_path(archive, base_id, &base_entry);
     if (!base_filename) {
         g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Could not find filename for ID '%s'", base_id);
-        g_free(base_id);
-        g_queue_free_full(chain, g_free);
         return NULL;
     }
     
-    gsize base_size = 0;
-    g_autofree gchar *base_buffer = read_file_from_zip(data->zip_path, base_filename, &base_size, error);
-    if (!base_buffer) {
-        g_free(base_id);
-        g_queue_free_full(chain, g_free);
+    g_autoptr(GBytes) base_bytes = dia_archive_read_hinted(archive, base_entry, base_filename, error);
+    if (!base_bytes) {
         return NULL;
     }
     
-    GdkPixbuf *canvas_pixbuf = load_pixbuf_from_memory(base_buffer, base_size, error);
+    GdkPixbuf *canvas_pixbuf = load_pixbuf_from_bytes(base_bytes, error);
     if (!canvas_pixbuf) {
-        g_free(base_id);
-        g_queue_free_full(chain, g_free);
         return NULL;
     }
     
     if (!gdk_pixbuf_get_has_alpha(canvas_pixbuf)) {
+        DIA_TRACE_SCOPE(add_alpha_span, "render.add_alpha");
         GdkPixbuf *temp = gdk_pixbuf_add_alpha(canvas_pixbuf, FALSE, 0, 0, 0);
         g_object_unref(canvas_pixbuf);
         canvas_pixbuf = temp;
+        DIA_TRACE_BYTES(add_alpha_span, gdk_pixbuf_get_byte_length(canvas_pixbuf));
     }
 
-    GdkPixbuf *base_alpha_pixbuf = load_alpha_for_id(data, base_id, error);
+    GdkPixbuf *base_alpha_pixbuf = NULL;
+    DiaAlphaDelta *base_alpha_delta = NULL;
+    if (!load_alpha_for_id(archive, base_id, &base_alpha_pixbuf, &base_alpha_delta, error)) {
+        g_object_unref(canvas_pixbuf);
+        return NULL;
+    }
+    if (base_alpha_delta) {
+        gboolean ok = dia_alpha_delta_apply(base_alpha_delta, canvas_pixbuf, error);
+        dia_alpha_delta_free(base_alpha_delta);
+        if (!ok) {
+            g_object_unref(canvas_pixbuf);
+            return NULL;
+        }
+    }
     if (base_alpha_pixbuf) {
         if (!apply_alpha_map_to_pixbuf(canvas_pixbuf, base_alpha_pixbuf, FALSE, error)) {
             g_object_unref(base_alpha_pixbuf);
-            g_free(base_id);
-            g_queue_free_full(chain, g_free);
             g_object_unref(canvas_pixbuf);
             return NULL;
         }
-        g_object_unref(base_alpha_pixbuf);
+        if (alpha_out) *alpha_out = g_steal_pointer(&base_alpha_pixbuf);
+        else g_object_unref(base_alpha_pixbuf);
     }
-    
-    g_free(base_id);
-    
-    // Apply overlays in order
-    while (!g_queue_is_empty(chain)) {
-        gchar *overlay_id = g_queue_pop_head(chain);
-        const gchar *overlay_filename = g_hash_table_lookup(data->image_map, overlay_id);
-        
+
+    return canvas_pixbuf;
+}
+
+// Legacy delta: a transparent PNG the size of the whole canvas, composited at (0, 0)
+static gboolean blend_full_delta(GdkPixbuf *canvas_pixbuf, GdkPixbuf *overlay_pixbuf, GdkPixbuf *overlay_alpha_pixbuf, GError **error) {
+    DIA_TRACE_SCOPE(span, "render.full_delta");
+    int canvas_width = gdk_pixbuf_get_width(canvas_pixbuf);
+    int canvas_height = gdk_pixbuf_get_height(canvas_pixbuf);
+    int overlay_width = gdk_pixbuf_get_width(overlay_pixbuf);
+    int overlay_height = gdk_pixbuf_get_height(overlay_pixbuf);
+
+    // Composite the delta and multiply in the alpha map in a single pass over the canvas
+    int composite_width = MIN(overlay_width, canvas_width);
+    int composite_height = MIN(overlay_height, canvas_height);
+    gboolean fused_alpha = overlay_width == canvas_width && overlay_height == canvas_height;
+
+    if (composite_width > 0 && composite_height > 0) {
+        GdkPixbuf *alpha_for_blend = fused_alpha ? overlay_alpha_pixbuf : NULL;
+        dia_blend_delta(gdk_pixbuf_get_pixels(canvas_pixbuf), gdk_pixbuf_get_rowstride(canvas_pixbuf),
+                        gdk_pixbuf_read_pixels(overlay_pixbuf), gdk_pixbuf_get_rowstride(overlay_pixbuf),
+                        gdk_pixbuf_get_n_channels(overlay_pixbuf),
+                        alpha_for_blend ? gdk_pixbuf_read_pixels(alpha_for_blend) : NULL,
+                        alpha_for_blend ? gdk_pixbuf_get_rowstride(alpha_for_blend) : 0,
+                        alpha_for_blend ? gdk_pixbuf_get_n_channels(alpha_for_blend) : 0,
+                        composite_width, composite_height);
+    }
+
+    // A delta smaller than the canvas still needs the alpha map applied everywhere
+    if (overlay_alpha_pixbuf && !fused_alpha) {
+        return apply_alpha_map_to_pixbuf(canvas_pixbuf, overlay_alpha_pixbuf, TRUE, error);
+    }
+    return TRUE;
+}
+
+// Blends one cropped tile into its rectangle of the canvas only. zmask tiles are decoded
+// directly into the canvas here; PNG tiles arrive already decoded.
+static gboolean blend_delta_tile(DiaArchive *archive, GdkPixbuf *canvas_pixbuf, const DecodedTile *decoded, GError **error) {
+    DIA_TRACE_SCOPE(span, "render.tile");
+    const DiaDeltaTile *tile = &decoded->tile;
+    if (!decoded->pixbuf) {
+        DIA_TRACE_BYTES(span, g_bytes_get_size(decoded->bytes));
+        return dia_zmask_apply(archive, decoded->bytes, canvas_pixbuf, tile->x, tile->y, tile->path, error);
+    }
+
+    int canvas_width = gdk_pixbuf_get_width(canvas_pixbuf);
+    int canvas_height = gdk_pixbuf_get_height(canvas_pixbuf);
+    int tile_width = gdk_pixbuf_get_width(decoded->pixbuf);
+    int tile_height = gdk_pixbuf_get_height(decoded->pixbuf);
+    if (tile->x > canvas_width - tile_width || tile->y > canvas_height - tile_height) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Delta tile '%s' (%dx%d at %d,%d) lies outside the %dx%d canvas",
+                    tile->path, tile_width, tile_height, tile->x, tile->y, canvas_width, canvas_height);
+        return FALSE;
+    }
+
+    int canvas_stride = gdk_pixbuf_get_rowstride(canvas_pixbuf);
+    guint8 *origin = gdk_pixbuf_get_pixels(canvas_pixbuf) + (gsize)tile->y * canvas_stride +
+                     (gsize)tile->x * gdk_pixbuf_get_n_channels(canvas_pixbuf);
+    dia_blend_delta(origin, canvas_stride,
+                    gdk_pixbuf_read_pixels(decoded->pixbuf), gdk_pixbuf_get_rowstride(decoded->pixbuf),
+                    gdk_pixbuf_get_n_channels(decoded->pixbuf),
+                    NULL, 0, 0, tile_width, tile_height);
+    return TRUE;
+}
+
+static void clear_decoded_tile(gpointer data) {
+    DecodedTile *decoded = data;
+    if (decoded->bytes) g_bytes_unref(decoded->bytes);
+    if (decoded->pixbuf) g_object_unref(decoded->pixbuf);
+}
+
+static void decoded_overlay_clear(DecodedOverlay *overlay) {
+    g_clear_object(&overlay->alpha);
+    g_clear_pointer(&overlay->alpha_delta, dia_alpha_delta_free);
+    g_clear_pointer(&overlay->tiles, g_array_unref);
+    g_clear_object(&overlay->full_delta);
+}
+
+// Everything of a delta that does not depend on its parent's pixels: entry reads, PNG decodes
+// and the alpha map or delta. On failure the caller still clears the overlay.
+static gboolean decode_overlay(DiaArchive *archive, const gchar *overlay_id, DecodedOverlay *overlay, GError **error) {
+    DIA_TRACE_SCOPE(span, "render.overlay_decode");
+    if (!load_alpha_for_id(archive, overlay_id, &overlay->alpha, &overlay->alpha_delta, error)) {
+        return FALSE;
+    }
+
+    gint n_tiles = dia_archive_n_tiles(archive, overlay_id);
+    if (n_tiles < 0) {
+        guint32 overlay_entry;
+        const gchar *overlay_filename = dia_archive_image_path(archive, overlay_id, &overlay_entry);
         if (!overlay_filename) {
             g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Could not find filename for overlay ID '%s'", overlay_id);
-            g_free(overlay_id);
-            g_object_unref(canvas_pixbuf);
-            g_queue_free_full(chain, g_free);
-            return NULL;
+            return FALSE;
         }
-        
-        gsize overlay_size = 0;
-        g_autofree gchar *overlay_buffer = read_file_from_zip(data->zip_path, overlay_filename, &overlay_size, error);
-        if (!overlay_buffer) {
-            g_free(overlay_id);
-            g_object_unref(canvas_pixbuf);
-            g_queue_free_full(chain, g_free);
-            return NULL;
+        g_autoptr(GBytes) overlay_bytes = dia_archive_read_hinted(archive, overlay_entry, overlay_filename, error);
+        if (!overlay_bytes) {
+            return FALSE;
         }
-        
-        g_autoptr(GdkPixbuf) overlay_pixbuf_orig = load_pixbuf_from_memory(overlay_buffer, overlay_size, error);
-        if (!overlay_pixbuf_orig) {
-            g_free(overlay_id);
-            g_object_unref(canvas_pixbuf);
-            g_queue_free_full(chain, g_free);
-            return NULL;
+        overlay->full_delta = load_pixbuf_from_bytes(overlay_bytes, error);
+        return overlay->full_delta != NULL;
+    }
+
+    overlay->tiles = g_array_sized_new(FALSE, TRUE, sizeof(DecodedTile), (guint)n_tiles);
+    g_array_set_clear_func(overlay->tiles, clear_decoded_tile);
+    for (gint i = 0; i < n_tiles; i++) {
+        g_array_set_size(overlay->tiles, (guint)i + 1);
+        DecodedTile *decoded = &g_array_index(overlay->tiles, DecodedTile, i);
+        dia_archive_get_tile(archive, overlay_id, (guint)i, &decoded->tile);
+        decoded->bytes = dia_archive_read_hinted(archive, decoded->tile.entry, decoded->tile.path, error);
+        if (!decoded->bytes) {
+            return FALSE;
         }
-        
-        GdkPixbuf *overlay_to_composite = overlay_pixbuf_orig;
-        g_autoptr(GdkPixbuf) temp_alpha_pixbuf = NULL;
-        
-        if (!gdk_pixbuf_get_has_alpha(overlay_to_composite)) {
-            temp_alpha_pixbuf = gdk_pixbuf_add_alpha(overlay_to_composite, FALSE, 0, 0, 0);
-            overlay_to_composite = temp_alpha_pixbuf;
+        if (dia_zmask_is_delta(decoded->bytes)) {
+            continue;
+        }
+        if (dia_jpeg_is_delta(decoded->bytes)) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "'%s' patches JPEG coefficients, not a pixel canvas", decoded->tile.path);
+            return FALSE;
+        }
+        decoded->pixbuf = load_pixbuf_from_bytes(decoded->bytes, error);
+        if (!decoded->pixbuf) {
+            return FALSE;
+        }
+        g_clear_pointer(&decoded->bytes, g_bytes_unref);
+    }
+    return TRUE;
+}
+
+// The in-order part of applying a delta: blending it and its alpha map into the canvas. An
+// alpha delta goes last, since it overrides the opaque alpha the tiles leave on changed pixels.
+static gboolean composite_overlay(DiaArchive *archive, GdkPixbuf *canvas_pixbuf, const DecodedOverlay *overlay, GError **error) {
+    DIA_TRACE_SCOPE(span, "render.overlay_composite");
+    int canvas_width = gdk_pixbuf_get_width(canvas_pixbuf);
+    int canvas_height = gdk_pixbuf_get_height(canvas_pixbuf);
+    if (overlay->alpha && (gdk_pixbuf_get_width(overlay->alpha) != canvas_width ||
+                           gdk_pixbuf_get_height(overlay->alpha) != canvas_height)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Alpha map size mismatch (%dx%d vs %dx%d)",
+                   gdk_pixbuf_get_width(overlay->alpha), gdk_pixbuf_get_height(overlay->alpha),
+                   canvas_width, canvas_height);
+        return FALSE;
+    }
+
+    if (!overlay->tiles) {
+        if (!blend_full_delta(canvas_pixbuf, overlay->full_delta, overlay->alpha, error)) return FALSE;
+    } else {
+        for (guint i = 0; i < overlay->tiles->len; i++) {
+            if (!blend_delta_tile(archive, canvas_pixbuf, &g_array_index(overlay->tiles, DecodedTile, i), error)) {
+                return FALSE;
+            }
         }
+        if (overlay->alpha && !apply_alpha_map_to_pixbuf(canvas_pixbuf, overlay->alpha, TRUE, error)) return FALSE;
+    }
+    return !overlay->alpha_delta || dia_alpha_delta_apply(overlay->alpha_delta, canvas_pixbuf, error);
+}
 
-        g_autoptr(GdkPixbuf) overlay_alpha_pixbuf = load_alpha_for_id(data, overlay_id, error);
-        
-        int canvas_width = gdk_pixbuf_get_width(canvas_pixbuf);
-        int canvas_height = gdk_pixbuf_get_height(canvas_pixbuf);
-        int overlay_width = gdk_pixbuf_get_width(overlay_to_composite);
-        int overlay_height = gdk_pixbuf_get_height(overlay_to_composite);
-        
-        // Composite overlay
-        int composite_width = MIN(overlay_width, canvas_width);
-        int composite_height = MIN(overlay_height, canvas_height);
-        
-        if (composite_width > 0 && composite_height > 0) {
-            gdk_pixbuf_composite(overlay_to_composite, canvas_pixbuf,
-                               0, 0, composite_width, composite_height,
-                               0, 0, 1.0, 1.0, GDK_INTERP_NEAREST, 255);
-        }
-
-        if (overlay_alpha_pixbuf) {
-            if (!apply_alpha_map_to_pixbuf(canvas_pixbuf, overlay_alpha_pixbuf, TRUE, error)) {
-                g_free(overlay_id);
-                g_object_unref(canvas_pixbuf);
-                g_queue_free_full(chain, g_free);
-                return NULL;
+// Composites one delta onto the canvas in place; alpha_out works as in dia_render_base()
+gboolean dia_render_overlay(DiaArchive *archive, GdkPixbuf *canvas_pixbuf, const gchar *overlay_id, GdkPixbuf **alpha_out, GError **error) {
+    DecodedOverlay overlay = { 0 };
+    gboolean ok = decode_overlay(archive, overlay_id, &overlay, error) &&
+                  composite_overlay(archive, canvas_pixbuf, &overlay, error);
+    if (ok && alpha_out) *alpha_out = g_steal_pointer(&overlay.alpha);
+    decoded_overlay_clear(&overlay);
+    return ok;
+}
+
+// Chain links are decoded on one pool shared by every render; decode_threads is 0 until set or
+// first used
+static GMutex decode_pool_lock;
+static GThreadPool *decode_pool;
+static guint decode_threads;
+
+static guint default_decode_threads(void) {
+    return MIN(g_get_num_processors(), DIA_DEFAULT_DECODE_THREADS);
+}
+
+// Sets how many chain links are decoded at once. 0 picks the default; 1 decodes each link on
+// the rendering thread just before it is composited.
+void dia_render_set_decode_threads(guint n_threads) {
+    g_mutex_lock(&decode_pool_lock);
+    decode_threads = n_threads ? n_threads : default_decode_threads();
+    if (decode_pool) g_thread_pool_set_max_threads(decode_pool, (gint)decode_threads, NULL);
+    g_mutex_unlock(&decode_pool_lock);
+}
+
+guint dia_render_get_decode_threads(void) {
+    g_mutex_lock(&decode_pool_lock);
+    if (!decode_threads) decode_threads = default_decode_threads();
+    guint n_threads = decode_threads;
+    g_mutex_unlock(&decode_pool_lock);
+    return n_threads;
+}
+
+static void decode_link(gpointer data, gpointer user_data) {
+    ChainLink *link = (ChainLink*)data;
+    ChainDecode *decode = link->decode;
+    (void)user_data;
+
+    // Links queued behind a failure or a cancelled render are dropped without decoding
+    if (!g_atomic_int_get(&decode->abandoned) && !g_cancellable_set_error_if_cancelled(decode->cancellable, &link->error)) {
+        if (link == decode->links) {
+            link->canvas = dia_render_base(decode->archive, link->image_id, NULL, &link->error);
+        } else {
+            decode_overlay(decode->archive, link->image_id, &link->overlay, &link->error);
+        }
+    }
+
+    g_mutex_lock(&decode->lock);
+    link->done = TRUE;
+    g_cond_broadcast(&decode->ready);
+    g_mutex_unlock(&decode->lock);
+}
+
+static GThreadPool* get_decode_pool(guint *n_threads) {
+    g_mutex_lock(&decode_pool_lock);
+    if (!decode_threads) decode_threads = default_decode_threads();
+    if (!decode_pool && decode_threads > 1) {
+        decode_pool = g_thread_pool_new(decode_link, NULL, (gint)decode_threads, FALSE, NULL);
+    }
+    *n_threads = decode_threads;
+    GThreadPool *pool = decode_threads > 1 ? decode_pool : NULL;
+    g_mutex_unlock(&decode_pool_lock);
+    return pool;
+}
+
+// Reconstructs chain (canvas image first, requested image last). Reads and decodes of up to
+// one link per decode thread run ahead on the pool while the canvas is composited strictly in
+// order, so decodes can overlap composites when cores are free for them. The canvas image is
+// decoded as a base unless cached_pixbuf already holds it.
+static GdkPixbuf* render_chain(DiaArchive *archive, DiaCanvasCache *cache, GQueue *chain, GdkPixbuf *cached_pixbuf,
+                               GCancellable *cancellable, GError **error) {
+    guint n_links = g_queue_get_length(chain);
+    ChainDecode decode = { .archive = archive, .cancellable = cancellable };
+    decode.links = g_new0(ChainLink, n_links);
+    g_mutex_init(&decode.lock);
+    g_cond_init(&decode.ready);
+
+    guint i = 0;
+    for (GList *l = chain->head; l; l = l->next, i++) {
+        decode.links[i].decode = &decode;
+        decode.links[i].image_id = l->data;
+    }
+    guint submitted = 0;
+    if (cached_pixbuf) {
+        decode.links[0].canvas = gdk_pixbuf_copy(cached_pixbuf);
+        decode.links[0].done = TRUE;
+        submitted = 1;
+    }
+
+    guint n_threads;
+    GThreadPool *pool = get_decode_pool(&n_threads);
+    guint lookahead = pool ? n_threads : 0;
+    GdkPixbuf *canvas_pixbuf = NULL;
+    gboolean ok = TRUE;
+    for (i = 0; ok && i < n_links; i++) {
+        for (; submitted < n_links && submitted <= i + lookahead; submitted++) {
+            if (pool) g_thread_pool_push(pool, &decode.links[submitted], NULL);
+            else decode_link(&decode.links[submitted], NULL);
+        }
+
+        ChainLink *link = &decode.links[i];
+        g_mutex_lock(&decode.lock);
+        while (!link->done) g_cond_wait(&decode.ready, &decode.lock);
+        g_mutex_unlock(&decode.lock);
+
+        if (link->error) {
+            g_propagate_error(error, g_steal_pointer(&link->error));
+            ok = FALSE;
+        } else if (i == 0) {
+            canvas_pixbuf = g_steal_pointer(&link->canvas);
+        } else if (g_cancellable_set_error_if_cancelled(cancellable, error)) {
+            // Bail out between steps once a newer render supersedes this one
+            ok = FALSE;
+        } else {
+            // Keep the parent of the requested image so its siblings only pay for one overlay
+            if (cache && i == n_links - 1 && !(i == 1 && cached_pixbuf)) {
+                g_autoptr(GdkPixbuf) parent_copy = gdk_pixbuf_copy(canvas_pixbuf);
+                dia_canvas_cache_insert(cache, decode.links[i - 1].image_id, parent_copy);
             }
+            ok = composite_overlay(archive, canvas_pixbuf, &link->overlay, error);
+            decoded_overlay_clear(&link->overlay);
         }
-        
-        g_free(overlay_id);
     }
-    
-    g_queue_free(chain);
+
+    // Links still in flight reference this frame; the queued ones drop out at once
+    if (!ok) g_atomic_int_set(&decode.abandoned, TRUE);
+    g_mutex_lock(&decode.lock);
+    for (guint j = 0; j < submitted; j++) {
+        while (!decode.links[j].done) g_cond_wait(&decode.ready, &decode.lock);
+    }
+    g_mutex_unlock(&decode.lock);
+
+    for (guint j = 0; j < n_links; j++) {
+        decoded_overlay_clear(&decode.links[j].overlay);
+        g_clear_object(&decode.links[j].canvas);
+        g_clear_error(&decode.links[j].error);
+    }
+    g_free(decode.links);
+    g_mutex_clear(&decode.lock);
+    g_cond_clear(&decode.ready);
+
+    if (!ok) {
+        g_clear_object(&canvas_pixbuf);
+        return NULL;
+    }
+    dia_canvas_cache_insert(cache, g_queue_peek_tail(chain), canvas_pixbuf);
     return canvas_pixbuf;
 }
 
-static GdkPixbuf* load_alpha_for_id(AppData *data, const gchar *image_id, GError **error) {
-    if (!data->alpha_map) return NULL;
+// Reads the coefficient blocks of a JPEG root
+DiaJpegCoefs* dia_render_jpeg_base(DiaArchive *archive, const gchar *base_id, GError **error) {
+    guint32 base_entry;
+    const gchar *base_filename = dia_archive_image_path(archive, base_id, &base_entry);
+    if (!base_filename) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Could not find filename for ID '%s'", base_id);
+        return NULL;
+    }
 
-    const gchar *alpha_path = g_hash_table_lookup(data->alpha_map, image_id);
-    if (!alpha_path) return NULL;
+    g_autoptr(GBytes) base_bytes = dia_archive_read_hinted(archive, base_entry, base_filename, error);
+    if (!base_bytes) return NULL;
+    if (!dia_jpeg_is_image(base_bytes)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "'%s' is not a JPEG", base_filename);
+        return NULL;
+    }
+    return dia_jpeg_coefs_new(base_bytes, base_filename, error);
+}
 
-    gsize alpha_size = 0;
-    g_autofree gchar *alpha_buffer = read_file_from_zip(data->zip_path, alpha_path, &alpha_size, error);
-    if (!alpha_buffer) return NULL;
+// Patches the changed coefficient blocks of a JPEG delta into its parent's, in place
+gboolean dia_render_jpeg_overlay(DiaArchive *archive, DiaJpegCoefs *coefs, const gchar *overlay_id, GError **error) {
+    DIA_TRACE_SCOPE(span, "render.jpeg_overlay");
+    gint n_tiles = dia_archive_n_tiles(archive, overlay_id);
+    if (n_tiles < 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "JPEG overlay ID '%s' has no coefficient delta", overlay_id);
+        return FALSE;
+    }
+    for (gint i = 0; i < n_tiles; i++) {
+        DiaDeltaTile tile;
+        dia_archive_get_tile(archive, overlay_id, (guint)i, &tile);
+        g_autoptr(GBytes) delta_bytes = dia_archive_read_hinted(archive, tile.entry, tile.path, error);
+        if (!delta_bytes) return FALSE;
+        if (!dia_jpeg_is_delta(delta_bytes)) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "'%s' is not a JPEG coefficient delta", tile.path);
+            return FALSE;
+        }
+        if (!dia_jpeg_coefs_apply(coefs, delta_bytes, tile.path, error)) return FALSE;
+    }
+    return TRUE;
+}
 
-    GdkPixbuf *alpha_pixbuf = load_pixbuf_from_memory(alpha_buffer, alpha_size, error);
-    return alpha_pixbuf;
+// Alpha-delta archives reconstruct the exact alpha on the canvas, so a canvas with any
+// non-opaque pixel came from an image with alpha
+static gboolean canvas_is_opaque(GdkPixbuf *canvas) {
+    int width = gdk_pixbuf_get_width(canvas);
+    int height = gdk_pixbuf_get_height(canvas);
+    int stride = gdk_pixbuf_get_rowstride(canvas);
+    const guint8 *pixels = gdk_pixbuf_read_pixels(canvas);
+    for (int y = 0; y < height; y++) {
+        const guint8 *row = pixels + (gsize)y * stride;
+        for (int x = 0; x < width; x++) {
+            if (row[4 * x + 3] != 0xff) return FALSE;
+        }
+    }
+    return TRUE;
 }
 
-static gboolean apply_alpha_map_to_pixbuf(GdkPixbuf *pixbuf, GdkPixbuf *alpha_map_pixbuf, gboolean combine_with_existing, GError **error) {
+// The canvas is always RGBA; the output is RGB for images that had no alpha
+static GdkPixbuf* build_output_pixbuf(GdkPixbuf *canvas, GdkPixbuf *alpha) {
+    int width = gdk_pixbuf_get_width(canvas);
+    int height = gdk_pixbuf_get_height(canvas);
+    GdkPixbuf *out = gdk_pixbuf_new(GDK_COLORSPACE_RGB, alpha != NULL, 8, width, height);
+    if (!out) return NULL;
+
+    const guint8 *src = gdk_pixbuf_read_pixels(canvas);
+    int src_stride = gdk_pixbuf_get_rowstride(canvas);
+    guint8 *dst = gdk_pixbuf_get_pixels(out);
+    int dst_stride = gdk_pixbuf_get_rowstride(out);
+    const guint8 *alpha_pixels = alpha ? gdk_pixbuf_read_pixels(alpha) : NULL;
+    int alpha_stride = alpha ? gdk_pixbuf_get_rowstride(alpha) : 0;
+    int alpha_channels = alpha ? gdk_pixbuf_get_n_channels(alpha) : 0;
+
+    for (int y = 0; y < height; y++) {
+        const guint8 *s = src + (gsize)y * src_stride;
+        guint8 *d = dst + (gsize)y * dst_stride;
+        if (alpha) {
+            const guint8 *a = alpha_pixels + (gsize)y * alpha_stride;
+            for (int x = 0; x < width; x++) {
+                d[4 * x] = s[4 * x];
+                d[4 * x + 1] = s[4 * x + 1];
+                d[4 * x + 2] = s[4 * x + 2];
+                d[4 * x + 3] = a[x * alpha_channels + alpha_channels - 1];
+            }
+        } else {
+            for (int x = 0; x < width; x++) {
+                d[3 * x] = s[4 * x];
+                d[3 * x + 1] = s[4 * x + 1];
+                d[3 * x + 2] = s[4 * x + 2];
+            }
+        }
+    }
+    return out;
+}
+
+// The image as it was packed, from its reconstructed canvas: RGB when it had no alpha, RGBA
+// otherwise. A legacy archive's canvas alpha is compounded along the chain, so its alpha is
+// taken from the image's own alpha map: alpha when the caller already has it, else read here.
+// An alpha-delta canvas carries the exact alpha itself.
+GdkPixbuf* dia_render_output(DiaArchive *archive, const gchar *image_id, GdkPixbuf *canvas, GdkPixbuf *alpha, GError **error) {
+    g_autoptr(GdkPixbuf) own_alpha = NULL;
+    if (!alpha && dia_archive_alpha_deltas(archive)) {
+        if (!canvas_is_opaque(canvas)) alpha = canvas;
+    } else if (!alpha) {
+        DiaAlphaDelta *alpha_delta = NULL;
+        if (!load_alpha_for_id(archive, image_id, &own_alpha, &alpha_delta, error)) return NULL;
+        dia_alpha_delta_free(alpha_delta);  // legacy archives have none
+        alpha = own_alpha;
+    }
+
+    GdkPixbuf *out = build_output_pixbuf(canvas, alpha);
+    if (!out) g_set_error(error, G_IO_ERROR, G_IO_ERROR_NO_SPACE, "Could not allocate output image for ID '%s'", image_id);
+    return out;
+}
+
+// Decodes the smallest stored preview whose longest side is at least min_size, or the largest
+// one if none is. Fails with G_IO_ERROR_NOT_FOUND when the image has no previews.
+GdkPixbuf* dia_render_preview(DiaArchive *archive, const gchar *image_id, guint min_size, guint *size_out, GError **error) {
+    DIA_TRACE_SCOPE(span, "render.preview");
+    guint n_previews = dia_archive_n_previews(archive, image_id);
+    if (n_previews == 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No preview stored for ID '%s'", image_id);
+        return NULL;
+    }
+
+    DiaPreview preview;
+    for (guint i = 0; i < n_previews; i++) {
+        dia_archive_get_preview(archive, image_id, i, &preview);
+        if (preview.size >= min_size) break;
+    }
+
+    g_autoptr(GBytes) bytes = dia_archive_read_hinted(archive, preview.entry, preview.path, error);
+    if (!bytes) return NULL;
+    GdkPixbuf *pixbuf = load_pixbuf_from_bytes(bytes, error);
+    if (pixbuf && size_out) *size_out = preview.size;
+    return pixbuf;
+}
+
+// Fills in *alpha_pixbuf for a full alpha map or *alpha_delta for an alpha delta, told apart
+// by magic. Images without an alpha entry succeed with both left NULL.
+static gboolean load_alpha_for_id(DiaArchive *archive, const gchar *image_id, GdkPixbuf **alpha_pixbuf,
+                                  DiaAlphaDelta **alpha_delta, GError **error) {
+    guint32 alpha_entry;
+    const gchar *alpha_path = dia_archive_alpha_path(archive, image_id, &alpha_entry);
+    if (!alpha_path) return TRUE;
+
+    DIA_TRACE_SCOPE(span, "render.alpha_load");
+    g_autoptr(GBytes) alpha_bytes = dia_archive_read_hinted(archive, alpha_entry, alpha_path, error);
+    if (!alpha_bytes) return FALSE;
+    DIA_TRACE_BYTES(span, g_bytes_get_size(alpha_bytes));
+
+    if (dia_alpha_is_delta(alpha_bytes)) {
+        *alpha_delta = dia_alpha_delta_decode(alpha_bytes, alpha_path, error);
+        return *alpha_delta != NULL;
+    }
+    *alpha_pixbuf = load_pixbuf_from_bytes(alpha_bytes, error);
+    return *alpha_pixbuf != NULL;
+}
+
+gboolean apply_alpha_map_to_pixbuf(GdkPixbuf *pixbuf, GdkPixbuf *alpha_map_pixbuf, gboolean combine_with_existing, GError **error) {
     if (!pixbuf || !alpha_map_pixbuf) return FALSE;
 
     int w = gdk_pixbuf_get_width(pixbuf);
@@ -180,6 +664,9 @@ static gboolean apply_alpha_map_to_pixbuf(GdkPixbuf *pixbuf, GdkPixbuf *alpha_ma
         return FALSE;
     }
 
+    DIA_TRACE_SCOPE(span, "render.alpha_apply");
+    DIA_TRACE_BYTES(span, (guint64)w * h);
+
     int rowstride = gdk_pixbuf_get_rowstride(pixbuf);
     int alpha_rowstride = gdk_pixbuf_get_rowstride(alpha_map_pixbuf);
     int n_channels = gdk_pixbuf_get_n_channels(pixbuf);
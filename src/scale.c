@@ -0,0 +1,263 @@
+#include "viewer.h"
+
+// Fitting the image to the viewport happens at most once per frame. A nearest-neighbour preview
+// from the closest mip level is shown right away, and the filtered result follows from a worker.
+
+#define DIA_SCALE_CACHE_ENTRIES 4
+
+typedef struct {
+    gint width;
+    gint height;
+    GdkPixbuf *pixbuf;
+} ScaledImage;
+
+typedef struct {
+    DiaScaler *scaler;
+    GPtrArray *mips;
+    guint generation;
+    gint width;
+    gint height;
+} ScaleJob;
+
+static void scaled_image_free(ScaledImage *scaled) {
+    g_object_unref(scaled->pixbuf);
+    g_free(scaled);
+}
+
+static void scale_job_free(ScaleJob *job) {
+    g_ptr_array_unref(job->mips);
+    g_free(job);
+}
+
+static void clear_cache(DiaScaler *scaler) {
+    ScaledImage *scaled;
+    while ((scaled = g_queue_pop_head(scaler->cache))) scaled_image_free(scaled);
+}
+
+static ScaledImage* cache_lookup(DiaScaler *scaler, gint width, gint height) {
+    for (GList *l = scaler->cache->head; l; l = l->next) {
+        ScaledImage *scaled = l->data;
+        if (scaled->width != width || scaled->height != height) continue;
+        g_queue_unlink(scaler->cache, l);
+        g_queue_push_head_link(scaler->cache, l);
+        return scaled;
+    }
+    return NULL;
+}
+
+static void cache_insert(DiaScaler *scaler, gint width, gint height, GdkPixbuf *pixbuf) {
+    if (cache_lookup(scaler, width, height)) return;
+    ScaledImage *scaled = g_new(ScaledImage, 1);
+    scaled->width = width;
+    scaled->height = height;
+    scaled->pixbuf = g_object_ref(pixbuf);
+    g_queue_push_head(scaler->cache, scaled);
+    while (g_queue_get_length(scaler->cache) > DIA_SCALE_CACHE_ENTRIES) scaled_image_free(g_queue_pop_tail(scaler->cache));
+}
+
+// Smallest level still at least width x height. With build set, missing halvings are made on the
+// way down; only one worker runs at a time, so the lock is just for readers on the main thread.
+static GdkPixbuf* pick_level(DiaScaler *scaler, GPtrArray *mips, gint width, gint height, gboolean build) {
+    g_mutex_lock(&scaler->lock);
+    guint level = 0;
+    for (;;) {
+        GdkPixbuf *current = g_ptr_array_index(mips, level);
+        gint half_width = gdk_pixbuf_get_width(current) / 2;
+        gint half_height = gdk_pixbuf_get_height(current) / 2;
+        if (half_width < width || half_height < height) break;
+
+        if (level + 1 >= mips->len) {
+            if (!build) break;
+            g_object_ref(current);
+            g_mutex_unlock(&scaler->lock);
+            GdkPixbuf *half = gdk_pixbuf_scale_simple(current, half_width, half_height, GDK_INTERP_BILINEAR);
+            g_object_unref(current);
+            g_mutex_lock(&scaler->lock);
+            if (!half) break;
+            g_ptr_array_add(mips, half);
+        }
+        level++;
+    }
+    GdkPixbuf *pixbuf = g_object_ref(g_ptr_array_index(mips, level));
+    g_mutex_unlock(&scaler->lock);
+    return pixbuf;
+}
+
+// Runs on a GTask worker thread
+static void scale_thread(GTask *task, gpointer source_object, gpointer task_data, GCancellable *cancellable) {
+    ScaleJob *job = (ScaleJob*)task_data;
+    (void)source_object; (void)cancellable;
+
+    GdkPixbuf *level = pick_level(job->scaler, job->mips, job->width, job->height, TRUE);
+    GdkPixbuf *scaled = gdk_pixbuf_scale_simple(level, job->width, job->height, GDK_INTERP_BILINEAR);
+    g_object_unref(level);
+    if (scaled) {
+        g_task_return_pointer(task, scaled, g_object_unref);
+    } else {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED, "Could not scale image to %dx%d", job->width, job->height);
+    }
+}
+
+static void start_job(DiaScaler *scaler, gint width, gint height);
+
+// Back on the main thread; a result is shown only if the viewport still wants that size
+static void on_scale_finished(GObject *source_object, GAsyncResult *result, gpointer user_data) {
+    DiaScaler *scaler = (DiaScaler*)user_data;
+    GTask *task = G_TASK(result);
+    ScaleJob *job = (ScaleJob*)g_task_get_task_data(task);
+    (void)source_object;
+
+    g_autoptr(GError) error = NULL;
+    GdkPixbuf *scaled = g_task_propagate_pointer(task, &error);
+    scaler->busy = FALSE;
+
+    if (job->generation == scaler->generation) {
+        if (scaled) {
+            cache_insert(scaler, job->width, job->height, scaled);
+            if (job->width == scaler->shown_width && job->height == scaler->shown_height) {
+                gtk_image_set_from_pixbuf(GTK_IMAGE(scaler->data->image_display), scaled);
+            }
+        } else {
+            g_printerr("[dia] %s\n", error ? error->message : "Could not scale image");
+        }
+    }
+
+    // The viewport or the image moved on while this job ran
+    if (scaler->pending && scaler->source) {
+        scaler->pending = FALSE;
+        gboolean full_size = scaler->shown_width == gdk_pixbuf_get_width(scaler->source) &&
+                             scaler->shown_height == gdk_pixbuf_get_height(scaler->source);
+        if (!full_size && !cache_lookup(scaler, scaler->shown_width, scaler->shown_height)) {
+            start_job(scaler, scaler->shown_width, scaler->shown_height);
+        }
+    }
+
+    if (scaled) g_object_unref(scaled);
+    g_application_release(g_application_get_default());
+}
+
+static void start_job(DiaScaler *scaler, gint width, gint height) {
+    if (scaler->busy) {
+        scaler->pending = TRUE;
+        return;
+    }
+    scaler->busy = TRUE;
+
+    ScaleJob *job = g_new0(ScaleJob, 1);
+    job->scaler = scaler;
+    job->mips = g_ptr_array_ref(scaler->mips);
+    job->generation = scaler->generation;
+    job->width = width;
+    job->height = height;
+
+    // Keep the application alive until the worker has handed its result back
+    g_application_hold(g_application_get_default());
+
+    GTask *task = g_task_new(NULL, NULL, on_scale_finished, scaler);
+    g_task_set_task_data(task, job, (GDestroyNotify)scale_job_free);
+    g_task_run_in_thread(task, scale_thread);
+    g_object_unref(task);
+}
+
+static void fit_now(DiaScaler *scaler) {
+    AppData *data = scaler->data;
+    if (!scaler->source || !data->scrolled_image) return;
+
+    GtkAllocation allocation;
+    gtk_widget_get_allocation(data->scrolled_image, &allocation);
+
+    int orig_width = gdk_pixbuf_get_width(scaler->source);
+    int orig_height = gdk_pixbuf_get_height(scaler->source);
+
+    int available_width = allocation.width - 5;
+    int available_height = allocation.height - 5;
+
+    if (available_width <= 0 || available_height <= 0) return;
+
+    double scale_x = (double)available_width / orig_width;
+    double scale_y = (double)available_height / orig_height;
+    double scale = MIN(scale_x, scale_y);
+
+    // Only scale down
+    scale = MIN(scale, 1.0);
+
+    int new_width = (int)(orig_width * scale);
+    int new_height = (int)(orig_height * scale);
+
+    if (new_width <= 0 || new_height <= 0) return;
+    if (new_width == scaler->shown_width && new_height == scaler->shown_height) return;
+    scaler->shown_width = new_width;
+    scaler->shown_height = new_height;
+
+    if (new_width == orig_width && new_height == orig_height) {
+        gtk_image_set_from_pixbuf(GTK_IMAGE(data->image_display), scaler->source);
+        return;
+    }
+
+    ScaledImage *cached = cache_lookup(scaler, new_width, new_height);
+    if (cached) {
+        gtk_image_set_from_pixbuf(GTK_IMAGE(data->image_display), cached->pixbuf);
+        return;
+    }
+
+    // Nearest sampling only touches the output pixels, so the preview stays cheap at any source size
+    GdkPixbuf *level = pick_level(scaler, scaler->mips, new_width, new_height, FALSE);
+    GdkPixbuf *preview = gdk_pixbuf_scale_simple(level, new_width, new_height, GDK_INTERP_NEAREST);
+    g_object_unref(level);
+    if (preview) {
+        gtk_image_set_from_pixbuf(GTK_IMAGE(data->image_display), preview);
+        g_object_unref(preview);
+    }
+    start_job(scaler, new_width, new_height);
+}
+
+static gboolean on_scale_tick(GtkWidget *widget, GdkFrameClock *frame_clock, gpointer user_data) {
+    DiaScaler *scaler = (DiaScaler*)user_data;
+    (void)widget; (void)frame_clock;
+    scaler->frame_pending = FALSE;
+    fit_now(scaler);
+    return G_SOURCE_REMOVE;
+}
+
+DiaScaler* dia_scaler_new(AppData *data) {
+    DiaScaler *scaler = g_new0(DiaScaler, 1);
+    scaler->data = data;
+    scaler->cache = g_queue_new();
+    g_mutex_init(&scaler->lock);
+    return scaler;
+}
+
+void dia_scaler_free(DiaScaler *scaler) {
+    if (!scaler) return;
+    clear_cache(scaler);
+    g_queue_free(scaler->cache);
+    if (scaler->mips) g_ptr_array_unref(scaler->mips);
+    if (scaler->source) g_object_unref(scaler->source);
+    g_mutex_clear(&scaler->lock);
+    g_free(scaler);
+}
+
+// A NULL source drops everything, e.g. when the window goes away
+void dia_scaler_set_source(DiaScaler *scaler, GdkPixbuf *source) {
+    scaler->generation++;
+    scaler->pending = FALSE;
+    scaler->shown_width = scaler->shown_height = 0;
+    clear_cache(scaler);
+    if (scaler->mips) g_ptr_array_unref(scaler->mips);
+    if (scaler->source) g_object_unref(scaler->source);
+    scaler->mips = NULL;
+    scaler->source = NULL;
+    if (!source) return;
+
+    scaler->source = g_object_ref(source);
+    scaler->mips = g_ptr_array_new_with_free_func(g_object_unref);
+    g_ptr_array_add(scaler->mips, g_object_ref(source));
+    fit_now(scaler);
+}
+
+// Coalesces any number of calls into one fit on the next frame
+void dia_scaler_queue(DiaScaler *scaler) {
+    if (!scaler->source || scaler->frame_pending || !scaler->data->scrolled_image) return;
+    scaler->frame_pending = TRUE;
+    gtk_widget_add_tick_callback(scaler->data->scrolled_image, on_scale_tick, scaler, NULL);
+}
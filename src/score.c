@@ -0,0 +1,596 @@
+#include "dia.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DIA_SCORE_X86 1
+#include <immintrin.h>
+#endif
+
+// Phase 1 of encode.py, natively: every image is decoded once into packed RGBX, images are
+// bucketed by size and PIL mode, and the pairs inside each bucket are scored by counting
+// pixels whose difference converts to L == 0, or with DIA_SCORE_BYTES by estimating the
+// compressed size of their delta.
+
+typedef struct {
+    guint id;
+    const gchar *path;
+    int width;
+    int height;
+    gchar mode[8];
+    guint8 *pixels;
+    gboolean failed;
+    guint bucket;
+    guint slot;
+} ScoreImage;
+
+// One requested pair, as slots within its bucket plus the blocks those slots fall in
+typedef struct {
+    guint block_left;
+    guint block_right;
+    guint left;
+    guint right;
+} ListedPair;
+
+typedef guint64 (*CountEqualFunc)(const guint8 *a, const guint8 *b, gsize n_pixels);
+
+// PIL's RGB -> L is (R*19595 + G*38470 + B*7471 + 0x8000) >> 16, which is zero for an
+// absolute difference exactly when dG == 0 and dB + 3*dR <= 4. Alpha is ignored, as in PIL.
+static inline gboolean pixel_scores(const guint8 *a, const guint8 *b) {
+    int dr = ABS((int)a[0] - (int)b[0]);
+    int dg = ABS((int)a[1] - (int)b[1]);
+    int db = ABS((int)a[2] - (int)b[2]);
+    return dg == 0 && db + 3 * dr <= 4;
+}
+
+static guint64 count_equal_scalar(const guint8 *a, const guint8 *b, gsize n_pixels) {
+    guint64 count = 0;
+    for (gsize i = 0; i < n_pixels; i++) {
+        count += pixel_scores(a + 4 * i, b + 4 * i);
+    }
+    return count;
+}
+
+#ifdef DIA_SCORE_X86
+// Bytes per pixel are R, G, B, X. With d = |a - b| per byte, R is shifted onto the B byte and
+// added three times with saturation, so one unsigned byte compare checks dB + 3*dR <= 4 and
+// another checks dG == 0. Each pixel then contributes 0 or 1 to a 32-bit lane counter.
+__attribute__((target("sse2")))
+static guint64 count_equal_sse2(const guint8 *a, const guint8 *b, gsize n_pixels) {
+    const __m128i low_byte = _mm_set1_epi32(0xff);
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i four = _mm_set1_epi8(4);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    gsize i = 0;
+
+    for (; i + 4 <= n_pixels; i += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + 4 * i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + 4 * i));
+        __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        __m128i r = _mm_slli_epi32(_mm_and_si128(d, low_byte), 16);
+        __m128i s = _mm_adds_epu8(d, _mm_adds_epu8(_mm_adds_epu8(r, r), r));
+        __m128i b_ok = _mm_cmpeq_epi8(_mm_min_epu8(s, four), s);
+        __m128i g_ok = _mm_cmpeq_epi8(d, zero);
+        __m128i ok = _mm_and_si128(_mm_srli_epi32(b_ok, 8), g_ok);
+        acc = _mm_add_epi32(acc, _mm_and_si128(_mm_srli_epi32(ok, 8), one));
+    }
+
+    guint32 lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    guint64 count = (guint64)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    return count + count_equal_scalar(a + 4 * i, b + 4 * i, n_pixels - i);
+}
+
+__attribute__((target("avx2")))
+static guint64 count_equal_avx2(const guint8 *a, const guint8 *b, gsize n_pixels) {
+    const __m256i low_byte = _mm256_set1_epi32(0xff);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i four = _mm256_set1_epi8(4);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = _mm256_setzero_si256();
+    gsize i = 0;
+
+    for (; i + 8 <= n_pixels; i += 8) {
+        __m256i va = _mm256_loadu_si256((const __m256i*)(a + 4 * i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*)(b + 4 * i));
+        __m256i d = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+        __m256i r = _mm256_slli_epi32(_mm256_and_si256(d, low_byte), 16);
+        __m256i s = _mm256_adds_epu8(d, _mm256_adds_epu8(_mm256_adds_epu8(r, r), r));
+        __m256i b_ok = _mm256_cmpeq_epi8(_mm256_min_epu8(s, four), s);
+        __m256i g_ok = _mm256_cmpeq_epi8(d, zero);
+        __m256i ok = _mm256_and_si256(_mm256_srli_epi32(b_ok, 8), g_ok);
+        acc = _mm256_add_epi32(acc, _mm256_and_si256(_mm256_srli_epi32(ok, 8), one));
+    }
+
+    guint32 lanes[8];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    guint64 count = 0;
+    for (int k = 0; k < 8; k++) count += lanes[k];
+    return count + count_equal_scalar(a + 4 * i, b + 4 * i, n_pixels - i);
+}
+#endif
+
+// Mirrors estimate_delta_bytes() in encode.py: a fixed cost per changed 64x64 cell, the binary
+// entropy of the change mask inside those cells, and the order-0 entropy of the changed pixels'
+// left-neighbour residuals, averaged over both images. Changes are exact per channel.
+#define COST_CELL 64
+#define COST_CELL_BYTES 24
+
+static double mask_bits(guint64 changed, guint64 area) {
+    double bits = -(double)changed * log2((double)changed / area);
+    if (changed < area) bits -= (double)(area - changed) * log2((double)(area - changed) / area);
+    return bits;
+}
+
+static guint64 estimate_delta_bytes(const guint8 *a, const guint8 *b, int width, int height) {
+    guint64 histogram[256] = { 0 };
+    guint64 n_cells = 0;
+    double bits = 0;
+    int grid_w = (width + COST_CELL - 1) / COST_CELL;
+    guint64 *counts = g_new(guint64, grid_w);
+
+    for (int y0 = 0; y0 < height; y0 += COST_CELL) {
+        int rows = MIN(COST_CELL, height - y0);
+        memset(counts, 0, sizeof(guint64) * grid_w);
+        for (int y = y0; y < y0 + rows; y++) {
+            const guint8 *pa = a + (gsize)y * width * 4;
+            const guint8 *pb = b + (gsize)y * width * 4;
+            for (int x = 0; x < width; x++, pa += 4, pb += 4) {
+                if (pa[0] == pb[0] && pa[1] == pb[1] && pa[2] == pb[2]) continue;
+                counts[x / COST_CELL]++;
+                for (int c = 0; c < 3; c++) {
+                    histogram[(guint8)(pa[c] - (x ? pa[c - 4] : 0))]++;
+                    histogram[(guint8)(pb[c] - (x ? pb[c - 4] : 0))]++;
+                }
+            }
+        }
+        for (int gx = 0; gx < grid_w; gx++) {
+            if (!counts[gx]) continue;
+            n_cells++;
+            bits += mask_bits(counts[gx], (guint64)rows * MIN(COST_CELL, width - gx * COST_CELL));
+        }
+    }
+    g_free(counts);
+    if (!n_cells) return 0;
+
+    guint64 total = 0;
+    double value_bits = 0;
+    for (int v = 0; v < 256; v++) {
+        if (!histogram[v]) continue;
+        total += histogram[v];
+        value_bits -= histogram[v] * log2((double)histogram[v]);
+    }
+    value_bits += total * log2((double)total);
+    return (guint64)(n_cells * COST_CELL_BYTES + (bits + value_bits / 2) / 8 + 0.5);
+}
+
+// Shares the SIMD level chosen for the blend kernels, so DIA_BLEND overrides both
+static CountEqualFunc count_equal_for(DiaBlendImpl impl) {
+    switch (impl) {
+#ifdef DIA_SCORE_X86
+    case DIA_BLEND_AVX2:
+        return count_equal_avx2;
+    case DIA_BLEND_SSE2:
+        return count_equal_sse2;
+#endif
+    default:
+        return count_equal_scalar;
+    }
+}
+
+// PIL's mode for a PNG, read from the IHDR chunk; pairs only score when sizes and modes match
+static gboolean read_png_header(const gchar *path, ScoreImage *image) {
+    static const guint8 signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    guint8 header[26];
+
+    FILE *file = fopen(path, "rb");
+    if (!file) return FALSE;
+    gsize got = fread(header, 1, sizeof(header), file);
+    fclose(file);
+
+    if (got != sizeof(header) || memcmp(header, signature, 8) != 0 || memcmp(header + 12, "IHDR", 4) != 0) {
+        return FALSE;
+    }
+
+    guint32 width, height;
+    memcpy(&width, header + 16, 4);
+    memcpy(&height, header + 20, 4);
+    image->width = (int)GUINT32_FROM_BE(width);
+    image->height = (int)GUINT32_FROM_BE(height);
+    guint8 bit_depth = header[24];
+    switch (header[25]) {
+    case 0: g_strlcpy(image->mode, bit_depth == 1 ? "1" : bit_depth == 16 ? "I;16" : "L", sizeof(image->mode)); break;
+    case 2: g_strlcpy(image->mode, "RGB", sizeof(image->mode)); break;
+    case 3: g_strlcpy(image->mode, "P", sizeof(image->mode)); break;
+    case 4: g_strlcpy(image->mode, "LA", sizeof(image->mode)); break;
+    case 6: g_strlcpy(image->mode, "RGBA", sizeof(image->mode)); break;
+    default: return FALSE;
+    }
+    return image->width > 0 && image->height > 0;
+}
+
+// -1 when either image failed to decode
+static gint64 score_pair(const ScoreImage *a, const ScoreImage *b, gsize n_pixels, CountEqualFunc count_equal,
+                         DiaScoreMetric metric) {
+    if (!a->pixels || !b->pixels) return -1;
+    if (metric == DIA_SCORE_BYTES) return (gint64)estimate_delta_bytes(a->pixels, b->pixels, a->width, a->height);
+    return (gint64)count_equal(a->pixels, b->pixels, n_pixels);
+}
+
+static guint8* decode_packed(const ScoreImage *image) {
+    g_autoptr(GdkPixbuf) pixbuf = gdk_pixbuf_new_from_file(image->path, NULL);
+    if (!pixbuf || gdk_pixbuf_get_width(pixbuf) != image->width || gdk_pixbuf_get_height(pixbuf) != image->height) {
+        return NULL;
+    }
+
+    int channels = gdk_pixbuf_get_n_channels(pixbuf);
+    int stride = gdk_pixbuf_get_rowstride(pixbuf);
+    const guint8 *src = gdk_pixbuf_read_pixels(pixbuf);
+    guint8 *packed = g_try_malloc((gsize)image->width * image->height * 4);
+    if (!packed) return NULL;
+
+    guint8 *dst = packed;
+    for (int y = 0; y < image->height; y++) {
+        const guint8 *s = src + (gsize)y * stride;
+        for (int x = 0; x < image->width; x++, s += channels, dst += 4) {
+            dst[0] = s[0];
+            dst[1] = s[1];
+            dst[2] = s[2];
+            dst[3] = 0;
+        }
+    }
+    return packed;
+}
+
+// Minimal parallel-for: workers pull item indices from a shared counter, so uneven items
+// balance out without a queue
+typedef void (*ScoreWorkFunc)(gpointer ctx, guint item);
+
+typedef struct {
+    ScoreWorkFunc func;
+    gpointer ctx;
+    guint n_items;
+    gint next;
+} ParallelFor;
+
+static gpointer parallel_for_worker(gpointer user_data) {
+    ParallelFor *work = user_data;
+    for (;;) {
+        guint item = (guint)g_atomic_int_add(&work->next, 1);
+        if (item >= work->n_items) break;
+        work->func(work->ctx, item);
+    }
+    return NULL;
+}
+
+static void parallel_for(guint n_items, guint jobs, ScoreWorkFunc func, gpointer ctx) {
+    ParallelFor work = { func, ctx, n_items, 0 };
+    guint n_threads = MIN(jobs, n_items);
+    if (n_threads <= 1) {
+        parallel_for_worker(&work);
+        return;
+    }
+
+    GThread **threads = g_new(GThread*, n_threads);
+    for (guint t = 0; t < n_threads; t++) {
+        threads[t] = g_thread_new("dia-score", parallel_for_worker, &work);
+    }
+    for (guint t = 0; t < n_threads; t++) {
+        g_thread_join(threads[t]);
+    }
+    g_free(threads);
+}
+
+typedef struct {
+    ScoreImage **images;
+    gint decodes;
+    gint failures;
+} DecodeBatch;
+
+static void decode_one(gpointer ctx, guint item) {
+    DecodeBatch *batch = ctx;
+    ScoreImage *image = batch->images[item];
+    if (image->pixels || image->failed) return;
+
+    image->pixels = decode_packed(image);
+    g_atomic_int_inc(&batch->decodes);
+    if (!image->pixels) {
+        image->failed = TRUE;
+        g_atomic_int_inc(&batch->failures);
+        g_printerr("[dia] could not decode '%s', skipping it\n", image->path);
+    }
+}
+
+// Each work item is one image of the left block against every later image of the right block
+// (or of its own block on the diagonal), written to its slice of the score buffer
+typedef struct {
+    ScoreImage **left;
+    ScoreImage **right;
+    guint n_right;
+    gboolean diagonal;
+    guint first_row;
+    gsize *row_offsets;
+    gint64 *scores;
+    gsize n_pixels;
+    CountEqualFunc count_equal;
+    DiaScoreMetric metric;
+} PairBatch;
+
+static void score_row(gpointer ctx, guint item) {
+    PairBatch *batch = ctx;
+    guint i = batch->first_row + item;
+    const ScoreImage *a = batch->left[i];
+    guint first = batch->diagonal ? i + 1 : 0;
+    gint64 *out = batch->scores + batch->row_offsets[item];
+
+    for (guint j = first; j < batch->n_right; j++) {
+        const ScoreImage *b = batch->right[j];
+        out[j - first] = score_pair(a, b, batch->n_pixels, batch->count_equal, batch->metric);
+    }
+}
+
+#define SCORE_PAIRS_PER_GROUP ((gsize)1 << 22)
+
+static void score_blocks(ScoreImage **left, guint n_left, ScoreImage **right, guint n_right, gboolean diagonal,
+                         gsize n_pixels, CountEqualFunc count_equal, DiaScoreMetric metric, guint jobs,
+                         DiaScoreEdgeFunc emit, gpointer user_data, DiaScoreStats *stats) {
+    PairBatch batch = { left, right, n_right, diagonal, 0, NULL, NULL, n_pixels, count_equal, metric };
+    batch.row_offsets = g_new(gsize, n_left + 1);
+    batch.scores = g_new(gint64, MIN(SCORE_PAIRS_PER_GROUP, (gsize)n_left * n_right) + n_right);
+
+    // Rows are grouped so the score buffer stays bounded however large the block is
+    guint row = 0;
+    while (row < n_left) {
+        guint n_rows = 0;
+        gsize n_pairs = 0;
+        while (row + n_rows < n_left) {
+            guint i = row + n_rows;
+            gsize row_pairs = diagonal ? n_right - i - 1 : n_right;
+            if (n_rows > 0 && n_pairs + row_pairs > SCORE_PAIRS_PER_GROUP) break;
+            batch.row_offsets[n_rows++] = n_pairs;
+            n_pairs += row_pairs;
+        }
+
+        batch.first_row = row;
+        parallel_for(n_rows, jobs, score_row, &batch);
+
+        // Emitted in (i, j) order so the edge list is deterministic
+        for (guint r = 0; r < n_rows; r++) {
+            guint i = row + r;
+            guint first = diagonal ? i + 1 : 0;
+            const gint64 *scores = batch.scores + batch.row_offsets[r];
+            for (guint j = first; j < n_right; j++) {
+                if (scores[j - first] < 0) continue;
+                emit((guint64)scores[j - first], left[i]->id, right[j]->id, user_data);
+                stats->pairs++;
+            }
+        }
+        row += n_rows;
+    }
+
+    g_free(batch.scores);
+    g_free(batch.row_offsets);
+}
+
+static void decode_block(ScoreImage **images, guint n, guint jobs, DiaScoreStats *stats) {
+    DecodeBatch batch = { images, 0, 0 };
+    parallel_for(n, jobs, decode_one, &batch);
+    stats->decodes += (guint64)batch.decodes;
+    stats->skipped += (guint)batch.failures;
+}
+
+static void release_block(ScoreImage **images, guint n) {
+    for (guint i = 0; i < n; i++) {
+        g_clear_pointer(&images[i]->pixels, g_free);
+    }
+}
+
+// A bucket that fits the memory budget is decoded once and scored in one block. Larger ones
+// are tiled into blocks so only two are resident at a time.
+static guint block_size_for(ScoreImage **images, guint n, const DiaScoreOptions *options) {
+    gsize image_bytes = (gsize)images[0]->width * images[0]->height * 4;
+    if ((guint64)image_bytes * n <= options->memory_budget) return n;
+    return (guint)CLAMP(options->memory_budget / (2 * image_bytes), 1, n);
+}
+
+static void score_bucket(GPtrArray *members, const DiaScoreOptions *options, guint jobs, CountEqualFunc count_equal,
+                         DiaScoreEdgeFunc emit, gpointer user_data, DiaScoreStats *stats) {
+    ScoreImage **images = (ScoreImage**)members->pdata;
+    guint n = members->len;
+    gsize n_pixels = (gsize)images[0]->width * images[0]->height;
+    guint block = block_size_for(images, n, options);
+
+    for (guint b0 = 0; b0 < n; b0 += block) {
+        guint n_left = MIN(block, n - b0);
+        decode_block(images + b0, n_left, jobs, stats);
+        score_blocks(images + b0, n_left, images + b0, n_left, TRUE, n_pixels, count_equal, options->metric, jobs,
+                     emit, user_data, stats);
+
+        for (guint b1 = b0 + block; b1 < n; b1 += block) {
+            guint n_right = MIN(block, n - b1);
+            decode_block(images + b1, n_right, jobs, stats);
+            score_blocks(images + b0, n_left, images + b1, n_right, FALSE, n_pixels, count_equal, options->metric, jobs,
+                         emit, user_data, stats);
+            release_block(images + b1, n_right);
+        }
+        release_block(images + b0, n_left);
+    }
+}
+
+typedef struct {
+    ScoreImage **images;
+    const ListedPair *pairs;
+    gint64 *scores;
+    gsize n_pixels;
+    CountEqualFunc count_equal;
+    DiaScoreMetric metric;
+} ListBatch;
+
+static void score_listed(gpointer ctx, guint item) {
+    ListBatch *batch = ctx;
+    const ScoreImage *a = batch->images[batch->pairs[item].left];
+    const ScoreImage *b = batch->images[batch->pairs[item].right];
+    batch->scores[item] = score_pair(a, b, batch->n_pixels, batch->count_equal, batch->metric);
+}
+
+static gint compare_listed_pairs(gconstpointer a, gconstpointer b) {
+    const ListedPair *pa = a;
+    const ListedPair *pb = b;
+    if (pa->block_left != pb->block_left) return pa->block_left < pb->block_left ? -1 : 1;
+    if (pa->block_right != pb->block_right) return pa->block_right < pb->block_right ? -1 : 1;
+    if (pa->left != pb->left) return pa->left < pb->left ? -1 : 1;
+    if (pa->right != pb->right) return pa->right < pb->right ? -1 : 1;
+    return 0;
+}
+
+static void release_slots(ScoreImage **images, guint n, guint block, guint index) {
+    if (index == G_MAXUINT) return;
+    release_block(images + index * block, MIN(block, n - index * block));
+}
+
+// Scores only the requested pairs of a bucket. Pairs are sorted by block so each left block is
+// decoded once and stays resident while the right blocks it pairs with come and go.
+static void score_bucket_pairs(GPtrArray *members, GArray *listed, const DiaScoreOptions *options, guint jobs,
+                               CountEqualFunc count_equal, DiaScoreEdgeFunc emit, gpointer user_data, DiaScoreStats *stats) {
+    ScoreImage **images = (ScoreImage**)members->pdata;
+    guint n = members->len;
+    gsize n_pixels = (gsize)images[0]->width * images[0]->height;
+    guint block = block_size_for(images, n, options);
+
+    for (guint p = 0; p < listed->len; p++) {
+        ListedPair *pair = &g_array_index(listed, ListedPair, p);
+        pair->block_left = pair->left / block;
+        pair->block_right = pair->right / block;
+    }
+    g_array_sort(listed, compare_listed_pairs);
+
+    guint unique = 0;
+    for (guint p = 0; p < listed->len; p++) {
+        if (unique > 0 && compare_listed_pairs(&g_array_index(listed, ListedPair, unique - 1), &g_array_index(listed, ListedPair, p)) == 0) continue;
+        g_array_index(listed, ListedPair, unique++) = g_array_index(listed, ListedPair, p);
+    }
+    g_array_set_size(listed, unique);
+
+    guint resident_left = G_MAXUINT;
+    guint resident_right = G_MAXUINT;
+    gint64 *scores = g_new(gint64, MIN(SCORE_PAIRS_PER_GROUP, (gsize)listed->len));
+
+    guint start = 0;
+    while (start < listed->len) {
+        const ListedPair *first = &g_array_index(listed, ListedPair, start);
+        guint end = start;
+        while (end < listed->len && end - start < SCORE_PAIRS_PER_GROUP &&
+               g_array_index(listed, ListedPair, end).block_left == first->block_left &&
+               g_array_index(listed, ListedPair, end).block_right == first->block_right) {
+            end++;
+        }
+
+        if (first->block_left != resident_left) {
+            release_slots(images, n, block, resident_left);
+            release_slots(images, n, block, resident_right);
+            resident_left = first->block_left;
+            resident_right = G_MAXUINT;
+            decode_block(images + resident_left * block, MIN(block, n - resident_left * block), jobs, stats);
+        }
+        if (first->block_right != resident_left && first->block_right != resident_right) {
+            release_slots(images, n, block, resident_right);
+            resident_right = first->block_right;
+            decode_block(images + resident_right * block, MIN(block, n - resident_right * block), jobs, stats);
+        }
+
+        ListBatch batch = { images, first, scores, n_pixels, count_equal, options->metric };
+        parallel_for(end - start, jobs, score_listed, &batch);
+        for (guint p = 0; p < end - start; p++) {
+            if (scores[p] < 0) continue;
+            emit((guint64)scores[p], images[first[p].left]->id, images[first[p].right]->id, user_data);
+            stats->pairs++;
+        }
+        start = end;
+    }
+
+    release_slots(images, n, block, resident_left);
+    release_slots(images, n, block, resident_right);
+    g_free(scores);
+}
+
+void dia_score_images(const gchar *const *paths, guint n_paths, const DiaScoreOptions *options,
+                      DiaScoreEdgeFunc emit, gpointer user_data, DiaScoreStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->images = n_paths;
+
+    guint jobs = options->jobs ? options->jobs : g_get_num_processors();
+    CountEqualFunc count_equal = count_equal_for(dia_blend_default_impl());
+    if (options->metric == DIA_SCORE_BYTES) {
+        g_print("[dia] estimating delta sizes on %u threads\n", jobs);
+    } else {
+        g_print("[dia] scoring with the %s kernel on %u threads\n", dia_blend_impl_name(dia_blend_default_impl()), jobs);
+    }
+
+    // Buckets keep first-seen order so output follows image IDs
+    ScoreImage *images = g_new0(ScoreImage, n_paths);
+    GHashTable *by_key = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    GPtrArray *buckets = g_ptr_array_new_with_free_func((GDestroyNotify)g_ptr_array_unref);
+
+    for (guint i = 0; i < n_paths; i++) {
+        ScoreImage *image = &images[i];
+        image->id = i;
+        image->path = paths[i];
+        if (!read_png_header(image->path, image)) {
+            g_printerr("[dia] '%s' is not a readable PNG, skipping it\n", image->path);
+            stats->skipped++;
+            continue;
+        }
+
+        gchar *key = g_strdup_printf("%dx%d %s", image->width, image->height, image->mode);
+        gpointer index = g_hash_table_lookup(by_key, key);
+        if (!index) {
+            g_ptr_array_add(buckets, g_ptr_array_new());
+            index = GUINT_TO_POINTER(buckets->len);
+            g_hash_table_insert(by_key, key, index);
+        } else {
+            g_free(key);
+        }
+
+        GPtrArray *members = g_ptr_array_index(buckets, GPOINTER_TO_UINT(index) - 1);
+        image->bucket = GPOINTER_TO_UINT(index) - 1;
+        image->slot = members->len;
+        g_ptr_array_add(members, image);
+    }
+
+    // A candidate list restricts scoring to those pairs; pairs across buckets can never score
+    GArray **listed = NULL;
+    if (options->pairs) {
+        listed = g_new0(GArray*, buckets->len);
+        for (gsize p = 0; p < options->n_pairs; p++) {
+            guint id1 = MIN(options->pairs[2 * p], options->pairs[2 * p + 1]);
+            guint id2 = MAX(options->pairs[2 * p], options->pairs[2 * p + 1]);
+            if (id1 == id2 || id2 >= n_paths || !images[id1].width || !images[id2].width ||
+                images[id1].bucket != images[id2].bucket) {
+                continue;
+            }
+            guint b = images[id1].bucket;
+            if (!listed[b]) listed[b] = g_array_new(FALSE, FALSE, sizeof(ListedPair));
+            ListedPair pair = { 0, 0, images[id1].slot, images[id2].slot };
+            g_array_append_val(listed[b], pair);
+        }
+    }
+
+    for (guint b = 0; b < buckets->len; b++) {
+        GPtrArray *members = g_ptr_array_index(buckets, b);
+        stats->buckets++;
+        if (members->len < 2) continue;
+        if (!listed) {
+            score_bucket(members, options, jobs, count_equal, emit, user_data, stats);
+        } else if (listed[b]) {
+            score_bucket_pairs(members, listed[b], options, jobs, count_equal, emit, user_data, stats);
+            g_array_free(listed[b], TRUE);
+        }
+    }
+
+    g_free(listed);
+    g_ptr_array_unref(buckets);
+    g_hash_table_destroy(by_key);
+    g_free(images);
+}
@@ -0,0 +1,653 @@
+#include "dia.h"
+
+#include <glib-unix.h>
+#include <glib/gstdio.h>
+#include <gio/gunixsocketaddress.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// HTTP/1.1 on a UNIX socket and/or a localhost port, one request per connection:
+//   GET /                               the archives and their image counts (JSON)
+//   GET /stats                          request rate, latency histogram and cache hit rate (JSON)
+//   GET /<archive>/<id>[?format=png|rgba]
+// A bounded pool of workers handles connections; up to options->queue more wait for one, and
+// beyond that new connections get 503 at once. Concurrent requests for the same image and
+// format share one render. Raw RGBA bodies are rows packed top to bottom, with the size in
+// X-Image-Width and X-Image-Height.
+
+#define SERVE_MAX_REQUEST 8192
+#define SERVE_TIMEOUT_SECONDS 30
+#define SERVE_RATE_SLOTS 61  // per-second request counts: the current second and the 60 complete ones before it
+
+static const gint64 latency_bounds_us[] = {
+    1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000, 2000000, 5000000
+};
+#define N_LATENCY_BUCKETS (G_N_ELEMENTS(latency_bounds_us) + 1)
+
+typedef struct {
+    const gchar *name;
+    DiaArchive *archive;
+    DiaCanvasCache *cache;  // view of the shared store
+    guint64 requests;
+} ServeArchive;
+
+typedef struct {
+    guint status;
+    const gchar *content_type;
+    GBytes *body;
+    gint width;  // RGBA bodies only
+    gint height;
+} Response;
+
+// One render that concurrent requests for the same image and format wait on
+typedef struct {
+    gint refs;
+    gboolean done;
+    Response response;
+} Render;
+
+typedef struct {
+    const DiaServeOptions *options;
+    GHashTable *archives;   // name -> ServeArchive
+    DiaCanvasCache *cache;
+    GThreadPool *pool;
+    gint64 start;
+
+    GMutex lock;            // everything below
+    GCond rendered;
+    GHashTable *in_flight;  // "archive/id/format" -> Render
+    guint64 requests;
+    guint64 images;
+    guint64 coalesced;
+    guint64 rejected;
+    guint64 errors;
+    guint64 bytes_sent;
+    guint active;
+    guint64 latency_counts[N_LATENCY_BUCKETS];
+    gint64 latency_total;
+    gint64 latency_max;
+    gint64 rate_second[SERVE_RATE_SLOTS];
+    guint64 rate_count[SERVE_RATE_SLOTS];
+} Server;
+
+static const gchar* status_reason(guint status) {
+    switch (status) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 503: return "Service Unavailable";
+    default: return "Internal Server Error";
+    }
+}
+
+static void set_response(Response *response, guint status, const gchar *content_type, GBytes *body) {
+    response->status = status;
+    response->content_type = content_type;
+    response->body = body;
+}
+
+static void respond_error(Response *response, guint status, const gchar *format, ...) G_GNUC_PRINTF(3, 4);
+static void respond_error(Response *response, guint status, const gchar *format, ...) {
+    va_list args;
+    va_start(args, format);
+    gchar *message = g_strdup_vprintf(format, args);
+    va_end(args);
+    gchar *line = g_strconcat(message, "\n", NULL);
+    g_free(message);
+    set_response(response, status, "text/plain; charset=utf-8", g_bytes_new_take(line, strlen(line)));
+}
+
+static gboolean write_response(GOutputStream *out, const Response *response, gboolean head) {
+    gsize size = response->body ? g_bytes_get_size(response->body) : 0;
+    GString *header = g_string_new(NULL);
+    g_string_append_printf(header, "HTTP/1.1 %u %s\r\nContent-Type: %s\r\nContent-Length: %" G_GSIZE_FORMAT "\r\nConnection: close\r\n",
+                           response->status, status_reason(response->status), response->content_type, size);
+    if (response->width) {
+        g_string_append_printf(header, "X-Image-Width: %d\r\nX-Image-Height: %d\r\n", response->width, response->height);
+    }
+    g_string_append(header, "\r\n");
+
+    gboolean ok = g_output_stream_write_all(out, header->str, header->len, NULL, NULL, NULL);
+    g_string_free(header, TRUE);
+    if (ok && !head && size) {
+        ok = g_output_stream_write_all(out, g_bytes_get_data(response->body, NULL), size, NULL, NULL, NULL);
+    }
+    return ok;
+}
+
+// Reads up to the blank line that ends the header; request bodies are never needed
+static gboolean read_request(GInputStream *in, gchar *buffer, Response *response) {
+    gsize length = 0;
+    for (;;) {
+        g_autoptr(GError) error = NULL;
+        gssize n = g_input_stream_read(in, buffer + length, SERVE_MAX_REQUEST - length, NULL, &error);
+        if (n <= 0) {
+            respond_error(response, 400, "Incomplete request%s%s", error ? ": " : "", error ? error->message : "");
+            return FALSE;
+        }
+        length += (gsize)n;
+        buffer[length] = '\0';
+        if (strstr(buffer, "\r\n\r\n") || strstr(buffer, "\n\n")) return TRUE;
+        if (length == SERVE_MAX_REQUEST) {
+            respond_error(response, 400, "Request header exceeds %d bytes", SERVE_MAX_REQUEST);
+            return FALSE;
+        }
+    }
+}
+
+// Records a finished request; latencies are kept for image requests only
+static void record_request(Server *server, const Response *response, gsize sent, gboolean image, gint64 elapsed) {
+    gint64 second = g_get_monotonic_time() / G_USEC_PER_SEC;
+    guint slot = (guint)(second % SERVE_RATE_SLOTS);
+
+    g_mutex_lock(&server->lock);
+    server->requests++;
+    server->bytes_sent += sent;
+    if (response->status >= 400) server->errors++;
+    if (server->rate_second[slot] != second) {
+        server->rate_second[slot] = second;
+        server->rate_count[slot] = 0;
+    }
+    server->rate_count[slot]++;
+    if (image) {
+        guint bucket = 0;
+        while (bucket < G_N_ELEMENTS(latency_bounds_us) && elapsed > latency_bounds_us[bucket]) bucket++;
+        server->images++;
+        server->latency_counts[bucket]++;
+        server->latency_total += elapsed;
+        server->latency_max = MAX(server->latency_max, elapsed);
+    }
+    g_mutex_unlock(&server->lock);
+}
+
+static GBytes* pack_rgba(GdkPixbuf *image) {
+    int width = gdk_pixbuf_get_width(image);
+    int height = gdk_pixbuf_get_height(image);
+    int stride = gdk_pixbuf_get_rowstride(image);
+    int channels = gdk_pixbuf_get_n_channels(image);
+    const guint8 *src = gdk_pixbuf_read_pixels(image);
+
+    gsize size = (gsize)width * height * 4;
+    guint8 *dst = g_try_malloc(size);
+    if (!dst) return NULL;
+    for (int y = 0; y < height; y++) {
+        const guint8 *s = src + (gsize)y * stride;
+        guint8 *d = dst + (gsize)y * width * 4;
+        for (int x = 0; x < width; x++) {
+            d[4 * x] = s[channels * x];
+            d[4 * x + 1] = s[channels * x + 1];
+            d[4 * x + 2] = s[channels * x + 2];
+            d[4 * x + 3] = channels == 4 ? s[channels * x + 3] : 0xff;
+        }
+    }
+    return g_bytes_new_take(dst, size);
+}
+
+static void render_image(Server *server, ServeArchive *served, const gchar *image_id, gboolean rgba, Response *response) {
+    g_autoptr(GError) error = NULL;
+    // Cached canvases are shared, and dia_render_output only reads them
+    g_autoptr(GdkPixbuf) canvas = render_composite_image(served->archive, served->cache, image_id, NULL, &error);
+    g_autoptr(GdkPixbuf) image = canvas ? dia_render_output(served->archive, image_id, canvas, NULL, &error) : NULL;
+    if (!image) {
+        g_printerr("WARNING: %s/%s: %s\n", served->name, image_id, error ? error->message : "Unknown error");
+        respond_error(response, 500, "%s", error ? error->message : "Unknown error");
+        return;
+    }
+
+    DIA_TRACE_SCOPE(span, "serve.encode");
+    if (rgba) {
+        GBytes *body = pack_rgba(image);
+        if (!body) {
+            respond_error(response, 500, "Could not allocate the image");
+            return;
+        }
+        set_response(response, 200, "application/octet-stream", body);
+        response->width = gdk_pixbuf_get_width(image);
+        response->height = gdk_pixbuf_get_height(image);
+    } else {
+        gchar *png = NULL;
+        gsize png_size = 0;
+        g_autofree gchar *level = g_strdup_printf("%d", server->options->png_compression);
+        if (!gdk_pixbuf_save_to_buffer(image, &png, &png_size, "png", &error, "compression", level, NULL)) {
+            respond_error(response, 500, "Could not encode the image: %s", error->message);
+            return;
+        }
+        set_response(response, 200, "image/png", g_bytes_new_take(png, png_size));
+    }
+    DIA_TRACE_BYTES(span, g_bytes_get_size(response->body));
+}
+
+static void render_unref(Server *server, Render *render) {
+    g_mutex_lock(&server->lock);
+    gboolean last = --render->refs == 0;
+    g_mutex_unlock(&server->lock);
+    if (!last) return;
+    if (render->response.body) g_bytes_unref(render->response.body);
+    g_free(render);
+}
+
+// The first request for a key renders; later ones wait for it and share the body
+static void serve_image(Server *server, ServeArchive *served, const gchar *image_id, gboolean rgba, Response *response) {
+    if (!dia_archive_image_path(served->archive, image_id, NULL)) {
+        respond_error(response, 404, "Archive '%s' has no image '%s'", served->name, image_id);
+        return;
+    }
+
+    g_autofree gchar *key = g_strdup_printf("%s/%s/%s", served->name, image_id, rgba ? "rgba" : "png");
+    g_mutex_lock(&server->lock);
+    served->requests++;
+    Render *render = g_hash_table_lookup(server->in_flight, key);
+    gboolean owner = render == NULL;
+    if (owner) {
+        render = g_new0(Render, 1);
+        g_hash_table_insert(server->in_flight, g_strdup(key), render);
+    } else {
+        server->coalesced++;
+    }
+    render->refs++;
+    g_mutex_unlock(&server->lock);
+
+    if (owner) {
+        render_image(server, served, image_id, rgba, &render->response);
+        g_mutex_lock(&server->lock);
+        render->done = TRUE;
+        g_hash_table_remove(server->in_flight, key);
+        g_cond_broadcast(&server->rendered);
+        g_mutex_unlock(&server->lock);
+    } else {
+        g_mutex_lock(&server->lock);
+        while (!render->done) g_cond_wait(&server->rendered, &server->lock);
+        g_mutex_unlock(&server->lock);
+    }
+
+    *response = render->response;
+    if (response->body) g_bytes_ref(response->body);
+    render_unref(server, render);
+}
+
+static GBytes* json_to_bytes(JsonBuilder *builder) {
+    JsonGenerator *generator = json_generator_new();
+    JsonNode *root = json_builder_get_root(builder);
+    json_generator_set_root(generator, root);
+    json_generator_set_pretty(generator, TRUE);
+    gsize length;
+    gchar *data = json_generator_to_data(generator, &length);
+    json_node_unref(root);
+    g_object_unref(generator);
+    return g_bytes_new_take(data, length);
+}
+
+static void serve_index(Server *server, Response *response) {
+    JsonBuilder *builder = json_builder_new();
+    json_builder_begin_object(builder);
+    json_builder_set_member_name(builder, "archives");
+    json_builder_begin_array(builder);
+    for (guint i = 0; i < server->options->n_archives; i++) {
+        json_builder_begin_object(builder);
+        json_builder_set_member_name(builder, "name");
+        json_builder_add_string_value(builder, server->options->names[i]);
+        json_builder_set_member_name(builder, "images");
+        json_builder_add_int_value(builder, dia_archive_n_images(server->options->archives[i]));
+        json_builder_end_object(builder);
+    }
+    json_builder_end_array(builder);
+    json_builder_end_object(builder);
+    set_response(response, 200, "application/json", json_to_bytes(builder));
+    g_object_unref(builder);
+}
+
+// Upper bound of the histogram bucket holding the given percentile, or the maximum for the last
+static double latency_percentile_ms(const Server *server, guint percent) {
+    if (!server->images) return 0.0;
+    guint64 rank = MAX((server->images * percent + 99) / 100, 1);
+    guint64 seen = 0;
+    for (guint i = 0; i < N_LATENCY_BUCKETS; i++) {
+        seen += server->latency_counts[i];
+        if (seen < rank) continue;
+        gint64 bound = i < G_N_ELEMENTS(latency_bounds_us) ? MIN(latency_bounds_us[i], server->latency_max) : server->latency_max;
+        return bound / 1000.0;
+    }
+    return server->latency_max / 1000.0;
+}
+
+// Requests per second over the last complete seconds
+static double recent_rate(const Server *server, gint64 now_second, guint seconds) {
+    guint64 total = 0;
+    for (guint i = 0; i < SERVE_RATE_SLOTS; i++) {
+        gint64 age = now_second - server->rate_second[i];
+        if (age >= 1 && age <= seconds) total += server->rate_count[i];
+    }
+    return total / (double)seconds;
+}
+
+static void add_cache_stats(JsonBuilder *builder, DiaCanvasCache *cache) {
+    DiaCacheStats stats;
+    dia_canvas_cache_get_stats(cache, &stats);
+    guint64 lookups = stats.hits + stats.misses;
+    json_builder_set_member_name(builder, "hits");
+    json_builder_add_int_value(builder, (gint64)stats.hits);
+    json_builder_set_member_name(builder, "misses");
+    json_builder_add_int_value(builder, (gint64)stats.misses);
+    json_builder_set_member_name(builder, "hit_rate");
+    json_builder_add_double_value(builder, lookups ? stats.hits / (double)lookups : 0.0);
+}
+
+static void add_member_int(JsonBuilder *builder, const gchar *name, gint64 value) {
+    json_builder_set_member_name(builder, name);
+    json_builder_add_int_value(builder, value);
+}
+
+static void add_member_double(JsonBuilder *builder, const gchar *name, double value) {
+    json_builder_set_member_name(builder, name);
+    json_builder_add_double_value(builder, value);
+}
+
+static void serve_stats(Server *server, Response *response) {
+    gint64 now = g_get_monotonic_time();
+    double uptime = (now - server->start) / (double)G_USEC_PER_SEC;
+    JsonBuilder *builder = json_builder_new();
+    json_builder_begin_object(builder);
+
+    g_mutex_lock(&server->lock);
+    add_member_double(builder, "uptime_s", uptime);
+    add_member_int(builder, "requests", (gint64)server->requests);
+    add_member_int(builder, "image_requests", (gint64)server->images);
+    add_member_int(builder, "coalesced", (gint64)server->coalesced);
+    add_member_int(builder, "rejected", (gint64)server->rejected);
+    add_member_int(builder, "errors", (gint64)server->errors);
+    add_member_int(builder, "bytes_sent", (gint64)server->bytes_sent);
+    add_member_int(builder, "active", server->active);
+    add_member_int(builder, "queued", g_thread_pool_unprocessed(server->pool));
+
+    json_builder_set_member_name(builder, "requests_per_second");
+    json_builder_begin_object(builder);
+    add_member_double(builder, "overall", uptime > 0 ? server->requests / uptime : 0.0);
+    add_member_double(builder, "last_10s", recent_rate(server, now / G_USEC_PER_SEC, 10));
+    add_member_double(builder, "last_60s", recent_rate(server, now / G_USEC_PER_SEC, SERVE_RATE_SLOTS - 1));
+    json_builder_end_object(builder);
+
+    json_builder_set_member_name(builder, "latency_ms");
+    json_builder_begin_object(builder);
+    add_member_double(builder, "mean", server->images ? server->latency_total / 1000.0 / server->images : 0.0);
+    add_member_double(builder, "p50", latency_percentile_ms(server, 50));
+    add_member_double(builder, "p90", latency_percentile_ms(server, 90));
+    add_member_double(builder, "p99", latency_percentile_ms(server, 99));
+    add_member_double(builder, "max", server->latency_max / 1000.0);
+    json_builder_set_member_name(builder, "histogram");
+    json_builder_begin_array(builder);
+    for (guint i = 0; i < N_LATENCY_BUCKETS; i++) {
+        json_builder_begin_object(builder);
+        json_builder_set_member_name(builder, "le");
+        if (i < G_N_ELEMENTS(latency_bounds_us)) json_builder_add_double_value(builder, latency_bounds_us[i] / 1000.0);
+        else json_builder_add_null_value(builder);
+        add_member_int(builder, "count", (gint64)server->latency_counts[i]);
+        json_builder_end_object(builder);
+    }
+    json_builder_end_array(builder);
+    json_builder_end_object(builder);
+    g_mutex_unlock(&server->lock);
+
+    DiaCacheStats stats;
+    dia_canvas_cache_get_stats(server->cache, &stats);
+    json_builder_set_member_name(builder, "cache");
+    json_builder_begin_object(builder);
+    add_cache_stats(builder, server->cache);
+    add_member_int(builder, "evictions", (gint64)stats.evictions);
+    add_member_int(builder, "canvases", stats.count);
+    add_member_int(builder, "resident_bytes", (gint64)stats.resident);
+    add_member_int(builder, "budget_bytes", (gint64)stats.budget);
+    json_builder_end_object(builder);
+
+    json_builder_set_member_name(builder, "archives");
+    json_builder_begin_array(builder);
+    for (guint i = 0; i < server->options->n_archives; i++) {
+        ServeArchive *served = g_hash_table_lookup(server->archives, server->options->names[i]);
+        json_builder_begin_object(builder);
+        json_builder_set_member_name(builder, "name");
+        json_builder_add_string_value(builder, served->name);
+        g_mutex_lock(&server->lock);
+        add_member_int(builder, "requests", (gint64)served->requests);
+        g_mutex_unlock(&server->lock);
+        add_cache_stats(builder, served->cache);
+        json_builder_end_object(builder);
+    }
+    json_builder_end_array(builder);
+
+    json_builder_end_object(builder);
+    set_response(response, 200, "application/json", json_to_bytes(builder));
+    g_object_unref(builder);
+}
+
+// format=png (default) or format=rgba; other parameters are ignored
+static gboolean parse_format(const gchar *query, gboolean *rgba) {
+    *rgba = FALSE;
+    if (!query) return TRUE;
+    gchar **params = g_strsplit(query, "&", -1);
+    gboolean ok = TRUE;
+    for (gint i = 0; params[i]; i++) {
+        if (!g_str_has_prefix(params[i], "format=")) continue;
+        const gchar *value = params[i] + strlen("format=");
+        if (strcmp(value, "rgba") == 0) *rgba = TRUE;
+        else if (strcmp(value, "png") == 0) *rgba = FALSE;
+        else ok = FALSE;
+    }
+    g_strfreev(params);
+    return ok;
+}
+
+static void route(Server *server, const gchar *target, gboolean *image, Response *response) {
+    g_autofree gchar *path = g_strdup(target);
+    gchar *query = strchr(path, '?');
+    if (query) *query++ = '\0';
+
+    if (strcmp(path, "/") == 0) {
+        serve_index(server, response);
+        return;
+    }
+    if (strcmp(path, "/stats") == 0) {
+        serve_stats(server, response);
+        return;
+    }
+
+    // /<archive>/<id>; IDs may contain slashes
+    gchar *slash = path[0] == '/' ? strchr(path + 1, '/') : NULL;
+    if (!slash || !slash[1]) {
+        respond_error(response, 404, "Not found: %s", path);
+        return;
+    }
+    *slash = '\0';
+    g_autofree gchar *name = g_uri_unescape_string(path + 1, NULL);
+    g_autofree gchar *image_id = g_uri_unescape_string(slash + 1, NULL);
+    gboolean rgba;
+    if (!name || !image_id || !parse_format(query, &rgba)) {
+        respond_error(response, 400, "Bad image request: %s", target);
+        return;
+    }
+
+    ServeArchive *served = g_hash_table_lookup(server->archives, name);
+    if (!served) {
+        respond_error(response, 404, "No archive named '%s'", name);
+        return;
+    }
+    *image = TRUE;
+    serve_image(server, served, image_id, rgba, response);
+}
+
+static void handle_connection(gpointer data, gpointer user_data) {
+    GSocketConnection *connection = data;
+    Server *server = user_data;
+    gint64 start = g_get_monotonic_time();
+    DIA_TRACE_SCOPE(span, "serve.request");
+
+    g_mutex_lock(&server->lock);
+    server->active++;
+    g_mutex_unlock(&server->lock);
+
+    g_socket_set_timeout(g_socket_connection_get_socket(connection), SERVE_TIMEOUT_SECONDS);
+    GInputStream *in = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+    GOutputStream *out = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+
+    Response response = { 0 };
+    gboolean image = FALSE;
+    gboolean head = FALSE;
+    gchar request[SERVE_MAX_REQUEST + 1];
+    if (read_request(in, request, &response)) {
+        // Request line: METHOD SP TARGET SP VERSION
+        gchar *line_end = strpbrk(request, "\r\n");
+        *line_end = '\0';
+        gchar **parts = g_strsplit(request, " ", -1);
+        head = g_strv_length(parts) == 3 && strcmp(parts[0], "HEAD") == 0;
+        if (g_strv_length(parts) != 3 || !g_str_has_prefix(parts[2], "HTTP/1.") || parts[1][0] != '/') {
+            respond_error(&response, 400, "Malformed request line");
+        } else if (strcmp(parts[0], "GET") != 0 && !head) {
+            respond_error(&response, 405, "Only GET and HEAD are supported");
+        } else {
+            route(server, parts[1], &image, &response);
+        }
+        g_strfreev(parts);
+    }
+
+    gsize sent = 0;
+    if (write_response(out, &response, head)) {
+        sent = response.body && !head ? g_bytes_get_size(response.body) : 0;
+    }
+    DIA_TRACE_BYTES(span, sent);
+    g_io_stream_close(G_IO_STREAM(connection), NULL, NULL);
+    record_request(server, &response, sent, image, g_get_monotonic_time() - start);
+    if (response.body) g_bytes_unref(response.body);
+    g_object_unref(connection);
+
+    g_mutex_lock(&server->lock);
+    server->active--;
+    g_mutex_unlock(&server->lock);
+}
+
+// Runs on the main loop: hands the connection to a worker, or turns it away when the queue is full
+static gboolean on_incoming(GSocketService *service, GSocketConnection *connection, GObject *source_object, gpointer user_data) {
+    Server *server = user_data;
+    (void)service;
+    (void)source_object;
+    if (g_thread_pool_unprocessed(server->pool) >= server->options->queue) {
+        Response response = { 0 };
+        respond_error(&response, 503, "Server busy");
+        write_response(g_io_stream_get_output_stream(G_IO_STREAM(connection)), &response, FALSE);
+        g_io_stream_close(G_IO_STREAM(connection), NULL, NULL);
+        g_mutex_lock(&server->lock);
+        server->rejected++;
+        g_mutex_unlock(&server->lock);
+        record_request(server, &response, g_bytes_get_size(response.body), FALSE, 0);
+        g_bytes_unref(response.body);
+        return TRUE;
+    }
+    g_thread_pool_push(server->pool, g_object_ref(connection), NULL);
+    return TRUE;
+}
+
+static gboolean on_quit_signal(gpointer user_data) {
+    g_main_loop_quit(user_data);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean listen_unix(GSocketListener *listener, const gchar *path, GError **error) {
+    // A socket file left behind by an earlier run would fail the bind; anything else is kept
+    GStatBuf st;
+    if (g_lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) g_unlink(path);
+
+    GSocketAddress *address = g_unix_socket_address_new(path);
+    gboolean ok = g_socket_listener_add_address(listener, address, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL, error);
+    g_object_unref(address);
+    if (!ok) g_prefix_error(error, "Could not listen on '%s': ", path);
+    return ok;
+}
+
+static gboolean listen_localhost(GSocketListener *listener, guint port, GError **error) {
+    GInetAddress *loopback = g_inet_address_new_loopback(G_SOCKET_FAMILY_IPV4);
+    GSocketAddress *address = g_inet_socket_address_new(loopback, (guint16)port);
+    gboolean ok = g_socket_listener_add_address(listener, address, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL, error);
+    g_object_unref(address);
+    g_object_unref(loopback);
+    if (!ok) g_prefix_error(error, "Could not listen on 127.0.0.1:%u: ", port);
+    return ok;
+}
+
+static void print_summary(Server *server) {
+    double uptime = (g_get_monotonic_time() - server->start) / (double)G_USEC_PER_SEC;
+    DiaCacheStats stats;
+    dia_canvas_cache_get_stats(server->cache, &stats);
+    guint64 lookups = stats.hits + stats.misses;
+    g_autofree gchar *sent = g_format_size(server->bytes_sent);
+    g_print("[dia] served %" G_GUINT64_FORMAT " requests (%" G_GUINT64_FORMAT " images, %" G_GUINT64_FORMAT " coalesced, %"
+            G_GUINT64_FORMAT " errors, %s) in %.1f s; p50 %.0f ms, p99 %.0f ms; cache hit rate %.1f%%\n",
+            server->requests, server->images, server->coalesced, server->errors, sent, uptime,
+            latency_percentile_ms(server, 50), latency_percentile_ms(server, 99),
+            lookups ? 100.0 * stats.hits / lookups : 0.0);
+}
+
+gboolean dia_serve(const DiaServeOptions *options, GError **error) {
+    guint workers = options->workers ? options->workers : g_get_num_processors();
+    Server server = { 0 };
+    server.options = options;
+    server.cache = dia_canvas_cache_new(options->cache_budget);
+    server.archives = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+    server.in_flight = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    g_mutex_init(&server.lock);
+    g_cond_init(&server.rendered);
+    for (guint i = 0; i < options->n_archives; i++) {
+        ServeArchive *served = g_new0(ServeArchive, 1);
+        served->name = options->names[i];
+        served->archive = options->archives[i];
+        // One store for all archives, so they compete for the same budget
+        served->cache = dia_canvas_cache_new_view(server.cache, served->name);
+        g_hash_table_insert(server.archives, (gpointer)served->name, served);
+    }
+
+    gboolean ok = TRUE;
+    server.pool = g_thread_pool_new(handle_connection, &server, (gint)workers, TRUE, error);
+    GSocketService *service = g_socket_service_new();
+    GSocketListener *listener = G_SOCKET_LISTENER(service);
+    if (!server.pool) ok = FALSE;
+    if (ok && options->socket_path) ok = listen_unix(listener, options->socket_path, error);
+    if (ok && options->port) ok = listen_localhost(listener, options->port, error);
+
+    if (ok) {
+        GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+        guint sigint = g_unix_signal_add(SIGINT, on_quit_signal, loop);
+        guint sigterm = g_unix_signal_add(SIGTERM, on_quit_signal, loop);
+        g_signal_connect(service, "incoming", G_CALLBACK(on_incoming), &server);
+        server.start = g_get_monotonic_time();
+        g_socket_service_start(service);
+
+        g_autofree gchar *budget = g_format_size(options->cache_budget);
+        GString *where = g_string_new(options->socket_path);
+        if (options->port) g_string_append_printf(where, "%s127.0.0.1:%u", where->len ? " and " : "", options->port);
+        g_print("[dia] serving %u archives on %s with %u workers and a %s canvas cache\n",
+                options->n_archives, where->str, workers, budget);
+        g_string_free(where, TRUE);
+        g_main_loop_run(loop);
+
+        g_socket_service_stop(service);
+        g_source_remove(sigint);
+        g_source_remove(sigterm);
+        g_main_loop_unref(loop);
+    }
+
+    // Stop accepting, then let the workers finish what they already hold
+    g_socket_listener_close(listener);
+    g_object_unref(service);
+    if (server.pool) g_thread_pool_free(server.pool, FALSE, TRUE);
+    if (ok) print_summary(&server);
+    if (ok && options->socket_path) g_unlink(options->socket_path);
+
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, server.archives);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) dia_canvas_cache_free(((ServeArchive*)value)->cache);
+    g_hash_table_destroy(server.archives);
+    g_hash_table_destroy(server.in_flight);
+    dia_canvas_cache_free(server.cache);
+    g_cond_clear(&server.rendered);
+    g_mutex_clear(&server.lock);
+    return ok;
+}
@@ -0,0 +1,235 @@
+#include "dia.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Stage tracing. Every thread appends finished spans to a buffer of its own, so recording only
+// takes an uncontended lock; the buffers are drained when a summary is due and at exit.
+// Span names are string literals and are written to the trace without escaping.
+
+#if DIA_TRACE
+#define TRACE_MAX_EVENTS (4 << 20)  // about 128 MiB of buffered spans
+#define TRACE_SUMMARY_SECONDS 5
+
+typedef struct {
+    const gchar *name;
+    gint64 start;
+    gint64 duration;
+    guint64 bytes;
+} TraceEvent;
+
+typedef struct {
+    GMutex lock;
+    GArray *events;
+    guint tid;
+} TraceBuffer;
+
+typedef struct {
+    const gchar *name;
+    guint64 count;
+    gint64 total;
+    gint64 max;
+    guint64 bytes;
+} TraceStats;
+
+gboolean dia_trace_on = FALSE;
+
+static GMutex registry_lock;
+static GPtrArray *buffers;
+static GPrivate thread_buffer;
+static gint n_events;
+static gint n_dropped;
+static gint64 epoch;
+
+static FILE *trace_file;
+static gchar *trace_path;
+static gint64 summary_interval;  // 0 when writing a trace file
+static gint64 next_summary;
+static gint summary_running;
+
+gint64 dia_trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (gint64)ts.tv_sec * G_GINT64_CONSTANT(1000000000) + ts.tv_nsec;
+}
+
+static TraceBuffer* get_thread_buffer(void) {
+    TraceBuffer *buffer = g_private_get(&thread_buffer);
+    if (buffer) return buffer;
+
+    // Buffers outlive their threads so nothing recorded by a finished worker is lost
+    buffer = g_new0(TraceBuffer, 1);
+    g_mutex_init(&buffer->lock);
+    buffer->events = g_array_new(FALSE, FALSE, sizeof(TraceEvent));
+    g_mutex_lock(&registry_lock);
+    g_ptr_array_add(buffers, buffer);
+    buffer->tid = buffers->len;
+    g_mutex_unlock(&registry_lock);
+    g_private_set(&thread_buffer, buffer);
+    return buffer;
+}
+
+static gint compare_stats(gconstpointer a, gconstpointer b) {
+    const TraceStats *sa = a, *sb = b;
+    return sa->total < sb->total ? 1 : sa->total > sb->total ? -1 : 0;
+}
+
+// Drains every buffer into per-stage totals and prints them, longest total first
+static void print_summary(gint64 now) {
+    GHashTable *by_name = g_hash_table_new(g_str_hash, g_str_equal);
+    GArray *stats = g_array_new(FALSE, TRUE, sizeof(TraceStats));
+
+    g_mutex_lock(&registry_lock);
+    for (guint i = 0; i < buffers->len; i++) {
+        TraceBuffer *buffer = g_ptr_array_index(buffers, i);
+        g_mutex_lock(&buffer->lock);
+        for (guint j = 0; j < buffer->events->len; j++) {
+            const TraceEvent *event = &g_array_index(buffer->events, TraceEvent, j);
+            gpointer slot;
+            if (!g_hash_table_lookup_extended(by_name, event->name, NULL, &slot)) {
+                TraceStats empty = { .name = event->name };
+                g_array_append_val(stats, empty);
+                slot = GUINT_TO_POINTER(stats->len - 1);
+                g_hash_table_insert(by_name, (gpointer)event->name, slot);
+            }
+            TraceStats *s = &g_array_index(stats, TraceStats, GPOINTER_TO_UINT(slot));
+            s->count++;
+            s->total += event->duration;
+            s->max = MAX(s->max, event->duration);
+            s->bytes += event->bytes;
+        }
+        g_atomic_int_add(&n_events, -(gint)buffer->events->len);
+        g_array_set_size(buffer->events, 0);
+        g_mutex_unlock(&buffer->lock);
+    }
+    g_mutex_unlock(&registry_lock);
+
+    g_array_sort(stats, compare_stats);
+    g_print("[dia] trace: %.1f s since start\n", (now - epoch) / 1e9);
+    g_print("[dia]   %-20s %9s %11s %9s %9s %10s %9s\n", "stage", "count", "total ms", "mean ms", "max ms", "MiB", "MiB/s");
+    for (guint i = 0; i < stats->len; i++) {
+        const TraceStats *s = &g_array_index(stats, TraceStats, i);
+        double total_s = s->total / 1e9;
+        double mib = s->bytes / 1048576.0;
+        g_print("[dia]   %-20s %9" G_GUINT64_FORMAT " %11.2f %9.3f %9.3f %10.1f %9.1f\n",
+                s->name, s->count, s->total / 1e6, s->total / 1e6 / s->count, s->max / 1e6,
+                mib, total_s > 0 ? mib / total_s : 0.0);
+    }
+    gint dropped = g_atomic_int_get(&n_dropped);
+    g_atomic_int_add(&n_dropped, -dropped);
+    if (dropped) g_print("[dia]   %d spans dropped\n", dropped);
+
+    g_array_free(stats, TRUE);
+    g_hash_table_destroy(by_name);
+}
+
+void dia_trace_record(const DiaTraceSpan *span) {
+    gint64 end = dia_trace_now();
+
+    if (g_atomic_int_add(&n_events, 1) >= TRACE_MAX_EVENTS) {
+        g_atomic_int_add(&n_events, -1);
+        g_atomic_int_inc(&n_dropped);
+    } else {
+        TraceBuffer *buffer = get_thread_buffer();
+        TraceEvent event = { span->name, span->start, end - span->start, span->bytes };
+        g_mutex_lock(&buffer->lock);
+        g_array_append_val(buffer->events, event);
+        g_mutex_unlock(&buffer->lock);
+    }
+
+    // Whichever thread first finishes a span after the deadline prints the summary
+    if (summary_interval && end >= next_summary && g_atomic_int_compare_and_exchange(&summary_running, 0, 1)) {
+        if (end >= next_summary) {
+            print_summary(end);
+            next_summary = end + summary_interval;
+        }
+        g_atomic_int_set(&summary_running, 0);
+    }
+}
+
+// Chrome trace event format, loadable in chrome://tracing and ui.perfetto.dev. Timestamps are
+// microseconds since dia_trace_init().
+static void write_trace_file(void) {
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", trace_file);
+    fprintf(trace_file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"%s\"}}",
+            g_get_prgname() ? g_get_prgname() : "dia");
+
+    g_mutex_lock(&registry_lock);
+    for (guint i = 0; i < buffers->len; i++) {
+        TraceBuffer *buffer = g_ptr_array_index(buffers, i);
+        g_mutex_lock(&buffer->lock);
+        fprintf(trace_file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}",
+                buffer->tid, buffer->tid == 1 ? "main" : "thread", buffer->tid);
+        for (guint j = 0; j < buffer->events->len; j++) {
+            const TraceEvent *event = &g_array_index(buffer->events, TraceEvent, j);
+            fprintf(trace_file, ",\n{\"name\":\"%s\",\"cat\":\"dia\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+                    event->name, buffer->tid, (event->start - epoch) / 1e3, event->duration / 1e3);
+            if (event->bytes) fprintf(trace_file, ",\"args\":{\"bytes\":%" G_GUINT64_FORMAT "}", event->bytes);
+            fputc('}', trace_file);
+        }
+        g_array_set_size(buffer->events, 0);
+        g_mutex_unlock(&buffer->lock);
+    }
+    g_mutex_unlock(&registry_lock);
+
+    fputs("\n]}\n", trace_file);
+    if (fclose(trace_file) != 0) {
+        g_printerr("WARNING: Could not write trace '%s': %s\n", trace_path, g_strerror(errno));
+    } else {
+        g_print("[dia] trace written to '%s'%s\n", trace_path, n_dropped ? " (buffer full, later spans dropped)" : "");
+    }
+    trace_file = NULL;
+}
+
+static void trace_shutdown(void) {
+    // Workers may still be finishing spans; they see the flag late at worst
+    dia_trace_on = FALSE;
+    if (trace_file) write_trace_file();
+    else if (summary_interval) print_summary(dia_trace_now());
+}
+#endif
+
+// spec is "summary", "summary:SECONDS" or the path of a Chrome trace to write at exit; NULL
+// falls back to the DIA_TRACE environment variable. Call once, before any worker thread starts.
+gboolean dia_trace_init(const gchar *spec, GError **error) {
+    if (!spec) spec = g_getenv("DIA_TRACE");
+    if (!spec || !*spec) return TRUE;
+
+#if DIA_TRACE
+    if (dia_trace_on) return TRUE;
+    gint64 interval = 0;
+    if (strcmp(spec, "summary") == 0) {
+        interval = TRACE_SUMMARY_SECONDS;
+    } else if (g_str_has_prefix(spec, "summary:")) {
+        gchar *end = NULL;
+        interval = g_ascii_strtoll(spec + 8, &end, 10);
+        if (*end || interval <= 0) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Invalid trace summary interval '%s'", spec + 8);
+            return FALSE;
+        }
+    } else {
+        trace_file = fopen(spec, "w");
+        if (!trace_file) {
+            int saved_errno = errno;
+            g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved_errno), "Could not create trace '%s': %s",
+                        spec, g_strerror(saved_errno));
+            return FALSE;
+        }
+        trace_path = g_strdup(spec);
+    }
+
+    buffers = g_ptr_array_new();
+    epoch = dia_trace_now();
+    summary_interval = interval * G_GINT64_CONSTANT(1000000000);
+    next_summary = epoch + summary_interval;
+    get_thread_buffer();
+    dia_trace_on = TRUE;
+    atexit(trace_shutdown);
+    g_print("[dia] tracing to %s\n", trace_file ? trace_path : "periodic summaries");
+#else
+    (void)error;
+    g_printerr("WARNING: Tracing was compiled out (TRACE=0), ignoring '%s'\n", spec);
+#endif
+    return TRUE;
+}
@@ -0,0 +1,496 @@
+#include "viewer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Read-only GtkTreeModel over the archive's image paths. Images live in one naturally sorted
+// array, so every folder is a contiguous run of it; rows are iters computed from that array and
+// a small table of folders, and nothing is allocated per row.
+
+enum {
+    ROW_IMAGE = 1,
+    ROW_DIR = 2,
+};
+
+// Each sort thread gets at least this many images
+#define SORT_CHUNK_MIN 4096
+
+typedef struct {
+    const gchar *path;
+    const gchar *id;
+    guint dir; // folder that directly contains the image
+} DiaTreeLeaf;
+
+typedef struct {
+    const gchar *name; // points into the path of the first image below it, not terminated
+    guint name_len;
+    guint parent;
+    guint first_leaf;
+    guint end_leaf;
+    guint n_children;   // rows directly below: images and subfolders
+    guint index;        // row position within the parent
+    guint first_subdir; // range of child folders in subdirs, in row order
+    guint n_subdirs;
+} DiaTreeDir;
+
+struct _DiaTreeModel {
+    GObject parent_instance;
+    gint stamp;
+    DiaTreeLeaf *leaves;
+    guint n_leaves;
+    GArray *dirs; // DiaTreeDir; 0 is the invisible root
+    guint *subdirs;
+};
+
+static void dia_tree_model_iface_init(GtkTreeModelIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE(DiaTreeModel, dia_tree_model, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(GTK_TYPE_TREE_MODEL, dia_tree_model_iface_init))
+
+// Simple natural comparator over a[0..len1) and b[0..len2): compares sequences of digits numerically,
+// otherwise lexicographically (ASCII)
+static int natural_cmp(const char *a, gsize len1, const char *b, gsize len2) {
+    const unsigned char *s1 = (const unsigned char*)a;
+    const unsigned char *s2 = (const unsigned char*)b;
+    const unsigned char *end1 = s1 + len1;
+    const unsigned char *end2 = s2 + len2;
+    while (s1 < end1 && s2 < end2) {
+        if (g_ascii_isdigit(*s1) && g_ascii_isdigit(*s2)) {
+            // skip leading zeros
+            while (s1 < end1 && *s1 == '0') s1++;
+            while (s2 < end2 && *s2 == '0') s2++;
+            const unsigned char *p1 = s1;
+            const unsigned char *p2 = s2;
+            while (p1 < end1 && g_ascii_isdigit(*p1)) p1++;
+            while (p2 < end2 && g_ascii_isdigit(*p2)) p2++;
+            int digits1 = p1 - s1;
+            int digits2 = p2 - s2;
+            if (digits1 != digits2) return digits1 - digits2;
+            int cmp = memcmp(s1, s2, digits1);
+            if (cmp != 0) return cmp;
+            s1 = p1;
+            s2 = p2;
+            continue;
+        }
+        if (*s1 != *s2) return (int)*s1 - (int)*s2;
+        s1++; s2++;
+    }
+    return (s1 < end1) - (s2 < end2);
+}
+
+// Paths are compared one component at a time, and components the natural order ties (e.g. "01"
+// and "1") fall back to bytes, so each folder's images stay contiguous for build_dirs
+static int compare_paths(const char *a, const char *b) {
+    for (;;) {
+        gsize len1 = strcspn(a, "/");
+        gsize len2 = strcspn(b, "/");
+        int cmp = natural_cmp(a, len1, b, len2);
+        if (cmp == 0) cmp = memcmp(a, b, MIN(len1, len2));
+        if (cmp == 0) cmp = (len1 > len2) - (len1 < len2);
+        if (cmp != 0) return cmp;
+        // Same component: an image sorts before a folder of the same name
+        if (!a[len1] || !b[len2]) return (a[len1] != 0) - (b[len2] != 0);
+        a += len1 + 1;
+        b += len2 + 1;
+    }
+}
+
+static int compare_leaves(const void *a, const void *b) {
+    const DiaTreeLeaf *la = a;
+    const DiaTreeLeaf *lb = b;
+    int cmp = compare_paths(la->path, lb->path);
+    if (cmp == 0) cmp = strcmp(la->id, lb->id);
+    return cmp;
+}
+
+typedef struct {
+    DiaTreeLeaf *src;
+    DiaTreeLeaf *dst;
+    gsize lo;
+    gsize mid;
+    gsize hi;
+} SortJob;
+
+static gpointer sort_run(gpointer user_data) {
+    SortJob *job = user_data;
+    qsort(job->src + job->lo, job->hi - job->lo, sizeof(DiaTreeLeaf), compare_leaves);
+    return NULL;
+}
+
+static gpointer merge_runs(gpointer user_data) {
+    SortJob *job = user_data;
+    gsize i = job->lo, j = job->mid, out = job->lo;
+    while (i < job->mid && j < job->hi) {
+        job->dst[out++] = compare_leaves(&job->src[j], &job->src[i]) < 0 ? job->src[j++] : job->src[i++];
+    }
+    while (i < job->mid) job->dst[out++] = job->src[i++];
+    while (j < job->hi) job->dst[out++] = job->src[j++];
+    return NULL;
+}
+
+static void run_jobs(GArray *jobs, GThreadFunc func) {
+    GThread **threads = g_new(GThread*, jobs->len);
+    for (guint i = 0; i < jobs->len; i++) {
+        threads[i] = g_thread_new("dia-sort", func, &g_array_index(jobs, SortJob, i));
+    }
+    for (guint i = 0; i < jobs->len; i++) g_thread_join(threads[i]);
+    g_free(threads);
+}
+
+// Archives written by encode.py are usually already in order, which costs one pass to confirm.
+// Otherwise runs are sorted on all cores and merged pairwise.
+static void sort_leaves(DiaTreeLeaf *leaves, gsize n) {
+    gsize i = 1;
+    while (i < n && compare_leaves(&leaves[i - 1], &leaves[i]) <= 0) i++;
+    if (i >= n) return;
+
+    gsize n_threads = MIN((gsize)g_get_num_processors(), n / SORT_CHUNK_MIN);
+    if (n_threads <= 1) {
+        qsort(leaves, n, sizeof(DiaTreeLeaf), compare_leaves);
+        return;
+    }
+
+    gsize chunk = (n + n_threads - 1) / n_threads;
+    GArray *jobs = g_array_new(FALSE, FALSE, sizeof(SortJob));
+    for (gsize lo = 0; lo < n; lo += chunk) {
+        SortJob job = { leaves, NULL, lo, 0, MIN(lo + chunk, n) };
+        g_array_append_val(jobs, job);
+    }
+    run_jobs(jobs, sort_run);
+
+    DiaTreeLeaf *src = leaves;
+    DiaTreeLeaf *dst = g_new(DiaTreeLeaf, n);
+    for (gsize width = chunk; width < n; width *= 2) {
+        g_array_set_size(jobs, 0);
+        for (gsize lo = 0; lo < n; lo += 2 * width) {
+            SortJob job = { src, dst, lo, MIN(lo + width, n), MIN(lo + 2 * width, n) };
+            g_array_append_val(jobs, job);
+        }
+        run_jobs(jobs, merge_runs);
+        DiaTreeLeaf *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != leaves) {
+        memcpy(leaves, src, n * sizeof(DiaTreeLeaf));
+        dst = src;
+    }
+    g_free(dst);
+    g_array_free(jobs, TRUE);
+}
+
+static DiaTreeDir* get_dir(DiaTreeModel *model, guint dir) {
+    return &g_array_index(model->dirs, DiaTreeDir, dir);
+}
+
+static void close_dirs(DiaTreeModel *model, GArray *stack, guint level, guint end_leaf) {
+    for (guint i = level; i < stack->len; i++) get_dir(model, g_array_index(stack, guint, i))->end_leaf = end_leaf;
+    g_array_set_size(stack, MIN(level, stack->len));
+}
+
+// One pass over the sorted paths; stack holds the folders of the previous image
+static void build_dirs(DiaTreeModel *model) {
+    DiaTreeDir root = { "", 0, 0, 0, model->n_leaves, 0, 0, 0, 0 };
+    g_array_append_val(model->dirs, root);
+    GArray *stack = g_array_new(FALSE, FALSE, sizeof(guint));
+    guint zero = 0;
+    g_array_append_val(stack, zero);
+
+    for (guint p = 0; p < model->n_leaves; p++) {
+        const gchar *name = model->leaves[p].path;
+        const gchar *slash;
+        guint level = 1;
+        for (; (slash = strchr(name, '/')); name = slash + 1, level++) {
+            guint len = (guint)(slash - name);
+            if (level < stack->len) {
+                DiaTreeDir *open = get_dir(model, g_array_index(stack, guint, level));
+                if (open->name_len == len && memcmp(open->name, name, len) == 0) continue;
+                close_dirs(model, stack, level, p);
+            }
+            guint parent = g_array_index(stack, guint, level - 1);
+            DiaTreeDir dir = { name, len, parent, p, p, 0, get_dir(model, parent)->n_children++, 0, 0 };
+            guint index = model->dirs->len;
+            g_array_append_val(model->dirs, dir);
+            g_array_append_val(stack, index);
+        }
+        close_dirs(model, stack, level, p);
+        model->leaves[p].dir = g_array_index(stack, guint, level - 1);
+        get_dir(model, model->leaves[p].dir)->n_children++;
+    }
+    close_dirs(model, stack, 1, model->n_leaves);
+    g_array_free(stack, TRUE);
+
+    // Folders are created in row order, so filling by parent keeps each range in row order too
+    for (guint d = 1; d < model->dirs->len; d++) get_dir(model, get_dir(model, d)->parent)->n_subdirs++;
+    guint offset = 0;
+    for (guint d = 0; d < model->dirs->len; d++) {
+        DiaTreeDir *dir = get_dir(model, d);
+        dir->first_subdir = offset;
+        offset += dir->n_subdirs;
+        dir->n_subdirs = 0;
+    }
+    model->subdirs = g_new(guint, MAX(offset, 1));
+    for (guint d = 1; d < model->dirs->len; d++) {
+        DiaTreeDir *parent = get_dir(model, get_dir(model, d)->parent);
+        model->subdirs[parent->first_subdir + parent->n_subdirs++] = d;
+    }
+}
+
+static void set_iter(DiaTreeModel *model, GtkTreeIter *iter, gint kind, guint index) {
+    iter->stamp = model->stamp;
+    iter->user_data = GUINT_TO_POINTER(index);
+    iter->user_data2 = GINT_TO_POINTER(kind);
+    iter->user_data3 = NULL;
+}
+
+static gboolean invalidate_iter(GtkTreeIter *iter) {
+    iter->stamp = 0;
+    return FALSE;
+}
+
+static gint iter_kind(GtkTreeIter *iter) {
+    return GPOINTER_TO_INT(iter->user_data2);
+}
+
+static guint iter_index(GtkTreeIter *iter) {
+    return GPOINTER_TO_UINT(iter->user_data);
+}
+
+static guint iter_parent_dir(DiaTreeModel *model, GtkTreeIter *iter) {
+    guint index = iter_index(iter);
+    return iter_kind(iter) == ROW_IMAGE ? model->leaves[index].dir : get_dir(model, index)->parent;
+}
+
+// The row of folder dir that contains image position p
+static void set_row_at(DiaTreeModel *model, guint dir, guint p, GtkTreeIter *iter) {
+    guint d = model->leaves[p].dir;
+    if (d == dir) {
+        set_iter(model, iter, ROW_IMAGE, p);
+        return;
+    }
+    while (get_dir(model, d)->parent != dir) d = get_dir(model, d)->parent;
+    set_iter(model, iter, ROW_DIR, d);
+}
+
+// Last child folder of dir that starts before image position p, or NULL
+static DiaTreeDir* subdir_before(DiaTreeModel *model, DiaTreeDir *dir, guint p) {
+    guint lo = 0, hi = dir->n_subdirs;
+    while (lo < hi) {
+        guint mid = lo + (hi - lo) / 2;
+        if (get_dir(model, model->subdirs[dir->first_subdir + mid])->first_leaf < p) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo ? get_dir(model, model->subdirs[dir->first_subdir + lo - 1]) : NULL;
+}
+
+static gint row_position(DiaTreeModel *model, GtkTreeIter *iter) {
+    guint index = iter_index(iter);
+    if (iter_kind(iter) == ROW_DIR) return (gint)get_dir(model, index)->index;
+
+    DiaTreeDir *dir = get_dir(model, model->leaves[index].dir);
+    DiaTreeDir *before = subdir_before(model, dir, index);
+    return before ? (gint)(before->index + 1 + (index - before->end_leaf)) : (gint)(index - dir->first_leaf);
+}
+
+static GtkTreeModelFlags tree_get_flags(GtkTreeModel *tree_model) {
+    (void)tree_model;
+    return GTK_TREE_MODEL_ITERS_PERSIST;
+}
+
+static gint tree_get_n_columns(GtkTreeModel *tree_model) {
+    (void)tree_model;
+    return 2;
+}
+
+static GType tree_get_column_type(GtkTreeModel *tree_model, gint column) {
+    (void)tree_model; (void)column;
+    return G_TYPE_STRING;
+}
+
+static gboolean tree_iter_nth_child(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter *parent, gint n) {
+    DiaTreeModel *model = DIA_TREE_MODEL(tree_model);
+    if (parent && iter_kind(parent) != ROW_DIR) return invalidate_iter(iter);
+    DiaTreeDir *dir = get_dir(model, parent ? iter_index(parent) : 0);
+    if (n < 0 || (guint)n >= dir->n_children) return invalidate_iter(iter);
+
+    // Images between two child folders are contiguous, so the last folder at or before n locates the row
+    guint lo = 0, hi = dir->n_subdirs;
+    while (lo < hi) {
+        guint mid = lo + (hi - lo) / 2;
+        if (get_dir(model, model->subdirs[dir->first_subdir + mid])->index <= (guint)n) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) {
+        set_iter(model, iter, ROW_IMAGE, dir->first_leaf + (guint)n);
+        return TRUE;
+    }
+    guint d = model->subdirs[dir->first_subdir + lo - 1];
+    DiaTreeDir *before = get_dir(model, d);
+    if (before->index == (guint)n) set_iter(model, iter, ROW_DIR, d);
+    else set_iter(model, iter, ROW_IMAGE, before->end_leaf + ((guint)n - before->index - 1));
+    return TRUE;
+}
+
+static gboolean tree_get_iter(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreePath *path) {
+    gint depth = 0;
+    gint *indices = gtk_tree_path_get_indices_with_depth(path, &depth);
+    if (depth <= 0) return invalidate_iter(iter);
+
+    GtkTreeIter parent;
+    for (gint i = 0; i < depth; i++) {
+        if (!tree_iter_nth_child(tree_model, iter, i ? &parent : NULL, indices[i])) return FALSE;
+        parent = *iter;
+    }
+    return TRUE;
+}
+
+static GtkTreePath* tree_get_path(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    DiaTreeModel *model = DIA_TREE_MODEL(tree_model);
+    g_return_val_if_fail(iter->stamp == model->stamp, NULL);
+
+    GtkTreePath *path = gtk_tree_path_new();
+    gtk_tree_path_prepend_index(path, row_position(model, iter));
+    for (guint d = iter_parent_dir(model, iter); d != 0; d = get_dir(model, d)->parent) {
+        gtk_tree_path_prepend_index(path, (gint)get_dir(model, d)->index);
+    }
+    return path;
+}
+
+static void tree_get_value(GtkTreeModel *tree_model, GtkTreeIter *iter, gint column, GValue *value) {
+    DiaTreeModel *model = DIA_TREE_MODEL(tree_model);
+    g_return_if_fail(iter->stamp == model->stamp);
+
+    g_value_init(value, G_TYPE_STRING);
+    guint index = iter_index(iter);
+    if (iter_kind(iter) == ROW_DIR) {
+        if (column == 1) {
+            DiaTreeDir *dir = get_dir(model, index);
+            g_value_take_string(value, g_strndup(dir->name, dir->name_len));
+        }
+        return;
+    }
+
+    const gchar *path = model->leaves[index].path;
+    const gchar *slash = strrchr(path, '/');
+    g_value_set_string(value, column == 0 ? model->leaves[index].id : slash ? slash + 1 : path);
+}
+
+static gboolean tree_iter_next(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    DiaTreeModel *model = DIA_TREE_MODEL(tree_model);
+    guint index = iter_index(iter);
+    guint dir = iter_parent_dir(model, iter);
+    guint p = iter_kind(iter) == ROW_IMAGE ? index + 1 : get_dir(model, index)->end_leaf;
+    if (p >= get_dir(model, dir)->end_leaf) return invalidate_iter(iter);
+    set_row_at(model, dir, p, iter);
+    return TRUE;
+}
+
+static gboolean tree_iter_previous(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    DiaTreeModel *model = DIA_TREE_MODEL(tree_model);
+    guint index = iter_index(iter);
+    guint dir = iter_parent_dir(model, iter);
+    guint p = iter_kind(iter) == ROW_IMAGE ? index : get_dir(model, index)->first_leaf;
+    if (p <= get_dir(model, dir)->first_leaf) return invalidate_iter(iter);
+    set_row_at(model, dir, p - 1, iter);
+    return TRUE;
+}
+
+static gboolean tree_iter_children(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter *parent) {
+    return tree_iter_nth_child(tree_model, iter, parent, 0);
+}
+
+static gboolean tree_iter_has_child(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    DiaTreeModel *model = DIA_TREE_MODEL(tree_model);
+    return iter_kind(iter) == ROW_DIR && get_dir(model, iter_index(iter))->n_children > 0;
+}
+
+static gint tree_iter_n_children(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    DiaTreeModel *model = DIA_TREE_MODEL(tree_model);
+    if (iter && iter_kind(iter) != ROW_DIR) return 0;
+    return (gint)get_dir(model, iter ? iter_index(iter) : 0)->n_children;
+}
+
+static gboolean tree_iter_parent(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter *child) {
+    DiaTreeModel *model = DIA_TREE_MODEL(tree_model);
+    guint dir = iter_parent_dir(model, child);
+    if (dir == 0) return invalidate_iter(iter);
+    set_iter(model, iter, ROW_DIR, dir);
+    return TRUE;
+}
+
+static void dia_tree_model_iface_init(GtkTreeModelIface *iface) {
+    iface->get_flags = tree_get_flags;
+    iface->get_n_columns = tree_get_n_columns;
+    iface->get_column_type = tree_get_column_type;
+    iface->get_iter = tree_get_iter;
+    iface->get_path = tree_get_path;
+    iface->get_value = tree_get_value;
+    iface->iter_next = tree_iter_next;
+    iface->iter_previous = tree_iter_previous;
+    iface->iter_children = tree_iter_children;
+    iface->iter_has_child = tree_iter_has_child;
+    iface->iter_n_children = tree_iter_n_children;
+    iface->iter_nth_child = tree_iter_nth_child;
+    iface->iter_parent = tree_iter_parent;
+}
+
+static void dia_tree_model_finalize(GObject *object) {
+    DiaTreeModel *model = DIA_TREE_MODEL(object);
+    g_free(model->leaves);
+    g_array_free(model->dirs, TRUE);
+    g_free(model->subdirs);
+    G_OBJECT_CLASS(dia_tree_model_parent_class)->finalize(object);
+}
+
+static void dia_tree_model_class_init(DiaTreeModelClass *klass) {
+    G_OBJECT_CLASS(klass)->finalize = dia_tree_model_finalize;
+}
+
+static void dia_tree_model_init(DiaTreeModel *model) {
+    model->stamp = g_random_int();
+    model->dirs = g_array_new(FALSE, FALSE, sizeof(DiaTreeDir));
+}
+
+// The model points into the archive's map, so the archive must outlive it
+DiaTreeModel* dia_tree_model_new(DiaArchive *archive) {
+    DiaTreeModel *model = g_object_new(DIA_TYPE_TREE_MODEL, NULL);
+    gint64 start = g_get_monotonic_time();
+
+    guint n_images = dia_archive_n_images(archive);
+    model->leaves = g_new(DiaTreeLeaf, MAX(n_images, 1));
+    for (guint i = 0; i < n_images; i++) {
+        const gchar *image_id = dia_archive_image_id(archive, i);
+        const gchar *filename = dia_archive_image_path(archive, image_id, NULL);
+        if (!filename) continue;
+        model->leaves[model->n_leaves++] = (DiaTreeLeaf){ filename, image_id, 0 };
+    }
+    sort_leaves(model->leaves, model->n_leaves);
+    build_dirs(model);
+
+    g_print("[dia] image list: %u images in %u folders in %.1f ms\n", model->n_leaves, model->dirs->len - 1,
+            (g_get_monotonic_time() - start) / 1000.0);
+    return model;
+}
+
+guint dia_tree_model_n_images(DiaTreeModel *model) {
+    return model->n_leaves;
+}
+
+// Images in display order, i.e. the order of the flattened, fully expanded tree
+const gchar* dia_tree_model_image_id(DiaTreeModel *model, guint position) {
+    return position < model->n_leaves ? model->leaves[position].id : NULL;
+}
+
+// Display position of an image row, or -1 for a folder
+gint dia_tree_model_iter_position(DiaTreeModel *model, GtkTreeIter *iter) {
+    g_return_val_if_fail(iter->stamp == model->stamp, -1);
+    return iter_kind(iter) == ROW_IMAGE ? (gint)iter_index(iter) : -1;
+}
+
+// Tree path of the image at a display position, or NULL past the end
+GtkTreePath* dia_tree_model_image_path(DiaTreeModel *model, guint position) {
+    if (position >= model->n_leaves) return NULL;
+    GtkTreeIter iter;
+    set_iter(model, &iter, ROW_IMAGE, position);
+    return tree_get_path(GTK_TREE_MODEL(model), &iter);
+}
@@ -1,6 +1,200 @@
 #include "viewer.h"
 
+// How long a selection has to stay put before its full chain is reconstructed; until then the
+// stored preview is shown
+#define DIA_FULL_RENDER_DELAY_MS 250
+
+typedef struct {
+    AppData *data;
+    gchar *image_id;
+    guint generation;
+    GPtrArray *prefetch;
+    guint chain_depth;
+    gint64 render_time;
+} RenderJob;
+
+typedef struct {
+    AppData *data;
+    gchar *image_id;
+    guint generation;
+    guint min_size;
+    guint size;
+} PreviewJob;
+
+static void render_job_free(RenderJob *job) {
+    g_free(job->image_id);
+    if (job->prefetch) g_ptr_array_unref(job->prefetch);
+    g_free(job);
+}
+
+static void preview_job_free(PreviewJob *job) {
+    g_free(job->image_id);
+    g_free(job);
+}
+
+// Runs on a GTask worker thread
+static void render_thread(GTask *task, gpointer source_object, gpointer task_data, GCancellable *cancellable) {
+    RenderJob *job = (RenderJob*)task_data;
+    (void)source_object;
+
+    GError *error = NULL;
+    gint64 start = g_get_monotonic_time();
+    GdkPixbuf *pixbuf = render_composite_image(job->data->archive, job->data->selection_cache, job->image_id, cancellable, &error);
+    job->render_time = g_get_monotonic_time() - start;
+    if (pixbuf) {
+        g_task_return_pointer(task, pixbuf, g_object_unref);
+    } else {
+        g_task_return_error(task, error);
+    }
+}
+
+// Back on the main thread; only the newest generation is allowed to touch the UI
+static void on_render_finished(GObject *source_object, GAsyncResult *result, gpointer user_data) {
+    DIA_TRACE_SCOPE(span, "ui.present");
+    AppData *data = (AppData*)user_data;
+    GTask *task = G_TASK(result);
+    RenderJob *job = (RenderJob*)g_task_get_task_data(task);
+    (void)source_object;
+
+    GError *error = NULL;
+    GdkPixbuf *pixbuf = g_task_propagate_pointer(task, &error);
+    
+    if (job->generation != data->render_generation) {
+        g_print("[dia] dropped stale render of '%s'\n", job->image_id);
+    } else if (pixbuf) {
+        g_print("[dia] rendered '%s' (chain depth %u) in %.1f ms\n", job->image_id, job->chain_depth, job->render_time / 1000.0);
+        data->shown_generation = job->generation;
+
+        g_autofree gchar *status = g_strdup_printf("Chain depth %u, rendered in %.1f ms, %dx%d",
+                                                   job->chain_depth, job->render_time / 1000.0,
+                                                   gdk_pixbuf_get_width(pixbuf), gdk_pixbuf_get_height(pixbuf));
+        gtk_label_set_text(GTK_LABEL(data->status_label), status);
+        
+        if (data->original_pixbuf) {
+            g_object_unref(data->original_pixbuf);
+        }
+        data->original_pixbuf = g_object_ref(pixbuf);
+        
+        dia_scaler_set_source(data->scaler, pixbuf);
+
+        // Prefetch and thumbnail renders look up the store directly, so these are the selections' own
+        DiaCacheStats stats;
+        dia_canvas_cache_get_stats(data->selection_cache, &stats);
+        g_autofree gchar *resident = g_format_size(stats.resident);
+        g_print("[dia] canvas cache: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses, %u canvases, %s resident\n",
+                stats.hits, stats.misses, stats.count, resident);
+
+        guint64 selections, served, completed;
+        dia_prefetcher_get_stats(data->prefetcher, &selections, &served, &completed);
+        g_print("[dia] prefetch: %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " selections served from prefetched canvases (%" G_GUINT64_FORMAT " prefetched)\n",
+                served, selections, completed);
+
+        // The foreground is idle again, so speculative work may resume
+        dia_prefetcher_schedule(data->prefetcher, job->prefetch);
+    } else {
+        g_printerr("ERROR: Could not render '%s': %s\n", job->image_id, error ? error->message : "Unknown error");
+        dia_scaler_set_source(data->scaler, NULL);
+        gtk_image_set_from_icon_name(GTK_IMAGE(data->image_display), "image-missing", GTK_ICON_SIZE_DIALOG);
+        gtk_label_set_text(GTK_LABEL(data->status_label), "Could not render this image");
+    }
+
+    if (job->generation == data->render_generation) {
+        gtk_spinner_stop(GTK_SPINNER(data->spinner));
+        gtk_widget_hide(data->spinner);
+    }
+
+    if (pixbuf) g_object_unref(pixbuf);
+    if (error) g_error_free(error);
+    g_application_release(g_application_get_default());
+}
+
+// Runs on a GTask worker thread
+static void preview_thread(GTask *task, gpointer source_object, gpointer task_data, GCancellable *cancellable) {
+    PreviewJob *job = (PreviewJob*)task_data;
+    (void)source_object; (void)cancellable;
+
+    GError *error = NULL;
+    GdkPixbuf *pixbuf = dia_render_preview(job->data->archive, job->image_id, job->min_size, &job->size, &error);
+    if (pixbuf) {
+        g_task_return_pointer(task, pixbuf, g_object_unref);
+    } else {
+        g_task_return_error(task, error);
+    }
+}
+
+// A preview is only shown while its selection is current and the full render has not landed yet
+static void on_preview_finished(GObject *source_object, GAsyncResult *result, gpointer user_data) {
+    DIA_TRACE_SCOPE(span, "ui.present_preview");
+    AppData *data = (AppData*)user_data;
+    GTask *task = G_TASK(result);
+    PreviewJob *job = (PreviewJob*)g_task_get_task_data(task);
+    (void)source_object;
+
+    g_autoptr(GError) error = NULL;
+    GdkPixbuf *pixbuf = g_task_propagate_pointer(task, &error);
+    if (!pixbuf) {
+        // A newer selection cancels the preview it supersedes; that is not worth reporting
+        if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            g_printerr("[dia] preview of '%s' failed: %s\n", job->image_id, error ? error->message : "Unknown error");
+        }
+    } else if (job->generation == data->render_generation && data->shown_generation != job->generation) {
+        g_autofree gchar *status = g_strdup_printf("Preview (%u px), full image follows", job->size);
+        gtk_label_set_text(GTK_LABEL(data->status_label), status);
+        dia_scaler_set_source(data->scaler, pixbuf);
+    }
+
+    if (pixbuf) g_object_unref(pixbuf);
+    g_application_release(g_application_get_default());
+}
+
+static void start_preview(AppData *data, const gchar *image_id, guint generation) {
+    GtkAllocation allocation;
+    gtk_widget_get_allocation(data->scrolled_image, &allocation);
+
+    PreviewJob *job = g_new0(PreviewJob, 1);
+    job->data = data;
+    job->image_id = g_strdup(image_id);
+    job->generation = generation;
+    job->min_size = (guint)MAX(allocation.width, allocation.height);
+
+    // Keep the application alive until the worker has handed its result back
+    g_application_hold(g_application_get_default());
+
+    GTask *task = g_task_new(NULL, data->render_cancellable, on_preview_finished, data);
+    g_task_set_task_data(task, job, (GDestroyNotify)preview_job_free);
+    g_task_run_in_thread(task, preview_thread);
+    g_object_unref(task);
+}
+
+static void start_render(AppData *data, RenderJob *job) {
+    // Keep the application alive until the worker has handed its result back
+    g_application_hold(g_application_get_default());
+
+    GTask *task = g_task_new(NULL, data->render_cancellable, on_render_finished, data);
+    g_task_set_task_data(task, job, (GDestroyNotify)render_job_free);
+    g_task_run_in_thread(task, render_thread);
+    g_object_unref(task);
+}
+
+static gboolean on_render_timeout(gpointer user_data) {
+    AppData *data = (AppData*)user_data;
+    RenderJob *job = data->pending_render;
+    data->pending_render = NULL;
+    data->render_timeout_id = 0;
+    start_render(data, job);
+    return G_SOURCE_REMOVE;
+}
+
+static void cancel_pending_render(AppData *data) {
+    if (!data->render_timeout_id) return;
+    g_source_remove(data->render_timeout_id);
+    data->render_timeout_id = 0;
+    render_job_free(data->pending_render);
+    data->pending_render = NULL;
+}
+
 void on_tree_selection_changed(GtkTreeSelection *selection, gpointer user_data) {
+    DIA_TRACE_SCOPE(span, "ui.select");
     AppData *data = (AppData*)user_data;
     GtkTreeModel *model = NULL;
     GtkTreeIter iter;
@@ -17,71 +211,67 @@ void on_tree_selection_changed(GtkTreeSelection *selection, gpointer user_data)
     gtk_spinner_start(GTK_SPINNER(data->spinner));
 
     g_print("\n--- Tree Selection: ID '%s' ---\n", image_id);
-    
-    GError *error = NULL;
-    GdkPixbuf *pixbuf = render_composite_image(data, image_id, &error);
-    
-    if (pixbuf) {
-        g_print("SUCCESS: Final image rendered. Displaying.\n");
-        
-        if (data->original_pixbuf) {
-            g_object_unref(data->original_pixbuf);
-        }
-        data->original_pixbuf = g_object_ref(pixbuf);
-        
-        scale_image_to_fit(data);
-        g_object_unref(pixbuf);
+
+    // Foreground renders always win over speculative ones
+    dia_prefetcher_pause(data->prefetcher);
+    if (dia_prefetcher_note_selection(data->prefetcher, image_id)) {
+        g_print("[dia] '%s' was prefetched\n", image_id);
+    }
+
+    // Neighbours in the flattened image order, so moving past the end of a folder is predicted
+    // too and folder rows are never candidates
+    DiaTreeModel *tree_model = DIA_TREE_MODEL(model);
+    gint position = dia_tree_model_iter_position(tree_model, &iter);
+    const gchar *next_row_id = dia_tree_model_image_id(tree_model, (guint)position + 1);
+    const gchar *prev_row_id = position > 0 ? dia_tree_model_image_id(tree_model, (guint)position - 1) : NULL;
+
+    // Abort whatever is still in flight; it will stop at its next overlay step
+    if (data->render_cancellable) {
+        g_cancellable_cancel(data->render_cancellable);
+        g_object_unref(data->render_cancellable);
+    }
+    data->render_cancellable = g_cancellable_new();
+
+    RenderJob *job = g_new0(RenderJob, 1);
+    job->data = data;
+    job->image_id = image_id;
+    job->generation = ++data->render_generation;
+    job->chain_depth = dia_archive_chain_depth(data->archive, image_id);
+    job->prefetch = dia_prefetcher_rank(data->prefetcher, image_id, next_row_id, prev_row_id);
+
+    // While the user is still moving through the list, only previews are decoded
+    cancel_pending_render(data);
+    if (!dia_canvas_cache_contains(data->canvas_cache, image_id) && dia_archive_n_previews(data->archive, image_id) > 0) {
+        start_preview(data, image_id, job->generation);
+        data->pending_render = job;
+        data->render_timeout_id = g_timeout_add(DIA_FULL_RENDER_DELAY_MS, on_render_timeout, data);
     } else {
-        g_printerr("ERROR: Could not render '%s': %s\n", image_id, error ? error->message : "Unknown error");
-        gtk_image_set_from_icon_name(GTK_IMAGE(data->image_display), "image-missing", GTK_ICON_SIZE_DIALOG);
-        if (error) g_error_free(error);
+        start_render(data, job);
     }
-    
-    gtk_spinner_stop(GTK_SPINNER(data->spinner));
-    gtk_widget_hide(data->spinner);
-    g_free(image_id);
 }
 
-void on_scrolled_window_size_allocate(GtkWidget *widget, GdkRectangle *allocation, gpointer user_data) {
+void on_main_window_destroy(GtkWidget *widget, gpointer user_data) {
     AppData *data = (AppData*)user_data;
-    (void)widget; (void)allocation;
-    
-    if (data->original_pixbuf) {
-        scale_image_to_fit(data);
+    (void)widget;
+
+    // Invalidate pending results so nothing is delivered to destroyed widgets
+    data->render_generation++;
+    if (data->render_cancellable) {
+        g_cancellable_cancel(data->render_cancellable);
     }
+    cancel_pending_render(data);
+    dia_scaler_set_source(data->scaler, NULL);
 }
 
-void scale_image_to_fit(AppData *data) {
-    if (!data->original_pixbuf || !data->scrolled_image) return;
-    
-    GtkAllocation allocation;
-    gtk_widget_get_allocation(data->scrolled_image, &allocation);
-    
-    int orig_width = gdk_pixbuf_get_width(data->original_pixbuf);
-    int orig_height = gdk_pixbuf_get_height(data->original_pixbuf);
-    
-    int available_width = allocation.width - 5;
-    int available_height = allocation.height - 5;
-    
-    if (available_width <= 0 || available_height <= 0) return;
-    
-    double scale_x = (double)available_width / orig_width;
-    double scale_y = (double)available_height / orig_height;
-    double scale = MIN(scale_x, scale_y);
-    
-    // Only scale down
-    scale = MIN(scale, 1.0);
-    
-    int new_width = (int)(orig_width * scale);
-    int new_height = (int)(orig_height * scale);
+void on_grid_toggled(GtkToggleButton *button, gpointer user_data) {
+    AppData *data = (AppData*)user_data;
+    gtk_stack_set_visible_child_name(GTK_STACK(data->view_stack), gtk_toggle_button_get_active(button) ? "grid" : "image");
+}
+
+void on_scrolled_window_size_allocate(GtkWidget *widget, GdkRectangle *allocation, gpointer user_data) {
+    AppData *data = (AppData*)user_data;
+    (void)widget; (void)allocation;
     
-    if (new_width > 0 && new_height > 0) {
-        GdkPixbuf *scaled_pixbuf = gdk_pixbuf_scale_simple(data->original_pixbuf, 
-                                                          new_width, new_height, 
-                                                          GDK_INTERP_BILINEAR);
-        if (scaled_pixbuf) {
-            gtk_image_set_from_pixbuf(GTK_IMAGE(data->image_display), scaled_pixbuf);
-            g_object_unref(scaled_pixbuf);
-        }
-    }
+    // Allocations arrive many times per frame while the window or paned is dragged
+    dia_scaler_queue(data->scaler);
 }
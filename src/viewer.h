@@ -1,9 +1,23 @@
 #pragma once
 
 #include <gtk/gtk.h>
-#include <zip.h>
-#include <json-glib/json-glib.h>
-#include <errno.h>
+#include "dia.h"
+
+#define DIA_DEFAULT_CACHE_MB 512
+#define DIA_DEFAULT_PREFETCH 4
+
+typedef struct _DiaPrefetcher DiaPrefetcher;
+typedef struct _DiaScaler DiaScaler;
+typedef struct _DiaThumbGrid DiaThumbGrid;
+
+// Image list: column 0 is the image ID (NULL for folders), column 1 the row label
+#define DIA_TYPE_TREE_MODEL (dia_tree_model_get_type())
+G_DECLARE_FINAL_TYPE(DiaTreeModel, dia_tree_model, DIA, TREE_MODEL, GObject)
+DiaTreeModel* dia_tree_model_new(DiaArchive *archive);
+guint dia_tree_model_n_images(DiaTreeModel *model);
+const gchar* dia_tree_model_image_id(DiaTreeModel *model, guint position);
+gint dia_tree_model_iter_position(DiaTreeModel *model, GtkTreeIter *iter);
+GtkTreePath* dia_tree_model_image_path(DiaTreeModel *model, guint position);
 
 // Shared application state
 typedef struct {
@@ -11,13 +25,74 @@ typedef struct {
     GtkWidget *image_display;
     GtkWidget *spinner;
     GtkWidget *scrolled_image;
+    GtkWidget *status_label;
+    GtkWidget *tree_view;
+    GtkWidget *view_stack;
+    GtkWidget *grid_toggle;
     gchar *zip_path;
-    GHashTable *image_map;
-    GHashTable *dependencies;
-    GHashTable *alpha_map;
+    DiaArchive *archive;
+    DiaCanvasCache *canvas_cache;
+    DiaCanvasCache *selection_cache;  // unscoped view of canvas_cache, counting only selection renders
     GdkPixbuf *original_pixbuf;
+    GCancellable *render_cancellable;
+    guint render_generation;
+    guint shown_generation;   // last selection whose full render reached the screen
+    gpointer pending_render;  // RenderJob waiting for render_timeout_id
+    guint render_timeout_id;
+    DiaPrefetcher *prefetcher;
+    guint prefetch_depth;
+    DiaScaler *scaler;
+    DiaThumbGrid *grid;
 } AppData;
 
+// Low-priority background renderer for the images the user is likely to select next
+struct _DiaPrefetcher {
+    AppData *data;
+    guint depth;
+    GThreadPool *pool;
+    GCancellable *cancellable;
+    GHashTable *prefetched;  // rendered by the prefetcher and not selected since
+    guint prune_at;
+    GMutex lock;
+    guint64 selections;
+    guint64 served;
+    guint64 completed;
+};
+
+// Fits the current image to the viewport: a nearest preview first, then a filtered pass from a worker
+struct _DiaScaler {
+    AppData *data;
+    GdkPixbuf *source;
+    GPtrArray *mips;  // successive halvings of source, level 0 being source itself
+    GMutex lock;      // guards mips
+    GQueue *cache;    // recently fitted sizes, most recent first
+    guint generation;
+    gint shown_width;
+    gint shown_height;
+    gboolean frame_pending;
+    gboolean busy;
+    gboolean pending;
+};
+
+// Scrollable thumbnail grid of every image, in tree order
+struct _DiaThumbGrid {
+    AppData *data;
+    DiaTreeModel *model;
+    GtkWidget *widget;
+    GtkWidget *area;
+    GtkAdjustment *adjustment;
+    gint columns;
+    GHashTable *thumbs;     // position -> cairo_surface_t, NULL when the image failed
+    GQueue order;           // positions in thumbs, oldest first
+    GHashTable *requested;  // positions queued or being decoded
+    GThreadPool *pool;
+    gint visible_first;     // read by the pool threads
+    gint visible_last;
+    gint closing;           // set by dia_thumb_grid_free, read by the pool threads
+    GMutex delivery_lock;
+    GQueue deliveries;      // finished jobs whose idle source has not run yet
+};
+
 // Core entry points
 int on_command_line(GtkApplication *app, GApplicationCommandLine *cmdline, gpointer user_data);
 void activate(GtkApplication *app, gpointer user_data);
@@ -25,14 +100,27 @@ void activate(GtkApplication *app, gpointer user_data);
 // Diagnostics
 void debug_print_stored_data(AppData *data);
 
-// Rendering
-GdkPixbuf* render_composite_image(AppData *data, const gchar *image_id, GError **error);
+// Prefetch
+DiaPrefetcher* dia_prefetcher_new(AppData *data, guint depth);
+void dia_prefetcher_free(DiaPrefetcher *prefetcher);
+void dia_prefetcher_pause(DiaPrefetcher *prefetcher);
+GPtrArray* dia_prefetcher_rank(DiaPrefetcher *prefetcher, const gchar *image_id, const gchar *next_row_id, const gchar *prev_row_id);
+void dia_prefetcher_schedule(DiaPrefetcher *prefetcher, GPtrArray *candidates);
+gboolean dia_prefetcher_note_selection(DiaPrefetcher *prefetcher, const gchar *image_id);
+void dia_prefetcher_get_stats(DiaPrefetcher *prefetcher, guint64 *selections, guint64 *served, guint64 *completed);
+
+// Scaling
+DiaScaler* dia_scaler_new(AppData *data);
+void dia_scaler_free(DiaScaler *scaler);
+void dia_scaler_set_source(DiaScaler *scaler, GdkPixbuf *source);
+void dia_scaler_queue(DiaScaler *scaler);
 
-// IO helpers
-gchar* read_file_from_zip(const char *zip_path, const char *inner_filename, gsize *size, GError **error);
-GdkPixbuf* load_pixbuf_from_memory(const gchar *buffer, gsize size, GError **error);
+// Thumbnail grid
+DiaThumbGrid* dia_thumb_grid_new(AppData *data, DiaTreeModel *model);
+void dia_thumb_grid_free(DiaThumbGrid *grid);
 
 // UI helpers
-void scale_image_to_fit(AppData *data);
 void on_tree_selection_changed(GtkTreeSelection *selection, gpointer user_data);
+void on_main_window_destroy(GtkWidget *widget, gpointer user_data);
 void on_scrolled_window_size_allocate(GtkWidget *widget, GdkRectangle *allocation, gpointer user_data);
+void on_grid_toggled(GtkToggleButton *button, gpointer user_data);
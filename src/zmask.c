@@ -0,0 +1,179 @@
+#include "dia.h"
+
+#include <string.h>
+#include <zstd.h>
+
+// zmask delta tile, written by encode.py --delta-codec zmask. Little-endian header:
+//   "DIAZ", version, width, height, n_changed (u32 each after the magic)
+// followed by one zstd frame holding a change bitmap of ceil(width / 8) bytes per row, least
+// significant bit first, then the RGB of every changed pixel in raster order. Changed pixels
+// are opaque, exactly like the alpha 255 pixels of a PNG delta.
+#define ZMASK_HEADER_SIZE 20
+#define ZMASK_VERSION 1
+
+static guint32 rd32(const guint8 *p) {
+    return (guint32)p[0] | ((guint32)p[1] << 8) | ((guint32)p[2] << 16) | ((guint32)p[3] << 24);
+}
+
+static void free_dctx(gpointer dctx) {
+    ZSTD_freeDCtx(dctx);
+}
+
+// Decompression contexts are reused per thread; they hold a sizeable window buffer. JPEG deltas
+// share them.
+static GPrivate dctx_key = G_PRIVATE_INIT(free_dctx);
+
+ZSTD_DCtx* dia_zstd_thread_dctx(void) {
+    ZSTD_DCtx *dctx = g_private_get(&dctx_key);
+    if (!dctx) {
+        dctx = ZSTD_createDCtx();
+        g_private_set(&dctx_key, dctx);
+    }
+    return dctx;
+}
+
+gboolean dia_zmask_is_delta(GBytes *bytes) {
+    gsize size;
+    const guint8 *data = g_bytes_get_data(bytes, &size);
+    return size >= ZMASK_HEADER_SIZE && memcmp(data, DIA_ZMASK_MAGIC, 4) == 0;
+}
+
+// The archive-wide dictionary is digested once and shared by every thread
+static ZSTD_DDict* zmask_dictionary(DiaArchive *archive, GError **error) {
+    g_mutex_lock(&archive->codec_lock);
+    if (!archive->zmask_dict) {
+        g_autoptr(GBytes) bytes = dia_archive_read(archive, DIA_ZMASK_DICT_NAME, error);
+        if (bytes) {
+            gsize size;
+            const void *data = g_bytes_get_data(bytes, &size);
+            archive->zmask_dict = ZSTD_createDDict(data, size);
+            if (!archive->zmask_dict) {
+                g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "'%s' is not a zstd dictionary", DIA_ZMASK_DICT_NAME);
+            }
+        }
+    }
+    ZSTD_DDict *dict = archive->zmask_dict;
+    g_mutex_unlock(&archive->codec_lock);
+    return dict;
+}
+
+void dia_zmask_clear(DiaArchive *archive) {
+    if (archive->zmask_dict) ZSTD_freeDDict(archive->zmask_dict);
+    archive->zmask_dict = NULL;
+}
+
+static guint64 count_set_bits(const guint8 *mask, gsize size) {
+    guint64 count = 0;
+    gsize i = 0;
+    for (; i + 8 <= size; i += 8) {
+        guint64 word;
+        memcpy(&word, mask + i, 8);
+        count += (guint64)__builtin_popcountll(word);
+    }
+    for (; i < size; i++) count += (guint64)__builtin_popcount(mask[i]);
+    return count;
+}
+
+static inline void put_pixel(guint8 *d, const guint8 *rgb) {
+    d[0] = rgb[0];
+    d[1] = rgb[1];
+    d[2] = rgb[2];
+    d[3] = 0xff;
+}
+
+// Decodes a zmask tile straight into its rectangle of the RGBA canvas
+gboolean dia_zmask_apply(DiaArchive *archive, GBytes *bytes, GdkPixbuf *canvas_pixbuf, gint x, gint y,
+                         const gchar *name, GError **error) {
+    gsize size;
+    const guint8 *data = g_bytes_get_data(bytes, &size);
+    guint32 version = rd32(data + 4);
+    guint32 width = rd32(data + 8);
+    guint32 height = rd32(data + 12);
+    guint32 n_changed = rd32(data + 16);
+    if (version != ZMASK_VERSION) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Delta tile '%s' has unknown zmask version %u", name, version);
+        return FALSE;
+    }
+
+    int canvas_width = gdk_pixbuf_get_width(canvas_pixbuf);
+    int canvas_height = gdk_pixbuf_get_height(canvas_pixbuf);
+    if (x < 0 || y < 0 || width > (guint32)canvas_width || height > (guint32)canvas_height ||
+        (guint32)x > canvas_width - width || (guint32)y > canvas_height - height) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Delta tile '%s' (%ux%u at %d,%d) lies outside the %dx%d canvas",
+                    name, width, height, x, y, canvas_width, canvas_height);
+        return FALSE;
+    }
+
+    if (n_changed > (guint64)width * height) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Delta tile '%s' claims %u changed pixels in %ux%u", name, n_changed, width, height);
+        return FALSE;
+    }
+
+    gsize mask_stride = (width + 7) / 8;
+    gsize mask_size = mask_stride * height;
+    gsize expected = mask_size + (gsize)n_changed * 3;
+    const guint8 *frame = data + ZMASK_HEADER_SIZE;
+    gsize frame_size = size - ZMASK_HEADER_SIZE;
+
+    ZSTD_DCtx *dctx = dia_zstd_thread_dctx();
+    if (!dctx) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NO_SPACE, "Could not allocate a zstd context");
+        return FALSE;
+    }
+
+    g_autofree guint8 *payload = g_try_malloc(MAX(expected, 1));
+    if (!payload) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NO_SPACE, "Could not allocate %" G_GSIZE_FORMAT " bytes for '%s'", expected, name);
+        return FALSE;
+    }
+
+    size_t got;
+    if (ZSTD_getDictID_fromFrame(frame, frame_size) != 0) {
+        ZSTD_DDict *dict = zmask_dictionary(archive, error);
+        if (!dict) {
+            g_prefix_error(error, "Delta tile '%s' needs the archive dictionary: ", name);
+            return FALSE;
+        }
+        got = ZSTD_decompress_usingDDict(dctx, payload, expected, frame, frame_size, dict);
+    } else {
+        got = ZSTD_decompressDCtx(dctx, payload, expected, frame, frame_size);
+    }
+    if (ZSTD_isError(got) || got != expected) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Could not decompress delta tile '%s': %s", name,
+                    ZSTD_isError(got) ? ZSTD_getErrorName(got) : "unexpected size");
+        return FALSE;
+    }
+
+    // Padding bits only ever make the count larger, so this bounds every read below
+    if (count_set_bits(payload, mask_size) != n_changed) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Delta tile '%s' has a change mask that does not match its %u pixels",
+                    name, n_changed);
+        return FALSE;
+    }
+
+    int stride = gdk_pixbuf_get_rowstride(canvas_pixbuf);
+    guint8 *origin = gdk_pixbuf_get_pixels(canvas_pixbuf) + (gsize)y * stride + (gsize)x * 4;
+    const guint8 *rgb = payload + mask_size;
+    gsize full_bytes = width / 8;
+    for (guint32 row = 0; row < height; row++) {
+        const guint8 *mask = payload + row * mask_stride;
+        guint8 *dst = origin + (gsize)row * stride;
+        for (gsize b = 0; b < mask_stride; b++) {
+            guint8 bits = mask[b];
+            if (!bits) continue;
+            guint8 *d = dst + b * 32;
+            if (bits == 0xff && b < full_bytes) {
+                for (int i = 0; i < 8; i++, rgb += 3) put_pixel(d + i * 4, rgb);
+                continue;
+            }
+            int limit = b < full_bytes ? 8 : (int)(width % 8);
+            for (int i = 0; i < limit; i++) {
+                if (bits & (1u << i)) {
+                    put_pixel(d + i * 4, rgb);
+                    rgb += 3;
+                }
+            }
+        }
+    }
+    return TRUE;
+}
@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+"""Writes a synthetic .dia archive with a known shape, for benchmarking the decode path with
+dia-bench. The dependency forest is laid out directly (complete trees of the given depth and
+branching factor), so no scoring runs. Deltas are encoded with encode.py's own Phase 2. The
+same arguments and seed always yield the same archive."""
+
+import argparse
+import math
+import sys
+import tempfile
+import time
+import zipfile
+from concurrent.futures import ThreadPoolExecutor
+from pathlib import Path
+
+import numpy as np
+from PIL import Image
+
+import encode
+
+def parse_size(text):
+    try:
+        width, height = (int(v) for v in text.lower().split("x"))
+    except ValueError:
+        raise argparse.ArgumentTypeError(f"'{text}' is not WIDTHxHEIGHT") from None
+    if width < 8 or height < 8:
+        raise argparse.ArgumentTypeError("images must be at least 8x8")
+    return width, height
+
+def texture(rng, width, height):
+    """Smooth colour field with a little grain: compresses like a photo, not like noise."""
+    grid = rng.integers(0, 256, (height // 32 + 2, width // 32 + 2, 3), dtype=np.uint8)
+    smooth = np.asarray(Image.fromarray(grid).resize((width, height), Image.BICUBIC), dtype=np.int16)
+    grain = rng.integers(-2, 3, (height, width, 3), dtype=np.int16)
+    return np.clip(smooth + grain, 0, 255).astype(np.uint8)
+
+def edit(rng, parent, fraction, regions):
+    """Copy of parent with about fraction of its area repainted in regions rectangles."""
+    height, width = parent.shape[:2]
+    child = parent.copy()
+    area = fraction * width * height / regions
+    for _ in range(regions if area >= 1 else 0):
+        aspect = rng.uniform(0.5, 2.0)
+        w = int(min(width, max(1, round(math.sqrt(area * aspect)))))
+        h = int(min(height, max(1, round(area / w))))
+        x, y = int(rng.integers(0, width - w + 1)), int(rng.integers(0, height - h + 1))
+        child[y:y + h, x:x + w, :3] = texture(rng, w, h)
+    return child
+
+def alpha_channel(rng, width, height):
+    """Horizontal fade with an opaque disc, so the map is neither flat nor noise."""
+    ramp = np.linspace(int(rng.integers(0, 128)), 255, width, dtype=np.float32)
+    alpha = np.tile(ramp, (height, 1))
+    yy, xx = np.mgrid[0:height, 0:width]
+    cx, cy, r = rng.uniform(0, width), rng.uniform(0, height), min(width, height) / 4
+    alpha[(xx - cx) ** 2 + (yy - cy) ** 2 < r * r] = 255
+    return alpha.astype(np.uint8)
+
+def forest(n_images, depth, branching):
+    """Parents of images 0..n-1 laid out as complete trees in breadth-first ID order; None for roots."""
+    tree_size = sum(branching ** d for d in range(depth + 1)) if branching > 0 else 1
+    parents = []
+    for image in range(n_images):
+        tree_start, k = image - image % tree_size, image % tree_size
+        parents.append(None if k == 0 else tree_start + (k - 1) // branching)
+    return parents
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawTextHelpFormatter)
+    parser.add_argument("output", help="Archive to write.")
+    parser.add_argument("-n", "--images", type=int, default=64, help="Number of images (default 64).")
+    parser.add_argument("--size", type=parse_size, default=(1920, 1080), metavar="WxH", help="Image size (default 1920x1080).")
+    parser.add_argument("--depth", type=int, default=4, help="Deltas from each root to its deepest image (default 4, 0 = all roots).")
+    parser.add_argument("--branching", type=int, default=2, help="Children per image (default 2).")
+    parser.add_argument("--changed", type=float, default=0.05, help="Fraction of the pixels each delta repaints (default 0.05).")
+    parser.add_argument("--regions", type=int, default=4, help="Rectangles the changed pixels are split into (default 4).")
+    parser.add_argument("--alpha", type=float, default=0.0, help="Fraction of the images that get an alpha channel (default 0).")
+    parser.add_argument("--delta-codec", choices=("png", "zmask"), default="png", help="Delta tile format, as for encode.py.")
+    parser.add_argument("--previews", action="store_true", help="Also store preview renditions.")
+    parser.add_argument("--seed", type=int, default=1, help="Random seed (default 1).")
+    parser.add_argument("-w", "--workers", type=int, default=4, help="Encoder threads (default 4).")
+    args = parser.parse_args()
+    if args.images < 1 or args.depth < 0 or args.branching < 0 or args.regions < 1:
+        parser.error("--images and --regions must be positive, --depth and --branching not negative")
+    if not 0 <= args.changed <= 1 or not 0 <= args.alpha <= 1:
+        parser.error("--changed and --alpha are fractions between 0 and 1")
+    if args.delta_codec == "zmask" and encode.zstandard is None:
+        parser.error("--delta-codec zmask needs the zstandard module (pip install zstandard)")
+
+    start = time.monotonic()
+    width, height = args.size
+    rng = np.random.default_rng(args.seed)
+    parents = forest(args.images, args.depth if args.branching else 0, args.branching)
+    output = Path(args.output)
+    with tempfile.TemporaryDirectory() as temp_dir:
+        # Pixels are drawn in ID order from one generator, so the seed fixes every image
+        pixels, saves, changed = [], [], []
+        with ThreadPoolExecutor(max_workers=max(1, args.workers)) as executor:
+            for image, parent in enumerate(parents):
+                if parent is None:
+                    rgb = texture(rng, width, height)
+                else:
+                    rgb = edit(rng, pixels[parent][:, :, :3], args.changed, args.regions)
+                    changed.append(np.count_nonzero(np.any(rgb != pixels[parent][:, :, :3], axis=2)) / (width * height))
+                image_pixels = rgb
+                if rng.uniform() < args.alpha:
+                    image_pixels = np.dstack([rgb, alpha_channel(rng, width, height)])
+                pixels.append(image_pixels)
+                saves.append(executor.submit(Image.fromarray(image_pixels).save, Path(temp_dir) / f"{image}.png"))
+            for save in saves:
+                save.result()
+
+        id_to_path = {str(i): f"{i}.png" for i in range(args.images)}
+        source_of = {image_id: Path(temp_dir) / rel_path for image_id, rel_path in id_to_path.items()}
+        dependencies_by_id = {str(i): str(p) for i, p in enumerate(parents) if p is not None}
+        root_image_ids = [str(i) for i, p in enumerate(parents) if p is None]
+        n_alpha = sum(1 for image_pixels in pixels if image_pixels.shape[2] == 4)
+        del pixels
+        codec = encode.ZmaskDeltaCodec() if args.delta_codec == "zmask" else encode.PngDeltaCodec()
+
+        all_ids = sorted(id_to_path, key=int)
+        partial_path = output.with_name(output.name + ".partial")
+        with zipfile.ZipFile(partial_path, 'w', zipfile.ZIP_STORED) as zipf:
+            entry_of = {}
+            def store(entries):
+                for arcname, data in entries:
+                    entry_of[arcname] = len(entry_of)
+                    encode.write_stored_aligned(zipf, arcname, data)
+
+            # The requested tree shape is the point of the archive, so no delta is traded for a full image
+            delta_tiles, alpha_map, _ = encode.encode_images(all_ids, id_to_path, source_of, dependencies_by_id, None, {},
+                                                             codec, None, store, max(1, args.workers), demote=False)
+            previews = encode.write_previews(all_ids, id_to_path, source_of, max(1, args.workers), store) if args.previews else {}
+            encode.write_index_and_map(zipf, {
+                "image_map": id_to_path,
+                "root_images": root_image_ids,
+                "dependencies": dependencies_by_id,
+                "alpha_map": alpha_map,
+                "alpha_encoding": "delta",
+                "delta_tiles": delta_tiles,
+                "delta_codec": codec.name,
+                "previews": previews,
+                "image_kinds": {},
+            }, entry_of)
+        partial_path.replace(output)
+
+    mean_changed = sum(changed) / len(changed) if changed else 0.0
+    print(f"\n{output}: {args.images} images of {width}x{height} in {len(root_image_ids)} trees, "
+          f"{mean_changed:.1%} of pixels changed per delta, {n_alpha} with alpha ({len(alpha_map)} alpha deltas), "
+          f"{output.stat().st_size / 2**20:.1f} MiB, {time.monotonic() - start:.1f}s")
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())